@@ -21,9 +21,15 @@ def bg_printenv():
     parser.add_argument(
         "-o",
         "--output",
-        choices=["in_progress", "revision", "kernel", "kernelargs", "watchdog_timeout", "ustate", "user"],
+        choices=["in_progress", "revision", "kernel", "kernelargs", "watchdog_timeout", "ustate", "user", "counters"],
         help="Comma-separated list of fields which are printed",
     )
     parser.add_argument("-r", "--raw", action="store_true", help="Raw output mode")
+    parser.add_argument(
+        "-O", "--output-format", choices=["text", "json", "tlv"], help="Print text, JSON Lines or binary TLV records"
+    )
+    parser.add_argument(
+        "-w", "--watch", metavar="SECONDS", nargs="?", help="Print the environments again whenever a printed field changes"
+    )
     parser.add_argument("--usage", action="store_true", help="Give a short usage message")
     return parser
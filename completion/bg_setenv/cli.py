@@ -11,6 +11,8 @@
 
 import argparse
 
+import shtab
+
 from .common import add_common_opts
 
 
@@ -44,4 +46,26 @@ def bg_setenv():
         choices=["0", "1"],
         help="Set in_progress variable to simulate a running update process.",
     )
+    parser.add_argument(
+        "-F",
+        "--format",
+        metavar="FORMAT",
+        choices=["1", "2", "3"],
+        help="Store the environment in file format 1 (full size), 2 (compact) or 3 (front-coded names)",
+    )
+    parser.add_argument(
+        "-L",
+        "--log-slots",
+        metavar="SLOTS",
+        help="Reserve SLOTS sectors for a log of user variable updates",
+    )
+    parser.add_argument(
+        "-G",
+        "--generate",
+        metavar="OVERRIDES",
+        help="Write one environment file per line of the CSV file OVERRIDES",
+    ).complete = shtab.FILE
+    parser.add_argument(
+        "-Z", "--compress", action="store_true", help="Store user variables of 256 bytes or more LZ4 compressed"
+    )
     return parser
@@ -16,7 +16,49 @@ def add_common_opts(parser):
     parser.add_argument(
         "-f", "--filepath", metavar="ENVFILE", help="Environment to use. Expects a file name, usually called BGENV.DAT."
     ).complete = shtab.FILE
+    parser.add_argument(
+        "-B", "--batch", metavar="FILE", help="Run the commands read from FILE, - for standard input"
+    ).complete = shtab.FILE
+    parser.add_argument(
+        "-I", "--image", metavar="IMAGE", help="Use the config partitions in the disk image file IMAGE"
+    ).complete = shtab.FILE
     parser.add_argument("-A", "--all", action="store_true", help="Probe all partitions for ebg environments")
+    parser.add_argument(
+        "-C", "--cache", action="store_true", help="Cache the probed config partitions in /run/efibootguard"
+    )
+    parser.add_argument(
+        "-U",
+        "--shared-mounts",
+        action="store_true",
+        help="Share the mounts of config partitions with concurrent calls under /run/efibootguard/mnt",
+    )
+    parser.add_argument(
+        "-Y",
+        "--group-sync",
+        action="store_true",
+        help="Mount config partitions without the sync option and flush each written environment once",
+    )
+    parser.add_argument(
+        "-M",
+        "--match",
+        metavar="RULES",
+        help="Only probe the FAT partitions matching any of the comma separated RULES",
+    )
+    parser.add_argument(
+        "-D",
+        "--disk-order",
+        metavar="ORDER",
+        help="With --all, probe the disks in the comma separated ORDER of boot, controller and other",
+    )
+    parser.add_argument(
+        "-E",
+        "--stop-early",
+        action="store_true",
+        help="With --all, stop probing after the first group of disks that completes the config partitions",
+    )
+    parser.add_argument(
+        "-S", "--stats", action="store_true", help="Print device, I/O and timing statistics to stderr at exit"
+    )
     parser.add_argument("-p", "--part", metavar="ENV_PART", type=int, help="Set environment partition to use")
     parser.add_argument("-v", "--verbose", action="store_true", help="Be verbose")
     parser.add_argument("-V", "--version", action="store_true", help="Print version")
@@ -0,0 +1,128 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2026
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#include <acpi.h>
+#include "utils.h"
+
+#define ACPI_TABLE_CACHE_SIZE 8
+
+/* RSDT or XSDT, valid once root_located is set */
+static EFI_ACPI_SDT_HEADER *root_table;
+static BOOLEAN root_located;
+
+/* earlier lookups, including those that found nothing */
+static struct {
+	CHAR8 signature[4];
+	EFI_ACPI_SDT_HEADER *table;
+} table_cache[ACPI_TABLE_CACHE_SIZE];
+static UINTN cached_tables;
+
+static EFI_ACPI_SDT_HEADER *
+parse_rsdp(EFI_ACPI_ROOT_SDP_HEADER *rsdp)
+{
+	EFI_ACPI_SDT_HEADER *sdt;
+
+	if (rsdp->revision > EFI_ACPI_ROOT_SDP_REVISION) {
+		ERROR(L"SDP revision not supported (%d)\n", rsdp->revision);
+		return NULL;
+	}
+
+	if (rsdp->revision == EFI_ACPI_ROOT_SDP_REVISION) {
+		sdt = (EFI_ACPI_SDT_HEADER *)(UINTN)(rsdp->xsdt_address);
+		if (strncmpa(ACPI_SIG_XSDT, (CHAR8 *)(VOID *)(sdt->signature),
+			     4)) {
+			return NULL;
+		}
+	} else {
+		sdt = (EFI_ACPI_SDT_HEADER *)(UINTN)(rsdp->rsdt_address);
+		if (strncmpa(ACPI_SIG_RSDT, (CHAR8 *)(VOID *)(sdt->signature),
+			     4)) {
+			return NULL;
+		}
+	}
+	return sdt;
+}
+
+static EFI_ACPI_SDT_HEADER *
+locate_root_table(VOID)
+{
+	EFI_CONFIGURATION_TABLE *ect = ST->ConfigurationTable;
+	EFI_GUID acpi_table_guid = ACPI_TABLE_GUID;
+	EFI_GUID acpi2_table_guid = ACPI_20_TABLE_GUID;
+	UINTN n;
+
+	for (n = 0; n < ST->NumberOfTableEntries; n++) {
+		if ((CompareGuid(&ect->VendorGuid, &acpi_table_guid) ||
+		     CompareGuid(&ect->VendorGuid, &acpi2_table_guid)) &&
+		    !strncmpa(ACPI_SIG_RSDP, (CHAR8 *)(ect->VendorTable), 8)) {
+			return parse_rsdp(
+				(EFI_ACPI_ROOT_SDP_HEADER *)ect->VendorTable);
+		}
+		ect++;
+	}
+	return NULL;
+}
+
+static EFI_ACPI_SDT_HEADER *
+walk_root_table(const CHAR8 *signature)
+{
+	BOOLEAN xsdt = !strncmpa(ACPI_SIG_XSDT,
+				 (CHAR8 *)(VOID *)(root_table->signature), 4);
+	UINTN size = xsdt ? sizeof(UINT64) : sizeof(UINT32);
+	UINT8 *entry_ptr = (UINT8 *)(root_table + 1);
+	UINTN n, count;
+
+	count = (root_table->length - sizeof(EFI_ACPI_SDT_HEADER)) / size;
+	for (n = 0; n < count; n++, entry_ptr += size) {
+		EFI_ACPI_SDT_HEADER *entry;
+
+		if (xsdt) {
+			entry = (EFI_ACPI_SDT_HEADER *)(UINTN)(
+				*(UINT64 *)entry_ptr);
+		} else {
+			entry = (EFI_ACPI_SDT_HEADER *)(UINTN)(
+				*(UINT32 *)entry_ptr);
+		}
+		if (!strncmpa((CHAR8 *)signature, entry->signature, 4)) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+EFI_ACPI_SDT_HEADER *acpi_find_table(const CHAR8 *signature)
+{
+	EFI_ACPI_SDT_HEADER *table = NULL;
+	UINTN n;
+
+	for (n = 0; n < cached_tables; n++) {
+		if (!strncmpa((CHAR8 *)signature, table_cache[n].signature,
+			      4)) {
+			return table_cache[n].table;
+		}
+	}
+
+	if (!root_located) {
+		root_table = locate_root_table();
+		root_located = TRUE;
+	}
+	if (root_table) {
+		table = walk_root_table(signature);
+	}
+
+	if (cached_tables < ACPI_TABLE_CACHE_SIZE) {
+		CopyMem(table_cache[cached_tables].signature,
+			(VOID *)signature, 4);
+		table_cache[cached_tables].table = table;
+		cached_tables++;
+	}
+	return table;
+}
@@ -43,7 +43,7 @@ static UINT32 get_station_id(SMBIOS_STRUCTURE_POINTER oem_strct)
 	return 0;
 }
 
-UINT32 simatic_station_id(VOID)
+static UINT32 read_station_id(VOID)
 {
 	SMBIOS_STRUCTURE_TABLE *smbios_table;
 	SMBIOS_STRUCTURE_POINTER smbios_struct;
@@ -62,3 +62,16 @@ UINT32 simatic_station_id(VOID)
 
 	return get_station_id(smbios_struct);
 }
+
+/* Every SIMATIC-aware driver asks during its probe, derive it only once. */
+UINT32 simatic_station_id(VOID)
+{
+	static BOOLEAN station_id_read;
+	static UINT32 station_id;
+
+	if (!station_id_read) {
+		station_id = read_station_id();
+		station_id_read = TRUE;
+	}
+	return station_id;
+}
@@ -15,18 +15,24 @@
 
 #include <smbios.h>
 
-SMBIOS_STRUCTURE_POINTER smbios_find_struct(SMBIOS_STRUCTURE_TABLE *table,
-					    UINT16 type)
+/* offset + 1 of the first structure of every type in indexed_table, 0 if
+ * it has none */
+static SMBIOS_STRUCTURE_TABLE *indexed_table;
+static UINT32 type_offset[256];
+
+static VOID build_index(SMBIOS_STRUCTURE_TABLE *table)
 {
 	SMBIOS_STRUCTURE_POINTER strct;
+	UINT8 *base = (UINT8 *)(uintptr_t)table->TableAddress;
 	UINT8 *str;
 	UINTN n;
 
-	strct.Raw = (UINT8 *)(uintptr_t)table->TableAddress;
+	SetMem(type_offset, sizeof(type_offset), 0);
+	strct.Raw = base;
 
 	for (n = 0; n < table->NumberOfSmbiosStructures; n++) {
-		if (strct.Hdr->Type == type) {
-			return strct;
+		if (type_offset[strct.Hdr->Type] == 0) {
+			type_offset[strct.Hdr->Type] = strct.Raw - base + 1;
 		}
 		/* Read over any appended strings. */
 		str = strct.Raw + strct.Hdr->Length;
@@ -35,7 +41,23 @@ SMBIOS_STRUCTURE_POINTER smbios_find_struct(SMBIOS_STRUCTURE_TABLE *table,
 		}
 		strct.Raw = str + 2;
 	}
+	indexed_table = table;
+}
+
+SMBIOS_STRUCTURE_POINTER smbios_find_struct(SMBIOS_STRUCTURE_TABLE *table,
+					    UINT16 type)
+{
+	SMBIOS_STRUCTURE_POINTER strct;
+
+	/* the table is walked once, for the first lookup of any driver */
+	if (table != indexed_table) {
+		build_index(table);
+	}
 
 	strct.Raw = NULL;
+	if (type < 256 && type_offset[type]) {
+		strct.Raw = (UINT8 *)(uintptr_t)table->TableAddress +
+			    type_offset[type] - 1;
+	}
 	return strct;
 }
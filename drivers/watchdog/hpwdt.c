@@ -31,21 +31,14 @@
 #define PCI_GET_SUBSYS_VENDOR_ID(id)	(UINT16)(id)
 #define PCI_GET_SUBSYS_PRODUCT_ID(id)	(UINT16)((id) >> 16)
 
-static EFI_STATUS init(EFI_PCI_IO *pci_io, UINT16 pci_vendor_id,
+static EFI_STATUS init(EFI_PCI_IO *pci_io,
+		       __attribute__((unused)) UINT16 pci_vendor_id,
 		       UINT16 pci_device_id, UINTN timeout)
 {
 	EFI_STATUS status;
 	UINT16 reload;
 	UINT8 control;
 
-	if (!pci_io || 
-	    !((pci_vendor_id == PCI_VENDOR_ID_HP &&
-	       pci_device_id == PCI_DEVICE_ID_ILO3) ||
-	      (pci_vendor_id == PCI_VENDOR_ID_HP_3PAR &&
-	       pci_device_id == PCI_DEVICE_ID_PCTRL))) {
-		return EFI_UNSUPPORTED;
-	}
-
 	if (pci_device_id == PCI_DEVICE_ID_ILO3) {
 		UINT16 vendor, product;
 		UINT32 value;
@@ -86,4 +79,10 @@ static EFI_STATUS init(EFI_PCI_IO *pci_io, UINT16 pci_vendor_id,
 	return EFI_SUCCESS;
 }
 
-WATCHDOG_REGISTER(init);
+static const WATCHDOG_PCI_ID pci_ids[] = {
+	{ PCI_VENDOR_ID_HP, PCI_DEVICE_ID_ILO3 },
+	{ PCI_VENDOR_ID_HP_3PAR, PCI_DEVICE_ID_PCTRL },
+	{ 0 }
+};
+
+WATCHDOG_REGISTER_PCI(init, pci_ids);
@@ -37,18 +37,24 @@
 
 #define kcs_sts_is_error(sts) (((sts >> 6 ) & 0x3) == 0x3)
 
+/*
+ * A BMC usually handles a byte within microseconds. Poll the status that
+ * often at first and back off towards KCS_POLL_MAX_US for slow ones.
+ */
+#define KCS_POLL_MIN_US			1
+#define KCS_POLL_MAX_US			10000
+
 static UINT8
 set_wdt_data[] = {IPMI_WDT_SET_USE_OSLOAD, IPMI_WDT_SET_ACTION_HARD_RESET,
 		  0x00, 0x00,0x00, 0x00};
 
 static EFI_EVENT cmdtimer;
 
-static BOOLEAN probed_before;
-
 static EFI_STATUS
 kcs_wait_iobf(UINT16 io_base, UINTN iobf)
 {
 	EFI_STATUS timerstatus = EFI_NOT_READY;
+	UINTN delay = KCS_POLL_MIN_US;
 
 	while (timerstatus == EFI_NOT_READY) {
 		UINT8 sts = inb(io_base + 1);
@@ -64,7 +70,10 @@ kcs_wait_iobf(UINT16 io_base, UINTN iobf)
 			if (sts & IPMI_KCS_STS_OBF)
 				return EFI_SUCCESS;
 		}
-		BS->Stall(1000 * 1000 / 10);
+		BS->Stall(delay);
+		delay *= 2;
+		if (delay > KCS_POLL_MAX_US)
+			delay = KCS_POLL_MAX_US;
 		timerstatus = BS->CheckEvent(cmdtimer);
 	}
 
@@ -91,22 +100,30 @@ static EFI_STATUS
 _send_ipmi_cmd(UINT16 io_base, UINT8 cmd, UINT8 *data, UINTN datalen)
 {
 	UINT8 lastbyte = cmd;
-	UINTN err = 0;
+	EFI_STATUS status;
 
-	err += kcs_outb(IPMI_KCS_CMD_WRITE_START, io_base, 1);
-	err += kcs_outb(IPMI_KCS_NETFS_LUN_WDT, io_base, 0);
+	/*
+	 * A transfer that failed is not continued, every further byte would
+	 * only wait for the timeout.
+	 */
+	status = kcs_outb(IPMI_KCS_CMD_WRITE_START, io_base, 1);
+	if (status == EFI_SUCCESS)
+		status = kcs_outb(IPMI_KCS_NETFS_LUN_WDT, io_base, 0);
 
 	if (datalen) {
 		lastbyte = data[datalen - 1];
-		err += kcs_outb(cmd, io_base, 0);
-		for (UINTN n = 0; n < datalen - 1; n++)
-			err += kcs_outb(data[n], io_base, 0);
+		if (status == EFI_SUCCESS)
+			status = kcs_outb(cmd, io_base, 0);
+		for (UINTN n = 0; n < datalen - 1 && status == EFI_SUCCESS; n++)
+			status = kcs_outb(data[n], io_base, 0);
 	}
 
-	err += kcs_outb(IPMI_KCS_CMD_WRITE_END, io_base,  1);
-	err += kcs_outb(lastbyte, io_base, 0);
+	if (status == EFI_SUCCESS)
+		status = kcs_outb(IPMI_KCS_CMD_WRITE_END, io_base, 1);
+	if (status == EFI_SUCCESS)
+		status = kcs_outb(lastbyte, io_base, 0);
 
-	if (err)
+	if (status)
 		return EFI_DEVICE_ERROR;
 
 	return kcs_wait_iobf(io_base, IPMI_KCS_STS_OBF);
@@ -164,11 +181,6 @@ static EFI_STATUS init(__attribute__((unused)) EFI_PCI_IO *pci_io,
 	UINT64 io_base;
 	UINT16 *timeout_value;
 
-	/* We do not use PCI, and machines with IPMI have many PCI devices */
-	if (probed_before)
-		return EFI_UNSUPPORTED;
-	probed_before = TRUE;
-
 	status = LibGetSystemConfigurationTable(&SMBIOSTableGuid,
 						(VOID **)&smbios_table);
 
@@ -273,7 +273,8 @@ static void update_no_reboot_flag_apl(const iTCO_info *itco)
 	}
 }
 
-static EFI_STATUS init(EFI_PCI_IO *pci_io, UINT16 pci_vendor_id,
+static EFI_STATUS init(EFI_PCI_IO *pci_io,
+		       __attribute__((unused)) UINT16 pci_vendor_id,
 		       UINT16 pci_device_id, UINTN timeout)
 {
 	UINT32 pm_base, tco_base, value;
@@ -281,8 +282,7 @@ static EFI_STATUS init(EFI_PCI_IO *pci_io, UINT16 pci_vendor_id,
 	const iTCO_info *itco;
 	EFI_STATUS status;
 
-	if (!pci_io || pci_vendor_id != PCI_VENDOR_ID_INTEL ||
-	    !itco_supported(pci_device_id, &itco_chip)) {
+	if (!itco_supported(pci_device_id, &itco_chip)) {
 		return EFI_UNSUPPORTED;
 	}
 	itco = &iTCO_chipset_info[itco_chip];
@@ -341,4 +341,18 @@ static EFI_STATUS init(EFI_PCI_IO *pci_io, UINT16 pci_vendor_id,
 	return EFI_SUCCESS;
 }
 
-WATCHDOG_REGISTER(init);
+/* must match the pci_id entries of iTCO_chipset_info */
+static const WATCHDOG_PCI_ID pci_ids[] = {
+	{ PCI_VENDOR_ID_INTEL, 0x5ae8 },	/* Apollo Lake */
+	{ PCI_VENDOR_ID_INTEL, 0x0f1c },	/* Bay Trail */
+	{ PCI_VENDOR_ID_INTEL, 0x9cc3 },	/* Wildcat Point-LP */
+	{ PCI_VENDOR_ID_INTEL, 0x2918 },	/* ICH9 */
+	{ PCI_VENDOR_ID_INTEL, 0x27bc },	/* NM10 */
+	{ PCI_VENDOR_ID_INTEL, 0x8c4e },	/* Lynx Point */
+	{ PCI_VENDOR_ID_INTEL, 0x8d44 },	/* Wellsburg */
+	{ PCI_VENDOR_ID_INTEL, 0x4b23 },	/* Elkhart Lake */
+	{ PCI_VENDOR_ID_INTEL, 0x43a3 },	/* Tiger Lake-H */
+	{ 0 }
+};
+
+WATCHDOG_REGISTER_PCI(init, pci_ids);
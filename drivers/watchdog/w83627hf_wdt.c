@@ -197,16 +197,13 @@ static int wdt_set_time(unsigned int timeout)
 	return 0;
 }
 
-static EFI_STATUS init(EFI_PCI_IO *pci_io, UINT16 pci_vendor_id,
-		       UINT16 pci_device_id, UINTN timeout)
+static EFI_STATUS init(__attribute__((unused)) EFI_PCI_IO *pci_io,
+		       __attribute__((unused)) UINT16 pci_vendor_id,
+		       __attribute__((unused)) UINT16 pci_device_id,
+		       UINTN timeout)
 {
 	int chip, ret;
 
-	if (!pci_io || pci_vendor_id != PCI_VENDOR_ID_INTEL ||
-	    pci_device_id != PCI_DEVICE_ID_INTEL_HOST_BRIDGE) {
-		return EFI_UNSUPPORTED;
-	}
-
 	switch (simatic_station_id()) {
 	case SIMATIC_IPCBX_59A:
 		chip = wdt_find(0x2e);
@@ -224,4 +221,9 @@ static EFI_STATUS init(EFI_PCI_IO *pci_io, UINT16 pci_vendor_id,
 	return EFI_UNSUPPORTED;
 }
 
-WATCHDOG_REGISTER(init);
+static const WATCHDOG_PCI_ID pci_ids[] = {
+	{ PCI_VENDOR_ID_INTEL, PCI_DEVICE_ID_INTEL_HOST_BRIDGE },
+	{ 0 }
+};
+
+WATCHDOG_REGISTER_PCI(init, pci_ids);
@@ -19,18 +19,9 @@
 #include <efilib.h>
 #include <mmio.h>
 #include <sys/io.h>
+#include "acpi.h"
 #include "utils.h"
 
-#define EFI_ACPI_TABLE_GUID \
-    { 0xeb9d2d30, 0x2d88, 0x11d3, {0x9a, 0x16, 0x0, 0x90, 0x27, 0x3f, 0xc1, 0x4d }}
-#define EFI_ACPI_20_TABLE_GUID \
-    { 0x8868e871, 0xe4f1, 0x11d3, {0xbc, 0x22, 0x0, 0x80, 0xc7, 0x3c, 0x88, 0x81 }}
-
-#define EFI_ACPI_ROOT_SDP_REVISION 0x02
-
-#define ACPI_SIG_RSDP (CHAR8 *)"RSD PTR "
-#define ACPI_SIG_RSDT (CHAR8 *)"RSDT"
-#define ACPI_SIG_XSDT (CHAR8 *)"XSDT"
 #define ACPI_SIG_WDAT (CHAR8 *)"WDAT"
 
 #pragma pack(1)
@@ -41,32 +32,6 @@
  * --------------------------------------------------------------------------
  */
 
-/* Root System Description Pointer  (ACPI section 5.2.5.3) */
-typedef struct {
-    CHAR8   signature[8];
-    UINT8   checksum;
-    UINT8   oem_id[6];
-    UINT8   revision;
-    UINT32  rsdt_address;
-    UINT32  length;
-    UINT64  xsdt_address;
-    UINT8   extended_checksum;
-    UINT8   reserved[3];
-} EFI_ACPI_ROOT_SDP_HEADER;
-
-/* System Description Table  (ACPI section 5.2.6) */
-typedef struct {
-	CHAR8   signature[4];
-	UINT32  length;
-	UINT8   revision;
-	UINT8   checksum;
-	CHAR8   oem_id[6];
-	CHAR8   oem_table_id[8];
-	UINT32  oem_revision;
-	UINT32  creator_id;
-	UINT32  creator_revision;
-} EFI_ACPI_SDT_HEADER;
-
 /* Generic Address Structure (ACPI section 5.2.3.2) */
 typedef struct {
 	UINT8 space_id;            /* Address space where struct or register exists */
@@ -135,102 +100,11 @@ typedef struct {
 
 #pragma pack()
 
-static BOOLEAN probed_before;
-
 /* --------------------------------------------------------------------------
  * Parsing of ACPI/WDAT structures for efibootguard
  * --------------------------------------------------------------------------
  */
 
-static EFI_STATUS
-parse_rsdt(EFI_ACPI_SDT_HEADER *rsdt, ACPI_TABLE_WDAT **wdat_table_ptr)
-{
-	UINT32 *entry_ptr;
-	UINT32 n, count;
-
-	if (strncmpa(ACPI_SIG_RSDT, (CHAR8 *)(VOID *)(rsdt->signature), 4)) {
-		return EFI_INCOMPATIBLE_VERSION;
-	}
-
-	entry_ptr = (UINT32 *)(rsdt + 1);
-	count = (rsdt->length - sizeof (EFI_ACPI_SDT_HEADER)) / sizeof(UINT32);
-	for (n = 0; n < count; n++, entry_ptr++) {
-		EFI_ACPI_SDT_HEADER *entry =
-			(EFI_ACPI_SDT_HEADER *)((UINTN)(*entry_ptr));
-		if (!strncmpa(ACPI_SIG_WDAT, entry->signature, 4)) {
-			*wdat_table_ptr = (ACPI_TABLE_WDAT *)entry;
-			return EFI_SUCCESS;
-		}
-	}
-	return EFI_UNSUPPORTED;
-}
-
-static EFI_STATUS
-parse_xsdt(EFI_ACPI_SDT_HEADER *xsdt, ACPI_TABLE_WDAT **wdat_table_ptr)
-{
-	UINT64 *entry_ptr;
-	UINT64 n, count;
-
-	if (strncmpa(ACPI_SIG_XSDT, (CHAR8 *)(VOID *)(xsdt->signature), 4)) {
-		return EFI_INCOMPATIBLE_VERSION;
-	}
-
-	entry_ptr = (UINT64 *)(xsdt + 1);
-	count = (xsdt->length - sizeof (EFI_ACPI_SDT_HEADER)) / sizeof(UINT64);
-	for (n = 0; n < count; n++, entry_ptr++) {
-		EFI_ACPI_SDT_HEADER *entry =
-			(EFI_ACPI_SDT_HEADER *)((UINTN)(*entry_ptr));
-		if (!strncmpa(ACPI_SIG_WDAT, entry->signature, 4)) {
-			*wdat_table_ptr = (ACPI_TABLE_WDAT *)entry;
-			return EFI_SUCCESS;
-		}
-	}
-	return EFI_UNSUPPORTED;
-}
-
-static EFI_STATUS
-parse_rsdp(EFI_ACPI_ROOT_SDP_HEADER *rsdp, ACPI_TABLE_WDAT **wdat_table_ptr)
-{
-	EFI_ACPI_SDT_HEADER *sdt;
-
-	*wdat_table_ptr = NULL;
-
-	if (rsdp->revision > EFI_ACPI_ROOT_SDP_REVISION) {
-		ERROR(L"SDP revision not supported (%d)\n", rsdp->revision);
-		return EFI_INCOMPATIBLE_VERSION;
-	}
-
-	if (rsdp->revision == EFI_ACPI_ROOT_SDP_REVISION) {
-		sdt = (EFI_ACPI_SDT_HEADER *)(UINTN)(rsdp->xsdt_address);
-		return parse_xsdt(sdt, wdat_table_ptr);
-	}
-	else {
-		sdt = (EFI_ACPI_SDT_HEADER *)(UINTN)(rsdp->rsdt_address);
-		return parse_rsdt(sdt, wdat_table_ptr);
-	}
-}
-
-static EFI_STATUS
-locate_and_parse_rsdp(ACPI_TABLE_WDAT **wdat_table_ptr)
-{
-	EFI_CONFIGURATION_TABLE *ect = ST->ConfigurationTable;
-	EFI_ACPI_ROOT_SDP_HEADER *rsdp;
-	EFI_GUID acpi_table_guid = ACPI_TABLE_GUID;
-	EFI_GUID acpi2_table_guid = ACPI_20_TABLE_GUID;
-	UINTN n;
-
-	for (n = 0; n < ST->NumberOfTableEntries; n++) {
-		if ((CompareGuid(&ect->VendorGuid, &acpi_table_guid) ||
-		     CompareGuid(&ect->VendorGuid, &acpi2_table_guid)) &&
-		    !strncmpa(ACPI_SIG_RSDP, (CHAR8 *)(ect->VendorTable), 8)) {
-			rsdp = (EFI_ACPI_ROOT_SDP_HEADER *)ect->VendorTable;
-			return parse_rsdp(rsdp, wdat_table_ptr);
-		}
-		ect++;
-	}
-	return EFI_UNSUPPORTED;
-}
-
 static EFI_STATUS
 read_reg(ACPI_ADDR *addr, UINT32 *value_ptr)
 {
@@ -365,8 +239,44 @@ write_value(ACPI_ADDR *addr, UINT32 value, UINT32 mask, BOOLEAN preserve)
 	return write_reg(addr, x);
 }
 
+/* The entries of every action in table order, those of action a are
+ * action_entries[action_start[a]] up to action_entries[action_start[a + 1]]
+ * exclusively. */
+static ACPI_WDAT_ENTRY **action_entries;
+static UINT32 action_start[256 + 1];
+
 static EFI_STATUS
-run_action(ACPI_TABLE_WDAT *wdat_table, UINT8 action, UINT32 param, UINT32 *retval)
+index_actions(ACPI_TABLE_WDAT *wdat_table)
+{
+	ACPI_WDAT_ENTRY *wdat_entry;
+	UINT32 fill[256];
+	UINTN n;
+
+	action_entries = AllocatePool((wdat_table->entries + 1) *
+				      sizeof(ACPI_WDAT_ENTRY *));
+	if (!action_entries) {
+		return EFI_OUT_OF_RESOURCES;
+	}
+	ZeroMem(action_start, sizeof(action_start));
+
+	/* ACPI_TABLE_WDAT is immediately followed by multiple ACPI_WDAT_ENTRY tables,
+	 * the former tells us how many (via ->entries). */
+	wdat_entry = (ACPI_WDAT_ENTRY *)(wdat_table + 1);
+	for (n = 0; n < wdat_table->entries; n++) {
+		action_start[wdat_entry[n].action + 1]++;
+	}
+	for (n = 0; n < 256; n++) {
+		action_start[n + 1] += action_start[n];
+		fill[n] = action_start[n];
+	}
+	for (n = 0; n < wdat_table->entries; n++) {
+		action_entries[fill[wdat_entry[n].action]++] = &wdat_entry[n];
+	}
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS
+run_action(UINT8 action, UINT32 param, UINT32 *retval)
 {
 	ACPI_WDAT_ENTRY *wdat_entry;
 	ACPI_ADDR *addr;
@@ -375,14 +285,8 @@ run_action(ACPI_TABLE_WDAT *wdat_table, UINT8 action, UINT32 param, UINT32 *retv
 	UINT32 flags, value, mask;
 	UINTN n;
 
-	/* ACPI_TABLE_WDAT is immediately followed by multiple ACPI_WDAT_ENTRY tables,
-	 * the former tells us how many (via ->entries). */
-	wdat_entry = (ACPI_WDAT_ENTRY *)(wdat_table + 1);
-	for (n = 0; n < wdat_table->entries; n++, wdat_entry++) {
-		/* Check if this is the action we have requested */
-		if (wdat_entry->action != action) {
-			continue;
-		}
+	for (n = action_start[action]; n < action_start[action + 1]; n++) {
+		wdat_entry = action_entries[n];
 
 		/* Decode the action */
 		preserve = (wdat_entry->instruction & ACPI_WDAT_PRESERVE_REGISTER) != 0;
@@ -417,36 +321,21 @@ run_action(ACPI_TABLE_WDAT *wdat_table, UINT8 action, UINT32 param, UINT32 *retv
 	return status;
 }
 
-static EFI_STATUS init(EFI_PCI_IO __attribute__((unused)) * pci_io,
-		       UINT16 __attribute__((unused)) pci_vendor_id,
-		       UINT16 __attribute__((unused)) pci_device_id,
-		       UINTN timeout)
+static EFI_STATUS
+start_watchdog(ACPI_TABLE_WDAT *wdat_table, UINTN timeout)
 {
-	ACPI_TABLE_WDAT *wdat_table;
 	EFI_STATUS status;
 	UINT32 boot_status;
 	UINTN n;
 
-	/* We do not use PCI, and machines may have many PCI devices */
-	if (probed_before)
-		return EFI_UNSUPPORTED;
-	probed_before = TRUE;
-
-	/* Locate WDAT in ACPI tables */
-	status = locate_and_parse_rsdp(&wdat_table);
-	if (EFI_ERROR(status)) {
-		return status;
-	}
-	INFO(L"Detected WDAT watchdog\n");
-
 	/* Check if the boot was caused by the watchdog */
-	status = run_action(wdat_table, ACPI_WDAT_GET_STATUS, 0, &boot_status);
+	status = run_action(ACPI_WDAT_GET_STATUS, 0, &boot_status);
 	if ((status == EFI_SUCCESS) && (boot_status != 0)) {
 		INFO(L"Boot caused by watchdog\n");
 	}
 
 	/* Enable reboot */
-	status = run_action(wdat_table, ACPI_WDAT_SET_REBOOT, 0, NULL);
+	status = run_action(ACPI_WDAT_SET_REBOOT, 0, NULL);
 	if (EFI_ERROR(status) && (status != EFI_UNSUPPORTED)) {
 		ERROR(L"Could not enable REBOOT for WDAT!\n");
 		return status;
@@ -462,21 +351,21 @@ static EFI_STATUS init(EFI_PCI_IO __attribute__((unused)) * pci_io,
 	n = (timeout * 1000) / wdat_table->timer_period;
 
 	/* Program countdown */
-	status = run_action(wdat_table, ACPI_WDAT_SET_COUNTDOWN, n, NULL);
+	status = run_action(ACPI_WDAT_SET_COUNTDOWN, n, NULL);
 	if (EFI_ERROR(status)) {
 		ERROR(L"Could not change WDAT timeout!\n");
 		return status;
 	}
 
 	/* Initial ping with specified timeout */
-	status = run_action(wdat_table, ACPI_WDAT_RESET, n, NULL);
+	status = run_action(ACPI_WDAT_RESET, n, NULL);
 	if (EFI_ERROR(status)) {
 		ERROR(L"Could not reset WDAT!\n");
 		return status;
 	}
 
 	/* Enable watchdog */
-	status = run_action(wdat_table, ACPI_WDAT_SET_RUNNING_STATE, 0, NULL);
+	status = run_action(ACPI_WDAT_SET_RUNNING_STATE, 0, NULL);
 	if (EFI_ERROR(status)) {
 		ERROR(L"Could not change WDAT to RUNNING state!\n");
 		return status;
@@ -485,4 +374,29 @@ static EFI_STATUS init(EFI_PCI_IO __attribute__((unused)) * pci_io,
 	return EFI_SUCCESS;
 }
 
+static EFI_STATUS init(EFI_PCI_IO __attribute__((unused)) * pci_io,
+		       UINT16 __attribute__((unused)) pci_vendor_id,
+		       UINT16 __attribute__((unused)) pci_device_id,
+		       UINTN timeout)
+{
+	ACPI_TABLE_WDAT *wdat_table;
+	EFI_STATUS status;
+
+	/* Locate WDAT in ACPI tables */
+	wdat_table = (ACPI_TABLE_WDAT *)acpi_find_table(ACPI_SIG_WDAT);
+	if (!wdat_table) {
+		return EFI_UNSUPPORTED;
+	}
+	INFO(L"Detected WDAT watchdog\n");
+
+	status = index_actions(wdat_table);
+	if (EFI_ERROR(status)) {
+		return status;
+	}
+	status = start_watchdog(wdat_table, timeout);
+	FreePool(action_entries);
+	action_entries = NULL;
+	return status;
+}
+
 WATCHDOG_REGISTER(init);
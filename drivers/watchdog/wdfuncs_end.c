@@ -17,5 +17,5 @@
 
 /* Section .wdfunc's end address for watchdog probing function pointers
  * preceding this marker, if any. */
-WATCHDOG_PROBE wdfuncs_end __attribute__((used, section(".wdfuncs"))) =
-	(WATCHDOG_PROBE)0x4353;
+WATCHDOG_DRIVER wdfuncs_end __attribute__((used, section(".wdfuncs"))) = {
+	(WATCHDOG_PROBE)0x4353, NULL};
@@ -17,5 +17,5 @@
 
 /* Section .wdfunc's sentinel value and start address for watchdog probing
  * function pointers following this marker, if any. */
-WATCHDOG_PROBE wdfuncs_start __attribute__((used, section(".wdfuncs"))) =
-	(WATCHDOG_PROBE)0x5343;
+WATCHDOG_DRIVER wdfuncs_start __attribute__((used, section(".wdfuncs"))) = {
+	(WATCHDOG_PROBE)0x5343, NULL};
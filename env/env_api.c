@@ -13,13 +13,45 @@
  * SPDX-License-Identifier:	GPL-2.0
  */
 
+#include <pthread.h>
+#include <sys/eventfd.h>
 #include "env_api.h"
 #include "ebgenv.h"
 #include "uservars.h"
+#include "env_disk_utils.h"
+#include "env_probe_cache.h"
+#include "env_probe_filter.h"
+#include "env_parallel.h"
+#include "env_snapshot.h"
 
 /* global EBG options */
 ebgenv_opts_t ebgenv_opts;
 
+/* Serializes all accesses to the probed partitions and the cached
+ * environments, which are shared by all handles. Recursive, as some entry
+ * points are built on others. */
+static pthread_mutex_t ebgenv_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+struct ebgenv_ctx {
+	bool active;
+};
+
+struct ebgenv_commit {
+	BGENV *env;
+	pthread_t thread;
+	/* eventfd signalled when result is set */
+	int fd;
+	int result;
+};
+
+/* signalled under ebgenv_lock when an asynchronous commit is done */
+static pthread_cond_t commit_done = PTHREAD_COND_INITIALIZER;
+
+/* number of live contexts, which keep the library initialized */
+static unsigned int ctx_count;
+/* number of handles opened and not yet closed */
+static unsigned int open_handles;
+
 /* UEFI uses 16-bit wide unicode strings.
  * However, wchar_t support functions are fixed to 32-bit wide
  * characters in glibc. This code is compiled with
@@ -70,6 +102,30 @@ int ebg_set_opt_bool(ebg_opt_t opt, bool value)
 		ebgenv_opts.verbose = value;
 		bgenv_be_verbose(value);
 		break;
+	case EBG_OPT_PROBE_CACHE:
+		probe_cache_enable(value);
+		break;
+	case EBG_OPT_LAZY_USERVARS:
+		bgenv_set_lazy_uservars(value);
+		break;
+	case EBG_OPT_MAP_ENV:
+		bgenv_set_map_env(value);
+		break;
+	case EBG_OPT_ENV_SNAPSHOT:
+		env_snapshot_enable(value);
+		break;
+	case EBG_OPT_SHARED_MOUNTS:
+		shared_mounts_enable(value);
+		break;
+	case EBG_OPT_GROUP_SYNC:
+		group_sync_enable(value);
+		break;
+	case EBG_OPT_PROBE_STOP_EARLY:
+		probe_order_stop_early(value);
+		break;
+	case EBG_OPT_COMPRESS_USERVARS:
+		bgenv_set_compress_uservars(value);
+		break;
 	default:
 		return EINVAL;
 	}
@@ -85,18 +141,52 @@ int ebg_get_opt_bool(ebg_opt_t opt, bool *value)
 	case EBG_OPT_VERBOSE:
 		*value = ebgenv_opts.verbose;
 		break;
+	case EBG_OPT_PROBE_CACHE:
+		*value = probe_cache_enabled();
+		break;
+	case EBG_OPT_LAZY_USERVARS:
+		*value = bgenv_lazy_uservars();
+		break;
+	case EBG_OPT_MAP_ENV:
+		*value = bgenv_map_env();
+		break;
+	case EBG_OPT_ENV_SNAPSHOT:
+		*value = env_snapshot_enabled();
+		break;
+	case EBG_OPT_SHARED_MOUNTS:
+		*value = shared_mounts_enabled();
+		break;
+	case EBG_OPT_GROUP_SYNC:
+		*value = group_sync_enabled();
+		break;
+	case EBG_OPT_PROBE_STOP_EARLY:
+		*value = probe_order_stops_early();
+		break;
+	case EBG_OPT_COMPRESS_USERVARS:
+		*value = bgenv_compress_uservars();
+		break;
 	default:
 		return EINVAL;
 	}
 	return 0;
 }
 
+int ebg_set_probe_filter(const char *rules)
+{
+	return probe_filter_set(rules);
+}
+
+int ebg_set_probe_order(const char *order)
+{
+	return probe_order_set(order);
+}
+
 void ebg_beverbose(ebgenv_t __attribute__((unused)) * e, bool v)
 {
 	ebg_set_opt_bool(EBG_OPT_VERBOSE, v);
 }
 
-int ebg_env_create_new(ebgenv_t *e)
+static int env_create_new(ebgenv_t *e, ebgenv_keep_cb_t keep, void *priv)
 {
 	if (!bgenv_init()) {
 		return EIO;
@@ -110,18 +200,12 @@ int ebg_env_create_new(ebgenv_t *e)
 	BG_ENVDATA *latest_data = ((BGENV *)latest_env)->data;
 
 	if (latest_data->in_progress != 1) {
-		e->bgenv = (void *)bgenv_create_new();
+		bgenv_close(latest_env);
+		/* starts as the latest environment with the next revision */
+		e->bgenv = (void *)bgenv_create_from_latest(keep, priv);
 		if (!e->bgenv) {
-			bgenv_close(latest_env);
 			return errno;
 		}
-		BG_ENVDATA *new_data = ((BGENV *)e->bgenv)->data;
-		uint32_t new_rev = new_data->revision;
-		uint8_t new_in_progress = new_data->in_progress;
-		memcpy(new_data, latest_env->data, sizeof(BG_ENVDATA));
-		new_data->revision = new_rev;
-		new_data->in_progress = new_in_progress;
-		bgenv_close(latest_env);
 	} else {
 		e->bgenv = latest_env;
 	}
@@ -129,7 +213,7 @@ int ebg_env_create_new(ebgenv_t *e)
 	return 0;
 }
 
-int ebg_env_open_current(ebgenv_t *e)
+static int env_open_current(ebgenv_t *e)
 {
 	if (!bgenv_init()) {
 		return EIO;
@@ -140,47 +224,242 @@ int ebg_env_open_current(ebgenv_t *e)
 	return e->bgenv == NULL ? EIO : 0;
 }
 
+int ebg_env_create_new(ebgenv_t *e)
+{
+	int res;
+
+	pthread_mutex_lock(&ebgenv_lock);
+	res = env_create_new(e, NULL, NULL);
+	if (res == 0) {
+		open_handles++;
+	}
+	pthread_mutex_unlock(&ebgenv_lock);
+	return res;
+}
+
+int ebg_env_create_new_filtered(ebgenv_t *e, ebgenv_keep_cb_t keep,
+				void *priv)
+{
+	int res;
+
+	if (!keep) {
+		return EINVAL;
+	}
+	pthread_mutex_lock(&ebgenv_lock);
+	res = env_create_new(e, keep, priv);
+	if (res == 0) {
+		open_handles++;
+	}
+	pthread_mutex_unlock(&ebgenv_lock);
+	return res;
+}
+
+int ebg_env_open_current(ebgenv_t *e)
+{
+	int res;
+
+	pthread_mutex_lock(&ebgenv_lock);
+	res = env_open_current(e);
+	if (res == 0) {
+		open_handles++;
+	}
+	pthread_mutex_unlock(&ebgenv_lock);
+	return res;
+}
+
+int ebg_env_open_current_ro(ebgenv_t *e)
+{
+	int res;
+
+	pthread_mutex_lock(&ebgenv_lock);
+	res = env_open_current(e);
+	if (res == 0) {
+		((BGENV *)e->bgenv)->read_only = true;
+		open_handles++;
+	}
+	pthread_mutex_unlock(&ebgenv_lock);
+	return res;
+}
+
 int ebg_env_get(ebgenv_t *e, char *key, char *buffer)
 {
-	return bgenv_get((BGENV *)e->bgenv, key, NULL, buffer,
-			 ENV_STRING_LENGTH);
+	int res;
+
+	pthread_mutex_lock(&ebgenv_lock);
+	res = bgenv_get((BGENV *)e->bgenv, key, NULL, buffer,
+			ENV_STRING_LENGTH);
+	pthread_mutex_unlock(&ebgenv_lock);
+	return res;
 }
 
 int ebg_env_get_ex(ebgenv_t *e, char *key, uint64_t *usertype, uint8_t *buffer,
 		   uint32_t maxlen)
 {
-	return bgenv_get((BGENV *)e->bgenv, key, usertype, buffer, maxlen);
+	int res;
+
+	pthread_mutex_lock(&ebgenv_lock);
+	res = bgenv_get((BGENV *)e->bgenv, key, usertype, buffer, maxlen);
+	pthread_mutex_unlock(&ebgenv_lock);
+	return res;
+}
+
+int ebg_env_get_str(ebgenv_t *e, char *key, const char **value)
+{
+	int res;
+
+	pthread_mutex_lock(&ebgenv_lock);
+	res = bgenv_get_str((BGENV *)e->bgenv, key, value);
+	pthread_mutex_unlock(&ebgenv_lock);
+	return res;
+}
+
+int ebg_env_get_u32(ebgenv_t *e, char *key, uint32_t *value)
+{
+	int res;
+
+	pthread_mutex_lock(&ebgenv_lock);
+	res = bgenv_get_u32((BGENV *)e->bgenv, key, value);
+	pthread_mutex_unlock(&ebgenv_lock);
+	return res;
+}
+
+int ebg_env_set_u32(ebgenv_t *e, char *key, uint32_t value)
+{
+	int res;
+
+	pthread_mutex_lock(&ebgenv_lock);
+	res = bgenv_set_u32((BGENV *)e->bgenv, key, value);
+	pthread_mutex_unlock(&ebgenv_lock);
+	return res;
 }
 
 int ebg_env_set(ebgenv_t *e, char *key, char *value)
 {
-	return bgenv_set((BGENV *)e->bgenv, key, USERVAR_TYPE_DEFAULT |
-			 USERVAR_TYPE_STRING_ASCII, value,
-			 strlen(value) + 1);
+	int res;
+
+	pthread_mutex_lock(&ebgenv_lock);
+	res = bgenv_set((BGENV *)e->bgenv, key, USERVAR_TYPE_DEFAULT |
+			USERVAR_TYPE_STRING_ASCII, value, strlen(value) + 1);
+	pthread_mutex_unlock(&ebgenv_lock);
+	return res;
 }
 
 int ebg_env_set_ex(ebgenv_t *e, char *key, uint64_t usertype, uint8_t *value,
 		   uint32_t datalen)
 {
-	return bgenv_set((BGENV *)e->bgenv, key, usertype, value, datalen);
+	int res;
+
+	pthread_mutex_lock(&ebgenv_lock);
+	res = bgenv_set((BGENV *)e->bgenv, key, usertype, value, datalen);
+	pthread_mutex_unlock(&ebgenv_lock);
+	return res;
+}
+
+int ebg_env_set_logged(ebgenv_t *e, char *key, uint64_t usertype,
+		       uint8_t *value, uint32_t datalen)
+{
+	int res;
+
+	pthread_mutex_lock(&ebgenv_lock);
+	res = bgenv_set_logged((BGENV *)e->bgenv, key, usertype, value,
+			       datalen);
+	pthread_mutex_unlock(&ebgenv_lock);
+	return res;
+}
+
+int ebg_env_set_batch(ebgenv_t *e, const ebgenv_batch_op_t *ops,
+		      uint32_t count)
+{
+	int res;
+
+	pthread_mutex_lock(&ebgenv_lock);
+	res = bgenv_set_batch((BGENV *)e->bgenv, ops, count);
+	pthread_mutex_unlock(&ebgenv_lock);
+	return res;
+}
+
+void ebg_env_uservar_iter_init(ebgenv_t __attribute__((unused)) *e,
+			       ebgenv_uservar_iter_t *it)
+{
+	it->offset = 0;
+}
+
+int ebg_env_uservar_next(ebgenv_t *e, ebgenv_uservar_iter_t *it,
+			 ebgenv_uservar_view_t *view)
+{
+	BGENV *env = (BGENV *)e->bgenv;
+	uint8_t *udata, *val;
+	uint32_t rsize;
+	char *key;
+	int res = 1;
+
+	if (!env || !env->data) {
+		return -EPERM;
+	}
+	if (!it || !view) {
+		return -EINVAL;
+	}
+	pthread_mutex_lock(&ebgenv_lock);
+	if (!bgenv_load(env)) {
+		res = -EIO;
+		goto out;
+	}
+	/* validated uservars always leave at least the terminating zero */
+	if (it->offset >= ENV_MEM_USERVARS) {
+		res = -EINVAL;
+		goto out;
+	}
+	udata = env->data->userdata + it->offset;
+	if (!*udata) {
+		res = 0;
+		goto out;
+	}
+	bgenv_map_uservar(udata, &key, &view->type, &val, &rsize,
+			  &view->datalen);
+	view->key = key;
+	view->data = val;
+	it->offset += rsize;
+out:
+	pthread_mutex_unlock(&ebgenv_lock);
+	return res;
 }
 
 uint32_t ebg_env_user_free(ebgenv_t *e)
 {
+	uint32_t res;
+
 	if (!e->bgenv) {
 		return 0;
 	}
 	if (!((BGENV *)e->bgenv)->data) {
 		return 0;
 	}
-	return bgenv_user_free(((BGENV *)e->bgenv)->data->userdata);
+	pthread_mutex_lock(&ebgenv_lock);
+	if (!bgenv_load(e->bgenv)) {
+		pthread_mutex_unlock(&ebgenv_lock);
+		return 0;
+	}
+	res = bgenv_user_free_indexed(&((BGENV *)e->bgenv)->uservar_index,
+				      ((BGENV *)e->bgenv)->data->userdata);
+	pthread_mutex_unlock(&ebgenv_lock);
+	return res;
 }
 
-uint16_t ebg_env_getglobalstate(ebgenv_t __attribute__((unused)) *e)
+static uint16_t env_getglobalstate(void)
 {
 	BGENV *env;
 	int res = USTATE_UNKNOWN;
 
+	/* without environments in memory, the boot loader's view is enough */
+	if (env_snapshot_enabled() && !bgenv_initialized()) {
+		res = env_snapshot_globalstate(ENV_SNAPSHOT_FILE,
+					       ENV_SNAPSHOT_STALE_FILE);
+		if (res >= 0) {
+			return res;
+		}
+		res = USTATE_UNKNOWN;
+	}
+
 	/* Test for rolled-back condition. */
 	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
 		env = bgenv_open_by_index(i);
@@ -213,7 +492,23 @@ uint16_t ebg_env_getglobalstate(ebgenv_t __attribute__((unused)) *e)
 	return res;
 }
 
-int ebg_env_setglobalstate(ebgenv_t *e, uint16_t ustate)
+struct state_commit {
+	BGENV **envs;
+	bool *written;
+	size_t skip;
+};
+
+static void write_state_by_index(size_t index, void *ctx)
+{
+	struct state_commit *commit = ctx;
+
+	if (index == commit->skip || !commit->envs[index]) {
+		return;
+	}
+	commit->written[index] = bgenv_write(commit->envs[index]);
+}
+
+static int env_setglobalstate(ebgenv_t *e, uint16_t ustate)
 {
 	char buffer[2];
 	int res;
@@ -221,6 +516,9 @@ int ebg_env_setglobalstate(ebgenv_t *e, uint16_t ustate)
 	if (ustate > USTATE_FAILED) {
 		return -EINVAL;
 	}
+	if (e->bgenv && ((BGENV *)e->bgenv)->read_only) {
+		return -EROFS;
+	}
 	(void)snprintf(buffer, sizeof(buffer), "%d", ustate);
 	res = bgenv_set((BGENV *)e->bgenv, "ustate", 0, buffer,
 			strlen(buffer) + 1);
@@ -229,29 +527,69 @@ int ebg_env_setglobalstate(ebgenv_t *e, uint16_t ustate)
 		return res;
 	}
 
+	BGENV *envs[ENV_NUM_CONFIG_PARTS] = { NULL };
+	bool written[ENV_NUM_CONFIG_PARTS];
+	struct state_commit commit = { envs, written, ENV_NUM_CONFIG_PARTS };
+	uint32_t maxrev = 0;
+	int latest = -1;
+
 	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
 		BGENV *env = bgenv_open_by_index(i);
 
+		written[i] = true;
 		if (!env) {
 			continue;
 		}
-		if (env->data->ustate != ustate) {
-			env->data->ustate = ustate;
-			env->data->crc32 = bgenv_crc32(0, env->data,
-				sizeof(BG_ENVDATA) - sizeof(env->data->crc32));
-			if (!bgenv_write(env)) {
-				bgenv_close(env);
-				return -EIO;
-			}
+		if (env->data->ustate == ustate) {
+			bgenv_close(env);
+			continue;
 		}
-		bgenv_close(env);
+		uint8_t u8 = ustate;
+
+		bgenv_patch(env, offsetof(BG_ENVDATA, ustate), &u8, sizeof(u8));
+		bgenv_update_crc(env);
+		envs[i] = env;
+		if (latest < 0 || env->data->revision > maxrev) {
+			maxrev = env->data->revision;
+			latest = i;
+		}
+	}
+	/* The environment that will be booted is committed only after all
+	 * others are durable, the rest are written concurrently. */
+	if (latest >= 0) {
+		commit.skip = latest;
+		bgenv_parallel_for(ENV_NUM_CONFIG_PARTS, write_state_by_index,
+				   &commit);
+		commit.skip = ENV_NUM_CONFIG_PARTS;
+		write_state_by_index(latest, &commit);
+	}
+	res = 0;
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		if (!written[i]) {
+			res = -EIO;
+		}
+		bgenv_close(envs[i]);
+	}
+	return res;
+}
+
+static int env_commit(BGENV *env)
+{
+	if (env->read_only) {
+		return 0;
+	}
+	/* bring checksum up to date */
+	bgenv_update_crc(env);
+	/* save, unless nothing changed */
+	if (bgenv_is_dirty(env) && !bgenv_write(env)) {
+		return EIO;
 	}
 	return 0;
 }
 
-int ebg_env_close(ebgenv_t *e)
+static int env_close(ebgenv_t *e)
 {
-	int res = 0;
+	int res;
 
 	/* if no environment is open, just return EIO */
 	if (!e->bgenv) {
@@ -261,17 +599,128 @@ int ebg_env_close(ebgenv_t *e)
 	BGENV *env_current;
 	env_current = (BGENV *)e->bgenv;
 
-	/* recalculate checksum */
-	env_current->data->crc32 =
-	    bgenv_crc32(0, env_current->data,
-			sizeof(BG_ENVDATA) - sizeof(env_current->data->crc32));
-	/* save */
-	if (!bgenv_write(env_current)) {
-		res = EIO;
+	/* the commit threads still use the handle */
+	while (env_current->commits) {
+		pthread_cond_wait(&commit_done, &ebgenv_lock);
 	}
+	res = env_commit(env_current);
 	bgenv_close(env_current);
 	e->bgenv = NULL;
-	bgenv_finalize();
+	if (open_handles > 0) {
+		open_handles--;
+	}
+	/* a context keeps the probe results for the next handle */
+	if (ctx_count == 0 && open_handles == 0) {
+		bgenv_finalize();
+	}
+	return res;
+}
+
+uint16_t ebg_env_getglobalstate(ebgenv_t __attribute__((unused)) *e)
+{
+	uint16_t res;
+
+	pthread_mutex_lock(&ebgenv_lock);
+	res = env_getglobalstate();
+	pthread_mutex_unlock(&ebgenv_lock);
+	return res;
+}
+
+int ebg_env_setglobalstate(ebgenv_t *e, uint16_t ustate)
+{
+	int res;
+
+	pthread_mutex_lock(&ebgenv_lock);
+	res = env_setglobalstate(e, ustate);
+	pthread_mutex_unlock(&ebgenv_lock);
+	return res;
+}
+
+int ebg_env_close(ebgenv_t *e)
+{
+	int res;
+
+	pthread_mutex_lock(&ebgenv_lock);
+	res = env_close(e);
+	pthread_mutex_unlock(&ebgenv_lock);
+	return res;
+}
+
+static void *commit_thread(void *arg)
+{
+	ebgenv_commit_t *commit = arg;
+	uint64_t done = 1;
+
+	pthread_mutex_lock(&ebgenv_lock);
+	commit->result = env_commit(commit->env);
+	commit->env->commits--;
+	pthread_cond_broadcast(&commit_done);
+	pthread_mutex_unlock(&ebgenv_lock);
+
+	if (write(commit->fd, &done, sizeof(done)) != sizeof(done)) {
+		VERBOSE(stderr, "Cannot signal commit completion: %s\n",
+			strerror(errno));
+	}
+	return NULL;
+}
+
+int ebg_env_commit_async(ebgenv_t *e, ebgenv_commit_t **commit)
+{
+	ebgenv_commit_t *c;
+	int res;
+
+	if (!e || !commit) {
+		return EINVAL;
+	}
+	c = calloc(1, sizeof(*c));
+	if (!c) {
+		return ENOMEM;
+	}
+	c->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (c->fd < 0) {
+		res = errno;
+		free(c);
+		return res;
+	}
+
+	pthread_mutex_lock(&ebgenv_lock);
+	c->env = e->bgenv;
+	if (!c->env) {
+		res = EIO;
+		goto unlock;
+	}
+	c->env->commits++;
+	res = pthread_create(&c->thread, NULL, commit_thread, c);
+	if (res) {
+		c->env->commits--;
+	}
+unlock:
+	pthread_mutex_unlock(&ebgenv_lock);
+	if (res) {
+		close(c->fd);
+		free(c);
+		return res;
+	}
+	*commit = c;
+	return 0;
+}
+
+int ebg_commit_fd(const ebgenv_commit_t *commit)
+{
+	return commit->fd;
+}
+
+int ebg_commit_finish(ebgenv_commit_t *commit)
+{
+	int res;
+
+	if (!commit) {
+		return EINVAL;
+	}
+	pthread_join(commit->thread, NULL);
+	res = commit->result;
+	close(commit->fd);
+	free(commit);
 	return res;
 }
 
@@ -298,30 +747,124 @@ int ebg_env_register_gc_var(ebgenv_t *e, char *key)
 	return 0;
 }
 
-int ebg_env_finalize_update(ebgenv_t *e)
+static bool gc_keep(const char *key, void *priv)
+{
+	for (GC_ITEM *gci = priv; gci; gci = gci->next) {
+		if (strcmp(gci->key, key) == 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static int env_finalize_update(ebgenv_t *e)
 {
 	if (!e->bgenv || !((BGENV *)e->bgenv)->data) {
 		return EIO;
 	}
+	if (((BGENV *)e->bgenv)->read_only) {
+		return EROFS;
+	}
 
 	GC_ITEM *pgci, *tmp;
+	BGENV *env = (BGENV *)e->bgenv;
 	uint8_t *udata;
+	uint8_t u8;
 
+	if (!bgenv_load(env)) {
+		return EIO;
+	}
 	pgci = (GC_ITEM *)e->gc_registry;
-	udata = ((BGENV *)e->bgenv)->data->userdata;
-	while (pgci) {
-		uint8_t *var;
-		var = bgenv_find_uservar(udata, pgci->key);
-		if (var) {
-			bgenv_del_uservar(udata, var);
+	udata = env->data->userdata;
+	/* drop all registered variables in a single pass */
+	if (pgci) {
+		uint32_t used = ENV_MEM_USERVARS -
+				bgenv_user_free_indexed(&env->uservar_index,
+							udata);
+
+		if (bgenv_copy_uservars(udata, udata, gc_keep, pgci) != used) {
+			bgenv_uservar_index_free(&env->uservar_index);
+			bgenv_mark_dirty(env, offsetof(BG_ENVDATA, userdata),
+					 sizeof(env->data->userdata));
 		}
+	}
+	while (pgci) {
 		free(pgci->key);
 		tmp = pgci->next;
 		free(pgci);
 		pgci = tmp;
 	}
+	e->gc_registry = NULL;
 
-	((BGENV *)e->bgenv)->data->in_progress = 0;
-	((BGENV *)e->bgenv)->data->ustate = USTATE_INSTALLED;
+	u8 = 0;
+	bgenv_patch(env, offsetof(BG_ENVDATA, in_progress), &u8, sizeof(u8));
+	u8 = USTATE_INSTALLED;
+	bgenv_patch(env, offsetof(BG_ENVDATA, ustate), &u8, sizeof(u8));
 	return 0;
 }
+
+int ebg_env_finalize_update(ebgenv_t *e)
+{
+	int res;
+
+	pthread_mutex_lock(&ebgenv_lock);
+	res = env_finalize_update(e);
+	pthread_mutex_unlock(&ebgenv_lock);
+	return res;
+}
+
+int ebg_ctx_new(ebgenv_ctx_t **ctx)
+{
+	int res = 0;
+
+	if (!ctx) {
+		return EINVAL;
+	}
+	*ctx = calloc(1, sizeof(**ctx));
+	if (!*ctx) {
+		return ENOMEM;
+	}
+	pthread_mutex_lock(&ebgenv_lock);
+	if (!bgenv_init()) {
+		res = EIO;
+	} else {
+		ctx_count++;
+		(*ctx)->active = true;
+	}
+	pthread_mutex_unlock(&ebgenv_lock);
+	if (res) {
+		free(*ctx);
+		*ctx = NULL;
+	}
+	return res;
+}
+
+int ebg_ctx_refresh(ebgenv_ctx_t *ctx)
+{
+	int res = 0;
+
+	if (!ctx || !ctx->active) {
+		return EINVAL;
+	}
+	pthread_mutex_lock(&ebgenv_lock);
+	if (open_handles > 0) {
+		res = EBUSY;
+	} else if (!bgenv_reload()) {
+		res = EIO;
+	}
+	pthread_mutex_unlock(&ebgenv_lock);
+	return res;
+}
+
+void ebg_ctx_free(ebgenv_ctx_t *ctx)
+{
+	if (!ctx) {
+		return;
+	}
+	pthread_mutex_lock(&ebgenv_lock);
+	if (ctx->active && --ctx_count == 0 && open_handles == 0) {
+		bgenv_finalize();
+	}
+	pthread_mutex_unlock(&ebgenv_lock);
+	free(ctx);
+}
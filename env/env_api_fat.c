@@ -12,37 +12,110 @@
  * SPDX-License-Identifier:	GPL-2.0
  */
 
+#include <sys/stat.h>
 #include "env_api.h"
 #include "env_disk_utils.h"
 #include "env_config_partitions.h"
 #include "env_config_file.h"
+#include "env_parallel.h"
+#include "env_snapshot.h"
+#include "env_trace.h"
 #include "uservars.h"
 #include "test-interface.h"
 #include "ebgpart.h"
 
 extern ebgenv_opts_t ebgenv_opts;
 
+/* The built-in variables, indexed by EBGENVKEY. */
+static const struct {
+	const char *name;
+	uint32_t offset;
+	uint32_t size;
+} builtin_keys[EBGENV_UNKNOWN] = {
+	[EBGENV_KERNELFILE] = { "kernelfile",
+				offsetof(BG_ENVDATA, kernelfile),
+				sizeof(((BG_ENVDATA *)0)->kernelfile) },
+	[EBGENV_KERNELPARAMS] = { "kernelparams",
+				  offsetof(BG_ENVDATA, kernelparams),
+				  sizeof(((BG_ENVDATA *)0)->kernelparams) },
+	[EBGENV_WATCHDOG_TIMEOUT_SEC] = {
+		"watchdog_timeout_sec",
+		offsetof(BG_ENVDATA, watchdog_timeout_sec),
+		sizeof(((BG_ENVDATA *)0)->watchdog_timeout_sec) },
+	[EBGENV_REVISION] = { "revision", offsetof(BG_ENVDATA, revision),
+			      sizeof(((BG_ENVDATA *)0)->revision) },
+	[EBGENV_USTATE] = { "ustate", offsetof(BG_ENVDATA, ustate),
+			    sizeof(((BG_ENVDATA *)0)->ustate) },
+	[EBGENV_IN_PROGRESS] = { "in_progress",
+				 offsetof(BG_ENVDATA, in_progress),
+				 sizeof(((BG_ENVDATA *)0)->in_progress) },
+};
+
+/* The names of the built-in variables all differ in length, which makes
+ * the length a perfect hash. Entries hold the EBGENVKEY plus one, so that
+ * zero marks lengths without a built-in variable. */
+#define BUILTIN_KEY_MAX_LEN 20
+static const uint8_t builtin_key_by_len[BUILTIN_KEY_MAX_LEN + 1] = {
+	[10] = EBGENV_KERNELFILE + 1,
+	[12] = EBGENV_KERNELPARAMS + 1,
+	[20] = EBGENV_WATCHDOG_TIMEOUT_SEC + 1,
+	[8] = EBGENV_REVISION + 1,
+	[6] = EBGENV_USTATE + 1,
+	[11] = EBGENV_IN_PROGRESS + 1,
+};
+
 EBGENVKEY bgenv_str2enum(char *key)
 {
-	if (strcmp(key, "kernelfile") == 0) {
-		return EBGENV_KERNELFILE;
-	}
-	if (strcmp(key, "kernelparams") == 0) {
-		return EBGENV_KERNELPARAMS;
-	}
-	if (strcmp(key, "watchdog_timeout_sec") == 0) {
-		return EBGENV_WATCHDOG_TIMEOUT_SEC;
+	size_t len = strnlen(key, BUILTIN_KEY_MAX_LEN + 1);
+	EBGENVKEY e;
+
+	if (len > BUILTIN_KEY_MAX_LEN || !builtin_key_by_len[len]) {
+		return EBGENV_UNKNOWN;
 	}
-	if (strcmp(key, "revision") == 0) {
-		return EBGENV_REVISION;
+	e = builtin_key_by_len[len] - 1;
+	if (memcmp(key, builtin_keys[e].name, len) != 0) {
+		return EBGENV_UNKNOWN;
 	}
-	if (strcmp(key, "ustate") == 0) {
-		return EBGENV_USTATE;
+	return e;
+}
+
+#if ENV_NUM_COUNTERS > 0
+static const char *const counter_names[ENV_NUM_COUNTERS] = {
+	ENV_COUNTER_NAMES
+};
+#endif
+
+/* Returns the index of the boot counter named key or -1 if there is none. */
+int bgenv_counter_index(const char *key)
+{
+#if ENV_NUM_COUNTERS > 0
+	for (int i = 0; i < ENV_NUM_COUNTERS; i++) {
+		if (strcmp(key, counter_names[i]) == 0) {
+			return i;
+		}
 	}
-	if (strcmp(key, "in_progress") == 0) {
-		return EBGENV_IN_PROGRESS;
+#else
+	(void)key;
+#endif
+	return -1;
+}
+
+/* Returns the name of boot counter index, NULL past the last one. */
+const char *bgenv_counter_name(unsigned int index)
+{
+#if ENV_NUM_COUNTERS > 0
+	if (index < ENV_NUM_COUNTERS) {
+		return counter_names[index];
 	}
-	return EBGENV_UNKNOWN;
+#else
+	(void)index;
+#endif
+	return NULL;
+}
+
+static uint32_t counter_offset(int index)
+{
+	return ENV_COUNTERS_OFFSET + index * sizeof(uint32_t);
 }
 
 void bgenv_be_verbose(bool v)
@@ -77,15 +150,309 @@ bool validate_envdata(BG_ENVDATA *data)
 	return true;
 }
 
+static size_t log_start(size_t len)
+{
+	return (len + ENV_LOG_SLOT_SIZE - 1) / ENV_LOG_SLOT_SIZE *
+	       ENV_LOG_SLOT_SIZE;
+}
+
+/* Checks that rec holds a single complete uservar record of len bytes. */
+static bool log_record_valid(const uint8_t *rec, uint32_t len)
+{
+	size_t klen = strnlen((const char *)rec, len);
+	uint32_t payload;
+
+	if (klen == 0 || klen + 1 + sizeof(uint32_t) + sizeof(uint64_t) > len) {
+		return false;
+	}
+	memcpy(&payload, rec + klen + 1, sizeof(payload));
+	return payload == len - klen - 1;
+}
+
+/* Parses the log following the format 2 data at offset start and replays
+ * its records onto the uservars of data. */
+static bool decode_log(BG_ENVDATA *data, const uint8_t *buf, size_t len,
+		       size_t start, ENV_LOG *log)
+{
+	const BG_ENVLOG_HDR *lhdr = (const BG_ENVLOG_HDR *)(buf + start);
+	ENV_LOG state = { 0 };
+
+	if (len < start + ENV_LOG_SLOT_SIZE ||
+	    lhdr->magic != ENV_LOG_HDR_MAGIC ||
+	    lhdr->crc32 != bgenv_crc32(0, (const uint8_t *)lhdr +
+					      ENV_LOG_CRC_START,
+				       sizeof(*lhdr) - ENV_LOG_CRC_START) ||
+	    lhdr->slot_size != ENV_LOG_SLOT_SIZE || lhdr->slots == 0 ||
+	    lhdr->slots > ENV_LOG_MAX_SLOTS ||
+	    len != start + (1 + (size_t)lhdr->slots) * ENV_LOG_SLOT_SIZE) {
+		VERBOSE(stderr, "Invalid update log!\n");
+		return false;
+	}
+	state.slots = lhdr->slots;
+	state.generation = lhdr->generation;
+	state.offset = start + ENV_LOG_SLOT_SIZE;
+
+	/* replay up to the first slot that does not continue the sequence,
+	 * which covers empty slots as well as a torn last write */
+	for (uint32_t k = 0; k < state.slots; k++) {
+		uint32_t slot = (state.generation + k) % state.slots;
+		const uint8_t *p = buf + state.offset +
+				   (size_t)slot * ENV_LOG_SLOT_SIZE;
+		const BG_ENVLOG_REC *rec = (const BG_ENVLOG_REC *)p;
+		const uint8_t *var = p + sizeof(*rec);
+		uint8_t *val;
+		uint32_t dsize;
+		uint64_t type;
+		char *key;
+
+		if (rec->magic != ENV_LOG_REC_MAGIC ||
+		    rec->generation != state.generation || rec->seq != k + 1 ||
+		    rec->len > ENV_LOG_REC_MAX_LEN ||
+		    rec->crc32 != bgenv_crc32(0, p + ENV_LOG_REC_CRC_START,
+					      sizeof(*rec) -
+						      ENV_LOG_REC_CRC_START +
+						      rec->len) ||
+		    !log_record_valid(var, rec->len)) {
+			break;
+		}
+		bgenv_map_uservar((uint8_t *)var, &key, &type, &val, NULL,
+				  &dsize);
+		if (bgenv_set_uservar(data->userdata, key, type, val, dsize)) {
+			VERBOSE(stderr, "Cannot replay update of %s!\n", key);
+			return false;
+		}
+		state.used = k + 1;
+		state.seq = rec->seq;
+	}
+	if (log) {
+		*log = state;
+	}
+	return true;
+}
+
+/* Checks the header of a format 2 or 3 file and fills the fixed fields of
+ * data from it, leaving the uservar area alone. */
+static bool decode_v2_header(BG_ENVDATA *data, const BG_ENVHDR_V2 *hdr)
+{
+	if (!ENV_FORMAT_COMPACT(hdr->version) ||
+	    hdr->header_size != sizeof(*hdr)) {
+		VERBOSE(stderr, "Unsupported environment format %u!\n",
+			hdr->version);
+		return false;
+	}
+	if (hdr->crc32 != bgenv_crc32(0, (const uint8_t *)hdr +
+					      ENV_V2_CRC_START,
+				      sizeof(*hdr) - ENV_V2_CRC_START)) {
+		VERBOSE(stderr, "Invalid header CRC32!\n");
+		return false;
+	}
+	if (hdr->userdata_len >= ENV_MEM_USERVARS) {
+		VERBOSE(stderr, "Invalid uservar size!\n");
+		return false;
+	}
+
+	memcpy(data->kernelfile, hdr->kernelfile, sizeof(data->kernelfile));
+	memcpy(data->kernelparams, hdr->kernelparams,
+	       sizeof(data->kernelparams));
+	data->in_progress = hdr->in_progress;
+	data->ustate = hdr->ustate;
+	data->watchdog_timeout_sec = hdr->watchdog_timeout_sec;
+	data->revision = hdr->revision;
+	memcpy((uint8_t *)data + ENV_COUNTERS_OFFSET,
+	       (const uint8_t *)hdr + ENV_V2_COUNTERS_OFFSET, ENV_COUNTERS_SIZE);
+
+	/* enforce NULL-termination of strings */
+	data->kernelfile[ENV_STRING_LENGTH - 1] = 0;
+	data->kernelparams[ENV_STRING_LENGTH - 1] = 0;
+	return true;
+}
+
+static bool decode_v2(BG_ENVDATA *data, const uint8_t *buf, size_t len,
+		      ENV_LOG *log)
+{
+	const BG_ENVHDR_V2 *hdr = (const BG_ENVHDR_V2 *)buf;
+	const uint8_t *udata = buf + sizeof(*hdr);
+	uint32_t ulen = hdr->userdata_len;
+	uint32_t used = ulen;
+	bool has_log;
+
+	if (!decode_v2_header(data, hdr)) {
+		return false;
+	}
+	if (len < sizeof(*hdr) + ulen) {
+		VERBOSE(stderr, "Invalid uservar size!\n");
+		return false;
+	}
+	has_log = len > sizeof(*hdr) + ulen;
+	if (hdr->userdata_crc32 != bgenv_crc32(0, udata, ulen)) {
+		VERBOSE(stderr, "Invalid CRC32!\n");
+		return false;
+	}
+	if (hdr->version == ENV_FORMAT_V3) {
+		if (!bgenv_expand_uservars(udata, ulen, data->userdata)) {
+			VERBOSE(stderr, "Corrupt uservars!\n");
+			return false;
+		}
+		used = ENV_MEM_USERVARS - bgenv_user_free(data->userdata);
+	} else {
+		memcpy(data->userdata, udata, ulen);
+		memset(data->userdata + ulen, 0, ENV_MEM_USERVARS - ulen);
+	}
+
+	if (!bgenv_validate_uservars(data->userdata)) {
+		VERBOSE(stderr, "Corrupt uservars!\n");
+		return false;
+	}
+	if (log) {
+		memset(log, 0, sizeof(*log));
+	}
+	if (has_log) {
+		if (!decode_log(data, buf, len, log_start(sizeof(*hdr) + ulen),
+				log)) {
+			return false;
+		}
+		used = ENV_MEM_USERVARS - bgenv_user_free(data->userdata);
+	}
+	/* the in-memory checksum is that of format 1, the zeroed tail of the
+	 * uservar area does not need to be hashed for it */
+	data->crc32 = bgenv_crc32(0, data, offsetof(BG_ENVDATA, userdata) + used);
+	data->crc32 = bgenv_crc32_zeros(data->crc32, ENV_MEM_USERVARS - used);
+	return true;
+}
+
+/* Fills data from the len bytes of an environment file in either format and
+ * stores the detected format and the state of its update log, if any.
+ * Invalid data is cleared. */
+bool bgenv_decode(BG_ENVDATA *data, const void *buf, size_t len, int *format,
+		  ENV_LOG *log)
+{
+	const BG_ENVHDR_V2 *hdr = buf;
+
+	if (log) {
+		memset(log, 0, sizeof(*log));
+	}
+	if (len >= sizeof(*hdr) && hdr->magic == ENV_V2_MAGIC) {
+		if (!decode_v2(data, buf, len, log)) {
+			if (log) {
+				memset(log, 0, sizeof(*log));
+			}
+			/* clear invalid environment */
+			clear_envdata(data);
+			return false;
+		}
+		if (format) {
+			*format = hdr->version;
+		}
+		return true;
+	}
+	if (len != sizeof(BG_ENVDATA)) {
+		VERBOSE(stderr, "Invalid environment size %zu.\n", len);
+		clear_envdata(data);
+		return false;
+	}
+	memcpy(data, buf, len);
+	if (format) {
+		*format = ENV_FORMAT_V1;
+	}
+
+	/* enforce NULL-termination of strings */
+	data->kernelfile[ENV_STRING_LENGTH - 1] = 0;
+	data->kernelparams[ENV_STRING_LENGTH - 1] = 0;
+
+	return validate_envdata(data);
+}
+
+/* Stores data in the compact format 2 or 3 into buf, which must provide
+ * ENV_FILE_MAX_SIZE bytes, and returns the resulting file size. Format 3
+ * falls back to format 2 if the front-coded uservars do not fit. If log has
+ * slots, an empty log of its generation is appended and log is updated to
+ * describe it. */
+size_t bgenv_encode_v2(const BG_ENVDATA *data, int format, void *buf,
+		       ENV_LOG *log)
+{
+	BG_ENVHDR_V2 *hdr = buf;
+	uint8_t *udata = (uint8_t *)buf + sizeof(*hdr);
+	uint32_t ulen;
+
+	memset(hdr, 0, sizeof(*hdr));
+	if (format == ENV_FORMAT_V3 &&
+	    bgenv_front_code_uservars((uint8_t *)data->userdata, udata,
+				      ENV_MEM_USERVARS, &ulen)) {
+		hdr->version = ENV_FORMAT_V3;
+	} else {
+		ulen = ENV_MEM_USERVARS -
+		       bgenv_user_free((uint8_t *)data->userdata);
+		memcpy(udata, data->userdata, ulen);
+		hdr->version = ENV_FORMAT_V2;
+	}
+	hdr->magic = ENV_V2_MAGIC;
+	hdr->header_size = sizeof(*hdr);
+	hdr->in_progress = data->in_progress;
+	hdr->ustate = data->ustate;
+	hdr->watchdog_timeout_sec = data->watchdog_timeout_sec;
+	hdr->revision = data->revision;
+	hdr->userdata_len = ulen;
+	memcpy((uint8_t *)hdr + ENV_V2_COUNTERS_OFFSET,
+	       (const uint8_t *)data + ENV_COUNTERS_OFFSET, ENV_COUNTERS_SIZE);
+	memcpy(hdr->kernelfile, data->kernelfile, sizeof(hdr->kernelfile));
+	memcpy(hdr->kernelparams, data->kernelparams,
+	       sizeof(hdr->kernelparams));
+	hdr->userdata_crc32 = bgenv_crc32(0, udata, ulen);
+	hdr->crc32 = bgenv_crc32(0, (uint8_t *)buf + ENV_V2_CRC_START,
+				 sizeof(*hdr) - ENV_V2_CRC_START);
+	if (!log || log->slots == 0) {
+		return sizeof(*hdr) + ulen;
+	}
+
+	size_t start = log_start(sizeof(*hdr) + ulen);
+	BG_ENVLOG_HDR *lhdr = (BG_ENVLOG_HDR *)((uint8_t *)buf + start);
+	size_t end = start + (1 + (size_t)log->slots) * ENV_LOG_SLOT_SIZE;
+
+	memset(udata + ulen, 0, end - sizeof(*hdr) - ulen);
+	lhdr->magic = ENV_LOG_HDR_MAGIC;
+	lhdr->slot_size = ENV_LOG_SLOT_SIZE;
+	lhdr->slots = log->slots;
+	lhdr->generation = log->generation;
+	lhdr->crc32 = bgenv_crc32(0, (uint8_t *)lhdr + ENV_LOG_CRC_START,
+				  sizeof(*lhdr) - ENV_LOG_CRC_START);
+	log->offset = start + ENV_LOG_SLOT_SIZE;
+	log->used = 0;
+	log->seq = 0;
+	return end;
+}
+
 bool read_env(CONFIG_PART *part, BG_ENVDATA *env)
 {
+	BG_TRACE_SPAN span;
+	bool result = false;
+	uint8_t *buf;
+	size_t len = 0;
+
 	if (!part) {
 		return false;
 	}
+	BG_TRACE_START(span, read_env, part->devpath);
+	/* room for a file of either format */
+	buf = malloc(ENV_FILE_MAX_SIZE);
+	if (!buf) {
+		goto out;
+	}
 	if (part->not_mounted) {
+		/* try the block device first, it is much cheaper than a mount */
+		int ret = raw_config_file_access(part, buf, ENV_FILE_MAX_SIZE,
+						 false);
+		if (ret >= 0) {
+			VERBOSE(stdout, "Read config file: raw access to %s\n",
+				part->devpath);
+			len = ret;
+			goto decode;
+		}
+		if (ret == -ENOENT || part->image) {
+			goto out;
+		}
 		/* mount partition before reading config file */
 		if (!mount_partition(part)) {
-			return false;
+			goto out;
 		}
 	} else {
 		VERBOSE(stdout, "Read config file: mounted to %s\n",
@@ -94,16 +461,13 @@ bool read_env(CONFIG_PART *part, BG_ENVDATA *env)
 	FILE *config;
 	config = open_config_file_from_part(part, "rb");
 	if (!config) {
-		return false;
+		goto out;
 	}
-	bool result = true;
-	if (!(fread(env, sizeof(BG_ENVDATA), 1, config) == 1)) {
+	len = fread(buf, 1, ENV_FILE_MAX_SIZE, config);
+	if (ferror(config)) {
 		VERBOSE(stderr, "Error reading environment data from %s\n",
 			part->devpath);
-		if (feof(config)) {
-			VERBOSE(stderr, "End of file encountered.\n");
-		}
-		result = false;
+		len = 0;
 	}
 	if (fclose(config)) {
 		VERBOSE(stderr,
@@ -112,24 +476,81 @@ bool read_env(CONFIG_PART *part, BG_ENVDATA *env)
 	if (part->not_mounted) {
 		unmount_partition(part);
 	}
-	if (result == false) {
-		clear_envdata(env);
-		return false;
-	}
 
-	/* enforce NULL-termination of strings */
-	env->kernelfile[ENV_STRING_LENGTH - 1] = 0;
-	env->kernelparams[ENV_STRING_LENGTH - 1] = 0;
+decode:
+	result = bgenv_decode(env, buf, len, &part->env_format, &part->log);
+out:
+	free(buf);
+	BG_TRACE_DONE(span, read_env, part->devpath, len, result ? 0 : -EIO);
+	return result;
+}
+
+/* Reads only the header of a format 2 file into the fixed fields of env
+ * and leaves its uservars empty. Returns false if the file is in format 1,
+ * its header is invalid or it is only accessible by mounting, so that the
+ * caller reads the whole file instead. */
+static bool read_env_header(CONFIG_PART *part, BG_ENVDATA *env)
+{
+	BG_ENVHDR_V2 hdr;
+	BG_TRACE_SPAN span;
+	bool result = false;
+	size_t len = 0;
+
+	BG_TRACE_START(span, read_env_header, part->devpath);
+	if (part->not_mounted) {
+		int ret = raw_config_file_read_head(part, &hdr, sizeof(hdr));
 
-	return validate_envdata(env);
+		if (ret < 0) {
+			goto out;
+		}
+		len = ret;
+	} else {
+		FILE *config = open_config_file_from_part(part, "rb");
+
+		if (!config) {
+			goto out;
+		}
+		len = fread(&hdr, 1, sizeof(hdr), config);
+		fclose(config);
+	}
+	if (len == sizeof(hdr) && hdr.magic == ENV_V2_MAGIC &&
+	    decode_v2_header(env, &hdr)) {
+		VERBOSE(stdout, "Read config file header of %s\n",
+			part->devpath);
+		memset(env->userdata, 0, sizeof(env->userdata));
+		part->env_format = hdr.version;
+		memset(&part->log, 0, sizeof(part->log));
+		result = true;
+	}
+out:
+	BG_TRACE_DONE(span, read_env_header, part->devpath, len,
+		      result ? 0 : -EIO);
+	return result;
 }
 
-bool write_env(CONFIG_PART *part, BG_ENVDATA *env)
+static bool write_env_file(CONFIG_PART *part, const void *buf, size_t len)
 {
-	if (!part) {
-		return false;
+	if (part->not_mounted) {
+		/* rewrite in place if the file exists with the expected size */
+		int ret = raw_config_file_access(part, (void *)buf, len, true);
+
+		if (ret == 0) {
+			VERBOSE(stdout, "Wrote config file: raw access to %s\n",
+				part->devpath);
+			return true;
+		}
+		/* mounted since the probe, write through that mount */
+		if (ret == -EBUSY) {
+			adopt_mountpoint(part);
+		}
 	}
 	if (part->not_mounted) {
+		/* without a mount, the file cannot change its size */
+		if (part->image) {
+			VERBOSE(stderr, "Cannot resize the config file in %s\n",
+				part->devpath);
+			return false;
+		}
 		/* mount partition before reading config file */
 		if (!mount_partition(part)) {
 			return false;
@@ -145,11 +566,18 @@ bool write_env(CONFIG_PART *part, BG_ENVDATA *env)
 		return false;
 	}
 	bool result = true;
-	if (!(fwrite(env, sizeof(BG_ENVDATA), 1, config) == 1)) {
+	if (!(fwrite(buf, len, 1, config) == 1)) {
 		VERBOSE(stderr, "Error saving environment data to %s\n",
 			part->devpath);
 		result = false;
 	}
+	/* durable before the next partition is written */
+	if (result && group_sync_enabled() &&
+	    (fflush(config) || sync_mounted_file(fileno(config)))) {
+		VERBOSE(stderr, "Error syncing environment data to %s\n",
+			part->devpath);
+		result = false;
+	}
 	if (fclose(config)) {
 		VERBOSE(stderr,
 			"Error closing environment file after writing.\n");
@@ -161,12 +589,164 @@ bool write_env(CONFIG_PART *part, BG_ENVDATA *env)
 	return result;
 }
 
+/* Stores env in the format the partition had, format 1 if it had none. */
+bool write_env(CONFIG_PART *part, BG_ENVDATA *env)
+{
+	BG_TRACE_SPAN span;
+	uint8_t *buf;
+	size_t len = 0;
+	bool result = false;
+
+	if (!part) {
+		return false;
+	}
+	BG_TRACE_START(span, write_env, part->devpath);
+	if (!ENV_FORMAT_COMPACT(part->env_format)) {
+		len = sizeof(BG_ENVDATA);
+		result = write_env_file(part, env, len);
+		goto out;
+	}
+	buf = malloc(ENV_FILE_MAX_SIZE);
+	if (!buf) {
+		goto out;
+	}
+	/* the rewritten file incorporates all logged updates */
+	ENV_LOG old = part->log;
+
+	part->log.generation++;
+	len = bgenv_encode_v2(env, part->env_format, buf, &part->log);
+	result = write_env_file(part, buf, len);
+	if (!result) {
+		part->log = old;
+	}
+	free(buf);
+out:
+	BG_TRACE_DONE(span, write_env, part->devpath, len, result ? 0 : -EIO);
+	return result;
+}
+
 /* Weaken the symbols in order to permit overloading in the test cases. */
 CONFIG_PART __attribute__((weak)) config_parts[ENV_NUM_CONFIG_PARTS];
 BG_ENVDATA __attribute__((weak)) envdata[ENV_NUM_CONFIG_PARTS];
 
 static bool initialized;
 
+/* true while envdata[i].crc32 is known to match the data */
+static bool envdata_crc_valid[ENV_NUM_CONFIG_PARTS];
+
+/* true while the file of partition i is known to hold envdata[i], apart
+ * from the blocks set in envdata_dirty[i] */
+static bool envdata_synced[ENV_NUM_CONFIG_PARTS];
+static uint8_t envdata_dirty[ENV_NUM_CONFIG_PARTS][ENV_DIRTY_MAP_SIZE];
+
+#define ENV_CRC_SIZE (sizeof(BG_ENVDATA) - sizeof(uint32_t))
+
+/* 8-bit copies of the kernelfile and kernelparams of envdata[i], valid
+ * while envdata_str_valid[i] */
+static char envdata_str[ENV_NUM_CONFIG_PARTS][2][ENV_STRING_LENGTH];
+static bool envdata_str_valid[ENV_NUM_CONFIG_PARTS];
+
+/* Read only the headers of format 2 files and load their uservars on
+ * first use, see bgenv_load(). */
+static bool lazy_uservars;
+
+/* true while envdata[i] only holds the fixed fields of the file of
+ * partition i */
+static bool envdata_partial[ENV_NUM_CONFIG_PARTS];
+
+/* Map format 1 files from the block device instead of reading them into
+ * envdata[], so that only the pages written to take private memory. */
+static bool map_env;
+
+/* the environment of partition i if envdata_map[i].data is set */
+static ENV_MAPPING envdata_map[ENV_NUM_CONFIG_PARTS];
+
+void bgenv_set_lazy_uservars(bool enable)
+{
+	lazy_uservars = enable;
+}
+
+bool bgenv_lazy_uservars(void)
+{
+	return lazy_uservars;
+}
+
+void bgenv_set_map_env(bool enable)
+{
+	map_env = enable;
+}
+
+bool bgenv_map_env(void)
+{
+	return map_env;
+}
+
+static BG_ENVDATA *env_data(size_t index)
+{
+	return envdata_map[index].data ? envdata_map[index].data
+				       : &envdata[index];
+}
+
+/* Maps a valid format 1 file of partition index. Returns false if the
+ * file has to be read instead, which also reports why it is invalid. */
+static bool map_env_by_index(size_t index)
+{
+	CONFIG_PART *part = &config_parts[index];
+	ENV_MAPPING *map = &envdata_map[index];
+	BG_TRACE_SPAN span;
+	BG_ENVDATA *data;
+	bool result = false;
+
+	BG_TRACE_START(span, map_env, part->devpath);
+	if (!part->not_mounted ||
+	    raw_config_file_map(part, sizeof(BG_ENVDATA), map) != 0) {
+		goto out;
+	}
+	data = map->data;
+	/* checking leaves the pages shared with the page cache */
+	if (((BG_ENVHDR_V2 *)data)->magic == ENV_V2_MAGIC ||
+	    data->kernelfile[ENV_STRING_LENGTH - 1] ||
+	    data->kernelparams[ENV_STRING_LENGTH - 1] ||
+	    data->crc32 != bgenv_crc32(0, data, ENV_CRC_SIZE) ||
+	    !bgenv_validate_uservars(data->userdata)) {
+		env_mapping_release(map);
+		goto out;
+	}
+	VERBOSE(stdout, "Mapped config file: raw access to %s\n",
+		part->devpath);
+	part->env_format = ENV_FORMAT_V1;
+	memset(&part->log, 0, sizeof(part->log));
+	result = true;
+out:
+	BG_TRACE_DONE(span, map_env, part->devpath,
+		      result ? sizeof(BG_ENVDATA) : 0, result ? 0 : -EIO);
+	return result;
+}
+
+static void read_env_by_index(size_t index, void *ctx)
+{
+	CONFIG_PART *part = &config_parts[index];
+	bool valid = false;
+
+	(void)ctx;
+	env_mapping_release(&envdata_map[index]);
+	envdata_partial[index] = lazy_uservars &&
+				 read_env_header(part, &envdata[index]);
+	if (envdata_partial[index]) {
+		valid = false;
+	} else if (map_env && map_env_by_index(index)) {
+		valid = true;
+	} else {
+		valid = read_env(part, &envdata[index]);
+	}
+	/* the checksum of a partial environment is only known once the
+	 * uservars are loaded */
+	envdata_crc_valid[index] = valid;
+	envdata_synced[index] = valid;
+	memset(envdata_dirty[index], 0, sizeof(envdata_dirty[index]));
+	envdata_str_valid[index] = false;
+}
+
 bool bgenv_init(void)
 {
 	if (initialized) {
@@ -178,24 +758,66 @@ bool bgenv_init(void)
 		VERBOSE(stderr, "Error finding config partitions.\n");
 		return false;
 	}
-	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
-		read_env(&config_parts[i], &envdata[i]);
+	bgenv_parallel_for(ENV_NUM_CONFIG_PARTS, read_env_by_index, NULL);
+	initialized = true;
+	return true;
+}
+
+/* Like bgenv_init(), but for the config partitions in a disk image file,
+ * which are accessed without mounting them. */
+bool bgenv_init_image(const char *image)
+{
+	if (initialized) {
+		return true;
+	}
+	if (!probe_image_config_partitions(config_parts, image)) {
+		VERBOSE(stderr, "Error finding config partitions in %s.\n",
+			image);
+		return false;
 	}
+	bgenv_parallel_for(ENV_NUM_CONFIG_PARTS, read_env_by_index, NULL);
 	initialized = true;
 	return true;
 }
 
+bool bgenv_initialized(void)
+{
+	return initialized;
+}
+
+/* Rereads all environments from the already probed config partitions. */
+bool bgenv_reload(void)
+{
+	if (!initialized) {
+		return false;
+	}
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		config_parts[i].env_format = 0;
+		memset(&config_parts[i].log, 0, sizeof(config_parts[i].log));
+	}
+	bgenv_parallel_for(ENV_NUM_CONFIG_PARTS, read_env_by_index, NULL);
+	return true;
+}
+
 void bgenv_finalize(void)
 {
 	if (!initialized) {
 		return;
 	}
 	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
-		free(config_parts[i].devpath);
 		config_parts[i].devpath = NULL;
 		free(config_parts[i].mountpoint);
 		config_parts[i].mountpoint = NULL;
+		config_parts[i].image = false;
+		config_parts[i].offset = 0;
+		config_parts[i].env_format = 0;
+		memset(&config_parts[i].log, 0, sizeof(config_parts[i].log));
+		envdata_crc_valid[i] = false;
+		envdata_synced[i] = false;
+		envdata_partial[i] = false;
+		env_mapping_release(&envdata_map[i]);
 	}
+	bgenv_arena_release(&probe_arena);
 	initialized = false;
 }
 
@@ -211,7 +833,7 @@ BGENV *bgenv_open_by_index(uint32_t index)
 		return NULL;
 	}
 	handle->desc = (void *)&config_parts[index];
-	handle->data = &envdata[index];
+	handle->data = env_data(index);
 	return handle;
 }
 
@@ -221,8 +843,8 @@ BGENV *bgenv_open_oldest(void)
 	uint32_t min_idx = 0;
 
 	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
-		if (envdata[i].revision < minrev) {
-			minrev = envdata[i].revision;
+		if (env_data(i)->revision < minrev) {
+			minrev = env_data(i)->revision;
 			min_idx = i;
 		}
 	}
@@ -235,17 +857,164 @@ BGENV *bgenv_open_latest(void)
 	uint32_t max_idx = 0;
 
 	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
-		if (envdata[i].revision > maxrev) {
-			maxrev = envdata[i].revision;
+		if (env_data(i)->revision > maxrev) {
+			maxrev = env_data(i)->revision;
 			max_idx = i;
 		}
 	}
-	return bgenv_open_by_index(max_idx);
+	return bgenv_open_by_index(max_idx);
+}
+
+/* index of the partition whose envdata env refers to, -1 for others */
+static int env_partition(BGENV *env)
+{
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		if (env->data == env_data(i)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* Reads the whole file of an environment of which only the header was read
+ * at initialization. Must precede any access to the uservars and any
+ * modification of env->data. Returns false if the file turned out to be
+ * invalid, which clears the environment. */
+bool bgenv_load(BGENV *env)
+{
+	int i;
+
+	if (!env || !env->data) {
+		return false;
+	}
+	i = env_partition(env);
+	if (i < 0 || !envdata_partial[i]) {
+		return true;
+	}
+	envdata_partial[i] = false;
+	envdata_crc_valid[i] = read_env(&config_parts[i], &envdata[i]);
+	envdata_synced[i] = envdata_crc_valid[i];
+	envdata_str_valid[i] = false;
+	bgenv_uservar_index_free(&env->uservar_index);
+	return envdata_crc_valid[i];
+}
+
+/* Collects the runs of blocks set in dirty, plus the blocks of the CRC. */
+static size_t dirty_ranges(const uint8_t *dirty, ENV_RANGE *ranges)
+{
+	size_t count = 0;
+
+	for (uint32_t b = 0; b < ENV_NUM_BLOCKS; b++) {
+		uint32_t offset = b * ENV_BLOCK_SIZE;
+		uint32_t len = sizeof(BG_ENVDATA) - offset;
+
+		if (!(dirty[b / 8] & (1 << (b % 8))) &&
+		    offset + ENV_BLOCK_SIZE <= ENV_CRC_SIZE) {
+			continue;
+		}
+		if (len > ENV_BLOCK_SIZE) {
+			len = ENV_BLOCK_SIZE;
+		}
+		if (count &&
+		    ranges[count - 1].offset + ranges[count - 1].len == offset) {
+			ranges[count - 1].len += len;
+		} else {
+			ranges[count].offset = offset;
+			ranges[count].len = len;
+			count++;
+		}
+	}
+	return count;
+}
+
+static bool do_write_env_blocks(CONFIG_PART *part, BG_ENVDATA *env,
+				const ENV_RANGE *ranges, size_t count)
+{
+	bool result = true;
+	struct stat st;
+	FILE *config;
+	int fd;
+
+	if (part->not_mounted) {
+		int ret = raw_config_file_write_ranges(part, env, sizeof(*env),
+						       ranges, count);
+
+		if (ret == 0) {
+			VERBOSE(stdout,
+				"Wrote %zu block range(s): raw access to %s\n",
+				count, part->devpath);
+			return true;
+		}
+		/* mounted since the probe, write through that mount */
+		if (ret != -EBUSY || !adopt_mountpoint(part)) {
+			return false;
+		}
+	}
+
+	config = open_config_file_from_part(part, "r+b");
+	if (!config) {
+		return false;
+	}
+	fd = fileno(config);
+	if (fstat(fd, &st) || st.st_size != sizeof(*env)) {
+		result = false;
+	}
+	for (size_t i = 0; i < count && result; i++) {
+		const uint8_t *p = (const uint8_t *)env + ranges[i].offset;
+		off_t offset = ranges[i].offset;
+		size_t len = ranges[i].len;
+
+		while (len) {
+			ssize_t n = pwrite(fd, p, len, offset);
+
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			if (n <= 0) {
+				VERBOSE(stderr, "Error saving environment "
+					"data to %s\n", part->devpath);
+				result = false;
+				break;
+			}
+			p += n;
+			offset += n;
+			len -= n;
+		}
+	}
+	if (fclose(config)) {
+		result = false;
+	}
+	if (result) {
+		VERBOSE(stdout, "Wrote %zu block range(s): mounted to %s\n",
+			count, part->mountpoint);
+	}
+	return result;
+}
+
+/* Rewrites only the modified blocks of an environment file in place. */
+static bool write_env_blocks(CONFIG_PART *part, BG_ENVDATA *env,
+			     const uint8_t *dirty)
+{
+	ENV_RANGE ranges[ENV_NUM_BLOCKS];
+	size_t count = dirty_ranges(dirty, ranges);
+	BG_TRACE_SPAN span;
+	uint64_t bytes = 0;
+	bool result;
+
+	BG_TRACE_START(span, write_env_blocks, part->devpath);
+	result = do_write_env_blocks(part, env, ranges, count);
+	for (size_t i = 0; i < count; i++) {
+		bytes += ranges[i].len;
+	}
+	BG_TRACE_DONE(span, write_env_blocks, part->devpath, bytes,
+		      result ? 0 : -EIO);
+	return result;
 }
 
 bool bgenv_write(BGENV *env)
 {
 	CONFIG_PART *part;
+	int i;
 
 	if (!env) {
 		return false;
@@ -257,19 +1026,136 @@ bool bgenv_write(BGENV *env)
 		    "Invalid config partition to store environment.\n");
 		return false;
 	}
+	if (!bgenv_load(env)) {
+		return false;
+	}
+	if (!part->image) {
+		env_snapshot_invalidate(ENV_SNAPSHOT_FILE,
+					ENV_SNAPSHOT_STALE_FILE);
+	}
+	/* the file must not change under a mapping that is still in use */
+	i = env_partition(env);
+	if (i >= 0 && env_mapping_detach(&envdata_map[i]) != 0) {
+		return false;
+	}
+	/* Unless the file might differ from what was read, only the
+	 * modified blocks need to be written. This keeps the file in place
+	 * and avoids rewriting the whole uservar area for a state change. */
+	if (i >= 0 && envdata_synced[i] &&
+	    part->env_format == ENV_FORMAT_V1 &&
+	    write_env_blocks(part, env->data, envdata_dirty[i])) {
+		goto written;
+	}
 	if (!write_env(part, env->data)) {
 		VERBOSE(stderr, "Could not write to %s\n",
 			part->devpath);
 		return false;
 	}
+	if (!ENV_FORMAT_COMPACT(part->env_format)) {
+		part->env_format = ENV_FORMAT_V1;
+	}
+	if (i >= 0) {
+		envdata_synced[i] = true;
+	}
+written:
+	if (i >= 0) {
+		memset(envdata_dirty[i], 0, sizeof(envdata_dirty[i]));
+	}
+	memset(env->dirty, 0, sizeof(env->dirty));
+	return true;
+}
+
+/* Selects the file format that bgenv_write() stores env in. */
+bool bgenv_set_format(BGENV *env, int format)
+{
+	if (!env || !env->desc ||
+	    (format != ENV_FORMAT_V1 && !ENV_FORMAT_COMPACT(format))) {
+		return false;
+	}
+	((CONFIG_PART *)env->desc)->env_format = format;
+	return true;
+}
+
+/* Selects the number of update log slots of a format 2 file, 0 for none.
+ * Takes effect with the next full write. */
+bool bgenv_set_log_slots(BGENV *env, unsigned int slots)
+{
+	if (!env || !env->desc || slots > ENV_LOG_MAX_SLOTS) {
+		return false;
+	}
+	((CONFIG_PART *)env->desc)->log.slots = slots;
 	return true;
 }
 
+static bool do_write_log_slot(CONFIG_PART *part, uint32_t offset,
+			      const void *buf)
+{
+	size_t file_len = part->log.offset +
+			  (size_t)part->log.slots * ENV_LOG_SLOT_SIZE;
+	bool result = true;
+	struct stat st;
+	FILE *config;
+	ssize_t n;
+	int fd;
+
+	if (part->not_mounted) {
+		int ret = raw_config_file_write_at(part, file_len, offset, buf,
+						   ENV_LOG_SLOT_SIZE);
+
+		if (ret == 0) {
+			VERBOSE(stdout,
+				"Appended log record: raw access to %s\n",
+				part->devpath);
+			return true;
+		}
+		/* mounted since the probe, write through that mount */
+		if (ret != -EBUSY || !adopt_mountpoint(part)) {
+			return false;
+		}
+	}
+	config = open_config_file_from_part(part, "r+b");
+	if (!config) {
+		return false;
+	}
+	fd = fileno(config);
+	if (fstat(fd, &st) || (size_t)st.st_size != file_len) {
+		result = false;
+	}
+	do {
+		n = result ? pwrite(fd, buf, ENV_LOG_SLOT_SIZE, offset) : 0;
+	} while (n < 0 && errno == EINTR);
+	if (n != ENV_LOG_SLOT_SIZE || fsync(fd)) {
+		result = false;
+	}
+	if (fclose(config)) {
+		result = false;
+	}
+	if (result) {
+		VERBOSE(stdout, "Appended log record: mounted to %s\n",
+			part->mountpoint);
+	}
+	return result;
+}
+
+/* Writes one slot of the update log in place. */
+static bool write_log_slot(CONFIG_PART *part, uint32_t offset, const void *buf)
+{
+	BG_TRACE_SPAN span;
+	bool result;
+
+	BG_TRACE_START(span, write_log_slot, part->devpath);
+	result = do_write_log_slot(part, offset, buf);
+	BG_TRACE_DONE(span, write_log_slot, part->devpath, ENV_LOG_SLOT_SIZE,
+		      result ? 0 : -EIO);
+	return result;
+}
+
 BG_ENVDATA *bgenv_read(BGENV *env)
 {
 	if (!env) {
 		return NULL;
 	}
+	bgenv_load(env);
 	return env->data;
 }
 
@@ -281,9 +1167,127 @@ BG_ENVDATA *bgenv_read(BGENV *env)
 __attribute((noinline))
 void bgenv_close(BGENV *env)
 {
+	if (env) {
+		bgenv_uservar_index_free(&env->uservar_index);
+		free(env->unpacked);
+	}
 	free(env);
 }
 
+static bool *env_crc_state(BGENV *env)
+{
+	int i = env_partition(env);
+
+	return i < 0 ? NULL : &envdata_crc_valid[i];
+}
+
+static void extend_dirty_range(BGENV *env, size_t offset, size_t len)
+{
+	int part = env_partition(env);
+
+	if (len == 0) {
+		return;
+	}
+	for (size_t b = offset / ENV_BLOCK_SIZE;
+	     b <= (offset + len - 1) / ENV_BLOCK_SIZE; b++) {
+		env->dirty[b / 8] |= 1 << (b % 8);
+		if (part >= 0) {
+			envdata_dirty[part][b / 8] |= 1 << (b % 8);
+		}
+	}
+	if (part >= 0 && offset < offsetof(BG_ENVDATA, in_progress)) {
+		envdata_str_valid[part] = false;
+	}
+}
+
+/* Record a modification of data that the checksum does not account for.
+ * Callers that rewrite the uservar area without going through the
+ * handle's index must also drop it with bgenv_uservar_index_free(). */
+void bgenv_mark_dirty(BGENV *env, size_t offset, size_t len)
+{
+	bool *crc_valid;
+
+	if (!env || !env->data || len == 0) {
+		return;
+	}
+	extend_dirty_range(env, offset, len);
+	crc_valid = env_crc_state(env);
+	if (crc_valid) {
+		*crc_valid = false;
+	}
+	/* data replaced as a whole needs no loading anymore */
+	if (offset == 0 && len >= sizeof(BG_ENVDATA) &&
+	    env_partition(env) >= 0) {
+		envdata_partial[env_partition(env)] = false;
+	}
+}
+
+/* Overwrite len bytes of data at offset and keep the checksum current. */
+void bgenv_patch(BGENV *env, size_t offset, const void *src, size_t len)
+{
+	uint8_t *dst;
+	bool *crc_valid;
+
+	if (!env || !env->data || offset + len > ENV_CRC_SIZE ||
+	    !bgenv_load(env)) {
+		return;
+	}
+	dst = (uint8_t *)env->data + offset;
+	if (memcmp(dst, src, len) == 0) {
+		return;
+	}
+	crc_valid = env_crc_state(env);
+	if (!crc_valid || !*crc_valid) {
+		memcpy(dst, src, len);
+		bgenv_mark_dirty(env, offset, len);
+		return;
+	}
+	env->data->crc32 = bgenv_crc32_patch(env->data->crc32, ENV_CRC_SIZE,
+					     offset, dst, src, len);
+	memcpy(dst, src, len);
+	extend_dirty_range(env, offset, len);
+	extend_dirty_range(env, ENV_CRC_SIZE, sizeof(env->data->crc32));
+}
+
+/* Make data->crc32 valid, rehashing only if an untracked change happened. */
+void bgenv_update_crc(BGENV *env)
+{
+	bool *crc_valid;
+	uint32_t sum;
+
+	if (!env || !env->data || !bgenv_load(env)) {
+		return;
+	}
+	crc_valid = env_crc_state(env);
+	if (crc_valid && *crc_valid) {
+		return;
+	}
+	sum = bgenv_crc32(0, env->data, ENV_CRC_SIZE);
+	if (env->data->crc32 != sum) {
+		env->data->crc32 = sum;
+		extend_dirty_range(env, ENV_CRC_SIZE, sizeof(env->data->crc32));
+	}
+	if (crc_valid) {
+		*crc_valid = true;
+	}
+}
+
+static bool dirty_map_set(const uint8_t *dirty)
+{
+	for (size_t i = 0; i < ENV_DIRTY_MAP_SIZE; i++) {
+		if (dirty[i]) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* true if data was modified through this handle since it was last written */
+bool bgenv_is_dirty(BGENV *env)
+{
+	return env && dirty_map_set(env->dirty);
+}
+
 static int bgenv_get_uint(char *buffer, uint64_t *type, void *data,
 			  unsigned int src, uint64_t t)
 {
@@ -300,14 +1304,36 @@ static int bgenv_get_uint(char *buffer, uint64_t *type, void *data,
 	return 0;
 }
 
-static int bgenv_get_string(char *buffer, uint64_t *type, void *data,
-			    const char16_t *srcstr)
+/* Returns an 8-bit copy of kernelfile or kernelparams, converted once per
+ * modification for the environments of the config partitions. */
+static const char *bgenv_builtin_str(BGENV *env, EBGENVKEY e)
+{
+	int part = env_partition(env);
+	char (*str)[ENV_STRING_LENGTH];
+
+	if (part < 0) {
+		str = env->str;
+	} else {
+		str = envdata_str[part];
+		if (envdata_str_valid[part]) {
+			goto done;
+		}
+	}
+	str16to8(str[0], env->data->kernelfile);
+	str16to8(str[1], env->data->kernelparams);
+	if (part >= 0) {
+		envdata_str_valid[part] = true;
+	}
+done:
+	return str[e == EBGENV_KERNELFILE ? 0 : 1];
+}
+
+static int bgenv_get_string(uint64_t *type, void *data, const char *str)
 {
-	str16to8(buffer, srcstr);
 	if (!data) {
-		return strlen(buffer)+1;
+		return strlen(str)+1;
 	}
-	strcpy(data, buffer);
+	strcpy(data, str);
 	if (type) {
 		*type = USERVAR_TYPE_STRING_ASCII;
 	}
@@ -319,6 +1345,8 @@ int bgenv_get(BGENV *env, char *key, uint64_t *type, void *data,
 {
 	EBGENVKEY e;
 	char buffer[ENV_STRING_LENGTH];
+	uint32_t u32;
+	int c;
 
 	if (!key || maxlen == 0) {
 		return -EINVAL;
@@ -327,27 +1355,36 @@ int bgenv_get(BGENV *env, char *key, uint64_t *type, void *data,
 	if (!env) {
 		return -EPERM;
 	}
+	c = e == EBGENV_UNKNOWN ? bgenv_counter_index(key) : -1;
+	if (c >= 0) {
+		memcpy(&u32, (uint8_t *)env->data + counter_offset(c),
+		       sizeof(u32));
+		return bgenv_get_uint(buffer, type, data, u32,
+				      USERVAR_TYPE_UINT32);
+	}
 	if (e == EBGENV_UNKNOWN) {
+		if (!bgenv_load(env)) {
+			return -EIO;
+		}
 		if (!data) {
 			uint8_t *u;
-			uint32_t size;
-			u = bgenv_find_uservar(env->data->userdata, key);
+			u = bgenv_find_uservar_indexed(&env->uservar_index,
+						       env->data->userdata,
+						       key);
 			if (!u) {
 				return -ENOENT;
 			}
-			bgenv_map_uservar(u, NULL, NULL, NULL, NULL, &size);
-			return size;
+			return bgenv_uservar_size(u);
 		}
-		return bgenv_get_uservar(env->data->userdata, key, type, data,
-					 maxlen);
+		return bgenv_get_uservar_indexed(&env->uservar_index,
+						 env->data->userdata, key,
+						 type, data, maxlen);
 	}
 	switch (e) {
 	case EBGENV_KERNELFILE:
-		return bgenv_get_string(buffer, type, data,
-					env->data->kernelfile);
 	case EBGENV_KERNELPARAMS:
-		return bgenv_get_string(buffer, type, data,
-					env->data->kernelparams);
+		return bgenv_get_string(type, data,
+					bgenv_builtin_str(env, e));
 	case EBGENV_WATCHDOG_TIMEOUT_SEC:
 		return bgenv_get_uint(buffer, type, data,
 				      env->data->watchdog_timeout_sec,
@@ -372,6 +1409,158 @@ int bgenv_get(BGENV *env, char *key, uint64_t *type, void *data,
 	}
 }
 
+int bgenv_get_str(BGENV *env, char *key, const char **value)
+{
+	EBGENVKEY e;
+	uint64_t type;
+	uint8_t *u;
+	uint8_t *data;
+	uint32_t size;
+	int res;
+
+	if (!key || !value) {
+		return -EINVAL;
+	}
+	if (!env || !env->data) {
+		return -EPERM;
+	}
+	e = bgenv_str2enum(key);
+	if (e == EBGENV_KERNELFILE || e == EBGENV_KERNELPARAMS) {
+		*value = bgenv_builtin_str(env, e);
+		return 0;
+	}
+	if (e != EBGENV_UNKNOWN || bgenv_counter_index(key) >= 0) {
+		return -EINVAL;
+	}
+	if (!bgenv_load(env)) {
+		return -EIO;
+	}
+	u = bgenv_find_uservar_indexed(&env->uservar_index,
+				       env->data->userdata, key);
+	if (!u) {
+		return -ENOENT;
+	}
+	bgenv_map_uservar(u, NULL, &type, &data, NULL, &size);
+	if ((type & USERVAR_STANDARD_TYPE_MASK) != USERVAR_TYPE_STRING_ASCII) {
+		return -EINVAL;
+	}
+	if (type & USERVAR_TYPE_COMPRESSED) {
+		size = bgenv_uservar_size(u);
+		data = realloc(env->unpacked, size ? size : 1);
+		if (!data) {
+			return -ENOMEM;
+		}
+		env->unpacked = (char *)data;
+		res = bgenv_uservar_read(u, data, size);
+		if (res) {
+			return res;
+		}
+	}
+	if (size == 0 || data[size - 1] != 0) {
+		return -EINVAL;
+	}
+	*value = (const char *)data;
+	return 0;
+}
+
+int bgenv_get_u32(BGENV *env, char *key, uint32_t *value)
+{
+	EBGENVKEY e;
+	uint64_t type, u64 = 0;
+	uint8_t *u;
+	uint8_t *data;
+	uint32_t size;
+	int c;
+
+	if (!key || !value) {
+		return -EINVAL;
+	}
+	if (!env || !env->data) {
+		return -EPERM;
+	}
+	e = bgenv_str2enum(key);
+	if (e == EBGENV_KERNELFILE || e == EBGENV_KERNELPARAMS) {
+		return -EINVAL;
+	}
+	c = e == EBGENV_UNKNOWN ? bgenv_counter_index(key) : -1;
+	if (c >= 0) {
+		memcpy(value, (uint8_t *)env->data + counter_offset(c),
+		       sizeof(*value));
+		return 0;
+	}
+	if (e != EBGENV_UNKNOWN) {
+		*value = 0;
+		/* little-endian, like the rest of the environment */
+		memcpy(value, (uint8_t *)env->data + builtin_keys[e].offset,
+		       builtin_keys[e].size);
+		return 0;
+	}
+	if (!bgenv_load(env)) {
+		return -EIO;
+	}
+	u = bgenv_find_uservar_indexed(&env->uservar_index,
+				       env->data->userdata, key);
+	if (!u) {
+		return -ENOENT;
+	}
+	bgenv_map_uservar(u, NULL, &type, &data, NULL, &size);
+	switch (type & USERVAR_STANDARD_TYPE_MASK) {
+	case USERVAR_TYPE_UINT8:
+	case USERVAR_TYPE_UINT16:
+	case USERVAR_TYPE_UINT32:
+	case USERVAR_TYPE_UINT64:
+		break;
+	default:
+		return -EINVAL;
+	}
+	if ((type & USERVAR_TYPE_COMPRESSED) || size > sizeof(u64)) {
+		return -EINVAL;
+	}
+	memcpy(&u64, data, size);
+	if (u64 > UINT32_MAX) {
+		return -ERANGE;
+	}
+	*value = u64;
+	return 0;
+}
+
+int bgenv_set_u32(BGENV *env, char *key, uint32_t value)
+{
+	EBGENVKEY e;
+
+	if (!key) {
+		return -EINVAL;
+	}
+	if (!env || !env->data) {
+		return -EPERM;
+	}
+	if (env->read_only) {
+		return -EROFS;
+	}
+	e = bgenv_str2enum(key);
+	if (e == EBGENV_KERNELFILE || e == EBGENV_KERNELPARAMS) {
+		return -EINVAL;
+	}
+	if (e == EBGENV_UNKNOWN) {
+		int c = bgenv_counter_index(key);
+
+		if (c >= 0) {
+			bgenv_patch(env, counter_offset(c), &value,
+				    sizeof(value));
+			return 0;
+		}
+		return bgenv_set(env, key, USERVAR_TYPE_UINT32, &value,
+				 sizeof(value));
+	}
+	if (builtin_keys[e].size < sizeof(value) &&
+	    value >> (8 * builtin_keys[e].size)) {
+		return -ERANGE;
+	}
+	bgenv_patch(env, builtin_keys[e].offset, &value,
+		    builtin_keys[e].size);
+	return 0;
+}
+
 static long bgenv_convert_to_long(char *value)
 {
 	long val;
@@ -395,6 +1584,11 @@ int bgenv_set(BGENV *env, char *key, uint64_t type, void *data,
 	EBGENVKEY e;
 	int val;
 	char *value = (char *)data;
+	uint16_t str16[ENV_STRING_LENGTH];
+	uint32_t u32;
+	uint16_t u16;
+	uint8_t u8;
+	int c;
 
 	if (!key || !data || datalen == 0) {
 		return -EINVAL;
@@ -404,9 +1598,28 @@ int bgenv_set(BGENV *env, char *key, uint64_t type, void *data,
 	if (!env) {
 		return -EPERM;
 	}
+	if (env->read_only) {
+		return -EROFS;
+	}
+	if (!bgenv_load(env)) {
+		return -EIO;
+	}
+	c = e == EBGENV_UNKNOWN ? bgenv_counter_index(key) : -1;
+	if (c >= 0) {
+		val = bgenv_convert_to_long(value);
+		if (val < 0) {
+			return -EINVAL;
+		}
+		u32 = val;
+		bgenv_patch(env, counter_offset(c), &u32, sizeof(u32));
+		return 0;
+	}
 	if (e == EBGENV_UNKNOWN) {
-		return bgenv_set_uservar(env->data->userdata, key, type, data,
-					 datalen);
+		bgenv_mark_dirty(env, offsetof(BG_ENVDATA, userdata),
+				 sizeof(env->data->userdata));
+		return bgenv_set_uservar_indexed(&env->uservar_index,
+						 env->data->userdata, key,
+						 type, data, datalen);
 	}
 	switch (e) {
 	case EBGENV_REVISION:
@@ -414,34 +1627,52 @@ int bgenv_set(BGENV *env, char *key, uint64_t type, void *data,
 		if (val < 0) {
 			return -EINVAL;
 		}
-		env->data->revision = val;
+		u32 = val;
+		bgenv_patch(env, offsetof(BG_ENVDATA, revision), &u32,
+			    sizeof(u32));
 		break;
 	case EBGENV_KERNELFILE:
-		str8to16(env->data->kernelfile, value);
+		if (strlen(value) >= ENV_STRING_LENGTH) {
+			return -EINVAL;
+		}
+		str8to16(str16, value);
+		bgenv_patch(env, offsetof(BG_ENVDATA, kernelfile), str16,
+			    (strlen(value) + 1) * sizeof(str16[0]));
 		break;
 	case EBGENV_KERNELPARAMS:
-		str8to16(env->data->kernelparams, value);
+		if (strlen(value) >= ENV_STRING_LENGTH) {
+			return -EINVAL;
+		}
+		str8to16(str16, value);
+		bgenv_patch(env, offsetof(BG_ENVDATA, kernelparams), str16,
+			    (strlen(value) + 1) * sizeof(str16[0]));
 		break;
 	case EBGENV_WATCHDOG_TIMEOUT_SEC:
 		val = bgenv_convert_to_long(value);
 		if (val < 0) {
 			return -EINVAL;
 		}
-		env->data->watchdog_timeout_sec = val;
+		u16 = val;
+		bgenv_patch(env, offsetof(BG_ENVDATA, watchdog_timeout_sec),
+			    &u16, sizeof(u16));
 		break;
 	case EBGENV_USTATE:
 		val = bgenv_convert_to_long(value);
 		if (val < 0) {
 			return -EINVAL;
 		}
-		env->data->ustate = val;
+		u8 = val;
+		bgenv_patch(env, offsetof(BG_ENVDATA, ustate), &u8,
+			    sizeof(u8));
 		break;
 	case EBGENV_IN_PROGRESS:
 		val = bgenv_convert_to_long(value);
 		if (val < 0) {
 			return -EINVAL;
 		}
-		env->data->in_progress = val;
+		u8 = val;
+		bgenv_patch(env, offsetof(BG_ENVDATA, in_progress), &u8,
+			    sizeof(u8));
 		break;
 	default:
 		return -EINVAL;
@@ -449,13 +1680,193 @@ int bgenv_set(BGENV *env, char *key, uint64_t type, void *data,
 	return 0;
 }
 
-BGENV *bgenv_create_new(void)
+/* Sets a user variable and stores the update by appending a record to the
+ * log of the environment file instead of rewriting it. Falls back to
+ * bgenv_set() if the file has no log, the log is full, the record does
+ * not fit into a slot or the environment has other pending changes. */
+int bgenv_set_logged(BGENV *env, char *key, uint64_t type, void *data,
+		     uint32_t datalen)
+{
+	uint8_t slot[ENV_LOG_SLOT_SIZE] = { 0 };
+	BG_ENVLOG_REC *rec = (BG_ENVLOG_REC *)slot;
+	uint8_t *var = slot + sizeof(*rec);
+	uint32_t used, start, end;
+	uint8_t *udata, *p, *old;
+	CONFIG_PART *part;
+	uint32_t len, index;
+	bool *crc_valid;
+	int res;
+
+	if (!key || !data || datalen == 0) {
+		return -EINVAL;
+	}
+	if (!env || !env->data) {
+		return -EPERM;
+	}
+	if (env->read_only) {
+		return -EROFS;
+	}
+	if (!bgenv_load(env)) {
+		return -EIO;
+	}
+	part = (CONFIG_PART *)env->desc;
+	crc_valid = env_crc_state(env);
+	len = strlen(key) + 1 + sizeof(uint32_t) + sizeof(uint64_t) + datalen;
+	if (bgenv_str2enum(key) != EBGENV_UNKNOWN ||
+	    bgenv_counter_index(key) >= 0 || !part || !crc_valid ||
+	    !*crc_valid || !ENV_FORMAT_COMPACT(part->env_format) ||
+	    part->log.slots == 0 || part->log.used >= part->log.slots ||
+	    len > ENV_LOG_REC_MAX_LEN ||
+	    dirty_map_set(envdata_dirty[env_partition(env)])) {
+		return bgenv_set(env, key, type, data, datalen);
+	}
+
+	/* The update changes the records from the one set on and may grow
+	 * the area by at most len bytes. Everything behind the last record
+	 * is zero, so a copy of that span is enough to patch the checksum. */
+	udata = env->data->userdata;
+	used = ENV_MEM_USERVARS -
+	       bgenv_user_free_indexed(&env->uservar_index, udata);
+	p = bgenv_find_uservar_indexed(&env->uservar_index, udata, key);
+	start = p ? p - udata : used;
+	end = used + len < ENV_MEM_USERVARS ? used + len : ENV_MEM_USERVARS;
+	old = calloc(1, end - start + 1);
+	if (!old) {
+		return bgenv_set(env, key, type, data, datalen);
+	}
+	memcpy(old, udata + start, used - start);
+
+	res = bgenv_set_uservar_indexed(&env->uservar_index, udata, key, type,
+					data, datalen);
+	end = ENV_MEM_USERVARS -
+	      bgenv_user_free_indexed(&env->uservar_index, udata);
+	if (end < used) {
+		end = used;
+	}
+	/* also covers a record that a failed resize has deleted */
+	env->data->crc32 = bgenv_crc32_patch(
+		env->data->crc32, ENV_CRC_SIZE,
+		offsetof(BG_ENVDATA, userdata) + start, old, udata + start,
+		end - start);
+	free(old);
+	if (res) {
+		return res;
+	}
+	bgenv_serialize_uservar(var, key, type, data, len);
+	rec->magic = ENV_LOG_REC_MAGIC;
+	rec->generation = part->log.generation;
+	rec->seq = part->log.seq + 1;
+	rec->len = len;
+	rec->crc32 = bgenv_crc32(0, slot + ENV_LOG_REC_CRC_START,
+				 sizeof(*rec) - ENV_LOG_REC_CRC_START + len);
+	index = (part->log.generation + part->log.used) % part->log.slots;
+
+	if (!write_log_slot(part, part->log.offset + index * ENV_LOG_SLOT_SIZE,
+			    slot)) {
+		VERBOSE(stderr, "Cannot append to log of %s, rewriting "
+			"environment on close.\n", part->devpath);
+		bgenv_mark_dirty(env, offsetof(BG_ENVDATA, userdata),
+				 sizeof(env->data->userdata));
+		return 0;
+	}
+	part->log.used++;
+	part->log.seq++;
+	return 0;
+}
+
+int bgenv_set_batch(BGENV *env, const ebgenv_batch_op_t *ops, uint32_t count)
+{
+	uint8_t header[offsetof(BG_ENVDATA, userdata)];
+	ebgenv_batch_op_t *uops;
+	uint32_t ucount = 0;
+	int res = 0;
+
+	if (!env) {
+		return -EPERM;
+	}
+	if (env->read_only) {
+		return -EROFS;
+	}
+	if (count && !ops) {
+		return -EINVAL;
+	}
+	if (!bgenv_load(env)) {
+		return -EIO;
+	}
+	uops = calloc(count ? count : 1, sizeof(ebgenv_batch_op_t));
+	if (!uops) {
+		return -ENOMEM;
+	}
+	/* keep a copy of the fixed fields to undo partial changes */
+	memcpy(header, env->data, sizeof(header));
+
+	for (uint32_t i = 0; i < count; i++) {
+		/* only a deletion may come without a value */
+		if (!ops[i].key ||
+		    (!ops[i].value &&
+		     !(ops[i].datatype & USERVAR_TYPE_DELETED))) {
+			res = -EINVAL;
+			goto batch_undo;
+		}
+		if (bgenv_str2enum(ops[i].key) == EBGENV_UNKNOWN &&
+		    bgenv_counter_index(ops[i].key) < 0) {
+			uops[ucount++] = ops[i];
+			continue;
+		}
+		res = bgenv_set(env, ops[i].key, ops[i].datatype,
+				ops[i].value, ops[i].datalen);
+		if (res) {
+			goto batch_undo;
+		}
+	}
+	if (ucount) {
+		res = bgenv_set_uservar_batch(&env->uservar_index,
+					      env->data->userdata, uops,
+					      ucount);
+		if (res) {
+			goto batch_undo;
+		}
+		bgenv_mark_dirty(env, offsetof(BG_ENVDATA, userdata),
+				 sizeof(env->data->userdata));
+	}
+	free(uops);
+	return 0;
+
+batch_undo:
+	if (memcmp(header, env->data, sizeof(header)) != 0) {
+		memcpy(env->data, header, sizeof(header));
+		bgenv_mark_dirty(env, 0, sizeof(header));
+	}
+	free(uops);
+	return res;
+}
+
+/* Copies the latest environment into env_new, which may be the same, with
+ * only the uservars that keep accepts in a single pass. */
+static void clone_env(BGENV *env_new, BGENV *env_latest,
+		      ebgenv_keep_cb_t keep, void *priv)
+{
+	BG_ENVDATA *dst = env_new->data;
+	BG_ENVDATA *src = env_latest->data;
+
+	if (dst != src) {
+		memcpy(dst, src, offsetof(BG_ENVDATA, userdata));
+	}
+	bgenv_copy_uservars(dst->userdata, src->userdata, keep, priv);
+	bgenv_mark_dirty(env_new, 0, sizeof(BG_ENVDATA));
+	bgenv_uservar_index_free(&env_new->uservar_index);
+}
+
+/* Opens the oldest environment as the one of the next revision, zeroed or,
+ * if clone is set, as a copy of the latest one filtered by keep. */
+static BGENV *create_new(bool clone, ebgenv_keep_cb_t keep, void *priv)
 {
 	BGENV *env_latest;
 	BGENV *env_new;
 
 	env_latest = bgenv_open_latest();
-	if (!env_latest) {
+	if (!env_latest || (clone && !bgenv_load(env_latest))) {
+		bgenv_close(env_latest);
 		goto create_new_io_error;
 	}
 
@@ -467,16 +1878,30 @@ BGENV *bgenv_create_new(void)
 		goto create_new_io_error;
 	}
 
-	if (env_latest->data != env_new->data) {
+	if (clone) {
+		clone_env(env_new, env_latest, keep, priv);
+	} else if (env_latest->data != env_new->data) {
 		/* zero fields */
 		memset(env_new->data, 0, sizeof(BG_ENVDATA));
+		bgenv_mark_dirty(env_new, 0, sizeof(BG_ENVDATA));
+		bgenv_uservar_index_free(&env_new->uservar_index);
 		/* set default watchdog timeout */
 		env_new->data->watchdog_timeout_sec = DEFAULT_TIMEOUT_SEC;
 	}
 	bgenv_close(env_latest);
 	/* update revision field and testing mode */
-	env_new->data->revision = new_rev;
-	env_new->data->in_progress = 1;
+	uint32_t rev = new_rev;
+	uint8_t in_progress = 1;
+	bgenv_patch(env_new, offsetof(BG_ENVDATA, revision), &rev,
+		    sizeof(rev));
+	bgenv_patch(env_new, offsetof(BG_ENVDATA, in_progress), &in_progress,
+		    sizeof(in_progress));
+	/* the boot counters count the boots of the new environment */
+	for (int i = 0; i < ENV_NUM_COUNTERS; i++) {
+		uint32_t zero = 0;
+
+		bgenv_patch(env_new, counter_offset(i), &zero, sizeof(zero));
+	}
 
 	return env_new;
 
@@ -484,3 +1909,13 @@ create_new_io_error:
 	errno = EIO;
 	return NULL;
 }
+
+BGENV *bgenv_create_new(void)
+{
+	return create_new(false, NULL, NULL);
+}
+
+BGENV *bgenv_create_from_latest(ebgenv_keep_cb_t keep, void *priv)
+{
+	return create_new(true, keep, priv);
+}
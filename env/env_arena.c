@@ -0,0 +1,83 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2026
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#include <stdalign.h>
+#include <stdlib.h>
+#include <string.h>
+#include "env_arena.h"
+
+struct bg_arena_chunk {
+	BG_ARENA_CHUNK *next;
+	size_t used;
+	size_t size;
+	max_align_t data[];
+};
+
+#define ARENA_ALIGN alignof(max_align_t)
+#define ARENA_CHUNK_DATA (BG_ARENA_CHUNK_SIZE - sizeof(BG_ARENA_CHUNK))
+
+void *bgenv_arena_alloc(BG_ARENA *arena, size_t size)
+{
+	BG_ARENA_CHUNK *chunk = arena->chunks;
+	size_t capacity;
+	void *p;
+
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	if (size == 0) {
+		size = ARENA_ALIGN;
+	}
+	if (chunk && chunk->size - chunk->used >= size) {
+		p = (char *)chunk->data + chunk->used;
+		chunk->used += size;
+		return p;
+	}
+
+	capacity = size > ARENA_CHUNK_DATA / 4 ? size : ARENA_CHUNK_DATA;
+	chunk = calloc(1, sizeof(BG_ARENA_CHUNK) + capacity);
+	if (!chunk) {
+		return NULL;
+	}
+	chunk->size = capacity;
+	chunk->used = size;
+	if (capacity == size && arena->chunks) {
+		/* keep allocating from the partly used chunk */
+		chunk->next = arena->chunks->next;
+		arena->chunks->next = chunk;
+	} else {
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+	}
+	return chunk->data;
+}
+
+char *bgenv_arena_strdup(BG_ARENA *arena, const char *s)
+{
+	size_t len = strlen(s) + 1;
+	char *p = bgenv_arena_alloc(arena, len);
+
+	if (p) {
+		memcpy(p, s, len);
+	}
+	return p;
+}
+
+void bgenv_arena_release(BG_ARENA *arena)
+{
+	BG_ARENA_CHUNK *chunk = arena->chunks;
+
+	while (chunk) {
+		BG_ARENA_CHUNK *next = chunk->next;
+
+		free(chunk);
+		chunk = next;
+	}
+	arena->chunks = NULL;
+}
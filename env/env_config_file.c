@@ -14,9 +14,12 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <errno.h>
+#include <limits.h>
 #include "env_api.h"
 #include "env_disk_utils.h"
 #include "env_config_file.h"
+#include "env_trace.h"
 
 FILE *open_config_file(char *configfilepath, char *mode)
 {
@@ -26,36 +29,34 @@ FILE *open_config_file(char *configfilepath, char *mode)
 
 FILE *open_config_file_from_part(CONFIG_PART *cfgpart, char *mode)
 {
-	char *configfilepath;
+	char configfilepath[PATH_MAX];
+	int len;
 
 	if (!cfgpart || !cfgpart->mountpoint) {
 		return NULL;
 	}
-	configfilepath = (char *)malloc(strlen(FAT_ENV_FILENAME) +
-					strlen(cfgpart->mountpoint) + 2);
-	if (!configfilepath) {
+	len = snprintf(configfilepath, sizeof(configfilepath), "%s/%s",
+		       cfgpart->mountpoint, FAT_ENV_FILENAME);
+	if (len < 0 || (size_t)len >= sizeof(configfilepath)) {
+		errno = ENAMETOOLONG;
 		return NULL;
 	}
-	strcpy(configfilepath, cfgpart->mountpoint);
-	strcat(configfilepath, "/");
-	strcat(configfilepath, FAT_ENV_FILENAME);
-	FILE *config = open_config_file(configfilepath, mode);
-	free(configfilepath);
-	return config;
+	return open_config_file(configfilepath, mode);
 }
 
-bool probe_config_file(CONFIG_PART *cfgpart)
+static bool do_probe_config_file(CONFIG_PART *cfgpart)
 {
 	bool do_unmount = false;
-	if (!cfgpart) {
-		return false;
-	}
 	printf_debug("Checking device: %s\n", cfgpart->devpath);
 	if (!(cfgpart->mountpoint = get_mountpoint(cfgpart->devpath))) {
 		/* partition is not mounted */
 		cfgpart->not_mounted = true;
 		VERBOSE(stdout, "Partition %s is not mounted.\n",
 			cfgpart->devpath);
+		int ret = raw_config_file_access(cfgpart, NULL, 0, false);
+		if (ret == 0 || ret == -ENOENT) {
+			return ret == 0;
+		}
 		if (!mount_partition(cfgpart)) {
 			return false;
 		}
@@ -93,3 +94,18 @@ bool probe_config_file(CONFIG_PART *cfgpart)
 	}
 	return false;
 }
+
+bool probe_config_file(CONFIG_PART *cfgpart)
+{
+	BG_TRACE_SPAN span;
+	bool result;
+
+	if (!cfgpart) {
+		return false;
+	}
+	BG_TRACE_START(span, probe_config_file, cfgpart->devpath);
+	result = do_probe_config_file(cfgpart);
+	BG_TRACE_DONE(span, probe_config_file, cfgpart->devpath, 0,
+		      result ? 0 : -ENOENT);
+	return result;
+}
@@ -13,16 +13,24 @@
  * SPDX-License-Identifier:	GPL-2.0
  */
 
+#include <limits.h>
 #include "env_api.h"
 #include "ebgpart.h"
 #include "env_config_partitions.h"
 #include "env_config_file.h"
+#include "env_disk_utils.h"
+#include "env_parallel.h"
+#include "env_probe_cache.h"
+#include "env_probe_filter.h"
+#include "env_snapshot.h"
 
 #define LOADER_PROT_VENDOR_GUID "4a67b082-0a4c-41cf-b6c7-440b29bb8c4f"
 #define GUID_LEN_CHARS		36
 #define EFI_ATTR_LEN_IN_WCHAR	2
 #define ARRAY_SIZE(arr)		(sizeof(arr) / sizeof((arr)[0]))
 
+BG_ARENA probe_arena;
+
 /**
  * Read the ESP UUID from the efivars. This only works if the bootloader
  * implements the LoaderDevicePartUUID from the systemd bootloader interface
@@ -84,23 +92,158 @@ static char *get_rootdev_from_efi(void)
 
 	// resolve to e.g. /sys/devices/pci0000:00/0000:00:1f.2/<...>/block/sda
 	char *blockpath = realpath(buffer.aschar, NULL);
+	if (!blockpath) {
+		return NULL;
+	}
 	char *_blockdev = strrchr(blockpath, '/') + 1;
 	char *blockdev = strdup(_blockdev);
 	free(blockpath);
 	return blockdev;
 }
 
-bool probe_config_partitions(CONFIG_PART *cfgpart, bool search_all_devices)
+/**
+ * Returns the sysfs path of the PCI or platform device that the block
+ * device name is attached to, e.g. /sys/devices/pci0000:00/0000:00:1f.2 for
+ * a SATA disk, or NULL. The returned string needs to be freed by the
+ * caller.
+ */
+static char *get_controller(const char *name)
+{
+	char path[PATH_MAX];
+	char *devpath;
+	char *slash;
+
+	(void)snprintf(path, sizeof(path), "/sys/class/block/%s", name);
+	devpath = realpath(path, NULL);
+	if (!devpath) {
+		return NULL;
+	}
+	while ((slash = strrchr(devpath, '/')) && slash != devpath) {
+		char *subsystem;
+		bool found;
+
+		*slash = '\0';
+		(void)snprintf(path, sizeof(path), "%s/subsystem", devpath);
+		subsystem = realpath(path, NULL);
+		if (!subsystem) {
+			continue;
+		}
+		slash = strrchr(subsystem, '/');
+		found = strcmp(slash + 1, "pci") == 0 ||
+			strcmp(slash + 1, "platform") == 0;
+		free(subsystem);
+		if (found) {
+			return devpath;
+		}
+	}
+	free(devpath);
+	return NULL;
+}
+
+static enum probe_tier get_tier(const PedDevice *dev, const char *rootdev,
+				const char *boot_controller)
+{
+	const char *name = strrchr(dev->path, '/');
+	char *controller;
+	bool same;
+
+	name = name ? name + 1 : dev->path;
+	if (strcmp(name, rootdev) == 0) {
+		return PROBE_TIER_BOOT;
+	}
+	if (!boot_controller) {
+		return PROBE_TIER_OTHER;
+	}
+	controller = get_controller(name);
+	same = controller && strcmp(controller, boot_controller) == 0;
+	free(controller);
+	return same ? PROBE_TIER_CONTROLLER : PROBE_TIER_OTHER;
+}
+
+struct probe_candidates {
+	CONFIG_PART *parts;
+	bool *found;
+	bool *probed;
+	enum probe_tier *tier;
+	/* indices of the candidates probed together */
+	size_t *batch;
+	size_t count;
+};
+
+static void probe_candidate(size_t index, void *ctx)
+{
+	struct probe_candidates *c = ctx;
+	size_t i = c->batch[index];
+
+	c->found[i] = probe_config_file(&c->parts[i]);
+}
+
+static bool add_candidate(struct probe_candidates *c, const char *devpath,
+			  enum probe_tier tier)
+{
+	CONFIG_PART *parts;
+	enum probe_tier *tiers;
+
+	parts = realloc(c->parts, (c->count + 1) * sizeof(*parts));
+	if (!parts) {
+		return false;
+	}
+	c->parts = parts;
+	tiers = realloc(c->tier, (c->count + 1) * sizeof(*tiers));
+	if (!tiers) {
+		return false;
+	}
+	c->tier = tiers;
+	tiers[c->count] = tier;
+	memset(&parts[c->count], 0, sizeof(*parts));
+	parts[c->count].devpath = bgenv_arena_strdup(&probe_arena, devpath);
+	if (!parts[c->count].devpath) {
+		return false;
+	}
+	c->count++;
+	return true;
+}
+
+static bool do_probe_config_partitions(CONFIG_PART *cfgpart,
+				       bool search_all_devices)
 {
 	PedDevice *dev = NULL;
 	char devpath[4096];
 	char *rootdev = NULL;
+	char *boot_controller = NULL;
+	enum probe_tier order[PROBE_TIERS];
+	size_t num_tiers = 1;
+	bool tiered = false;
+	size_t probed = 0;
+	struct probe_candidates cand = {0};
+	bool result = false;
+	bool use_cache = probe_cache_enabled();
+	uint64_t seqnum = 0;
 	int count = 0;
 
 	if (!cfgpart) {
 		return false;
 	}
 
+	/* the boot loader knows where it found them, unless other disks or
+	 * partitions than its own choice are asked for */
+	if (env_snapshot_enabled() && !search_all_devices &&
+	    probe_filter_id() == 0 &&
+	    env_snapshot_load(ENV_SNAPSHOT_FILE, cfgpart)) {
+		return true;
+	}
+
+	if (use_cache) {
+		if (probe_cache_load(ENV_PROBE_CACHE_FILE, cfgpart,
+				     search_all_devices)) {
+			return true;
+		}
+		/* drop what a stale cache left in the arena */
+		bgenv_arena_release(&probe_arena);
+		/* any uevent during the scan must invalidate the result */
+		use_cache = probe_cache_seqnum(&seqnum);
+	}
+
 	if (!search_all_devices) {
 		if (!(rootdev = get_rootdev_from_efi())) {
 			VERBOSE(stderr, "Warning, could not determine root "
@@ -108,13 +251,26 @@ bool probe_config_partitions(CONFIG_PART *cfgpart, bool search_all_devices)
 		} else {
 			VERBOSE(stdout, "Limit probing to disk %s\n", rootdev);
 		}
+		ped_device_probe_all(rootdev);
+	} else {
+		/* all disks, but the boot disk and its neighbours first */
+		rootdev = get_rootdev_from_efi();
+		if (rootdev) {
+			boot_controller = get_controller(rootdev);
+			num_tiers = probe_order_get(order);
+			tiered = true;
+		}
+		ped_device_probe_all(NULL);
 	}
 
-	ped_device_probe_all(rootdev);
-	free(rootdev);
-
+	/* collect all FAT partitions in device order */
 	while ((dev = ped_device_get_next(dev))) {
+		enum probe_tier tier = PROBE_TIER_BOOT;
+
 		printf_debug("Device: %s\n", dev->model);
+		if (tiered) {
+			tier = get_tier(dev, rootdev, boot_controller);
+		}
 		PedDisk *pd = ped_disk_new(dev);
 		if (!pd) {
 			continue;
@@ -136,37 +292,189 @@ bool probe_config_partitions(CONFIG_PART *cfgpart, bool search_all_devices)
 				(void)snprintf(devpath, 4096, "%s%u",
 					       dev->path, part->num);
 			}
-
-			CONFIG_PART tmp = {.devpath = strdup(devpath)};
-			if (!tmp.devpath) {
-				VERBOSE(stderr, "Out of memory.");
-				return false;
+			/* partition devices start at offset 0 */
+			if (!probe_filter_match(part, devpath, 0)) {
+				VERBOSE(stdout, "Skipping %s, it does not "
+						"match the probe filter.\n",
+					devpath);
+				part = ped_disk_next_partition(pd, part);
+				continue;
 			}
-			if (probe_config_file(&tmp)) {
-				printf_debug("%s", "Environment file found.\n");
-				if (count < ENV_NUM_CONFIG_PARTS) {
-					cfgpart[count] = tmp;
-				} else {
-					free(tmp.devpath);
-					VERBOSE(stderr,
-						"Error, there are "
-						"more than %d config "
-						"partitions.\n",
-						ENV_NUM_CONFIG_PARTS);
-					return false;
-				}
-				count++;
-			} else {
-				free(tmp.devpath);
+			if (!add_candidate(&cand, devpath, tier)) {
+				VERBOSE(stderr, "Out of memory.");
+				ped_device_free_all();
+				goto cleanup;
 			}
 			part = ped_disk_next_partition(pd, part);
 		}
 	}
+
+	cand.found = calloc(cand.count ? cand.count : 1, sizeof(bool));
+	cand.probed = calloc(cand.count ? cand.count : 1, sizeof(bool));
+	cand.batch = calloc(cand.count ? cand.count : 1, sizeof(size_t));
+	if (!cand.found || !cand.probed || !cand.batch) {
+		VERBOSE(stderr, "Out of memory.");
+		goto cleanup;
+	}
+	/* probe the candidates of a tier at once, their I/O is independent.
+	 * Later tiers are probed even if the config partitions are complete,
+	 * to detect duplicates, unless stopping early was asked for. */
+	for (size_t t = 0; t < num_tiers &&
+	     (count < ENV_NUM_CONFIG_PARTS || !probe_order_stops_early());
+	     t++) {
+		size_t n = 0;
+
+		for (size_t i = 0; i < cand.count; i++) {
+			if (!tiered || cand.tier[i] == order[t]) {
+				cand.batch[n++] = i;
+				cand.probed[i] = true;
+			}
+		}
+		bgenv_parallel_for(n, probe_candidate, &cand);
+		for (size_t j = 0; j < n; j++) {
+			if (!cand.found[cand.batch[j]]) {
+				continue;
+			}
+			printf_debug("%s", "Environment file found.\n");
+			if (count >= ENV_NUM_CONFIG_PARTS) {
+				VERBOSE(stderr,
+					"Error, there are more than %d config "
+					"partitions.\n",
+					ENV_NUM_CONFIG_PARTS);
+				goto cleanup;
+			}
+			count++;
+		}
+	}
+	/* only the probed candidates can be cached, the order of the scan
+	 * is kept for cfgpart */
+	for (size_t i = 0; i < cand.count; i++) {
+		if (cand.probed[i]) {
+			cand.parts[probed] = cand.parts[i];
+			cand.found[probed] = cand.found[i];
+			probed++;
+		}
+	}
+	cand.count = probed;
 	if (count < ENV_NUM_CONFIG_PARTS) {
 		VERBOSE(stderr,
 			"Error, less than %d config partitions exist.\n",
 			ENV_NUM_CONFIG_PARTS);
+		goto cleanup;
+	}
+	if (use_cache) {
+		probe_cache_store(ENV_PROBE_CACHE_FILE, seqnum, cand.parts,
+				  cand.found, cand.count, search_all_devices);
+	}
+	count = 0;
+	for (size_t i = 0; i < cand.count; i++) {
+		if (cand.found[i]) {
+			cfgpart[count++] = cand.parts[i];
+			cand.parts[i].mountpoint = NULL;
+		}
+	}
+	result = true;
+
+cleanup:
+	/* the devpaths of the other candidates stay in the arena */
+	for (size_t i = 0; i < cand.count; i++) {
+		free(cand.parts[i].mountpoint);
+	}
+	if (!result) {
+		bgenv_arena_release(&probe_arena);
+	}
+	free(cand.parts);
+	free(cand.found);
+	free(cand.probed);
+	free(cand.tier);
+	free(cand.batch);
+	free(boot_controller);
+	free(rootdev);
+	return result;
+}
+
+bool probe_config_partitions(CONFIG_PART *cfgpart, bool search_all_devices)
+{
+	bool result;
+
+	/* every candidate is looked up in the same mount table */
+	mount_table_load();
+	result = do_probe_config_partitions(cfgpart, search_all_devices);
+	mount_table_release();
+	return result;
+}
+
+/* Finds the config partitions in the partition table of a disk image file,
+ * using only raw access to their FAT file systems. */
+bool probe_image_config_partitions(CONFIG_PART *cfgpart, const char *image)
+{
+	PedDevice *dev;
+	char *devpath;
+	int count = 0;
+	bool result = false;
+
+	if (!cfgpart || !image) {
 		return false;
 	}
-	return true;
+	dev = ped_device_open_image(image);
+	if (!dev) {
+		VERBOSE(stderr, "No partition table found in %s.\n", image);
+		return false;
+	}
+	/* shared by all candidates */
+	devpath = bgenv_arena_strdup(&probe_arena, image);
+	if (!devpath) {
+		VERBOSE(stderr, "Out of memory.");
+		goto cleanup;
+	}
+	for (PedPartition *part = dev->part_list; part; part = part->next) {
+		CONFIG_PART candidate = {
+			.not_mounted = true,
+			.image = true,
+			.offset = part->start_LBA * LB_SIZE,
+		};
+
+		if (part->fs_type != FS_TYPE_FAT12 &&
+		    part->fs_type != FS_TYPE_FAT16 &&
+		    part->fs_type != FS_TYPE_FAT32) {
+			continue;
+		}
+		if (!probe_filter_match(part, image, candidate.offset)) {
+			VERBOSE(stdout, "Skipping partition %u, it does not "
+					"match the probe filter.\n",
+				part->num);
+			continue;
+		}
+		candidate.devpath = devpath;
+		if (raw_config_file_access(&candidate, NULL, 0, false) != 0) {
+			continue;
+		}
+		VERBOSE(stdout, "Environment file found in partition %u.\n",
+			part->num);
+		if (count >= ENV_NUM_CONFIG_PARTS) {
+			VERBOSE(stderr,
+				"Error, there are more than %d config "
+				"partitions.\n",
+				ENV_NUM_CONFIG_PARTS);
+			goto cleanup;
+		}
+		cfgpart[count++] = candidate;
+	}
+	if (count < ENV_NUM_CONFIG_PARTS) {
+		VERBOSE(stderr,
+			"Error, less than %d config partitions exist.\n",
+			ENV_NUM_CONFIG_PARTS);
+		goto cleanup;
+	}
+	result = true;
+
+cleanup:
+	if (!result) {
+		for (int i = 0; i < count; i++) {
+			cfgpart[i].devpath = NULL;
+		}
+		bgenv_arena_release(&probe_arena);
+	}
+	ped_device_close(dev);
+	return result;
 }
@@ -13,52 +13,275 @@
  */
 
 #include <stdlib.h>
-#include <mntent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include "env_api.h"
 #include "env_disk_utils.h"
+#include "env_trace.h"
+#include "fat.h"
 
 const char *tmp_mnt_dir = "/tmp/mnt-XXXXXX";
 
-char *get_mountpoint(char *devpath)
+static bool use_shared_mounts;
+
+void shared_mounts_enable(bool enable)
 {
-	char *mntpoint = NULL;
-	struct mntent *part;
-	FILE *mtab;
+	use_shared_mounts = enable;
+}
 
-	mtab = setmntent("/proc/mounts", "r");
-	if (!mtab) {
-		return NULL;
+bool shared_mounts_enabled(void)
+{
+	return use_shared_mounts;
+}
+
+static bool use_group_sync;
+
+void group_sync_enable(bool enable)
+{
+	use_group_sync = enable;
+}
+
+bool group_sync_enabled(void)
+{
+	return use_group_sync;
+}
+
+static unsigned long mount_flags(void)
+{
+	/* with group sync, the writer flushes once in sync_mounted_file() */
+	return use_group_sync ? 0 : MS_SYNCHRONOUS;
+}
+
+int sync_mounted_file(int fd)
+{
+	/* the file data and inode first, then the FAT and directory, and
+	 * both reach the medium before the caller goes on */
+	if (fsync(fd) || syncfs(fd)) {
+		return -errno;
+	}
+	return 0;
+}
+
+typedef struct {
+	dev_t dev;
+	/* position in the mount table, the first mount of a device wins */
+	size_t index;
+	char *dir;
+} MOUNT_ENTRY;
+
+typedef struct {
+	MOUNT_ENTRY *entries;
+	size_t count;
+	size_t size;
+} MOUNT_TABLE;
+
+/* the mount table while a probe runs, see mount_table_load() */
+static MOUNT_TABLE probe_mounts;
+static bool probe_mounts_loaded;
+
+/* Decodes the octal escapes of spaces and other special characters in a
+ * path of /proc/self/mountinfo in place. */
+static void unescape_mount_path(char *path)
+{
+	char *out = path;
+
+	for (char *in = path; *in; out++) {
+		if (in[0] == '\\' && in[1] >= '0' && in[1] <= '3' &&
+		    in[2] >= '0' && in[2] <= '7' && in[3] >= '0' &&
+		    in[3] <= '7') {
+			*out = (in[1] - '0') << 6 | (in[2] - '0') << 3 |
+			       (in[3] - '0');
+			in += 4;
+		} else {
+			*out = *in++;
+		}
 	}
+	*out = '\0';
+}
 
-	while ((part = getmntent(mtab)) != NULL) {
-		if ((part->mnt_fsname != NULL) &&
-		    (strcmp(part->mnt_fsname, devpath)) == 0) {
-			mntpoint = strdup(part->mnt_dir);
+static int compare_mount_entries(const void *a, const void *b)
+{
+	const MOUNT_ENTRY *x = a;
+	const MOUNT_ENTRY *y = b;
+
+	if (x->dev != y->dev) {
+		return x->dev < y->dev ? -1 : 1;
+	}
+	return x->index < y->index ? -1 : x->index > y->index;
+}
+
+static void mount_table_free(MOUNT_TABLE *table)
+{
+	for (size_t i = 0; i < table->count; i++) {
+		free(table->entries[i].dir);
+	}
+	free(table->entries);
+	memset(table, 0, sizeof(*table));
+}
+
+/* Reads the mounts of whole file systems from /proc/self/mountinfo into
+ * table, sorted by device number. */
+static bool mount_table_read(MOUNT_TABLE *table)
+{
+	size_t size = 0;
+	size_t index = 0;
+	char *line = NULL;
+	bool result = true;
+	FILE *f;
+
+	memset(table, 0, sizeof(*table));
+	f = fopen("/proc/self/mountinfo", "re");
+	if (!f) {
+		return false;
+	}
+	while (getline(&line, &size, f) > 0) {
+		unsigned int maj, min;
+		char *root, *dir, *save;
+		MOUNT_ENTRY *entry;
+		int pos = 0;
+
+		/* mount ID, parent ID, MAJOR:MINOR, root, mount point, ... */
+		if (sscanf(line, "%*u %*u %u:%u %n", &maj, &min, &pos) != 2 ||
+		    pos == 0) {
+			continue;
+		}
+		index++;
+		root = strtok_r(line + pos, " ", &save);
+		dir = strtok_r(NULL, " ", &save);
+		/* bind mounts of subdirectories do not hold the file */
+		if (!root || !dir || strcmp(root, "/") != 0) {
+			continue;
+		}
+		unescape_mount_path(dir);
+		/* shared mounts are only used with a reference */
+		if (use_shared_mounts &&
+		    strncmp(dir, ENV_SHARED_MOUNT_DIR "/",
+			    sizeof(ENV_SHARED_MOUNT_DIR)) == 0) {
+			continue;
+		}
+		if (table->count == table->size) {
+			size_t n = table->size ? 2 * table->size : 64;
+			MOUNT_ENTRY *entries = realloc(table->entries,
+						       n * sizeof(MOUNT_ENTRY));
+
+			if (!entries) {
+				result = false;
+				break;
+			}
+			table->entries = entries;
+			table->size = n;
+		}
+		entry = &table->entries[table->count];
+		entry->dev = makedev(maj, min);
+		entry->index = index;
+		entry->dir = strdup(dir);
+		if (!entry->dir) {
+			result = false;
 			break;
 		}
+		table->count++;
+	}
+	free(line);
+	fclose(f);
+	if (!result) {
+		mount_table_free(table);
+		return false;
+	}
+	if (table->count) {
+		qsort(table->entries, table->count, sizeof(MOUNT_ENTRY),
+		      compare_mount_entries);
 	}
-	endmntent(mtab);
+	return true;
+}
+
+static char *mount_table_lookup(const MOUNT_TABLE *table, dev_t dev)
+{
+	size_t lo = 0;
+	size_t hi = table->count;
 
+	/* the first entry of dev, which has the lowest index */
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (table->entries[mid].dev < dev) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo == table->count || table->entries[lo].dev != dev) {
+		return NULL;
+	}
+	return strdup(table->entries[lo].dir);
+}
+
+void mount_table_load(void)
+{
+	if (!probe_mounts_loaded) {
+		probe_mounts_loaded = mount_table_read(&probe_mounts);
+	}
+}
+
+void mount_table_release(void)
+{
+	mount_table_free(&probe_mounts);
+	probe_mounts_loaded = false;
+}
+
+char *get_mountpoint(char *devpath)
+{
+	MOUNT_TABLE table;
+	char *mntpoint;
+	struct stat st;
+
+	/* matched by device number, whatever node the mount was made from */
+	if (stat(devpath, &st) || !S_ISBLK(st.st_mode)) {
+		return NULL;
+	}
+	if (probe_mounts_loaded) {
+		return mount_table_lookup(&probe_mounts, st.st_rdev);
+	}
+	if (!mount_table_read(&table)) {
+		return NULL;
+	}
+	mntpoint = mount_table_lookup(&table, st.st_rdev);
+	mount_table_free(&table);
 	return mntpoint;
 }
 
-bool mount_partition(CONFIG_PART *cfgpart)
+bool adopt_mountpoint(CONFIG_PART *cfgpart)
+{
+	char *mountpoint = get_mountpoint(cfgpart->devpath);
+
+	if (!mountpoint) {
+		return false;
+	}
+	VERBOSE(stdout, "Partition %s has been mounted to %s.\n",
+		cfgpart->devpath, mountpoint);
+	free(cfgpart->mountpoint);
+	cfgpart->mountpoint = mountpoint;
+	cfgpart->not_mounted = false;
+	return true;
+}
+
+static bool do_mount_partition(CONFIG_PART *cfgpart)
 {
 	char tmpdir_template[256];
 	char *mountpoint;
 	(void)snprintf(tmpdir_template, 256, "%s", tmp_mnt_dir);
-	if (!cfgpart) {
-		return false;
-	}
-	if (!cfgpart->devpath) {
-		return false;
-	}
 	if (!(mountpoint = mkdtemp(tmpdir_template))) {
 		VERBOSE(stderr, "Error creating temporary mount point.\n");
 		return false;
 	}
-	if (mount(cfgpart->devpath, mountpoint, "vfat", MS_SYNCHRONOUS, NULL)) {
+	if (mount(cfgpart->devpath, mountpoint, "vfat", mount_flags(), NULL)) {
 		VERBOSE(stderr, "Error mounting to temporary mount point.\n");
 		if (rmdir(tmpdir_template)) {
 			VERBOSE(stderr,
@@ -75,22 +298,399 @@ bool mount_partition(CONFIG_PART *cfgpart)
 	return true;
 }
 
+/* Opens the lock file path.suffix and locks it with flock() operation op.
+ * Returns the file descriptor or -1. */
+static int lock_shared_mount(const char *path, const char *suffix, int op)
+{
+	char lockpath[PATH_MAX];
+	int fd;
+
+	if (snprintf(lockpath, sizeof(lockpath), "%s.%s", path, suffix) >=
+	    (int)sizeof(lockpath)) {
+		return -1;
+	}
+	fd = open(lockpath, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		return -1;
+	}
+	while (flock(fd, op)) {
+		if (errno != EINTR) {
+			close(fd);
+			return -1;
+		}
+	}
+	return fd;
+}
+
+/* Mounts cfgpart to the shared mount point path of the block device rdev,
+ * unless another process did so before, and takes a reference to it. The
+ * .lock file serializes mounting and unmounting, the .users file is locked
+ * shared by every user of the mount. */
+static bool do_mount_shared_partition(CONFIG_PART *cfgpart, const char *path,
+				      dev_t rdev)
+{
+	char parent[] = ENV_SHARED_MOUNT_DIR;
+	struct stat st;
+	bool result = false;
+	int users;
+	int state;
+
+	if ((mkdir(dirname(parent), 0755) && errno != EEXIST) ||
+	    (mkdir(ENV_SHARED_MOUNT_DIR, 0700) && errno != EEXIST)) {
+		VERBOSE(stderr, "Error creating shared mount directory.\n");
+		return false;
+	}
+	state = lock_shared_mount(path, "lock", LOCK_EX);
+	if (state < 0) {
+		VERBOSE(stderr, "Error locking shared mount point %s.\n", path);
+		return false;
+	}
+	users = lock_shared_mount(path, "users", LOCK_SH);
+	cfgpart->mountpoint = strdup(path);
+	if (users < 0 || !cfgpart->mountpoint) {
+		VERBOSE(stderr, "Error referencing shared mount point %s.\n",
+			path);
+		goto out;
+	}
+	/* the root of a mounted file system is on the device itself */
+	if (stat(path, &st) == 0 && st.st_dev == rdev) {
+		VERBOSE(stdout, "Reusing shared mount point %s.\n", path);
+		result = true;
+		goto out;
+	}
+	if (mkdir(path, 0700) && errno != EEXIST) {
+		VERBOSE(stderr, "Error creating shared mount point %s.\n",
+			path);
+		goto out;
+	}
+	if (mount(cfgpart->devpath, path, "vfat", mount_flags(), NULL)) {
+		VERBOSE(stderr, "Error mounting to shared mount point %s.\n",
+			path);
+		rmdir(path);
+		goto out;
+	}
+	result = true;
+out:
+	if (result) {
+		cfgpart->shared_mount = true;
+		cfgpart->mount_users = users;
+	} else {
+		if (users >= 0) {
+			close(users);
+		}
+		free(cfgpart->mountpoint);
+		cfgpart->mountpoint = NULL;
+	}
+	close(state);
+	return result;
+}
+
+/* Drops the reference to a shared mount and unmounts it if no other process
+ * holds one. Returns 0 or a negative errno value. */
+static int unmount_shared_partition(CONFIG_PART *cfgpart)
+{
+	int result = 0;
+	int state;
+
+	state = lock_shared_mount(cfgpart->mountpoint, "lock", LOCK_EX);
+	if (state < 0) {
+		result = -errno;
+		/* the mount lingers until the next user unmounts it */
+		VERBOSE(stderr, "Error locking shared mount point %s.\n",
+			cfgpart->mountpoint);
+		close(cfgpart->mount_users);
+		return result;
+	}
+	/* only succeeds if the shared locks of all other users are gone */
+	if (flock(cfgpart->mount_users, LOCK_EX | LOCK_NB) == 0) {
+		if (umount(cfgpart->mountpoint)) {
+			VERBOSE(stderr, "Error unmounting shared mount point "
+					"%s.\n",
+				cfgpart->mountpoint);
+			result = -errno;
+		} else if (rmdir(cfgpart->mountpoint)) {
+			VERBOSE(stderr, "Error deleting shared mount point "
+					"%s.\n",
+				cfgpart->mountpoint);
+		}
+	}
+	close(cfgpart->mount_users);
+	close(state);
+	return result;
+}
+
+bool mount_partition(CONFIG_PART *cfgpart)
+{
+	char path[PATH_MAX];
+	BG_TRACE_SPAN span;
+	struct stat st;
+	bool result;
+
+	if (!cfgpart) {
+		return false;
+	}
+	if (!cfgpart->devpath) {
+		return false;
+	}
+	BG_TRACE_START(span, mount_partition, cfgpart->devpath);
+	if (use_shared_mounts && stat(cfgpart->devpath, &st) == 0 &&
+	    S_ISBLK(st.st_mode)) {
+		snprintf(path, sizeof(path), "%s/%u:%u", ENV_SHARED_MOUNT_DIR,
+			 major(st.st_rdev), minor(st.st_rdev));
+		result = do_mount_shared_partition(cfgpart, path, st.st_rdev);
+	} else {
+		result = do_mount_partition(cfgpart);
+	}
+	BG_TRACE_DONE(span, mount_partition, cfgpart->devpath, 0,
+		      result ? 0 : -EIO);
+	return result;
+}
+
 void unmount_partition(CONFIG_PART *cfgpart)
 {
+	BG_TRACE_SPAN span;
+	int result = 0;
+
 	if (!cfgpart) {
 		return;
 	}
 	if (!cfgpart->mountpoint) {
 		return;
 	}
+	BG_TRACE_START(span, unmount_partition, cfgpart->devpath);
+	if (cfgpart->shared_mount) {
+		result = unmount_shared_partition(cfgpart);
+		cfgpart->shared_mount = false;
+		goto out;
+	}
 	if (umount(cfgpart->mountpoint)) {
 		VERBOSE(stderr, "Error unmounting temporary mountpoint %s.\n",
 			cfgpart->mountpoint);
+		result = -errno;
 	}
 	if (rmdir(cfgpart->mountpoint)) {
 		VERBOSE(stderr, "Error deleting temporary directory %s.\n",
 			cfgpart->mountpoint);
 	}
+out:
 	free(cfgpart->mountpoint);
 	cfgpart->mountpoint = NULL;
+	BG_TRACE_DONE(span, unmount_partition, cfgpart->devpath, 0, result);
+}
+
+/* Opens the partition's block device and looks up the environment file.
+ * Returns the file descriptor or a negative errno value. */
+static int raw_open_config_file(CONFIG_PART *cfgpart, bool write,
+				struct fat_volume *vol, struct fat_file *file)
+{
+	int flags;
+	int fd;
+	int ret;
+
+	if (!cfgpart || !cfgpart->devpath) {
+		return -EINVAL;
+	}
+	flags = (write ? O_RDWR : O_RDONLY) | O_CLOEXEC;
+	/* The partition may have been mounted since it was probed. An
+	 * exclusive open then fails with EBUSY instead of writing underneath
+	 * the file system. Image files are never mounted. */
+	if (write && !cfgpart->image) {
+		flags |= O_EXCL;
+	}
+	fd = open(cfgpart->devpath, flags);
+	if (fd < 0) {
+		/* keep -ENOENT for a missing file, not a missing device */
+		return errno == ENOENT ? -ENODEV : -errno;
+	}
+	ret = fat_open_volume_at(fd, cfgpart->offset, vol, false);
+	if (ret == 0) {
+		ret = fat_find_root_file(vol, FAT_ENV_FILENAME, file);
+	}
+	if (ret) {
+		close(fd);
+		return ret;
+	}
+	return fd;
+}
+
+int raw_config_file_access(CONFIG_PART *cfgpart, void *buf, size_t len,
+			   bool write)
+{
+	struct fat_volume vol;
+	struct fat_file file;
+	int fd;
+	int ret = 0;
+
+	fd = raw_open_config_file(cfgpart, write, &vol, &file);
+	if (fd < 0) {
+		return fd;
+	}
+	if (!buf) {
+		goto out;
+	}
+	/* the file is only rewritten in place, never resized */
+	if (file.size > len || (write && file.size != len)) {
+		ret = -EFBIG;
+		goto out;
+	}
+	ret = fat_file_access(&vol, &file, 0, buf, file.size, write);
+	if (ret == 0 && write && fsync(fd)) {
+		ret = -errno;
+	}
+	if (ret == 0 && !write) {
+		ret = file.size;
+	}
+out:
+	if (close(fd) && ret >= 0) {
+		ret = -errno;
+	}
+	return ret;
+}
+
+int raw_config_file_read_head(CONFIG_PART *cfgpart, void *buf, size_t len)
+{
+	struct fat_volume vol;
+	struct fat_file file;
+	int fd;
+	int ret;
+
+	fd = raw_open_config_file(cfgpart, false, &vol, &file);
+	if (fd < 0) {
+		return fd;
+	}
+	if (len > file.size) {
+		len = file.size;
+	}
+	ret = fat_file_access(&vol, &file, 0, buf, len, false);
+	if (ret == 0) {
+		ret = len;
+	}
+	if (close(fd) && ret >= 0) {
+		ret = -errno;
+	}
+	return ret;
+}
+
+int raw_config_file_map(CONFIG_PART *cfgpart, size_t len, ENV_MAPPING *map)
+{
+	struct fat_volume vol;
+	struct fat_file file;
+	off_t offset, start;
+	void *p;
+	int fd;
+	int ret;
+
+	fd = raw_open_config_file(cfgpart, false, &vol, &file);
+	if (fd < 0) {
+		return fd;
+	}
+	ret = file.size != len ? -EFBIG : fat_file_extent(&vol, &file, &offset);
+	if (ret) {
+		goto out;
+	}
+	/* the file need not start at a page boundary of the device */
+	start = offset - offset % sysconf(_SC_PAGESIZE);
+	p = mmap(NULL, len + (offset - start), PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE, fd, start);
+	if (p == MAP_FAILED) {
+		ret = -errno;
+		goto out;
+	}
+	map->base = p;
+	map->len = len + (offset - start);
+	map->data = (uint8_t *)p + (offset - start);
+out:
+	close(fd);
+	return ret;
+}
+
+int env_mapping_detach(ENV_MAPPING *map)
+{
+	void *copy;
+	int ret = 0;
+
+	if (!map->base || map->detached) {
+		return 0;
+	}
+	copy = malloc(map->len);
+	if (!copy) {
+		return -ENOMEM;
+	}
+	memcpy(copy, map->base, map->len);
+	if (mmap(map->base, map->len, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+		ret = -errno;
+	} else {
+		memcpy(map->base, copy, map->len);
+		map->detached = true;
+	}
+	free(copy);
+	return ret;
+}
+
+void env_mapping_release(ENV_MAPPING *map)
+{
+	if (map->base) {
+		munmap(map->base, map->len);
+	}
+	memset(map, 0, sizeof(*map));
+}
+
+int raw_config_file_write_ranges(CONFIG_PART *cfgpart, const void *buf,
+				 size_t len, const ENV_RANGE *ranges,
+				 size_t count)
+{
+	struct fat_volume vol;
+	struct fat_file file;
+	int fd;
+	int ret = 0;
+
+	fd = raw_open_config_file(cfgpart, true, &vol, &file);
+	if (fd < 0) {
+		return fd;
+	}
+	if (file.size != len) {
+		ret = -EFBIG;
+		goto out;
+	}
+	for (size_t i = 0; i < count && ret == 0; i++) {
+		ret = fat_file_access(&vol, &file, ranges[i].offset,
+				      (uint8_t *)buf + ranges[i].offset,
+				      ranges[i].len, true);
+	}
+	if (ret == 0 && fsync(fd)) {
+		ret = -errno;
+	}
+out:
+	if (close(fd) && ret == 0) {
+		ret = -errno;
+	}
+	return ret;
+}
+
+int raw_config_file_write_at(CONFIG_PART *cfgpart, size_t file_len,
+			     uint32_t offset, const void *buf, size_t len)
+{
+	struct fat_volume vol;
+	struct fat_file file;
+	int fd;
+	int ret;
+
+	fd = raw_open_config_file(cfgpart, true, &vol, &file);
+	if (fd < 0) {
+		return fd;
+	}
+	if (file.size != file_len) {
+		ret = -EFBIG;
+		goto out;
+	}
+	ret = fat_file_access(&vol, &file, offset, (void *)buf, len, true);
+	if (ret == 0 && fsync(fd)) {
+		ret = -errno;
+	}
+out:
+	if (close(fd) && ret == 0) {
+		ret = -errno;
+	}
+	return ret;
 }
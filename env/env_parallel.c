@@ -0,0 +1,56 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2026
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#include <pthread.h>
+#include "env_parallel.h"
+
+struct parallel_work {
+	void (*fn)(size_t index, void *ctx);
+	void *ctx;
+	size_t count;
+	size_t next;
+};
+
+static void *parallel_worker(void *arg)
+{
+	struct parallel_work *work = arg;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED)) <
+	       work->count) {
+		work->fn(i, work->ctx);
+	}
+	return NULL;
+}
+
+void bgenv_parallel_for(size_t count, void (*fn)(size_t index, void *ctx),
+			void *ctx)
+{
+	struct parallel_work work = {
+		.fn = fn, .ctx = ctx, .count = count, .next = 0,
+	};
+	pthread_t threads[ENV_MAX_PROBE_THREADS];
+	size_t nthreads = 0;
+
+	/* the calling thread is a worker too */
+	while (nthreads + 1 < count && nthreads + 1 < ENV_MAX_PROBE_THREADS) {
+		if (pthread_create(&threads[nthreads], NULL, parallel_worker,
+				   &work)) {
+			/* run with whatever workers could be started */
+			break;
+		}
+		nthreads++;
+	}
+	parallel_worker(&work);
+	for (size_t i = 0; i < nthreads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+}
@@ -0,0 +1,239 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2026
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "env_api.h"
+#include "env_config_partitions.h"
+#include "env_disk_utils.h"
+#include "env_probe_cache.h"
+#include "env_probe_filter.h"
+#include "fat.h"
+
+#define PROBE_CACHE_MAGIC "ebg-probe-cache 3"
+#define UEVENT_SEQNUM_FILE "/sys/kernel/uevent_seqnum"
+
+static bool use_probe_cache;
+
+void probe_cache_enable(bool enable)
+{
+	use_probe_cache = enable;
+}
+
+bool probe_cache_enabled(void)
+{
+	return use_probe_cache;
+}
+
+bool probe_cache_seqnum(uint64_t *seqnum)
+{
+	FILE *f = fopen(UEVENT_SEQNUM_FILE, "r");
+	bool result;
+
+	if (!f) {
+		return false;
+	}
+	result = fscanf(f, "%" SCNu64, seqnum) == 1;
+	fclose(f);
+	return result;
+}
+
+struct part_identity {
+	uint64_t rdev;
+	uint32_t vol_id;
+	bool has_env;
+};
+
+/* Cheap fingerprint of a partition: a stat, the boot sector and the root
+ * directory. */
+static bool get_part_identity(const char *devpath, struct part_identity *id)
+{
+	struct fat_volume vol;
+	struct fat_file file;
+	struct stat sb;
+	bool result = false;
+	int fd;
+	int ret;
+
+	fd = open(devpath, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return false;
+	}
+	if (fstat(fd, &sb) || fat_open_volume(fd, &vol, false)) {
+		goto out;
+	}
+	ret = fat_find_root_file(&vol, FAT_ENV_FILENAME, &file);
+	if (ret && ret != -ENOENT) {
+		goto out;
+	}
+	id->rdev = sb.st_rdev;
+	id->vol_id = vol.vol_id;
+	id->has_env = ret == 0;
+	result = true;
+out:
+	close(fd);
+	return result;
+}
+
+bool probe_cache_load(const char *path, CONFIG_PART *cfgpart,
+		      bool search_all_devices)
+{
+	CONFIG_PART parts[ENV_NUM_CONFIG_PARTS] = {0};
+	char devpath[4096];
+	char magic[sizeof(PROBE_CACHE_MAGIC) + 1];
+	char order[PROBE_TIERS + 2];
+	uint64_t seqnum, cached_seqnum;
+	unsigned int filter;
+	int all;
+	int count = 0;
+	bool result = false;
+	FILE *f;
+
+	if (!probe_cache_seqnum(&seqnum)) {
+		return false;
+	}
+	f = fopen(path, "r");
+	if (!f) {
+		return false;
+	}
+	if (!fgets(magic, sizeof(magic), f) ||
+	    strcmp(magic, PROBE_CACHE_MAGIC "\n") != 0 ||
+	    fscanf(f, "seqnum %" SCNu64 " all %d filter %x order %4s\n",
+		   &cached_seqnum, &all, &filter, order) != 4 ||
+	    cached_seqnum != seqnum || all != search_all_devices ||
+	    filter != probe_filter_id() ||
+	    strcmp(order, probe_order_id()) != 0) {
+		goto out;
+	}
+
+	for (;;) {
+		struct part_identity cached, current;
+		unsigned long long rdev;
+		unsigned int vol_id;
+		int found;
+		int n;
+
+		n = fscanf(f, "part %4095s %llx %x %d\n", devpath, &rdev,
+			   &vol_id, &found);
+		if (n == EOF) {
+			break;
+		}
+		if (n != 4 || !get_part_identity(devpath, &current)) {
+			goto out;
+		}
+		cached.rdev = rdev;
+		cached.vol_id = vol_id;
+		cached.has_env = found;
+		if (current.rdev != cached.rdev ||
+		    current.vol_id != cached.vol_id ||
+		    current.has_env != cached.has_env) {
+			VERBOSE(stdout, "Probe cache is stale for %s.\n",
+				devpath);
+			goto out;
+		}
+		if (!found) {
+			continue;
+		}
+		if (count >= ENV_NUM_CONFIG_PARTS) {
+			goto out;
+		}
+		parts[count].devpath = bgenv_arena_strdup(&probe_arena,
+							  devpath);
+		if (!parts[count].devpath) {
+			goto out;
+		}
+		count++;
+	}
+	if (count != ENV_NUM_CONFIG_PARTS) {
+		goto out;
+	}
+
+	/* same state as left behind by probe_config_file() */
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		char *mountpoint = get_mountpoint(parts[i].devpath);
+
+		parts[i].not_mounted = !mountpoint;
+		free(mountpoint);
+	}
+	memcpy(cfgpart, parts, sizeof(parts));
+	VERBOSE(stdout, "Using config partitions from probe cache %s.\n",
+		path);
+	result = true;
+out:
+	fclose(f);
+	return result;
+}
+
+void probe_cache_store(const char *path, uint64_t seqnum,
+		       const CONFIG_PART *parts, const bool *found,
+		       size_t count, bool search_all_devices)
+{
+	char *tmppath = NULL;
+	char *dir = NULL;
+	FILE *f = NULL;
+	int fd;
+
+	if (asprintf(&tmppath, "%s.XXXXXX", path) == -1) {
+		return;
+	}
+	dir = strdup(path);
+	if (!dir) {
+		goto out;
+	}
+	if (mkdir(dirname(dir), 0755) && errno != EEXIST) {
+		VERBOSE(stderr, "Cannot create probe cache directory.\n");
+		goto out;
+	}
+	fd = mkstemp(tmppath);
+	if (fd < 0) {
+		goto out;
+	}
+	f = fdopen(fd, "w");
+	if (!f) {
+		close(fd);
+		goto remove;
+	}
+	fprintf(f, "%s\nseqnum %" PRIu64 " all %d filter %x order %s\n",
+		PROBE_CACHE_MAGIC, seqnum, search_all_devices,
+		probe_filter_id(), probe_order_id());
+	for (size_t i = 0; i < count; i++) {
+		struct part_identity id;
+
+		/* a partition that cannot be fingerprinted cannot be
+		 * revalidated, so do not cache anything */
+		if (!get_part_identity(parts[i].devpath, &id) ||
+		    id.has_env != found[i]) {
+			goto remove;
+		}
+		fprintf(f, "part %s %llx %x %d\n", parts[i].devpath,
+			(unsigned long long)id.rdev, id.vol_id, found[i]);
+	}
+	if (fclose(f) == 0 && rename(tmppath, path) == 0) {
+		f = NULL;
+		goto out;
+	}
+	f = NULL;
+remove:
+	if (f) {
+		fclose(f);
+	}
+	unlink(tmppath);
+out:
+	free(dir);
+	free(tmppath);
+}
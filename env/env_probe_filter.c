@@ -0,0 +1,306 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2026
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "env_api.h"
+#include "env_probe_filter.h"
+#include "fat.h"
+
+enum probe_rule_key {
+	RULE_TYPE,
+	RULE_UUID,
+	RULE_NAME,
+	RULE_LABEL,
+};
+
+struct probe_rule {
+	enum probe_rule_key key;
+	/* GUID rules, in on-disk byte order */
+	uint8_t guid[16];
+	/* name and label rules, pointing into rules_buf */
+	const char *pattern;
+};
+
+static struct probe_rule *rules;
+static size_t num_rules;
+static char *rules_buf;
+static uint32_t rules_id;
+
+static const char *const tier_names[PROBE_TIERS] = {
+	[PROBE_TIER_BOOT] = "boot",
+	[PROBE_TIER_CONTROLLER] = "controller",
+	[PROBE_TIER_OTHER] = "other",
+};
+
+static enum probe_tier tier_order[PROBE_TIERS] = {
+	PROBE_TIER_BOOT, PROBE_TIER_CONTROLLER, PROBE_TIER_OTHER,
+};
+static size_t num_tiers = PROBE_TIERS;
+static bool stop_early;
+static char order_id[PROBE_TIERS + 2] = "bco";
+
+static void update_order_id(void)
+{
+	size_t i;
+
+	for (i = 0; i < num_tiers; i++) {
+		order_id[i] = tier_names[tier_order[i]][0];
+	}
+	if (stop_early) {
+		order_id[i++] = '+';
+	}
+	order_id[i] = '\0';
+}
+
+int probe_order_set(const char *order)
+{
+	enum probe_tier new_order[PROBE_TIERS];
+	bool seen[PROBE_TIERS] = {false};
+	size_t count = 0;
+	const char *c = order;
+
+	if (!order || !*order) {
+		order = "boot,controller,other";
+		c = order;
+	}
+	while (*c) {
+		size_t len = strcspn(c, ",");
+		int t;
+
+		for (t = 0; t < PROBE_TIERS; t++) {
+			if (strlen(tier_names[t]) == len &&
+			    strncmp(c, tier_names[t], len) == 0) {
+				break;
+			}
+		}
+		if (t == PROBE_TIERS || seen[t]) {
+			VERBOSE(stderr, "Invalid probe order '%s'.\n", order);
+			return -EINVAL;
+		}
+		seen[t] = true;
+		new_order[count++] = t;
+		c += len;
+		if (*c == ',') {
+			c++;
+		}
+	}
+	if (count == 0) {
+		return -EINVAL;
+	}
+
+	memcpy(tier_order, new_order, sizeof(new_order));
+	num_tiers = count;
+	update_order_id();
+	return 0;
+}
+
+void probe_order_stop_early(bool enable)
+{
+	stop_early = enable;
+	update_order_id();
+}
+
+bool probe_order_stops_early(void)
+{
+	return stop_early;
+}
+
+size_t probe_order_get(enum probe_tier order[PROBE_TIERS])
+{
+	memcpy(order, tier_order, sizeof(tier_order));
+	return num_tiers;
+}
+
+const char *probe_order_id(void)
+{
+	return order_id;
+}
+
+static int hex_digit(char c)
+{
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	c = tolower(c);
+	if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}
+	return -1;
+}
+
+/* Parses the textual form of a GUID, whose first three groups are stored
+ * in little-endian byte order. */
+static bool parse_guid(const char *s, uint8_t guid[16])
+{
+	static const uint8_t order[16] = {
+		3, 2, 1, 0, 5, 4, 7, 6, 8, 9, 10, 11, 12, 13, 14, 15,
+	};
+	int n = 0;
+
+	for (int i = 0; i < 36; i++) {
+		int hi, lo;
+
+		if (i == 8 || i == 13 || i == 18 || i == 23) {
+			if (s[i] != '-') {
+				return false;
+			}
+			continue;
+		}
+		hi = hex_digit(s[i]);
+		lo = hi < 0 ? -1 : hex_digit(s[i + 1]);
+		if (lo < 0) {
+			return false;
+		}
+		guid[order[n++]] = (uint8_t)(hi << 4 | lo);
+		i++;
+	}
+	return s[36] == '\0';
+}
+
+static bool parse_rule(char *text, struct probe_rule *rule)
+{
+	static const char *const keys[] = {
+		[RULE_TYPE] = "type",
+		[RULE_UUID] = "uuid",
+		[RULE_NAME] = "name",
+		[RULE_LABEL] = "label",
+	};
+	char *value = strchr(text, '=');
+
+	if (!value) {
+		return false;
+	}
+	*value++ = '\0';
+	for (size_t k = 0; k < sizeof(keys) / sizeof(keys[0]); k++) {
+		if (strcmp(text, keys[k]) != 0) {
+			continue;
+		}
+		rule->key = k;
+		if (k == RULE_TYPE || k == RULE_UUID) {
+			return parse_guid(value, rule->guid);
+		}
+		rule->pattern = value;
+		return *value != '\0';
+	}
+	return false;
+}
+
+int probe_filter_set(const char *spec)
+{
+	struct probe_rule *new_rules = NULL;
+	char *buf = NULL;
+	char *saveptr = NULL;
+	size_t count = 0;
+
+	if (spec && *spec) {
+		size_t max = 1;
+		char *text;
+
+		for (const char *c = spec; *c; c++) {
+			max += *c == ',';
+		}
+		buf = strdup(spec);
+		new_rules = calloc(max, sizeof(*new_rules));
+		if (!buf || !new_rules) {
+			free(buf);
+			free(new_rules);
+			return -ENOMEM;
+		}
+		for (text = strtok_r(buf, ",", &saveptr); text;
+		     text = strtok_r(NULL, ",", &saveptr)) {
+			if (!parse_rule(text, &new_rules[count])) {
+				VERBOSE(stderr, "Invalid probe filter rule "
+						"'%s'.\n", text);
+				free(buf);
+				free(new_rules);
+				return -EINVAL;
+			}
+			count++;
+		}
+	}
+
+	free(rules_buf);
+	free(rules);
+	rules_buf = buf;
+	rules = new_rules;
+	num_rules = count;
+	/* never 0 for actual rules, which tells the probe cache apart */
+	rules_id = count ? bgenv_crc32(0, spec, strlen(spec)) | 1 : 0;
+	return 0;
+}
+
+uint32_t probe_filter_id(void)
+{
+	return rules_id;
+}
+
+static void read_label(PedPartition *part, const char *devpath,
+		       off_t offset)
+{
+	struct fat_boot_sector header;
+	int fat_bits;
+	int fd;
+
+	part->label_read = true;
+	part->label[0] = '\0';
+	fd = open(devpath, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return;
+	}
+	if (pread(fd, &header, sizeof(header), offset) == sizeof(header)) {
+		fat_bits = determine_FAT_bits(&header, false);
+		if (fat_bits > 0) {
+			fat_volume_label(&header, fat_bits, part->label);
+		}
+	}
+	close(fd);
+}
+
+static bool rule_matches(const struct probe_rule *rule, PedPartition *part,
+			 const char *devpath, off_t offset)
+{
+	switch (rule->key) {
+	case RULE_TYPE:
+		return part->gpt && memcmp(part->type_GUID, rule->guid, 16) == 0;
+	case RULE_UUID:
+		return part->gpt &&
+		       memcmp(part->partition_GUID, rule->guid, 16) == 0;
+	case RULE_NAME:
+		return part->gpt &&
+		       fnmatch(rule->pattern, part->name, FNM_CASEFOLD) == 0;
+	case RULE_LABEL:
+		if (!part->label_read) {
+			read_label(part, devpath, offset);
+		}
+		return fnmatch(rule->pattern, part->label, FNM_CASEFOLD) == 0;
+	}
+	return false;
+}
+
+bool probe_filter_match(PedPartition *part, const char *devpath,
+			off_t offset)
+{
+	if (num_rules == 0) {
+		return true;
+	}
+	for (size_t i = 0; i < num_rules; i++) {
+		if (rule_matches(&rules[i], part, devpath, offset)) {
+			return true;
+		}
+	}
+	return false;
+}
@@ -0,0 +1,204 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2026
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "env_api.h"
+#include "ebgpart.h"
+#include "env_config_partitions.h"
+#include "env_disk_utils.h"
+#include "env_snapshot.h"
+
+/* efivarfs files start with the attributes of the variable */
+#define EFIVAR_ATTR_SIZE sizeof(uint32_t)
+
+static bool use_snapshot;
+
+void env_snapshot_enable(bool enable)
+{
+	use_snapshot = enable;
+}
+
+bool env_snapshot_enabled(void)
+{
+	return use_snapshot;
+}
+
+static bool valid_uuid(const uint8_t *uuid)
+{
+	for (int i = 0; i < ENV_SNAPSHOT_UUID_LEN; i++) {
+		if (i == 8 || i == 13 || i == 18 || i == 23) {
+			if (uuid[i] != '-') {
+				return false;
+			}
+		} else if (!isxdigit(uuid[i]) || isupper(uuid[i])) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool env_snapshot_read(const char *path, BG_ENVSNAPSHOT *snapshot)
+{
+	/* one more byte to detect a variable of another size */
+	uint8_t buf[EFIVAR_ATTR_SIZE + sizeof(BG_ENVSNAPSHOT) + 1];
+	size_t len;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		return false;
+	}
+	len = fread(buf, 1, sizeof(buf), f);
+	fclose(f);
+	if (len != EFIVAR_ATTR_SIZE + sizeof(BG_ENVSNAPSHOT)) {
+		VERBOSE(stderr, "Invalid size of environment snapshot.\n");
+		return false;
+	}
+	memcpy(snapshot, buf + EFIVAR_ATTR_SIZE, sizeof(BG_ENVSNAPSHOT));
+	if (snapshot->magic != ENV_SNAPSHOT_MAGIC ||
+	    snapshot->version != ENV_SNAPSHOT_VERSION) {
+		VERBOSE(stderr, "Unknown environment snapshot format.\n");
+		return false;
+	}
+	if (snapshot->count != ENV_NUM_CONFIG_PARTS ||
+	    snapshot->booted >= snapshot->count) {
+		VERBOSE(stderr, "Environment snapshot does not cover all "
+				"config partitions.\n");
+		return false;
+	}
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		if (!valid_uuid(snapshot->part[i].part_uuid)) {
+			VERBOSE(stderr, "Invalid partition UUID in "
+					"environment snapshot.\n");
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Returns the device node of the partition, which needs to be freed by the
+ * caller, or NULL if it does not exist. */
+static char *resolve_part(const BG_ENVSNAPSHOT_PART *part)
+{
+	char path[PATH_MAX];
+	char *devpath;
+
+	(void)snprintf(path, sizeof(path), "%s/disk/by-partuuid/%.*s", DEVDIR,
+		       ENV_SNAPSHOT_UUID_LEN, part->part_uuid);
+	devpath = realpath(path, NULL);
+	if (!devpath) {
+		VERBOSE(stderr, "Error, no disk in %s\n", path);
+	}
+	return devpath;
+}
+
+bool env_snapshot_load(const char *path, CONFIG_PART *cfgpart)
+{
+	CONFIG_PART parts[ENV_NUM_CONFIG_PARTS] = {0};
+	BG_ENVSNAPSHOT snapshot;
+
+	if (!env_snapshot_read(path, &snapshot)) {
+		return false;
+	}
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		char *devpath = resolve_part(&snapshot.part[i]);
+		char *mountpoint;
+
+		if (!devpath) {
+			return false;
+		}
+		parts[i].devpath = bgenv_arena_strdup(&probe_arena, devpath);
+		free(devpath);
+		if (!parts[i].devpath) {
+			return false;
+		}
+		/* same state as left behind by probe_config_file() */
+		mountpoint = get_mountpoint(parts[i].devpath);
+		parts[i].not_mounted = !mountpoint;
+		free(mountpoint);
+	}
+	memcpy(cfgpart, parts, sizeof(parts));
+	VERBOSE(stdout, "Using config partitions from environment snapshot.\n");
+	return true;
+}
+
+int env_snapshot_globalstate(const char *path, const char *stale_path)
+{
+	BG_ENVSNAPSHOT snapshot;
+	uint32_t maxrev = 0;
+	int latest = 0;
+
+	if (access(stale_path, F_OK) == 0 ||
+	    !env_snapshot_read(path, &snapshot)) {
+		return -1;
+	}
+	/* the snapshot must still describe the disks present */
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		char *devpath = resolve_part(&snapshot.part[i]);
+
+		if (!devpath) {
+			return -1;
+		}
+		free(devpath);
+	}
+
+	/* same decision as for the environments in memory */
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		const BG_ENVSNAPSHOT_PART *part = &snapshot.part[i];
+
+		if (part->revision == REVISION_FAILED &&
+		    part->ustate == USTATE_FAILED) {
+			return USTATE_FAILED;
+		}
+		if (part->revision > maxrev) {
+			maxrev = part->revision;
+			latest = i;
+		}
+	}
+	return snapshot.part[latest].ustate;
+}
+
+void env_snapshot_invalidate(const char *path, const char *stale_path)
+{
+	char *dir;
+	int fd;
+
+	/* nothing to invalidate if the boot loader published no snapshot */
+	if (access(path, F_OK) != 0 || access(stale_path, F_OK) == 0) {
+		return;
+	}
+	dir = strdup(stale_path);
+	if (!dir) {
+		return;
+	}
+	if (mkdir(dirname(dir), 0755) && errno != EEXIST) {
+		VERBOSE(stderr, "Cannot create environment snapshot marker "
+				"directory.\n");
+		free(dir);
+		return;
+	}
+	free(dir);
+	fd = open(stale_path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		VERBOSE(stderr, "Cannot mark environment snapshot as stale.\n");
+		return;
+	}
+	close(fd);
+}
@@ -0,0 +1,50 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2026
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#include <time.h>
+#include "env_trace.h"
+
+ebgenv_trace_cb_t bgenv_trace_cb;
+static void *trace_priv;
+
+void ebg_set_trace_callback(ebgenv_trace_cb_t cb, void *priv)
+{
+	/* priv is published before the callback that needs it */
+	__atomic_store_n(&trace_priv, priv, __ATOMIC_RELAXED);
+	__atomic_store_n(&bgenv_trace_cb, cb, __ATOMIC_RELEASE);
+}
+
+uint64_t bgenv_trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void bgenv_trace_emit(const char *event, const char *detail, uint64_t bytes,
+		      int result, uint64_t start_ns)
+{
+	ebgenv_trace_cb_t cb = __atomic_load_n(&bgenv_trace_cb,
+					       __ATOMIC_ACQUIRE);
+	ebgenv_trace_event_t ev = {
+		.event = event,
+		.detail = detail,
+		.bytes = bytes,
+		.duration_ns = bgenv_trace_now() - start_ns,
+		.result = result,
+	};
+
+	/* the callback may have been unregistered in the meantime */
+	if (cb) {
+		cb(&ev, __atomic_load_n(&trace_priv, __ATOMIC_RELAXED));
+	}
+}
@@ -0,0 +1,357 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2026
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+/*
+ * Minimal FAT reader on top of EFI_DISK_IO_PROTOCOL, the boot loader
+ * counterpart of the raw access in tools/fat.c. It only handles files of
+ * unchanged size in the root directory, which is all that is needed for
+ * the environment.
+ */
+
+#include <efi.h>
+#include <efilib.h>
+#include <fatdisk.h>
+#include <envdata.h>
+
+#define FAT_DIRENT_SIZE		32
+#define FAT_NAME_LEN		11
+#define FAT_ATTR_VOLUME		0x08
+#define FAT_ATTR_DIR		0x10
+#define FAT_DELETED_FLAG	0xe5
+#define FAT_MAX_FAT12		0xff4
+
+static UINT16 get_le16(const UINT8 *p)
+{
+	return (UINT16)(p[0] | p[1] << 8);
+}
+
+static UINT32 get_le32(const UINT8 *p)
+{
+	return (UINT32)get_le16(p) | (UINT32)get_le16(p + 2) << 16;
+}
+
+static EFI_STATUS disk_read(FAT_DISK *disk, UINT64 offset, UINTN len,
+			    VOID *buffer)
+{
+	return disk->disk_io->ReadDisk(disk->disk_io, disk->media_id, offset,
+				       len, buffer);
+}
+
+EFI_STATUS fat_disk_open(EFI_DEVICE_PATH *devpath, FAT_DISK *disk)
+{
+	EFI_DEVICE_PATH *dp = devpath;
+	EFI_HANDLE handle;
+	EFI_STATUS status;
+	UINT8 sector[512];
+	UINT32 sector_size, sec_per_clus, reserved, fats, dir_entries;
+	UINT32 total_sectors, fat_length, rootdir_sectors;
+	UINT64 data_start;
+
+	ZeroMem(disk, sizeof(*disk));
+
+	status = BS->LocateDevicePath(&DiskIoProtocol, &dp, &handle);
+	if (EFI_ERROR(status)) {
+		return status;
+	}
+	/* a shorter match would be the whole disk, not the partition */
+	if (!IsDevicePathEnd(dp)) {
+		return EFI_NOT_FOUND;
+	}
+	status = BS->HandleProtocol(handle, &DiskIoProtocol,
+				    (VOID **)&disk->disk_io);
+	if (EFI_ERROR(status)) {
+		return status;
+	}
+	status = BS->HandleProtocol(handle, &BlockIoProtocol,
+				    (VOID **)&disk->block_io);
+	if (EFI_ERROR(status)) {
+		return status;
+	}
+	disk->media_id = disk->block_io->Media->MediaId;
+
+	status = disk_read(disk, 0, sizeof(sector), sector);
+	if (EFI_ERROR(status)) {
+		return status;
+	}
+
+	sector_size = get_le16(sector + 0x0b);
+	sec_per_clus = sector[0x0d];
+	reserved = get_le16(sector + 0x0e);
+	fats = sector[0x10];
+	dir_entries = get_le16(sector + 0x11);
+	total_sectors = get_le16(sector + 0x13);
+	if (total_sectors == 0) {
+		total_sectors = get_le32(sector + 0x20);
+	}
+	fat_length = get_le16(sector + 0x16);
+	if (fat_length == 0) {
+		fat_length = get_le32(sector + 0x24);
+		disk->fat_bits = 32;
+	}
+
+	/* the geometry checks of fat_read_bpb() in tools/fat.c */
+	if (reserved == 0 || fats == 0 || fat_length == 0 ||
+	    sector_size < 512 || sector_size > 4096 ||
+	    (sector_size & (sector_size - 1)) != 0 || sec_per_clus == 0 ||
+	    (sec_per_clus & (sec_per_clus - 1)) != 0) {
+		return EFI_VOLUME_CORRUPTED;
+	}
+
+	/* dir_entries and reserved are 16 bit and fats is 8 bit, but
+	 * fat_length is 32 bit, so the sum must not be done in UINT32 or a
+	 * corrupt boot sector could wrap it below total_sectors */
+	rootdir_sectors = (dir_entries * FAT_DIRENT_SIZE + sector_size - 1) /
+			  sector_size;
+	data_start = (UINT64)reserved + (UINT64)fats * fat_length +
+		     rootdir_sectors;
+	if (data_start >= total_sectors) {
+		return EFI_VOLUME_CORRUPTED;
+	}
+
+	disk->cluster_size = sector_size * sec_per_clus;
+	disk->fat_start = (UINT64)reserved * sector_size;
+	disk->fat_size = (UINT64)fat_length * sector_size;
+	disk->root_dir_start = disk->fat_start + fats * disk->fat_size;
+	disk->root_dir_entries = dir_entries;
+	disk->root_cluster = get_le32(sector + 0x2c);
+	disk->data_start = data_start * sector_size;
+	disk->total_clusters = (total_sectors - data_start) / sec_per_clus;
+	if (disk->fat_bits == 0) {
+		disk->fat_bits =
+			disk->total_clusters > FAT_MAX_FAT12 ? 16 : 12;
+	}
+	return EFI_SUCCESS;
+}
+
+static BOOLEAN cluster_valid(const FAT_DISK *disk, UINT32 cluster)
+{
+	return cluster >= 2 && cluster < disk->total_clusters + 2;
+}
+
+static UINT64 cluster_offset(const FAT_DISK *disk, UINT32 cluster)
+{
+	return disk->data_start + (UINT64)(cluster - 2) * disk->cluster_size;
+}
+
+static EFI_STATUS next_cluster(FAT_DISK *disk, UINT32 cluster, UINT32 *next)
+{
+	UINTN bytes = disk->fat_bits == 32 ? 4 : 2;
+	EFI_STATUS status;
+	UINT64 offset;
+	UINT8 *entry;
+
+	switch (disk->fat_bits) {
+	case 12:
+		offset = cluster + cluster / 2;
+		break;
+	case 16:
+		offset = (UINT64)cluster * 2;
+		break;
+	default:
+		offset = (UINT64)cluster * 4;
+		break;
+	}
+	if (offset + bytes > disk->fat_size) {
+		return EFI_VOLUME_CORRUPTED;
+	}
+
+	if (disk->cache_len == 0 || offset < disk->cache_start ||
+	    offset + bytes > disk->cache_start + disk->cache_len) {
+		disk->cache_start = offset & ~(UINT64)511;
+		disk->cache_len = FAT_DISK_CACHE_SIZE;
+		if (disk->cache_start + disk->cache_len > disk->fat_size) {
+			disk->cache_len = disk->fat_size - disk->cache_start;
+		}
+		status = disk_read(disk, disk->fat_start + disk->cache_start,
+				   disk->cache_len, disk->cache);
+		if (EFI_ERROR(status)) {
+			disk->cache_len = 0;
+			return status;
+		}
+	}
+	entry = disk->cache + (offset - disk->cache_start);
+
+	switch (disk->fat_bits) {
+	case 12:
+		*next = get_le16(entry);
+		*next = (cluster & 1) ? *next >> 4 : *next & 0xfff;
+		break;
+	case 16:
+		*next = get_le16(entry);
+		break;
+	default:
+		*next = get_le32(entry) & 0x0fffffff;
+		break;
+	}
+	return EFI_SUCCESS;
+}
+
+/* Returns EFI_SUCCESS if found, EFI_NOT_FOUND if the end of the directory
+ * was reached and EFI_NOT_READY if more entries follow. */
+static EFI_STATUS match_dirents(const UINT8 *dirents, UINTN count,
+				const CHAR8 *name, FAT_DISK_FILE *file)
+{
+	for (UINTN i = 0; i < count; i++) {
+		const UINT8 *de = dirents + i * FAT_DIRENT_SIZE;
+
+		if (de[0] == 0) {
+			return EFI_NOT_FOUND;
+		}
+		if (de[0] == FAT_DELETED_FLAG ||
+		    (de[11] & (FAT_ATTR_VOLUME | FAT_ATTR_DIR))) {
+			continue;
+		}
+		if (CompareMem(de, name, FAT_NAME_LEN) == 0) {
+			file->first_cluster = get_le16(de + 26) |
+					      (UINT32)get_le16(de + 20) << 16;
+			file->size = get_le32(de + 28);
+			return EFI_SUCCESS;
+		}
+	}
+	return EFI_NOT_READY;
+}
+
+EFI_STATUS fat_disk_find_root_file(FAT_DISK *disk, const CHAR8 *name,
+				   FAT_DISK_FILE *file)
+{
+	EFI_STATUS status;
+	UINT32 cluster;
+	UINTN len;
+	UINT8 *buffer;
+
+	if (disk->fat_bits != 32) {
+		/* fixed size root directory */
+		len = disk->root_dir_entries * FAT_DIRENT_SIZE;
+		buffer = AllocatePool(len);
+		if (!buffer) {
+			return EFI_OUT_OF_RESOURCES;
+		}
+		status = disk_read(disk, disk->root_dir_start, len, buffer);
+		if (!EFI_ERROR(status)) {
+			status = match_dirents(buffer, disk->root_dir_entries,
+					       name, file);
+		}
+		FreePool(buffer);
+		return status == EFI_NOT_READY ? EFI_NOT_FOUND : status;
+	}
+
+	buffer = AllocatePool(disk->cluster_size);
+	if (!buffer) {
+		return EFI_OUT_OF_RESOURCES;
+	}
+	status = EFI_NOT_FOUND;
+	cluster = disk->root_cluster;
+	/* the bound protects against cyclic chains */
+	for (UINT32 n = 0; n < disk->total_clusters; n++) {
+		if (!cluster_valid(disk, cluster)) {
+			break;
+		}
+		status = disk_read(disk, cluster_offset(disk, cluster),
+				   disk->cluster_size, buffer);
+		if (EFI_ERROR(status)) {
+			break;
+		}
+		status = match_dirents(buffer,
+				       disk->cluster_size / FAT_DIRENT_SIZE,
+				       name, file);
+		if (status != EFI_NOT_READY) {
+			break;
+		}
+		status = next_cluster(disk, cluster, &cluster);
+		if (EFI_ERROR(status)) {
+			break;
+		}
+		status = EFI_NOT_FOUND;
+	}
+	FreePool(buffer);
+	return status;
+}
+
+EFI_STATUS fat_disk_file_access(FAT_DISK *disk, const FAT_DISK_FILE *file,
+				UINT64 offset, VOID *buffer, UINTN len,
+				BOOLEAN write)
+{
+	UINT32 cluster = file->first_cluster;
+	UINTN skip = offset % disk->cluster_size;
+	UINT8 *p = buffer;
+	EFI_STATUS status;
+
+	if (offset > file->size || len > file->size - offset) {
+		return EFI_BAD_BUFFER_SIZE;
+	}
+
+	for (UINT64 n = offset / disk->cluster_size; n > 0; n--) {
+		if (!cluster_valid(disk, cluster)) {
+			return EFI_VOLUME_CORRUPTED;
+		}
+		status = next_cluster(disk, cluster, &cluster);
+		if (EFI_ERROR(status)) {
+			return status;
+		}
+	}
+
+	while (len > 0) {
+		UINT32 first = cluster;
+		UINTN run = 0;
+
+		/* coalesce physically contiguous clusters into one request */
+		do {
+			if (!cluster_valid(disk, cluster)) {
+				return EFI_VOLUME_CORRUPTED;
+			}
+			run += disk->cluster_size;
+			if (run - skip >= len) {
+				break;
+			}
+			status = next_cluster(disk, cluster, &cluster);
+			if (EFI_ERROR(status)) {
+				return status;
+			}
+		} while (cluster == first + run / disk->cluster_size);
+
+		run -= skip;
+		if (run > len) {
+			run = len;
+		}
+		if (write) {
+			status = disk->disk_io->WriteDisk(
+				disk->disk_io, disk->media_id,
+				cluster_offset(disk, first) + skip, run, p);
+		} else {
+			status = disk_read(disk, cluster_offset(disk, first) + skip,
+					   run, p);
+		}
+		if (EFI_ERROR(status)) {
+			return status;
+		}
+		p += run;
+		len -= run;
+		skip = 0;
+	}
+
+	if (write) {
+		return disk->block_io->FlushBlocks(disk->block_io);
+	}
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS fat_disk_open_cfg(EFI_DEVICE_PATH *devpath, FAT_DISK *disk,
+			     FAT_DISK_FILE *file)
+{
+	EFI_STATUS status;
+
+	status = fat_disk_open(devpath, disk);
+	if (EFI_ERROR(status)) {
+		return status;
+	}
+	return fat_disk_find_root_file(disk, (const CHAR8 *)FAT_ENV_SHORT_NAME,
+				       file);
+}
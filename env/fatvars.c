@@ -12,6 +12,7 @@
  * SPDX-License-Identifier:	GPL-2.0
  */
 
+#include <stddef.h>
 #include <efi.h>
 #include <efilib.h>
 #include <efiapi.h>
@@ -19,36 +20,342 @@
 #include <utils.h>
 #include <syspart.h>
 #include <envdata.h>
+#include <fatdisk.h>
+#include <loader_interface.h>
+
+/*
+ * The fields of BG_ENVDATA in front of userdata, which is all the boot
+ * decision needs. Environments are streamed through a small buffer, so
+ * only these are kept in memory.
+ */
+#pragma pack(push)
+#pragma pack(1)
+typedef struct {
+	uint16_t kernelfile[ENV_STRING_LENGTH];
+	uint16_t kernelparams[ENV_STRING_LENGTH];
+	uint8_t in_progress;
+	uint8_t ustate;
+	uint16_t watchdog_timeout_sec;
+	uint32_t revision;
+#if ENV_NUM_COUNTERS > 0
+	uint32_t counters[ENV_NUM_COUNTERS];
+#endif
+} BG_ENVHDR;
+#pragma pack(pop)
+
+_Static_assert(sizeof(BG_ENVHDR) == offsetof(BG_ENVDATA, userdata),
+	       "BG_ENVHDR does not match BG_ENVDATA");
+
+#define ENV_CHUNK_SIZE 4096
+#define ENV_CRC_OFFSET offsetof(BG_ENVDATA, crc32)
+
+_Static_assert(ENV_CHUNK_SIZE >= sizeof(BG_ENVHDR_V2),
+	       "header does not fit into the first chunk");
+_Static_assert(ENV_V2_HOT_SIZE <= 512,
+	       "state fields and counters do not fit into one sector");
+
+/* An environment file, read directly via DiskIo if possible, otherwise via
+ * the firmware's file protocol. The latter is also used once a raw access
+ * fails. */
+typedef struct {
+	FAT_DISK *disk;
+	FAT_DISK_FILE file;
+	EFI_FILE_HANDLE fh;
+} CFG_FILE;
 
 static int current_partition = 0;
-static BG_ENVDATA *env;
+static BG_ENVHDR *env;
 
-static BG_STATUS save_current_config(VOID)
+/* volume indices of the config partitions, discovered once by load_config */
+static UINTN config_volumes[ENV_NUM_CONFIG_PARTS];
+static UINTN config_volume_count;
+
+static VOID cfg_file_open(VOLUME_DESC *v, EFI_FILE_HANDLE fh, CFG_FILE *cf)
 {
-	BG_STATUS result = BG_CONFIG_ERROR;
+	cf->fh = fh;
+	cf->disk = AllocatePool(sizeof(FAT_DISK));
+	if (cf->disk &&
+	    (EFI_ERROR(fat_disk_open_cfg(v->devpath, cf->disk, &cf->file)) ||
+	     cf->file.size < sizeof(BG_ENVHDR_V2))) {
+		FreePool(cf->disk);
+		cf->disk = NULL;
+	}
+}
+
+static VOID cfg_file_close(CFG_FILE *cf)
+{
+	if (cf->disk) {
+		FreePool(cf->disk);
+		cf->disk = NULL;
+	}
+}
+
+static EFI_STATUS cfg_file_access(CFG_FILE *cf, UINT64 offset, VOID *buffer,
+				  UINTN len, BOOLEAN write)
+{
+	EFI_STATUS status;
+	UINTN done = len;
+
+	if (cf->disk) {
+		status = fat_disk_file_access(cf->disk, &cf->file, offset,
+					      buffer, len, write);
+		if (!EFI_ERROR(status)) {
+			return status;
+		}
+		/* the file is still open, retry this and all further
+		 * accesses through the firmware's FAT driver */
+		WARNING(L"Raw access to environment failed: %r\n", status);
+		cfg_file_close(cf);
+	}
+
+	status = cf->fh->SetPosition(cf->fh, offset);
+	if (EFI_ERROR(status)) {
+		return status;
+	}
+	if (write) {
+		status = cf->fh->Write(cf->fh, &done, buffer);
+	} else {
+		status = read_cfg_file(cf->fh, &done, buffer);
+	}
+	if (!EFI_ERROR(status) && done != len) {
+		status = EFI_END_OF_FILE;
+	}
+	return status;
+}
+
+/*
+ * Streams a format 1 environment through the chunk buffer, folding each
+ * chunk into the CRC, and takes the header from the file.
+ */
+static EFI_STATUS stream_env(CFG_FILE *cf, UINT8 *chunk, BG_ENVHDR *hdr,
+			     BOOLEAN *crc_ok)
+{
+	UINT32 crc = 0, stored = 0;
+	EFI_STATUS status;
+	UINTN len;
+
+	for (UINTN offset = 0; offset < sizeof(BG_ENVDATA); offset += len) {
+		UINTN crc_len;
+
+		len = sizeof(BG_ENVDATA) - offset;
+		if (len > ENV_CHUNK_SIZE) {
+			len = ENV_CHUNK_SIZE;
+		}
+		status = cfg_file_access(cf, offset, chunk, len, FALSE);
+		if (EFI_ERROR(status)) {
+			return status;
+		}
+		if (offset == 0) {
+			CopyMem(hdr, chunk, sizeof(*hdr));
+		}
+
+		crc_len = len;
+		if (offset + len > ENV_CRC_OFFSET) {
+			crc_len = offset < ENV_CRC_OFFSET ?
+				ENV_CRC_OFFSET - offset : 0;
+			for (UINTN i = crc_len; i < len; i++) {
+				((UINT8 *)&stored)[offset + i - ENV_CRC_OFFSET] =
+					chunk[i];
+			}
+		}
+		crc = crc32_update(crc, chunk, crc_len);
+	}
+
+	*crc_ok = crc == stored;
+	if (!*crc_ok) {
+		INFO(L"calculated: %lx\n", crc);
+		INFO(L"stored: %lx\n", stored);
+	}
+	return EFI_SUCCESS;
+}
+
+/*
+ * Replaces the header of a format 1 environment, whose current header is in
+ * the chunk buffer. The CRC is patched for the bytes that differ instead of
+ * being recomputed over the whole file, so only those bytes and the CRC are
+ * written, typically two sectors.
+ */
+static EFI_STATUS patch_env(CFG_FILE *cf, UINT8 *chunk, const BG_ENVHDR *hdr)
+{
+	const UINT8 *new = (const UINT8 *)hdr;
+	UINTN first = 0, last = sizeof(*hdr);
+	EFI_STATUS status;
+	UINT32 crc;
+
+	while (first < last && chunk[first] == new[first]) {
+		first++;
+	}
+	if (first == last) {
+		return EFI_SUCCESS;
+	}
+	while (chunk[last - 1] == new[last - 1]) {
+		last--;
+	}
+
+	status = cfg_file_access(cf, ENV_CRC_OFFSET, &crc, sizeof(crc), FALSE);
+	if (EFI_ERROR(status)) {
+		return status;
+	}
+	crc = crc32_patch(crc, ENV_CRC_OFFSET, first, chunk + first,
+			  new + first, last - first);
+
+	status = cfg_file_access(cf, first, (VOID *)(new + first),
+				 last - first, TRUE);
+	if (EFI_ERROR(status)) {
+		return status;
+	}
+	return cfg_file_access(cf, ENV_CRC_OFFSET, &crc, sizeof(crc), TRUE);
+}
+
+/*
+ * Reads the header of an environment in either format and checks it. The
+ * compact format is recognized by its magic, its uservars are only read to
+ * verify their CRC.
+ */
+static EFI_STATUS read_env(CFG_FILE *cf, UINT8 *chunk, BG_ENVHDR *hdr,
+			   BOOLEAN *crc_ok)
+{
+	BG_ENVHDR_V2 *v2 = (BG_ENVHDR_V2 *)chunk;
+	UINT32 crc = 0, stored, ulen;
+	EFI_STATUS status;
+	UINTN len;
+
+	status = cfg_file_access(cf, 0, chunk, sizeof(*v2), FALSE);
+	if (EFI_ERROR(status)) {
+		return status;
+	}
+	if (v2->magic != ENV_V2_MAGIC) {
+		return stream_env(cf, chunk, hdr, crc_ok);
+	}
+
+	*crc_ok = ENV_FORMAT_COMPACT(v2->version) &&
+		  v2->header_size == sizeof(*v2) &&
+		  v2->userdata_len < ENV_MEM_USERVARS &&
+		  v2->crc32 == crc32_update(0, chunk + ENV_V2_CRC_START,
+					    sizeof(*v2) - ENV_V2_CRC_START);
+	if (!*crc_ok) {
+		INFO(L"Invalid environment header.\n");
+		return EFI_SUCCESS;
+	}
+	CopyMem(hdr->kernelfile, v2->kernelfile, sizeof(hdr->kernelfile));
+	CopyMem(hdr->kernelparams, v2->kernelparams,
+		sizeof(hdr->kernelparams));
+	hdr->in_progress = v2->in_progress;
+	hdr->ustate = v2->ustate;
+	hdr->watchdog_timeout_sec = v2->watchdog_timeout_sec;
+	hdr->revision = v2->revision;
+	CopyMem((UINT8 *)hdr + ENV_COUNTERS_OFFSET,
+		chunk + ENV_V2_COUNTERS_OFFSET, ENV_COUNTERS_SIZE);
+	stored = v2->userdata_crc32;
+	ulen = v2->userdata_len;
+
+	for (UINTN offset = 0; offset < ulen; offset += len) {
+		len = ulen - offset;
+		if (len > ENV_CHUNK_SIZE) {
+			len = ENV_CHUNK_SIZE;
+		}
+		status = cfg_file_access(cf, sizeof(*v2) + offset, chunk, len,
+					 FALSE);
+		if (EFI_ERROR(status)) {
+			return status;
+		}
+		crc = crc32_update(crc, chunk, len);
+	}
+	*crc_ok = crc == stored;
+	if (!*crc_ok) {
+		INFO(L"calculated: %lx\n", crc);
+		INFO(L"stored: %lx\n", stored);
+	}
+	return EFI_SUCCESS;
+}
+
+/*
+ * Updates the state fields and counters of hdr in the file. In the compact
+ * format, they share the leading sector with the header CRC, and only that
+ * is written.
+ */
+static EFI_STATUS write_env(CFG_FILE *cf, UINT8 *chunk, const BG_ENVHDR *hdr)
+{
+	BG_ENVHDR_V2 *v2 = (BG_ENVHDR_V2 *)chunk;
+	EFI_STATUS status;
+
+	status = cfg_file_access(cf, 0, chunk, sizeof(*v2), FALSE);
+	if (EFI_ERROR(status)) {
+		return status;
+	}
+	if (v2->magic != ENV_V2_MAGIC) {
+		return patch_env(cf, chunk, hdr);
+	}
+
+	v2->in_progress = hdr->in_progress;
+	v2->ustate = hdr->ustate;
+	v2->watchdog_timeout_sec = hdr->watchdog_timeout_sec;
+	v2->revision = hdr->revision;
+	CopyMem(chunk + ENV_V2_COUNTERS_OFFSET,
+		(const UINT8 *)hdr + ENV_COUNTERS_OFFSET, ENV_COUNTERS_SIZE);
+	v2->crc32 = crc32_update(0, chunk + ENV_V2_CRC_START,
+				 sizeof(*v2) - ENV_V2_CRC_START);
+	return cfg_file_access(cf, 0, chunk, ENV_V2_HOT_SIZE, TRUE);
+}
+
+/* Publishes the state of the config partitions after the boot decision,
+ * which userspace can then query without probing them itself. */
+static VOID publish_snapshot(const int *env_invalid)
+{
+	BG_ENVSNAPSHOT snapshot;
 	EFI_STATUS efistatus;
-	UINTN numHandles = volume_count;
-	UINTN *config_volumes;
+	UINTN i, j;
+
+	ZeroMem(&snapshot, sizeof(snapshot));
+	snapshot.magic = ENV_SNAPSHOT_MAGIC;
+	snapshot.version = ENV_SNAPSHOT_VERSION;
+	snapshot.count = config_volume_count;
+	snapshot.booted = current_partition;
+
+	for (i = 0; i < config_volume_count; i++) {
+		BG_ENVSNAPSHOT_PART *part = &snapshot.part[i];
+		CHAR16 *uuid;
+
+		uuid = devpath_get_part_uuid(volumes[config_volumes[i]].devpath);
+		if (!uuid) {
+			/* not a GPT partition, userspace cannot find it */
+			return;
+		}
+		for (j = 0; j < ENV_SNAPSHOT_UUID_LEN && uuid[j]; j++) {
+			CHAR16 c = uuid[j];
 
-	config_volumes = (UINTN *)AllocatePool(sizeof(UINTN) *  volume_count);
-	if (!config_volumes) {
-		ERROR(L"Could not allocate memory for config partition mapping.\n");
-		return result;
+			part->part_uuid[j] = c >= L'A' && c <= L'Z' ?
+					     c - L'A' + 'a' : c;
+		}
+		FreePool(uuid);
+		if (env_invalid[i]) {
+			continue;
+		}
+		part->valid = 1;
+		part->in_progress = env[i].in_progress;
+		part->ustate = env[i].ustate;
+		part->revision = env[i].revision;
 	}
 
-	if (EFI_ERROR(enumerate_cfg_parts(config_volumes, &numHandles))) {
-		ERROR(L"Could not enumerate config partitions.\n");
-		goto scc_cleanup;
+	efistatus = set_bg_env_snapshot(&snapshot);
+	if (EFI_ERROR(efistatus)) {
+		WARNING(L"Cannot publish environment snapshot: %r\n",
+			efistatus);
 	}
+}
 
-	numHandles = filter_cfg_parts(config_volumes, numHandles);
+static BG_STATUS save_current_config(VOID)
+{
+	EFI_STATUS efistatus;
+	CFG_FILE cf;
+	UINT8 *chunk;
 
-	if (numHandles != ENV_NUM_CONFIG_PARTS) {
+	if (config_volume_count != ENV_NUM_CONFIG_PARTS) {
 		ERROR(L"Unexpected number of config partitions: found %d, but expected %d.\n",
-		      numHandles, ENV_NUM_CONFIG_PARTS);
+		      config_volume_count, ENV_NUM_CONFIG_PARTS);
 		/* In case of saving, this must be treated as error, to not
 		 * overwrite another partition's config file. */
-		goto scc_cleanup;
+		return BG_CONFIG_ERROR;
 	}
 
 	VOLUME_DESC *v = &volumes[config_volumes[current_partition]];
@@ -58,67 +365,97 @@ static BG_STATUS save_current_config(VOID)
 	if (EFI_ERROR(efistatus)) {
 		ERROR(L"Could not open environment file on system partition %d: %r\n",
 		      current_partition, efistatus);
-		goto scc_cleanup;
+		return BG_CONFIG_ERROR;
 	}
 
-	UINTN writelen = sizeof(BG_ENVDATA);
+	chunk = AllocatePool(ENV_CHUNK_SIZE);
+	if (!chunk) {
+		ERROR(L"Could not allocate memory for config data.\n");
+		(VOID) close_cfg_file(v->root, fh);
+		return BG_CONFIG_ERROR;
+	}
 
-	uint32_t crc32;
-	(VOID) BS->CalculateCrc32(
-	    &env[current_partition],
-	    sizeof(BG_ENVDATA) - sizeof(env[current_partition].crc32), &crc32);
-	env[current_partition].crc32 = crc32;
-	efistatus = fh->Write(fh, &writelen, (VOID *)&env[current_partition]);
+	cfg_file_open(v, fh, &cf);
+	efistatus = write_env(&cf, chunk, &env[current_partition]);
+	cfg_file_close(&cf);
+	FreePool(chunk);
 	if (EFI_ERROR(efistatus)) {
 		ERROR(L"Cannot write environment to file: %r\n", efistatus);
 		(VOID) close_cfg_file(v->root, fh);
-		goto scc_cleanup;
+		return BG_CONFIG_ERROR;
 	}
 
 	if (EFI_ERROR(close_cfg_file(v->root, fh))) {
 		ERROR(L"Could not close environment config file.\n");
-		goto scc_cleanup;
+		return BG_CONFIG_ERROR;
 	}
 
-	result = BG_SUCCESS;
-scc_cleanup:
-	FreePool(config_volumes);
-	return result;
+	return BG_SUCCESS;
 }
 
 BG_STATUS load_config(BG_LOADER_PARAMS *bglp)
 {
 	BG_STATUS result = BG_CONFIG_ERROR;
-	UINTN numHandles = volume_count;
-	UINTN *config_volumes;
+	/* one more than needed to detect too many config partitions */
+	const UINTN maxHandles = ENV_NUM_CONFIG_PARTS + 1;
+	UINTN numHandles = maxHandles;
+	UINTN *cfg_volumes = NULL;
+	EFI_FILE_HANDLE *cfg_files = NULL;
+	UINT8 *chunk;
 	UINTN i;
 	int env_invalid[ENV_NUM_CONFIG_PARTS] = {0};
+	BOOLEAN save = FALSE;
 
-	env = (BG_ENVDATA *)AllocateZeroPool(sizeof(BG_ENVDATA) *
-					 ENV_NUM_CONFIG_PARTS);
-	if (!env) {
+	env = (BG_ENVHDR *)AllocateZeroPool(sizeof(BG_ENVHDR) *
+					ENV_NUM_CONFIG_PARTS);
+	chunk = AllocatePool(ENV_CHUNK_SIZE);
+	if (!env || !chunk) {
 		ERROR(L"Could not allocate memory for config data.\n");
-		return result;
+		goto lc_cleanup;
 	}
 
-	config_volumes = (UINTN *)AllocatePool(sizeof(UINTN) * volume_count);
-	if (!config_volumes) {
+	cfg_volumes = (UINTN *)AllocatePool(sizeof(UINTN) * maxHandles);
+	cfg_files = (EFI_FILE_HANDLE *)AllocateZeroPool(
+		sizeof(EFI_FILE_HANDLE) * maxHandles);
+	if (!cfg_volumes || !cfg_files) {
 		ERROR(L"Could not allocate memory for config partition mapping.\n");
-		goto env_cleanup;
+		goto lc_cleanup;
 	}
 
-	if (EFI_ERROR(enumerate_cfg_parts(config_volumes, &numHandles))) {
+	/* single discovery pass, the files stay open for reading */
+	if (EFI_ERROR(enumerate_cfg_parts(0, cfg_volumes, cfg_files,
+					  &numHandles))) {
 		ERROR(L"Could not enumerate config partitions.\n");
 		goto lc_cleanup;
 	}
+	/* Configs on the boot medium take precedence over all others, so the
+	 * remaining volumes only matter if the boot medium has none. */
+	if (numHandles == 0) {
+		UINTN first = volume_count;
+
+		if (get_deferred_volumes(volumes, &volume_count) > 0) {
+			numHandles = maxHandles;
+			if (EFI_ERROR(enumerate_cfg_parts(first, cfg_volumes,
+							  cfg_files,
+							  &numHandles))) {
+				ERROR(L"Could not enumerate config partitions.\n");
+				goto lc_cleanup;
+			}
+		}
+	}
 
-	numHandles = filter_cfg_parts(config_volumes, numHandles);
+	numHandles = filter_cfg_parts(cfg_volumes, cfg_files, numHandles);
 
 	if (numHandles > ENV_NUM_CONFIG_PARTS) {
 		ERROR(L"Too many config partitions found. Aborting.\n");
+		close_cfg_parts(cfg_volumes, cfg_files, numHandles);
 		goto lc_cleanup;
 	}
 
+	/* remember the mapping for the write-back */
+	config_volume_count = numHandles;
+	CopyMem(config_volumes, cfg_volumes, sizeof(UINTN) * numHandles);
+
 	result = BG_SUCCESS;
 
 	if (numHandles < ENV_NUM_CONFIG_PARTS) {
@@ -129,38 +466,26 @@ BG_STATUS load_config(BG_LOADER_PARAMS *bglp)
 		result = BG_CONFIG_PARTIALLY_CORRUPTED;
 	}
 
-	/* Load all config data */
+	/* Load all config data. Reading the file's clusters directly is much
+	 * faster than going through some firmwares' FAT driver, which stays
+	 * the fallback. */
 	for (i = 0; i < numHandles; i++) {
-		EFI_FILE_HANDLE fh = NULL;
-		VOLUME_DESC *v = &volumes[config_volumes[i]];
-		if (EFI_ERROR(open_cfg_file(v->root, &fh,
-					    EFI_FILE_MODE_READ))) {
-			WARNING(L"Could not open environment file on config partition %d\n",
-				i);
-			result = BG_CONFIG_PARTIALLY_CORRUPTED;
-			continue;
-		}
-		UINTN readlen = sizeof(BG_ENVDATA);
-		if (EFI_ERROR(read_cfg_file(fh, &readlen, (VOID *)&env[i])) ||
-		    readlen < sizeof(BG_ENVDATA)) {
+		BOOLEAN crc_ok = FALSE;
+		CFG_FILE cf;
+
+		cfg_file_open(&volumes[cfg_volumes[i]], cfg_files[i], &cf);
+		if (EFI_ERROR(read_env(&cf, chunk, &env[i], &crc_ok))) {
 			ERROR(L"Cannot read environment from config partition %d.\n", i);
 			env_invalid[i] = 1;
-			if (EFI_ERROR(close_cfg_file(v->root, fh))) {
-				ERROR(L"Could not close environment config file.\n");
-			}
 			result = BG_CONFIG_PARTIALLY_CORRUPTED;
+			cfg_file_close(&cf);
 			continue;
 		}
+		cfg_file_close(&cf);
 
-		uint32_t crc32;
-		(VOID) BS->CalculateCrc32(
-		    &env[i], sizeof(BG_ENVDATA) - sizeof(env[i].crc32), &crc32);
-
-		if (crc32 != env[i].crc32) {
+		if (!crc_ok) {
 			ERROR(L"CRC32 error in environment data on config partition %d.\n",
 			      i);
-			INFO(L"calculated: %lx\n", crc32);
-			INFO(L"stored: %lx\n", env[i].crc32);
 			/* Don't treat this as fatal error because we may still
 			 * have
 			 * valid environments */
@@ -168,17 +493,11 @@ BG_STATUS load_config(BG_LOADER_PARAMS *bglp)
 			result = BG_CONFIG_PARTIALLY_CORRUPTED;
 		}
 
-		if (EFI_ERROR(close_cfg_file(v->root, fh))) {
-			ERROR(L"Could not close environment config file.\n");
-			/* Don't abort, so we may still be able to boot a
-			 * config */
-			result = BG_CONFIG_PARTIALLY_CORRUPTED;
-		}
-
 		/* enforce NULL-termination of strings */
 		env[i].kernelfile[ENV_STRING_LENGTH - 1] = 0;
 		env[i].kernelparams[ENV_STRING_LENGTH - 1] = 0;
 	}
+	close_cfg_parts(cfg_volumes, cfg_files, numHandles);
 
 	/* Find environment with latest revision and check if there is a test
 	 * configuration. */
@@ -222,9 +541,27 @@ BG_STATUS load_config(BG_LOADER_PARAMS *bglp)
 		/* If this configuration has never been booted with, set ustate
 		 * to indicate that this configuration is now being tested */
 		env[latest_idx].ustate = USTATE_TESTING;
+		save = TRUE;
+	}
+
+#if ENV_NUM_COUNTERS > 0
+	/* Count the boot in the environment that is booted, in the same
+	 * write as a state change of it. */
+	if (!env_invalid[current_partition]) {
+		for (i = 0; i < ENV_NUM_COUNTERS; i++) {
+			if (env[current_partition].counters[i] != (UINT32)-1) {
+				env[current_partition].counters[i]++;
+			}
+		}
+		save = TRUE;
+	}
+#endif
+	if (save) {
 		save_current_config();
 	}
 
+	publish_snapshot(env_invalid);
+
 	bglp->payload_path = StrDuplicate(env[current_partition].kernelfile);
 	bglp->payload_options =
 	    StrDuplicate(env[current_partition].kernelparams);
@@ -237,9 +574,18 @@ BG_STATUS load_config(BG_LOADER_PARAMS *bglp)
 	INFO(L" timeout: %d seconds\n", bglp->timeout);
 
 lc_cleanup:
-	FreePool(config_volumes);
-env_cleanup:
-	FreePool(env);
+	if (cfg_volumes) {
+		FreePool(cfg_volumes);
+	}
+	if (cfg_files) {
+		FreePool(cfg_files);
+	}
+	if (chunk) {
+		FreePool(chunk);
+	}
+	if (env) {
+		FreePool(env);
+	}
 	return result;
 }
 
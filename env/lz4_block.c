@@ -0,0 +1,208 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2026
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+/*
+ * A small LZ4 block codec, used for large user variables and, on the
+ * decompression side, for the compressed sections of the unified kernel
+ * stub. A greedy single-probe match finder is enough for that and keeps
+ * both free of external dependencies. The output obeys the end-of-block
+ * rules of the format and can be decoded by liblz4.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include "lz4_block.h"
+
+#define LZ4_MIN_MATCH		4
+#define LZ4_HASH_BITS		12
+#define LZ4_LAST_LITERALS	5
+#define LZ4_MFLIMIT		12
+#define LZ4_MAX_OFFSET		65535
+#define LZ4_RUN_MASK		15
+
+static uint32_t read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t lz4_hash(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+/* Writes the 255-byte continuation of a length field. */
+static uint8_t *put_length(uint8_t *op, const uint8_t *oend, uint32_t len)
+{
+	for (; len >= 255; len -= 255) {
+		if (op >= oend) {
+			return NULL;
+		}
+		*op++ = 255;
+	}
+	if (op >= oend) {
+		return NULL;
+	}
+	*op++ = (uint8_t)len;
+	return op;
+}
+
+/* Emits one sequence, or the final literal run if matchlen is 0. */
+static uint8_t *put_sequence(uint8_t *op, const uint8_t *oend,
+			     const uint8_t *lit, uint32_t litlen,
+			     uint32_t offset, uint32_t matchlen)
+{
+	uint8_t *token;
+
+	if (op >= oend) {
+		return NULL;
+	}
+	token = op++;
+	*token = (litlen >= LZ4_RUN_MASK ? LZ4_RUN_MASK : litlen) << 4;
+	if (litlen >= LZ4_RUN_MASK) {
+		op = put_length(op, oend, litlen - LZ4_RUN_MASK);
+		if (!op) {
+			return NULL;
+		}
+	}
+	if (litlen > (uint32_t)(oend - op)) {
+		return NULL;
+	}
+	memcpy(op, lit, litlen);
+	op += litlen;
+	if (matchlen == 0) {
+		return op;
+	}
+
+	if (oend - op < 2) {
+		return NULL;
+	}
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+	matchlen -= LZ4_MIN_MATCH;
+	*token |= matchlen >= LZ4_RUN_MASK ? LZ4_RUN_MASK : matchlen;
+	if (matchlen >= LZ4_RUN_MASK) {
+		op = put_length(op, oend, matchlen - LZ4_RUN_MASK);
+	}
+	return op;
+}
+
+uint32_t lz4_block_compress(const uint8_t *src, uint32_t len, uint8_t *dst,
+			    uint32_t cap)
+{
+	uint32_t table[1 << LZ4_HASH_BITS];
+	const uint8_t *ip = src, *anchor = src, *end = src + len;
+	/* the last match must start LZ4_MFLIMIT bytes before the end and
+	 * leave LZ4_LAST_LITERALS bytes of literals behind it */
+	const uint8_t *mflimit = len > LZ4_MFLIMIT ? end - LZ4_MFLIMIT : src;
+	const uint8_t *matchlimit = end - LZ4_LAST_LITERALS;
+	uint8_t *op = dst;
+	const uint8_t *oend = dst + cap;
+
+	memset(table, 0, sizeof(table));
+	while (ip < mflimit) {
+		uint32_t h = lz4_hash(read32(ip));
+		const uint8_t *ref = src + table[h];
+		const uint8_t *mp;
+
+		table[h] = ip - src;
+		if (ref >= ip || ip - ref > LZ4_MAX_OFFSET ||
+		    read32(ref) != read32(ip)) {
+			ip++;
+			continue;
+		}
+		mp = ip + LZ4_MIN_MATCH;
+		while (mp < matchlimit && *mp == ref[mp - ip]) {
+			mp++;
+		}
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+		op = put_sequence(op, oend, anchor, ip - anchor, ip - ref,
+				  mp - ip);
+		if (!op) {
+			return 0;
+		}
+		ip = anchor = mp;
+	}
+	op = put_sequence(op, oend, anchor, end - anchor, 0, 0);
+	return op ? op - dst : 0;
+}
+
+static int get_length(const uint8_t **ip, const uint8_t *iend, uint32_t *len)
+{
+	uint8_t b;
+
+	if (*len != LZ4_RUN_MASK) {
+		return 0;
+	}
+	do {
+		if (*ip >= iend) {
+			return -EINVAL;
+		}
+		b = *(*ip)++;
+		if (*len > UINT32_MAX - b) {
+			return -EINVAL;
+		}
+		*len += b;
+	} while (b == 255);
+	return 0;
+}
+
+int lz4_block_decompress(const uint8_t *src, uint32_t len, uint8_t *dst,
+			 uint32_t dstlen)
+{
+	const uint8_t *ip = src, *iend = src + len;
+	uint8_t *op = dst;
+	const uint8_t *oend = dst + dstlen;
+
+	while (ip < iend) {
+		uint8_t token = *ip++;
+		uint32_t n = token >> 4;
+		uint32_t offset;
+		const uint8_t *match;
+
+		if (get_length(&ip, iend, &n) || n > (uint32_t)(iend - ip) ||
+		    n > (uint32_t)(oend - op)) {
+			return -EINVAL;
+		}
+		memcpy(op, ip, n);
+		ip += n;
+		op += n;
+		if (ip == iend) {
+			break;
+		}
+
+		if (iend - ip < 2) {
+			return -EINVAL;
+		}
+		offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		if (offset == 0 || offset > (uint32_t)(op - dst)) {
+			return -EINVAL;
+		}
+		n = token & LZ4_RUN_MASK;
+		if (get_length(&ip, iend, &n) ||
+		    (uint32_t)(oend - op) < LZ4_MIN_MATCH ||
+		    n > (uint32_t)(oend - op) - LZ4_MIN_MATCH) {
+			return -EINVAL;
+		}
+		n += LZ4_MIN_MATCH;
+		/* matches may overlap their own output */
+		for (match = op - offset; n > 0; n--) {
+			*op++ = *match++;
+		}
+	}
+	return op == oend ? 0 : -EINVAL;
+}
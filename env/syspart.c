@@ -18,17 +18,18 @@
 
 #define MAX_INFO_SIZE 1024
 
-EFI_STATUS enumerate_cfg_parts(UINTN *config_volumes, UINTN *numHandles)
+EFI_STATUS enumerate_cfg_parts(UINTN first_volume, UINTN *config_volumes,
+			       EFI_FILE_HANDLE *config_files, UINTN *numHandles)
 {
 	EFI_STATUS status;
 	UINTN rootCount = 0;
 
-	if (!config_volumes || !numHandles) {
+	if (!config_volumes || !config_files || !numHandles) {
 		ERROR(L"Invalid parameter in system partition enumeration.\n");
 		return EFI_INVALID_PARAMETER;
 	}
-	for (UINTN index = 0; index < volume_count && rootCount < *numHandles;
-	     index++) {
+	for (UINTN index = first_volume;
+	     index < volume_count && rootCount < *numHandles; index++) {
 		EFI_FILE_HANDLE fh = NULL;
 		if (!volumes[index].root) {
 			continue;
@@ -37,13 +38,10 @@ EFI_STATUS enumerate_cfg_parts(UINTN *config_volumes, UINTN *numHandles)
 				       EFI_FILE_MODE_READ);
 		if (status == EFI_SUCCESS) {
 			INFO(L"Config file found on volume %d.\n", index);
+			/* keep the file open, it is read right after */
 			config_volumes[rootCount] = index;
+			config_files[rootCount] = fh;
 			rootCount++;
-			status = close_cfg_file(volumes[index].root, fh);
-			if (EFI_ERROR(status)) {
-				ERROR(L"Could not close config file on partition %d.\n",
-				      index);
-			}
 		}
 	}
 	*numHandles = rootCount;
@@ -59,7 +57,33 @@ static VOID swap_uintn(UINTN *a, UINTN *b)
 	*b = tmp;
 }
 
-UINTN filter_cfg_parts(UINTN *config_volumes, UINTN numHandles)
+static VOID swap_file(EFI_FILE_HANDLE *a, EFI_FILE_HANDLE *b)
+{
+	EFI_FILE_HANDLE tmp;
+	tmp = *a;
+	*a = *b;
+	*b = tmp;
+}
+
+VOID close_cfg_parts(UINTN *config_volumes, EFI_FILE_HANDLE *config_files,
+		     UINTN numHandles)
+{
+	for (UINTN i = 0; i < numHandles; i++) {
+		VOLUME_DESC *v = &volumes[config_volumes[i]];
+
+		if (!config_files[i]) {
+			continue;
+		}
+		if (EFI_ERROR(close_cfg_file(v->root, config_files[i]))) {
+			ERROR(L"Could not close config file on partition %d.\n",
+			      config_volumes[i]);
+		}
+		config_files[i] = NULL;
+	}
+}
+
+UINTN filter_cfg_parts(UINTN *config_volumes, EFI_FILE_HANDLE *config_files,
+		       UINTN numHandles)
 {
 	BOOLEAN use_envs_on_bootmedium_only = FALSE;
 
@@ -85,11 +109,16 @@ UINTN filter_cfg_parts(UINTN *config_volumes, UINTN numHandles)
 
 		if (IsOnBootMedium(v->devpath)) {
 			swap_uintn(&config_volumes[j],
-				   &config_volumes[num_sorted++]);
+				   &config_volumes[num_sorted]);
+			swap_file(&config_files[j], &config_files[num_sorted]);
+			num_sorted++;
 		} else {
 			WARNING(L"Ignoring config on volume #%d\n", cvi);
 		}
 	}
+	/* the ignored files are not needed anymore */
+	close_cfg_parts(&config_volumes[num_sorted], &config_files[num_sorted],
+			numHandles - num_sorted);
 
 	return num_sorted;
 }
@@ -15,6 +15,27 @@
 #include <string.h>
 #include "env_api.h"
 #include "uservars.h"
+#include "lz4_block.h"
+#include "env_trace.h"
+
+/* The fields of a record follow its key without padding, so they are
+ * only accessed through memcpy(), which is safe for any alignment and
+ * compiles to plain loads where the CPU allows that. */
+static uint32_t load_u32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint64_t load_u64(const uint8_t *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
 
 void bgenv_map_uservar(uint8_t *udata, char **key, uint64_t *type, uint8_t **val,
 		       uint32_t *record_size, uint32_t *data_size)
@@ -34,10 +55,15 @@ void bgenv_map_uservar(uint8_t *udata, char **key, uint64_t *type, uint8_t **val
 	 * |      (reserved)      |  (free for user)  |    (reserved)   |
 	 *
 	 * internal flags and standard types are declared in ebgenv.h
+	 *
+	 * USERVAR_TYPE_COMPRESSED marks data of the form
+	 * | uint32_t raw size | LZ4 block |
+	 * which the getters expand transparently, see bgenv_uservar_read().
 	 */
 	char *var_key;
-	uint32_t *payload_size;
-	uint64_t *var_type;
+	uint32_t key_size;
+	uint32_t payload_size;
+	uint8_t *var_type;
 	uint8_t *data;
 
 	/* Get the key */
@@ -45,28 +71,29 @@ void bgenv_map_uservar(uint8_t *udata, char **key, uint64_t *type, uint8_t **val
 	if (key) {
 		*key = var_key;
 	}
+	key_size = strlen(var_key) + 1;
 
-	/* Get position of payload size */
-	payload_size = (uint32_t *)(var_key + strlen(var_key) + 1);
+	/* Get the payload size */
+	payload_size = load_u32(udata + key_size);
 
 	/* Calculate the record size (size of the whole thing) */
 	if (record_size) {
-		*record_size = *payload_size + strlen(var_key) + 1;
+		*record_size = payload_size + key_size;
 	}
 
-	/* Get position of the type field */
-	var_type = (uint64_t *)((uint8_t *)payload_size + sizeof(uint32_t));
+	/* Get the type field */
+	var_type = udata + key_size + sizeof(uint32_t);
 	if (type) {
-		*type = *var_type;
+		*type = load_u64(var_type);
 	}
 
 	/* Calculate the data size */
 	if (data_size) {
-		*data_size = *payload_size - sizeof(uint32_t) -
+		*data_size = payload_size - sizeof(uint32_t) -
 			     sizeof(uint64_t);
 	}
 	/* Get the pointer to the data field */
-	data = (uint8_t *)var_type + sizeof(uint64_t);
+	data = var_type + sizeof(uint64_t);
 	if (val) {
 		*val = data;
 	}
@@ -88,7 +115,7 @@ bool bgenv_validate_uservars(uint8_t *udata)
 		spaceleft -= key_len + 1;
 		udata += key_len + 1;
 
-		uint32_t payload_size = *(uint32_t *)udata;
+		uint32_t payload_size = load_u32(udata);
 
 		/* the payload must leave at least one byte free */
 		if (payload_size >= spaceleft) {
@@ -101,7 +128,8 @@ bool bgenv_validate_uservars(uint8_t *udata)
 	return true;
 }
 
-static uint8_t *bgenv_uservar_alloc(uint8_t *udata, uint32_t datalen)
+static uint8_t *bgenv_uservar_alloc(USERVAR_INDEX *idx, uint8_t *udata,
+				    uint32_t datalen)
 {
 	uint32_t spaceleft;
 
@@ -109,7 +137,7 @@ static uint8_t *bgenv_uservar_alloc(uint8_t *udata, uint32_t datalen)
 		errno = EINVAL;
 		return NULL;
 	}
-	spaceleft = bgenv_user_free(udata);
+	spaceleft = bgenv_user_free_indexed(idx, udata);
 	VERBOSE(stdout, "uservar_alloc: free: %lu requested: %lu \n",
 		(unsigned long)spaceleft, (unsigned long)datalen);
 
@@ -124,8 +152,8 @@ static uint8_t *bgenv_uservar_alloc(uint8_t *udata, uint32_t datalen)
 	return udata + (ENV_MEM_USERVARS - spaceleft);
 }
 
-static uint8_t *bgenv_uservar_realloc(uint8_t *udata, uint32_t new_rsize,
-				      uint8_t *p)
+static uint8_t *bgenv_uservar_realloc(USERVAR_INDEX *idx, uint8_t *udata,
+				      uint32_t new_rsize, uint8_t *p)
 {
 	uint32_t spaceleft;
 	uint32_t rsize;
@@ -139,9 +167,9 @@ static uint8_t *bgenv_uservar_realloc(uint8_t *udata, uint32_t new_rsize,
 	}
 
 	/* Delete variable and return pointer to end of whole user vars */
-	bgenv_del_uservar(udata, p);
+	bgenv_del_uservar_indexed(idx, udata, p);
 
-	spaceleft = bgenv_user_free(udata);
+	spaceleft = bgenv_user_free_indexed(idx, udata);
 
 	if (spaceleft < new_rsize - 1) {
 		errno = ENOMEM;
@@ -151,8 +179,8 @@ static uint8_t *bgenv_uservar_realloc(uint8_t *udata, uint32_t new_rsize,
 	return udata + ENV_MEM_USERVARS - spaceleft;
 }
 
-static void bgenv_serialize_uservar(uint8_t *p, char *key, uint64_t type,
-				    void *data, uint32_t record_size)
+void bgenv_serialize_uservar(uint8_t *p, char *key, uint64_t type,
+			     void *data, uint32_t record_size)
 {
 	uint32_t payload_size, data_size;
 
@@ -166,7 +194,7 @@ static void bgenv_serialize_uservar(uint8_t *p, char *key, uint64_t type,
 	p += sizeof(uint32_t);
 
 	/* store datatype */
-	*((uint64_t *)p) = type;
+	memcpy(p, &type, sizeof(uint64_t));
 	p += sizeof(uint64_t);
 
 	/* store data */
@@ -174,66 +202,94 @@ static void bgenv_serialize_uservar(uint8_t *p, char *key, uint64_t type,
 	memcpy(p, data, data_size);
 }
 
-int bgenv_get_uservar(uint8_t *udata, char *key, uint64_t *type, void *data,
-		      uint32_t maxlen)
+uint32_t bgenv_uservar_size(uint8_t *var)
+{
+	uint64_t type;
+	uint8_t *data;
+	uint32_t size, raw;
+
+	bgenv_map_uservar(var, NULL, &type, &data, NULL, &size);
+	if (!(type & USERVAR_TYPE_COMPRESSED) || size < sizeof(raw)) {
+		return size;
+	}
+	memcpy(&raw, data, sizeof(raw));
+	return raw;
+}
+
+int bgenv_uservar_read(uint8_t *var, void *buf, uint32_t maxlen)
+{
+	uint64_t type;
+	uint8_t *data, *tmp;
+	uint32_t size, raw;
+	int res;
+
+	bgenv_map_uservar(var, NULL, &type, &data, NULL, &size);
+	if (!(type & USERVAR_TYPE_COMPRESSED)) {
+		memcpy(buf, data, size > maxlen ? maxlen : size);
+		return 0;
+	}
+	if (size < sizeof(raw)) {
+		return -EINVAL;
+	}
+	memcpy(&raw, data, sizeof(raw));
+	data += sizeof(raw);
+	size -= sizeof(raw);
+	/* LZ4 cannot expand a block by more than a factor of 255 */
+	if (raw / 255 > size) {
+		return -EINVAL;
+	}
+	if (raw <= maxlen) {
+		return lz4_block_decompress(data, size, buf, raw);
+	}
+	tmp = malloc(raw);
+	if (!tmp) {
+		return -ENOMEM;
+	}
+	res = lz4_block_decompress(data, size, tmp, raw);
+	if (res == 0) {
+		memcpy(buf, tmp, maxlen);
+	}
+	free(tmp);
+	return res;
+}
+
+int bgenv_get_uservar_indexed(USERVAR_INDEX *idx, uint8_t *udata, char *key,
+			      uint64_t *type, void *data, uint32_t maxlen)
 {
-	uint8_t *uservar, *value;
-	char *lkey;
-	uint32_t dsize;
+	uint8_t *uservar;
 	uint64_t ltype;
+	int res;
 
-	uservar = bgenv_find_uservar(udata, key);
+	uservar = bgenv_find_uservar_indexed(idx, udata, key);
 
 	if (!uservar) {
 		return -ENOENT;
 	}
 
-	bgenv_map_uservar(uservar, &lkey, &ltype, &value, NULL, &dsize);
-
-	if (dsize > maxlen) {
-		dsize = maxlen;
+	res = bgenv_uservar_read(uservar, data, maxlen);
+	if (res) {
+		return res;
 	}
 
-	memcpy(data, value, dsize);
-
 	if (type) {
-		*type = ltype;
+		bgenv_map_uservar(uservar, NULL, &ltype, NULL, NULL, NULL);
+		*type = ltype & ~USERVAR_TYPE_COMPRESSED;
 	}
 
 	return 0;
 }
 
+int bgenv_get_uservar(uint8_t *udata, char *key, uint64_t *type, void *data,
+		      uint32_t maxlen)
+{
+	return bgenv_get_uservar_indexed(NULL, udata, key, type, data, maxlen);
+}
+
 int bgenv_set_uservar(uint8_t *udata, char *key, uint64_t type, void *data,
 	              uint32_t datalen)
 {
-	uint32_t total_size;
-	uint8_t *p;
-
-	total_size = datalen + sizeof(uint64_t) + sizeof(uint32_t) +
-		     strlen(key) + 1;
-
-	p = bgenv_find_uservar(udata, key);
-	if (p) {
-		if (type & USERVAR_TYPE_DELETED) {
-			bgenv_del_uservar(udata, p);
-			return 0;
-		}
-
-		p = bgenv_uservar_realloc(udata, total_size, p);
-	} else {
-		if ((type & USERVAR_TYPE_DELETED) == 0) {
-			p = bgenv_uservar_alloc(udata, total_size);
-		} else {
-			return 0;
-		}
-	}
-	if (!p) {
-		return -errno;
-	}
-
-	bgenv_serialize_uservar(p, key, type, data, total_size);
-
-	return 0;
+	return bgenv_set_uservar_indexed(NULL, udata, key, type, data,
+					 datalen);
 }
 
 uint8_t *bgenv_find_uservar(uint8_t *udata, char *key)
@@ -265,22 +321,7 @@ uint8_t *bgenv_next_uservar(uint8_t *udata)
 
 void bgenv_del_uservar(uint8_t *udata, uint8_t *var)
 {
-	uint32_t spaceleft;
-	uint32_t rsize;
-
-	/* Get the record size of the variable */
-	bgenv_map_uservar(var, NULL, NULL, NULL, &rsize, NULL);
-
-	/* Move variable out of place and close gap. */
-	spaceleft = bgenv_user_free(udata);
-
-	memmove(var,
-	        var + rsize,
-	        ENV_MEM_USERVARS - spaceleft - (var - udata) - rsize);
-
-	spaceleft = spaceleft + rsize;
-
-	memset(udata + ENV_MEM_USERVARS - spaceleft, 0, spaceleft);
+	bgenv_del_uservar_indexed(NULL, udata, var);
 }
 
 uint32_t bgenv_user_free(uint8_t *udata)
@@ -308,3 +349,622 @@ uint32_t bgenv_user_free(uint8_t *udata)
 
 	return spaceleft;
 }
+
+static uint32_t uservar_hash(const char *key)
+{
+	/* 32 bit FNV-1a */
+	uint32_t h = 2166136261U;
+
+	while (*key) {
+		h ^= (uint8_t)*key++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static void index_put(USERVAR_INDEX *idx, uint32_t offset, uint32_t hash)
+{
+	uint32_t mask = idx->size - 1;
+	uint32_t i = hash & mask;
+
+	while (idx->slots[i].offset) {
+		i = (i + 1) & mask;
+	}
+	idx->slots[i].offset = offset + 1;
+	idx->slots[i].hash = hash;
+	idx->count++;
+}
+
+static bool index_resize(USERVAR_INDEX *idx, uint32_t size)
+{
+	USERVAR_SLOT *old = idx->slots;
+	uint32_t old_size = idx->size;
+
+	idx->slots = calloc(size, sizeof(USERVAR_SLOT));
+	if (!idx->slots) {
+		idx->slots = old;
+		return false;
+	}
+	idx->size = size;
+	idx->count = 0;
+	for (uint32_t i = 0; i < old_size; i++) {
+		if (old[i].offset) {
+			index_put(idx, old[i].offset - 1, old[i].hash);
+		}
+	}
+	free(old);
+	return true;
+}
+
+/* Keep the load factor at or below one half. */
+static bool index_reserve(USERVAR_INDEX *idx, uint32_t count)
+{
+	uint32_t size = idx->size ? idx->size : 16;
+
+	while (size < 2 * count) {
+		size *= 2;
+	}
+	if (size == idx->size) {
+		return true;
+	}
+	return index_resize(idx, size);
+}
+
+static int64_t index_lookup(USERVAR_INDEX *idx, uint8_t *udata,
+			    const char *key, uint32_t hash)
+{
+	uint32_t mask = idx->size - 1;
+	uint32_t i = hash & mask;
+
+	while (idx->slots[i].offset) {
+		if (idx->slots[i].hash == hash &&
+		    strcmp((char *)udata + idx->slots[i].offset - 1, key) == 0) {
+			return i;
+		}
+		i = (i + 1) & mask;
+	}
+	return -1;
+}
+
+/* Remove a slot and close the gap in its probe sequence. */
+static void index_remove_slot(USERVAR_INDEX *idx, uint32_t i)
+{
+	uint32_t mask = idx->size - 1;
+	uint32_t j = i;
+
+	for (;;) {
+		uint32_t k;
+
+		j = (j + 1) & mask;
+		if (!idx->slots[j].offset) {
+			break;
+		}
+		k = idx->slots[j].hash & mask;
+		/* leave entries whose home lies cyclically in (i, j] */
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) {
+			continue;
+		}
+		idx->slots[i] = idx->slots[j];
+		i = j;
+	}
+	idx->slots[i].offset = 0;
+	idx->count--;
+}
+
+/* Make sure the index exists; on allocation failure the caller falls
+ * back to a linear scan. */
+static USERVAR_INDEX *index_get(USERVAR_INDEX *idx, uint8_t *udata)
+{
+	if (!idx) {
+		return NULL;
+	}
+	if (!idx->slots && !bgenv_uservar_index_build(idx, udata)) {
+		return NULL;
+	}
+	return idx;
+}
+
+bool bgenv_uservar_index_build(USERVAR_INDEX *idx, uint8_t *udata)
+{
+	uint32_t count = 0;
+	uint8_t *u;
+
+	bgenv_uservar_index_free(idx);
+
+	for (u = udata; *u; u = bgenv_next_uservar(u)) {
+		count++;
+	}
+	if (!index_reserve(idx, count + 1)) {
+		return false;
+	}
+	for (u = udata; *u; u = bgenv_next_uservar(u)) {
+		index_put(idx, u - udata, uservar_hash((char *)u));
+	}
+	idx->used = u - udata;
+	return true;
+}
+
+void bgenv_uservar_index_free(USERVAR_INDEX *idx)
+{
+	if (!idx) {
+		return;
+	}
+	free(idx->slots);
+	idx->slots = NULL;
+	idx->size = 0;
+	idx->count = 0;
+	idx->used = 0;
+}
+
+uint32_t bgenv_user_free_indexed(USERVAR_INDEX *idx, uint8_t *udata)
+{
+	if (!udata) {
+		return 0;
+	}
+	idx = index_get(idx, udata);
+	if (!idx) {
+		return bgenv_user_free(udata);
+	}
+	return ENV_MEM_USERVARS - idx->used;
+}
+
+uint8_t *bgenv_find_uservar_indexed(USERVAR_INDEX *idx, uint8_t *udata,
+				    char *key)
+{
+	int64_t i;
+
+	if (!udata) {
+		return NULL;
+	}
+	idx = index_get(idx, udata);
+	if (!idx) {
+		return bgenv_find_uservar(udata, key);
+	}
+	i = index_lookup(idx, udata, key, uservar_hash(key));
+	if (i < 0) {
+		return NULL;
+	}
+	return udata + idx->slots[i].offset - 1;
+}
+
+static bool compress_uservars;
+
+void bgenv_set_compress_uservars(bool enable)
+{
+	compress_uservars = enable;
+}
+
+bool bgenv_compress_uservars(void)
+{
+	return compress_uservars;
+}
+
+/* Returns the compressed form of data in a new buffer and its size in *len,
+ * or NULL if compression is off or the value is small, already compressed
+ * or does not shrink. */
+static uint8_t *uservar_pack(uint64_t type, const void *data, uint32_t *len)
+{
+	uint32_t raw = *len, size;
+	uint8_t *buf;
+
+	if (!compress_uservars || raw < USERVAR_COMPRESS_MIN_SIZE ||
+	    (type & (USERVAR_TYPE_DELETED | USERVAR_TYPE_COMPRESSED))) {
+		return NULL;
+	}
+	/* failing to allocate just stores the value as it is */
+	buf = malloc(raw);
+	if (!buf) {
+		return NULL;
+	}
+	size = lz4_block_compress(data, raw, buf + sizeof(raw),
+				  raw - sizeof(raw) - 1);
+	if (size == 0) {
+		free(buf);
+		return NULL;
+	}
+	memcpy(buf, &raw, sizeof(raw));
+	*len = size + sizeof(raw);
+	return buf;
+}
+
+static int uservar_store(USERVAR_INDEX *idx, uint8_t *udata, char *key,
+			 uint64_t type, void *data, uint32_t datalen)
+{
+	uint32_t total_size;
+	uint8_t *p;
+
+	idx = index_get(idx, udata);
+
+	total_size = datalen + sizeof(uint64_t) + sizeof(uint32_t) +
+		     strlen(key) + 1;
+
+	p = bgenv_find_uservar_indexed(idx, udata, key);
+	if (p) {
+		if (type & USERVAR_TYPE_DELETED) {
+			bgenv_del_uservar_indexed(idx, udata, p);
+			return 0;
+		}
+
+		uint32_t old_size;
+
+		/* The pointers cannot tell, a resized last record is moved
+		 * to where it was, but it has left the index by then. */
+		bgenv_map_uservar(p, NULL, NULL, NULL, &old_size, NULL);
+		if (old_size == total_size) {
+			/* same size, overwrite in place */
+			bgenv_serialize_uservar(p, key, type, data,
+						total_size);
+			return 0;
+		}
+		p = bgenv_uservar_realloc(idx, udata, total_size, p);
+	} else {
+		if ((type & USERVAR_TYPE_DELETED) == 0) {
+			p = bgenv_uservar_alloc(idx, udata, total_size);
+		} else {
+			return 0;
+		}
+	}
+	if (!p) {
+		return -errno;
+	}
+	if (idx && !index_reserve(idx, idx->count + 1)) {
+		bgenv_uservar_index_free(idx);
+		idx = NULL;
+	}
+
+	/* append behind the last record */
+	bgenv_serialize_uservar(p, key, type, data, total_size);
+	if (p + total_size < udata + ENV_MEM_USERVARS) {
+		p[total_size] = 0;
+	}
+	if (idx) {
+		index_put(idx, p - udata, uservar_hash(key));
+		idx->used += total_size;
+	}
+
+	return 0;
+}
+
+int bgenv_set_uservar_indexed(USERVAR_INDEX *idx, uint8_t *udata, char *key,
+			      uint64_t type, void *data, uint32_t datalen)
+{
+	BG_TRACE_SPAN span;
+	uint8_t *packed;
+	int res;
+
+	BG_TRACE_START(span, set_uservar, key);
+	packed = uservar_pack(type, data, &datalen);
+	if (packed) {
+		type |= USERVAR_TYPE_COMPRESSED;
+		data = packed;
+	}
+	res = uservar_store(idx, udata, key, type, data, datalen);
+	free(packed);
+	BG_TRACE_DONE(span, set_uservar, key, datalen, res);
+	return res;
+}
+
+void bgenv_del_uservar_indexed(USERVAR_INDEX *idx, uint8_t *udata,
+			       uint8_t *var)
+{
+	BG_TRACE_SPAN span;
+	uint32_t spaceleft;
+	uint32_t rsize;
+	uint32_t offset = var - udata;
+
+	/* the key is overwritten by the deletion */
+	BG_TRACE_START(span, del_uservar, NULL);
+	if (idx && idx->slots) {
+		int64_t i = index_lookup(idx, udata, (char *)var,
+					 uservar_hash((char *)var));
+		if (i >= 0) {
+			index_remove_slot(idx, i);
+		}
+	}
+
+	/* Get the record size of the variable */
+	bgenv_map_uservar(var, NULL, NULL, NULL, &rsize, NULL);
+
+	/* Move variable out of place and close gap. */
+	spaceleft = bgenv_user_free_indexed(idx, udata);
+
+	memmove(var,
+	        var + rsize,
+	        ENV_MEM_USERVARS - spaceleft - (var - udata) - rsize);
+
+	/* only the vacated tail needs clearing, the rest is zero already */
+	memset(udata + ENV_MEM_USERVARS - spaceleft - rsize, 0, rsize);
+
+	if (idx && idx->slots) {
+		idx->used -= rsize;
+		/* records behind the deleted one moved down */
+		for (uint32_t i = 0; i < idx->size; i++) {
+			if (idx->slots[i].offset > offset + 1) {
+				idx->slots[i].offset -= rsize;
+			}
+		}
+	}
+	BG_TRACE_DONE(span, del_uservar, NULL, rsize, 0);
+}
+
+/* Map each distinct key of a batch to the index of its last operation. */
+static int64_t batch_lookup(const uint32_t *tab, uint32_t mask,
+			    const ebgenv_batch_op_t *ops, const char *key,
+			    uint32_t *slot)
+{
+	uint32_t i = uservar_hash(key) & mask;
+
+	while (tab[i]) {
+		if (strcmp(ops[tab[i] - 1].key, key) == 0) {
+			*slot = i;
+			return tab[i] - 1;
+		}
+		i = (i + 1) & mask;
+	}
+	*slot = i;
+	return -1;
+}
+
+static int set_uservar_batch(USERVAR_INDEX *idx, uint8_t *udata,
+			     const ebgenv_batch_op_t *ops, uint32_t count)
+{
+	uint32_t size = 16;
+	uint32_t used = 0;
+	uint32_t slot;
+	uint32_t *tab;
+	int res = 0;
+	uint8_t *u, *w, *end;
+	struct {
+		uint8_t *data;
+		uint32_t len;
+	} *packed;
+
+	if (!udata || (count && !ops)) {
+		return -EINVAL;
+	}
+	if (count == 0) {
+		return 0;
+	}
+	for (uint32_t i = 0; i < count; i++) {
+		if (!ops[i].key || !*ops[i].key) {
+			return -EINVAL;
+		}
+	}
+
+	while (size < 2 * count) {
+		size *= 2;
+	}
+	tab = calloc(size, sizeof(uint32_t));
+	packed = calloc(count, sizeof(*packed));
+	if (!tab || !packed) {
+		free(tab);
+		free(packed);
+		return -ENOMEM;
+	}
+	/* later operations on the same key supersede earlier ones */
+	for (uint32_t i = 0; i < count; i++) {
+		batch_lookup(tab, size - 1, ops, ops[i].key, &slot);
+		tab[slot] = i + 1;
+	}
+	for (uint32_t i = 0; i < count; i++) {
+		packed[i].len = ops[i].datalen;
+		if (batch_lookup(tab, size - 1, ops, ops[i].key, &slot) ==
+		    (int64_t)i) {
+			packed[i].data = uservar_pack(ops[i].datatype,
+						      ops[i].value,
+						      &packed[i].len);
+		}
+	}
+
+	/* first pass: size of the result, leaving the area untouched if it
+	 * does not fit */
+	for (u = udata; *u; u = bgenv_next_uservar(u)) {
+		uint32_t rsize;
+
+		if (batch_lookup(tab, size - 1, ops, (char *)u, &slot) >= 0) {
+			continue;
+		}
+		bgenv_map_uservar(u, NULL, NULL, NULL, &rsize, NULL);
+		used += rsize;
+	}
+	end = u;
+	for (uint32_t i = 0; i < count; i++) {
+		if (batch_lookup(tab, size - 1, ops, ops[i].key, &slot) !=
+			    (int64_t)i ||
+		    (ops[i].datatype & USERVAR_TYPE_DELETED)) {
+			continue;
+		}
+		used += packed[i].len + sizeof(uint64_t) + sizeof(uint32_t) +
+			strlen(ops[i].key) + 1;
+	}
+	/* one byte is needed for the list terminator */
+	if (used >= ENV_MEM_USERVARS) {
+		res = -ENOMEM;
+		goto out;
+	}
+
+	/* second pass: compact the records that are kept ... */
+	for (u = w = udata; *u;) {
+		uint32_t rsize;
+
+		bgenv_map_uservar(u, NULL, NULL, NULL, &rsize, NULL);
+		if (batch_lookup(tab, size - 1, ops, (char *)u, &slot) < 0) {
+			if (w != u) {
+				memmove(w, u, rsize);
+			}
+			w += rsize;
+		}
+		u += rsize;
+	}
+	/* ... and append the new values in the order given */
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t rsize;
+
+		if (batch_lookup(tab, size - 1, ops, ops[i].key, &slot) !=
+			    (int64_t)i ||
+		    (ops[i].datatype & USERVAR_TYPE_DELETED)) {
+			continue;
+		}
+		rsize = packed[i].len + sizeof(uint64_t) + sizeof(uint32_t) +
+			strlen(ops[i].key) + 1;
+		if (packed[i].data) {
+			bgenv_serialize_uservar(w, ops[i].key,
+						ops[i].datatype |
+							USERVAR_TYPE_COMPRESSED,
+						packed[i].data, rsize);
+		} else {
+			bgenv_serialize_uservar(w, ops[i].key, ops[i].datatype,
+						ops[i].value, rsize);
+		}
+		w += rsize;
+	}
+	if (end > w) {
+		memset(w, 0, end - w);
+	} else {
+		*w = 0;
+	}
+
+	if (idx && idx->slots) {
+		bgenv_uservar_index_build(idx, udata);
+	}
+out:
+	for (uint32_t i = 0; i < count; i++) {
+		free(packed[i].data);
+	}
+	free(packed);
+	free(tab);
+	return res;
+}
+
+uint32_t bgenv_copy_uservars(uint8_t *dst, uint8_t *src, ebgenv_keep_cb_t keep,
+			     void *priv)
+{
+	uint8_t *end = src + ENV_MEM_USERVARS;
+	uint32_t used = 0;
+
+	while (src < end && *src) {
+		uint32_t rsize;
+
+		bgenv_map_uservar(src, NULL, NULL, NULL, &rsize, NULL);
+		if (!keep || keep((const char *)src, priv)) {
+			/* records only move towards the start */
+			if (dst + used != src) {
+				memmove(dst + used, src, rsize);
+			}
+			used += rsize;
+		}
+		src += rsize;
+	}
+	memset(dst + used, 0, ENV_MEM_USERVARS - used);
+	return used;
+}
+
+static int compare_keys(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+bool bgenv_front_code_uservars(uint8_t *udata, uint8_t *out, uint32_t max,
+			       uint32_t *len)
+{
+	uint8_t **vars;
+	uint32_t count = 0;
+	const char *prev = "";
+	bool result = true;
+
+	*len = 0;
+	for (uint8_t *var = udata; *var; var = bgenv_next_uservar(var)) {
+		count++;
+	}
+	if (count == 0) {
+		return max > 0;
+	}
+	vars = malloc(count * sizeof(uint8_t *));
+	if (!vars) {
+		return false;
+	}
+	count = 0;
+	for (uint8_t *var = udata; *var; var = bgenv_next_uservar(var)) {
+		vars[count++] = var;
+	}
+	qsort(vars, count, sizeof(uint8_t *), compare_keys);
+
+	for (uint32_t i = 0; i < count; i++) {
+		const char *key = (const char *)vars[i];
+		uint32_t shared = 0;
+		uint32_t rsize;
+
+		while (shared < UINT8_MAX && prev[shared] &&
+		       prev[shared] == key[shared]) {
+			shared++;
+		}
+		bgenv_map_uservar(vars[i], NULL, NULL, NULL, &rsize, NULL);
+		if (*len + 1 + rsize - shared >= max) {
+			result = false;
+			break;
+		}
+		/* the rest of the key is followed by the record fields */
+		out[(*len)++] = shared;
+		memcpy(out + *len, key + shared, rsize - shared);
+		*len += rsize - shared;
+		prev = key;
+	}
+	free(vars);
+	return result;
+}
+
+bool bgenv_expand_uservars(const uint8_t *in, uint32_t len, uint8_t *udata)
+{
+	const uint8_t *prev = udata;
+	uint32_t prev_len = 0;
+	uint32_t pos = 0;
+	uint32_t used = 0;
+
+	memset(udata, 0, ENV_MEM_USERVARS);
+	while (pos < len) {
+		uint32_t shared = in[pos++];
+		uint32_t suffix, key_len, payload_size;
+
+		if (shared > prev_len) {
+			return false;
+		}
+		suffix = strnlen((const char *)in + pos, len - pos);
+		key_len = shared + suffix;
+		if (key_len == 0 ||
+		    len - pos - suffix < 1 + sizeof(uint32_t) ||
+		    key_len + 1 + sizeof(uint32_t) >= ENV_MEM_USERVARS - used) {
+			return false;
+		}
+		payload_size = load_u32(in + pos + suffix + 1);
+		/* the area must keep its terminating zero byte */
+		if (payload_size > len - pos - suffix - 1 ||
+		    payload_size >= ENV_MEM_USERVARS - used - key_len - 1) {
+			return false;
+		}
+		memcpy(udata + used, prev, shared);
+		memcpy(udata + used + shared, in + pos, suffix + 1 + payload_size);
+		prev = udata + used;
+		prev_len = key_len;
+		used += key_len + 1 + payload_size;
+		pos += suffix + 1 + payload_size;
+	}
+	return true;
+}
+
+int bgenv_set_uservar_batch(USERVAR_INDEX *idx, uint8_t *udata,
+			    const ebgenv_batch_op_t *ops, uint32_t count)
+{
+	BG_TRACE_SPAN span;
+	uint64_t bytes = 0;
+	int res;
+
+	BG_TRACE_START(span, set_uservar_batch, NULL);
+	res = set_uservar_batch(idx, udata, ops, count);
+	if (BG_TRACE_ACTIVE(span) && ops) {
+		for (uint32_t i = 0; i < count; i++) {
+			bytes += ops[i].datalen;
+		}
+	}
+	BG_TRACE_DONE(span, set_uservar_batch, NULL, bytes, res);
+	return res;
+}
@@ -0,0 +1,26 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2026
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Continues the reflected 0xEDB88320 CRC over size bytes of buf, without
+ * the pre- and post-inversion of the CRC-32 checksum. */
+uint32_t crc32_raw(uint32_t crc, const void *buf, size_t size);
+
+/* Multiplies a and b modulo the CRC polynomial. */
+uint32_t crc32_multmodp(uint32_t a, uint32_t b);
+
+/* Returns x^(8 * len) modulo the CRC polynomial, the factor that advances
+ * an unconditioned CRC over len zero bytes. */
+uint32_t crc32_x8nmodp(size_t len);
@@ -32,6 +32,9 @@
 #define USERVAR_TYPE_STRING_ASCII      32
 #define USERVAR_TYPE_BOOL	       64
 #define USERVAR_TYPE_DELETED  (1ULL << 63)
+/* set by the library on values it stored LZ4 compressed, never returned by
+ * the getters */
+#define USERVAR_TYPE_COMPRESSED  (1ULL << 62)
 #define USERVAR_TYPE_DEFAULT		0
 
 #define USERVAR_STANDARD_TYPE_MASK ((1ULL << 32) - 1)
@@ -47,7 +50,94 @@ typedef struct {
 	ebgenv_opts_t opts;
 } ebgenv_t;
 
-typedef enum { EBG_OPT_PROBE_ALL_DEVICES, EBG_OPT_VERBOSE } ebg_opt_t;
+/* A user variable as stored in the environment. key, type and data point
+ * directly into the environment and stay valid until it is modified or
+ * closed. data is not aligned; numeric values must be read with memcpy().
+ * Values with USERVAR_TYPE_COMPRESSED in type are shown as stored; read
+ * them with ebg_env_get_ex() to get them expanded. */
+typedef struct {
+	const char *key;
+	uint64_t type;
+	const uint8_t *data;
+	uint32_t datalen;
+} ebgenv_uservar_view_t;
+
+/* Position of an iteration over the user variables, see
+ * ebg_env_uservar_next(). */
+typedef struct {
+	uint32_t offset;
+} ebgenv_uservar_iter_t;
+
+/* Keeps the probed config partitions and the environments read from them
+ * across handles, see ebg_ctx_new(). */
+typedef struct ebgenv_ctx ebgenv_ctx_t;
+
+/* A write of an environment in the background, see
+ * ebg_env_commit_async(). */
+typedef struct ebgenv_commit ebgenv_commit_t;
+
+typedef enum {
+	EBG_OPT_PROBE_ALL_DEVICES,
+	EBG_OPT_VERBOSE,
+	/* remember probed config partitions in /run/efibootguard */
+	EBG_OPT_PROBE_CACHE,
+	/* read only the headers of format 2 environment files when opening
+	 * and load their user variables on first use */
+	EBG_OPT_LAZY_USERVARS,
+	/* map format 1 environment files from the block device instead of
+	 * reading them into memory */
+	EBG_OPT_MAP_ENV,
+	/* find the config partitions and answer ebg_env_getglobalstate()
+	 * from the snapshot the boot loader published in an EFI variable */
+	EBG_OPT_ENV_SNAPSHOT,
+	/* share the mounts of config partitions with other processes under
+	 * /run/efibootguard/mnt, the last user unmounts them */
+	EBG_OPT_SHARED_MOUNTS,
+	/* mount config partitions without MS_SYNCHRONOUS and flush each
+	 * environment file once after writing it */
+	EBG_OPT_GROUP_SYNC,
+	/* with EBG_OPT_PROBE_ALL_DEVICES, stop probing after the first group
+	 * of disks that completes the config partitions, which leaves
+	 * duplicates on later disks undetected */
+	EBG_OPT_PROBE_STOP_EARLY,
+	/* store user variables of USERVAR_COMPRESS_MIN_SIZE bytes or more LZ4
+	 * compressed, which library versions without compression support
+	 * return as the raw compressed bytes */
+	EBG_OPT_COMPRESS_USERVARS
+} ebg_opt_t;
+
+/* A single operation of ebg_env_set_batch(). A datatype containing
+ * USERVAR_TYPE_DELETED deletes the variable, all other operations need a
+ * value. */
+typedef struct {
+	char *key;
+	uint64_t datatype;
+	uint8_t *value;
+	uint32_t datalen;
+} ebgenv_batch_op_t;
+
+/* A completed phase of the library, passed to the callback registered
+ * with ebg_set_trace_callback(). */
+typedef struct {
+	/* e.g. "read_env", "mount_partition" or "set_uservar", see
+	 * docs/API.md for all */
+	const char *event;
+	/* device path, mount point or variable key, NULL if there is none */
+	const char *detail;
+	/* bytes hashed, read, written or stored, for ped_device_probe_all
+	 * the number of block devices found */
+	uint64_t bytes;
+	uint64_t duration_ns;
+	/* 0 on success, negative on failure */
+	int result;
+} ebgenv_trace_event_t;
+
+typedef void (*ebgenv_trace_cb_t)(const ebgenv_trace_event_t *event,
+				  void *priv);
+
+/* Decides whether the user variable key is kept, see
+ * ebg_env_create_new_filtered(). */
+typedef bool (*ebgenv_keep_cb_t)(const char *key, void *priv);
 
 /**
  * @brief Set a global EBG option. Call before creating the ebg env.
@@ -65,6 +155,43 @@ int ebg_set_opt_bool(ebg_opt_t opt, bool value);
  */
 int ebg_get_opt_bool(ebg_opt_t opt, bool *value);
 
+/**
+ * @brief Limit the FAT partitions searched for environments. Call before
+ *        creating the ebg env. rules is a comma separated list of
+ *        type=GUID and uuid=GUID for the GPT partition type and unique
+ *        partition GUID, name=GLOB for the GPT partition name and
+ *        label=GLOB for the FAT volume label. A partition is only mounted
+ *        or read if it matches any rule. Names and labels are matched
+ *        ignoring case.
+ * @param rules the rules, NULL or "" to search all FAT partitions
+ * @return 0 on success, -EINVAL for malformed rules, -ENOMEM
+ */
+int ebg_set_probe_filter(const char *rules);
+
+/**
+ * @brief Set the order in which disks are probed with
+ *        EBG_OPT_PROBE_ALL_DEVICES. order is a comma separated list of
+ *        "boot" for the disk in the LoaderDevicePartUUID EFI variable,
+ *        "controller" for the other disks on its controller and "other"
+ *        for the rest. Probing stops after the first group of disks that
+ *        completes the config partitions, groups left out are never
+ *        probed. Without LoaderDevicePartUUID, all disks are probed.
+ * @param order the order, NULL or "" for "boot,controller,other"
+ * @return 0 on success, -EINVAL for an invalid order
+ */
+int ebg_set_probe_order(const char *order);
+
+/**
+ * @brief Register a callback that receives the duration of every traced
+ *        phase, such as probing devices, mounting partitions, reading and
+ *        writing environments, checksumming and modifying user variables.
+ *        Partitions are probed from several threads, so the callback must
+ *        be thread-safe. Without a callback, no timestamps are taken.
+ * @param cb callback to register, NULL to unregister
+ * @param priv passed to every call of cb
+ */
+void ebg_set_trace_callback(ebgenv_trace_cb_t cb, void *priv);
+
 /** @brief Tell the library to output information for the user.
  *  @param e A pointer to an ebgenv_t context.
  *  @param v A boolean to set verbosity.
@@ -81,12 +208,33 @@ void __attribute__((deprecated)) ebg_beverbose(ebgenv_t *e, bool v);
  */
 int ebg_env_create_new(ebgenv_t *e);
 
+/** @brief Like ebg_env_create_new(), but the new environment only takes
+ *         over the user variables of the latest one for which keep returns
+ *         true. They are copied in a single pass, which is cheaper than
+ *         deleting the others afterwards. If an update is already in
+ *         progress, its environment is opened unchanged.
+ *  @param e A pointer to an ebgenv_t context.
+ *  @param keep Called with the key of every user variable.
+ *  @param priv Passed to keep.
+ *  @return 0 on success, errno on failure
+ */
+int ebg_env_create_new_filtered(ebgenv_t *e, ebgenv_keep_cb_t keep,
+				void *priv);
+
 /** @brief Initialize environment library and open current environment.
  *  @param e A pointer to an ebgenv_t context.
  *  @return 0 on success, errno on failure
  */
 int ebg_env_open_current(ebgenv_t *e);
 
+/** @brief Initialize environment library and open current environment for
+ *         reading only. Setting variables fails with -EROFS and closing
+ *         the environment never writes it back.
+ *  @param e A pointer to an ebgenv_t context.
+ *  @return 0 on success, errno on failure
+ */
+int ebg_env_open_current_ro(ebgenv_t *e);
+
 /** @brief Retrieve variable content
  *  @param e A pointer to an ebgenv_t context.
  *  @param key an enum constant to specify the variable
@@ -98,6 +246,37 @@ int ebg_env_open_current(ebgenv_t *e);
  */
 int ebg_env_get(ebgenv_t *e, char *key, char* buffer);
 
+/** @brief Retrieve a string variable without copying it
+ *  @param e A pointer to an ebgenv_t context.
+ *  @param key kernelfile, kernelparams or the name of a user variable of
+ *         type USERVAR_TYPE_STRING_ASCII
+ *  @param value Receives the string. It stays valid until the variable is
+ *         modified or the environment is closed. Compressed strings are
+ *         expanded into a buffer of the handle that the next call reuses.
+ *  @return 0 on success, -errno on failure
+ */
+int ebg_env_get_str(ebgenv_t *e, char *key, const char **value);
+
+/** @brief Retrieve a numeric variable without formatting it as text
+ *  @param e A pointer to an ebgenv_t context.
+ *  @param key a numeric built-in variable such as ustate, or the name of a
+ *         user variable of an unsigned integer type
+ *  @param value Receives the value.
+ *  @return 0 on success, -ERANGE if the value does not fit, -errno on
+ *          failure
+ */
+int ebg_env_get_u32(ebgenv_t *e, char *key, uint32_t *value);
+
+/** @brief Store a numeric variable without parsing text
+ *  @param e A pointer to an ebgenv_t context.
+ *  @param key a numeric built-in variable such as ustate, or the name of a
+ *         user variable, which is stored as USERVAR_TYPE_UINT32
+ *  @param value The value to store.
+ *  @return 0 on success, -ERANGE if the value does not fit into the
+ *          built-in variable, -errno on failure
+ */
+int ebg_env_set_u32(ebgenv_t *e, char *key, uint32_t value);
+
 /** @brief Store new content into variable
  *  @param e A pointer to an ebgenv_t context.
  *  @param key name of the environment variable to set
@@ -118,6 +297,33 @@ int ebg_env_set(ebgenv_t *e, char *key, char *value);
 int ebg_env_set_ex(ebgenv_t *e, char *key, uint64_t datatype, uint8_t *value,
 		   uint32_t datalen);
 
+/** @brief Store a frequently changing user variable
+ *  @param e A pointer to an ebgenv_t context.
+ *  @param key name of the user variable to set
+ *  @param datatype user specific or predefined datatype of the value
+ *  @param value arbitrary data to be stored into the variable
+ *  @param datalen length of the data to be stored into the variable
+ *  @return 0 on success, -errno on failure
+ *  @note If the environment file has an update log (see bg_setenv
+ *        --log-slots), the update is written immediately as a single
+ *        sector appended to the log. Otherwise, or if the log is full, it
+ *        behaves like ebg_env_set_ex().
+ */
+int ebg_env_set_logged(ebgenv_t *e, char *key, uint64_t datatype,
+		       uint8_t *value, uint32_t datalen);
+
+/** @brief Store or delete several variables at once
+ *  @param e A pointer to an ebgenv_t context.
+ *  @param ops array of operations, applied in order
+ *  @param count number of operations
+ *  @return 0 on success, -errno on failure. On failure, the environment
+ *          is left unchanged.
+ *  @note All user variables are rewritten in a single pass over the
+ *        user variable area, independent of the number of operations.
+ */
+int ebg_env_set_batch(ebgenv_t *e, const ebgenv_batch_op_t *ops,
+		      uint32_t count);
+
 /** @brief Get content of user variable
  *  @param e A pointer to an ebgenv_t context.
  *  @param key name of the environment variable to retrieve
@@ -129,6 +335,23 @@ int ebg_env_set_ex(ebgenv_t *e, char *key, uint64_t datatype, uint8_t *value,
 int ebg_env_get_ex(ebgenv_t *e, char *key, uint64_t *datatype, uint8_t *buffer,
 		   uint32_t maxlen);
 
+/** @brief Start an iteration over all user variables
+ *  @param e A pointer to an ebgenv_t context.
+ *  @param it Iterator to initialize.
+ */
+void ebg_env_uservar_iter_init(ebgenv_t *e, ebgenv_uservar_iter_t *it);
+
+/** @brief Get the next user variable without copying it
+ *  @param e A pointer to an ebgenv_t context.
+ *  @param it Iterator initialized by ebg_env_uservar_iter_init().
+ *  @param view Receives the variable. Modifying the environment
+ *         invalidates both the view and the iterator.
+ *  @return 1 if view was filled, 0 after the last variable,
+ *          -errno on failure
+ */
+int ebg_env_uservar_next(ebgenv_t *e, ebgenv_uservar_iter_t *it,
+			 ebgenv_uservar_view_t *view);
+
 /** @brief Get available space for user variables
  *  @param e A pointer to an ebgenv_t context.
  *  @return Free space in bytes
@@ -143,7 +366,8 @@ uint16_t ebg_env_getglobalstate(ebgenv_t *e);
 
 /** @brief Set global ustate value, accounting for all environments
  *         if state is set to zero and updating only current environment if
- *         state is set to a non-zero value.
+ *         state is set to a non-zero value. The environments are
+ *         written concurrently, the one with the highest revision last.
  *  @param e A pointer to an ebgenv_t context.
  *  @param ustate The global ustate value to set.
  *  @return errno on error, 0 if okay.
@@ -151,12 +375,36 @@ uint16_t ebg_env_getglobalstate(ebgenv_t *e);
 int ebg_env_setglobalstate(ebgenv_t *e, uint16_t ustate);
 
 /** @brief Closes environment and finalize library. Changes are written before
- *         closing.
+ *         closing, an unmodified environment is not written.
  *  @param e A pointer to an ebgenv_t context.
  *  @return 0 on success, errno on failure
  */
 int ebg_env_close(ebgenv_t *e);
 
+/** @brief Writes the changes of an environment on a worker thread, as
+ *         ebg_env_close() would, but keeps the environment open. Other
+ *         calls of the library wait while the write is in progress, and
+ *         ebg_env_close() waits for it to finish.
+ *  @param e A pointer to an ebgenv_t context.
+ *  @param commit Receives the commit, which must be released with
+ *         ebg_commit_finish().
+ *  @return 0 on success, errno on failure
+ */
+int ebg_env_commit_async(ebgenv_t *e, ebgenv_commit_t **commit);
+
+/** @brief Returns a file descriptor that becomes readable once the commit
+ *         is done, for use with poll() or an event loop.
+ *  @param commit A commit started by ebg_env_commit_async().
+ *  @return The file descriptor, owned by the commit.
+ */
+int ebg_commit_fd(const ebgenv_commit_t *commit);
+
+/** @brief Waits for a commit to complete and releases it.
+ *  @param commit A commit started by ebg_env_commit_async().
+ *  @return 0 if the environment was written or unchanged, errno on failure
+ */
+int ebg_commit_finish(ebgenv_commit_t *commit);
+
 /** @brief Register a variable that will be deleted on finalize
  *  @param e A pointer to an ebgenv_t context.
  *  @param key A string containing the variable key
@@ -169,3 +417,27 @@ int ebg_env_register_gc_var(ebgenv_t *e, char *key);
  *  @return 0 on success, errno on failure
  */
 int ebg_env_finalize_update(ebgenv_t *e);
+
+/** @brief Probe the config partitions and read all environments once, and
+ *         keep them until the context is freed. While a context exists,
+ *         opening and closing environments neither probes nor reads the
+ *         partitions again; ebg_env_close() only writes back changes.
+ *         All functions of the library may be called from several threads,
+ *         environments are accessed under an internal lock.
+ *  @param ctx Receives the new context.
+ *  @return 0 on success, errno on failure
+ */
+int ebg_ctx_new(ebgenv_ctx_t **ctx);
+
+/** @brief Reread all environments from the probed config partitions, for
+ *         example after another program modified them.
+ *  @param ctx A context returned by ebg_ctx_new().
+ *  @return 0 on success, EBUSY if an environment is open, errno on failure
+ */
+int ebg_ctx_refresh(ebgenv_ctx_t *ctx);
+
+/** @brief Release a context. The library is finalized once the last
+ *         context is freed and no environment is open.
+ *  @param ctx A context returned by ebg_ctx_new().
+ */
+void ebg_ctx_free(ebgenv_ctx_t *ctx);
@@ -44,8 +44,13 @@
 #include <string.h>
 #include <stdlib.h>
 
+/* overridable to point the probe at a fake device tree */
+#ifndef SYSBLOCKDIR
 #define SYSBLOCKDIR "/sys/block"
+#endif
+#ifndef DEVDIR
 #define DEVDIR "/dev"
+#endif
 
 #define LB_SIZE 512
 
@@ -119,6 +124,17 @@ typedef enum {
 typedef struct _PedPartition {
 	EbgFileSystemType fs_type;
 	uint16_t num;
+	/* first sector of the partition on the device */
+	uint64_t start_LBA;
+	/* from the GPT entry, in on-disk byte order, name in ASCII */
+	bool gpt;
+	uint8_t type_GUID[16];
+	uint8_t partition_GUID[16];
+	char name[37];
+	/* FAT volume label, empty if there is none, valid once the boot
+	 * sector was read */
+	bool label_read;
+	char label[12];
 	struct _PedPartition *next;
 } PedPartition;
 
@@ -134,9 +150,17 @@ typedef struct _PedDisk {
 } PedDisk;
 
 void ped_device_probe_all(char *rootdev);
+/* Reaching the end of the list frees it, like ped_device_free_all(). */
 PedDevice *ped_device_get_next(const PedDevice *dev);
+/* Frees the probed devices without walking to the end of the list. */
+void ped_device_free_all(void);
 PedDisk *ped_disk_new(const PedDevice *dev);
 PedPartition *ped_disk_next_partition(const PedDisk *pd,
 				      const PedPartition *part);
 
+/* Reads the partition table of a disk image file. The returned device is
+ * not part of the probed list and is released with ped_device_close(). */
+PedDevice *ped_device_open_image(const char *path);
+void ped_device_close(PedDevice *dev);
+
 void ebgpart_beverbose(bool v);
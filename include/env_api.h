@@ -30,6 +30,7 @@
 #include "config.h"
 #include "envdata.h"
 #include "ebgenv.h"
+#include "uservars.h"
 #include <uchar.h>
 
 #ifdef DEBUG
@@ -42,6 +43,16 @@
 
 #define DEFAULT_TIMEOUT_SEC 30
 
+/* largest format 2 file, including padding and a log of maximum size */
+#define ENV_V2_MAX_SIZE                                                        \
+	(sizeof(BG_ENVHDR_V2) + ENV_MEM_USERVARS +                             \
+	 (ENV_LOG_MAX_SLOTS + 2) * ENV_LOG_SLOT_SIZE)
+
+/* largest environment file in any of the formats */
+#define ENV_FILE_MAX_SIZE                                                      \
+	(ENV_V2_MAX_SIZE > sizeof(BG_ENVDATA) ? ENV_V2_MAX_SIZE                \
+					       : sizeof(BG_ENVDATA))
+
 extern ebgenv_opts_t ebgenv_opts;
 
 #define VERBOSE(o, ...)                                                        \
@@ -57,15 +68,62 @@ typedef enum {
 	EBGENV_UNKNOWN
 } EBGENVKEY;
 
+/* State of the update log of a format 2 file, see BG_ENVLOG_HDR. */
+typedef struct {
+	/* number of record slots, 0 if the file has no log */
+	uint16_t slots;
+	uint32_t generation;
+	/* file offset of the first slot */
+	uint32_t offset;
+	/* records of the current generation in the file */
+	uint16_t used;
+	uint32_t seq;
+} ENV_LOG;
+
 typedef struct {
 	char *devpath;
 	char *mountpoint;
 	bool not_mounted;
+	/* devpath is a disk image file, which is never mounted, and the
+	 * partition starts offset bytes into it */
+	bool image;
+	uint64_t offset;
+	/* ENV_FORMAT_* of the file as read, 0 if there was none */
+	int env_format;
+	ENV_LOG log;
+	/* mountpoint is a mount shared with other processes, which
+	 * mount_users keeps a reference to, see shared_mounts_enable() */
+	bool shared_mount;
+	int mount_users;
 } CONFIG_PART;
 
+/* granularity in which modified environments are written back */
+#define ENV_BLOCK_SIZE 512
+#define ENV_NUM_BLOCKS                                                         \
+	((sizeof(BG_ENVDATA) + ENV_BLOCK_SIZE - 1) / ENV_BLOCK_SIZE)
+#define ENV_DIRTY_MAP_SIZE ((ENV_NUM_BLOCKS + 7) / 8)
+
+typedef struct {
+	uint32_t offset;
+	uint32_t len;
+} ENV_RANGE;
+
 typedef struct {
 	void *desc;
 	BG_ENVDATA *data;
+	/* bitmap of the blocks of data modified through this handle */
+	uint8_t dirty[ENV_DIRTY_MAP_SIZE];
+	/* modifications are refused and nothing is ever written back */
+	bool read_only;
+	/* 8-bit strings for environments outside the config partitions */
+	char str[2][ENV_STRING_LENGTH];
+	/* built on first uservar access */
+	USERVAR_INDEX uservar_index;
+	/* expanded copy of the compressed string last returned by
+	 * bgenv_get_str() */
+	char *unpacked;
+	/* asynchronous commits of this handle that are not done yet */
+	unsigned int commits;
 } BGENV;
 
 typedef struct gc_item {
@@ -79,21 +137,53 @@ extern char *str16to8(char *buffer, const char16_t *src);
 extern char16_t *str8to16(char16_t *buffer, const char *src);
 
 extern uint32_t bgenv_crc32(uint32_t, const void *, size_t);
+extern uint32_t bgenv_crc32_patch(uint32_t crc, size_t size, size_t offset,
+				  const void *old, const void *new, size_t len);
+extern uint32_t bgenv_crc32_zeros(uint32_t crc, size_t len);
 
 extern bool bgenv_init(void);
 extern void bgenv_finalize(void);
+extern bool bgenv_init_image(const char *image);
+extern bool bgenv_reload(void);
+extern bool bgenv_initialized(void);
+extern bool bgenv_load(BGENV *env);
+extern void bgenv_set_lazy_uservars(bool enable);
+extern bool bgenv_lazy_uservars(void);
+extern void bgenv_set_map_env(bool enable);
+extern bool bgenv_map_env(void);
 extern BGENV *bgenv_open_by_index(uint32_t index);
 extern BGENV *bgenv_open_oldest(void);
 extern BGENV *bgenv_open_latest(void);
 extern bool bgenv_write(BGENV *env);
 extern BG_ENVDATA *bgenv_read(BGENV *env);
 extern void bgenv_close(BGENV *env);
+extern void bgenv_mark_dirty(BGENV *env, size_t offset, size_t len);
+extern void bgenv_patch(BGENV *env, size_t offset, const void *src,
+			size_t len);
+extern void bgenv_update_crc(BGENV *env);
+extern bool bgenv_is_dirty(BGENV *env);
 
 extern BGENV *bgenv_create_new(void);
+extern BGENV *bgenv_create_from_latest(ebgenv_keep_cb_t keep, void *priv);
 extern int bgenv_get(BGENV *env, char *key, uint64_t *type, void *data,
 		     uint32_t maxlen);
 extern int bgenv_set(BGENV *env, char *key, uint64_t type, void *data,
 		     uint32_t datalen);
+extern int bgenv_get_str(BGENV *env, char *key, const char **value);
+extern int bgenv_get_u32(BGENV *env, char *key, uint32_t *value);
+extern int bgenv_set_u32(BGENV *env, char *key, uint32_t value);
+extern int bgenv_set_batch(BGENV *env, const ebgenv_batch_op_t *ops,
+			   uint32_t count);
 extern uint8_t *bgenv_find_uservar(uint8_t *userdata, char *key);
+extern int bgenv_counter_index(const char *key);
+extern const char *bgenv_counter_name(unsigned int index);
 
 extern bool validate_envdata(BG_ENVDATA *data);
+extern bool bgenv_decode(BG_ENVDATA *data, const void *buf, size_t len,
+			 int *format, ENV_LOG *log);
+extern size_t bgenv_encode_v2(const BG_ENVDATA *data, int format, void *buf,
+			      ENV_LOG *log);
+extern bool bgenv_set_format(BGENV *env, int format);
+extern bool bgenv_set_log_slots(BGENV *env, unsigned int slots);
+extern int bgenv_set_logged(BGENV *env, char *key, uint64_t type, void *data,
+			    uint32_t datalen);
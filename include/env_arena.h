@@ -0,0 +1,35 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2026
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+/* bytes requested from malloc at a time, larger objects get their own */
+#define BG_ARENA_CHUNK_SIZE 4096
+
+typedef struct bg_arena_chunk BG_ARENA_CHUNK;
+
+/*
+ * Bump allocator for objects that share a lifetime, like the results of a
+ * probe run. Everything allocated from an arena is freed at once by
+ * bgenv_arena_release(), so error paths need no cleanup of their own. An
+ * arena is not thread-safe. A zeroed BG_ARENA is empty.
+ */
+typedef struct {
+	BG_ARENA_CHUNK *chunks;
+} BG_ARENA;
+
+/* Returns size zeroed bytes suitably aligned for any type, NULL if out of
+ * memory. */
+void *bgenv_arena_alloc(BG_ARENA *arena, size_t size);
+char *bgenv_arena_strdup(BG_ARENA *arena, const char *s);
+void bgenv_arena_release(BG_ARENA *arena);
@@ -16,5 +16,11 @@
 
 #include <stdbool.h>
 #include "env_api.h"
+#include "env_arena.h"
+
+/* Holds the devpath strings of the probed config partitions, released by
+ * bgenv_finalize() or a failed probe. */
+extern BG_ARENA probe_arena;
 
 bool probe_config_partitions(CONFIG_PART *cfgpart, bool search_all_devices);
+bool probe_image_config_partitions(CONFIG_PART *cfgpart, const char *image);
@@ -15,8 +15,117 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 #include "env_api.h"
 
+#define ENV_SHARED_MOUNT_DIR "/run/efibootguard/mnt"
+
+/* Returns the mount point of the file system on the block device devpath,
+ * or NULL if it is not mounted. */
 char *get_mountpoint(char *devpath);
+
+/*
+ * Keeps a snapshot of the mount table, which get_mountpoint() answers from
+ * until mount_table_release(). Meant to bracket a probe of many partitions,
+ * which then reads the mount table only once.
+ */
+void mount_table_load(void);
+void mount_table_release(void);
+
+/*
+ * Looks up a partition that was not mounted when probed in the mount table
+ * again, after a raw write found it busy. If it is mounted now, records its
+ * mount point and clears not_mounted, so that it is accessed through the
+ * mount from then on. Returns false if it is not mounted.
+ */
+bool adopt_mountpoint(CONFIG_PART *cfgpart);
 bool mount_partition(CONFIG_PART *cfgpart);
 void unmount_partition(CONFIG_PART *cfgpart);
+
+/*
+ * With shared mounts enabled, mount_partition() mounts a config partition
+ * block device to ENV_SHARED_MOUNT_DIR/MAJOR:MINOR, or reuses the mount
+ * another process made there. The users of a mount are counted with shared
+ * flock() locks, which the kernel drops for processes that die, and the
+ * last one to call unmount_partition() unmounts it. get_mountpoint() does
+ * not report these mounts, as they may go away at any time.
+ */
+void shared_mounts_enable(bool enable);
+bool shared_mounts_enabled(void);
+
+/*
+ * With group sync enabled, mount_partition() mounts without MS_SYNCHRONOUS,
+ * and writers of a mounted environment file call sync_mounted_file() once
+ * after writing all of it, instead of flushing every single block write.
+ */
+void group_sync_enable(bool enable);
+bool group_sync_enabled(void);
+
+/* Makes the file fd and the metadata of its file system durable with
+ * fsync() and syncfs(). Returns 0 or a negative errno value. */
+int sync_mounted_file(int fd);
+
+/*
+ * Reads or rewrites the environment file of an unmounted partition directly
+ * through its block device, without mounting it. With buf == NULL, only
+ * checks that the file exists. A read accepts files of up to len bytes and
+ * returns the file size, a write requires the file to be exactly len bytes
+ * and returns 0. Returns -ENOENT if the file does not exist, -EBUSY for a
+ * write to a partition that is mounted now, or another negative errno value
+ * if raw access is not possible and the caller should fall back to mounting
+ * the partition.
+ */
+int raw_config_file_access(CONFIG_PART *cfgpart, void *buf, size_t len,
+			   bool write);
+
+/*
+ * Reads the first len bytes of the environment file of an unmounted
+ * partition, or the whole file if it is shorter, and returns the number of
+ * bytes read. Returns the same errors as a read with
+ * raw_config_file_access().
+ */
+int raw_config_file_read_head(CONFIG_PART *cfgpart, void *buf, size_t len);
+
+/* A private, copy-on-write mapping of an environment file */
+typedef struct {
+	void *base;
+	size_t len;
+	/* the file contents within the mapping, NULL if unused */
+	void *data;
+	/* true once backed by anonymous memory, see env_mapping_detach() */
+	bool detached;
+} ENV_MAPPING;
+
+/*
+ * Maps the environment file of an unmounted partition privately from its
+ * block device. The file must be exactly len bytes and occupy consecutive
+ * clusters. Modifications of the mapping stay private to the process.
+ * Returns 0, -EFBIG for a file of a different size, -ENOTSUP for a
+ * fragmented one, or the same errors as raw_config_file_access().
+ */
+int raw_config_file_map(CONFIG_PART *cfgpart, size_t len, ENV_MAPPING *map);
+
+/*
+ * Replaces the mapping with anonymous memory of the same contents and
+ * address, after which the file may be rewritten through any path.
+ * Returns 0 or a negative errno value.
+ */
+int env_mapping_detach(ENV_MAPPING *map);
+void env_mapping_release(ENV_MAPPING *map);
+
+/*
+ * Rewrites only the given byte ranges of the len byte environment file of
+ * an unmounted partition in place, taking them from the same offsets in
+ * buf. Returns the same values as a write with raw_config_file_access().
+ */
+int raw_config_file_write_ranges(CONFIG_PART *cfgpart, const void *buf,
+				 size_t len, const ENV_RANGE *ranges,
+				 size_t count);
+
+/*
+ * Overwrites len bytes at offset of the file_len byte environment file of
+ * an unmounted partition in place. Returns the same values as a write with
+ * raw_config_file_access().
+ */
+int raw_config_file_write_at(CONFIG_PART *cfgpart, size_t file_len,
+			     uint32_t offset, const void *buf, size_t len);
@@ -0,0 +1,28 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2026
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+/* Upper bound of worker threads used for probing and reading partitions.
+ * Defining it to 1 runs everything in the calling thread. */
+#ifndef ENV_MAX_PROBE_THREADS
+#define ENV_MAX_PROBE_THREADS 8
+#endif
+
+/*
+ * Calls fn(index, ctx) for every index in [0, count), distributed over a
+ * small pool of threads. Returns once all calls have completed. Callers
+ * store results per index, so the outcome does not depend on scheduling.
+ */
+void bgenv_parallel_for(size_t count, void (*fn)(size_t index, void *ctx),
+			void *ctx);
@@ -0,0 +1,43 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2026
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "env_api.h"
+
+#define ENV_PROBE_CACHE_FILE "/run/efibootguard/probe.cache"
+
+/*
+ * The probe cache remembers which FAT partitions were seen by
+ * probe_config_partitions() and which of them hold an environment file.
+ * It is only trusted as long as the kernel has not emitted any uevent since
+ * it was written, and every cached partition still has the same device
+ * number, FAT volume serial and presence of the environment file. A cache
+ * written with other probe filter rules or disk order is ignored.
+ */
+void probe_cache_enable(bool enable);
+bool probe_cache_enabled(void);
+
+/* Reads the current uevent sequence number. */
+bool probe_cache_seqnum(uint64_t *seqnum);
+
+/* Fills cfgpart from the cache file if it is still valid. The devpaths are
+ * allocated from probe_arena. */
+bool probe_cache_load(const char *path, CONFIG_PART *cfgpart,
+		      bool search_all_devices);
+
+/* Records the outcome of a full scan started at uevent seqnum. */
+void probe_cache_store(const char *path, uint64_t seqnum,
+		       const CONFIG_PART *parts, const bool *found,
+		       size_t count, bool search_all_devices);
@@ -0,0 +1,74 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2026
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "ebgpart.h"
+
+/*
+ * The probe filter limits which FAT partitions are searched for an
+ * environment file. Its rules are a comma separated list of
+ *   type=GUID    GPT partition type
+ *   uuid=GUID    GPT unique partition GUID
+ *   name=GLOB    GPT partition name
+ *   label=GLOB   FAT volume label of the boot sector
+ * and a partition is searched if it matches any of them. Names and labels
+ * are matched like file names in the shell, ignoring case.
+ */
+
+/*
+ * When probing all devices, disks are probed in tiers: the boot disk known
+ * from the LoaderDevicePartUUID EFI variable, the other disks of its
+ * controller and all other disks. All tiers in the order are probed, so that
+ * a duplicate config partition on a later one is still detected, unless
+ * probing is set to stop after the first tier that completes the config
+ * partitions. Tiers left out of the order are never probed. Without a
+ * known boot disk, all disks form a single tier.
+ */
+enum probe_tier {
+	PROBE_TIER_BOOT,
+	PROBE_TIER_CONTROLLER,
+	PROBE_TIER_OTHER,
+	PROBE_TIERS
+};
+
+/* Sets the order from a comma separated list of "boot", "controller" and
+ * "other", NULL or "" restores the default of all three in this order.
+ * Returns 0 or -EINVAL. */
+int probe_order_set(const char *order);
+
+/* Copies the order to order and returns the number of tiers in it. */
+size_t probe_order_get(enum probe_tier order[PROBE_TIERS]);
+
+/* Stops probing after the first tier that completes the config partitions,
+ * which leaves duplicates on later tiers undetected. */
+void probe_order_stop_early(bool enable);
+bool probe_order_stops_early(void);
+
+/* The order as a short string, such as "bco" for the default, followed by
+ * '+' if probing stops early. */
+const char *probe_order_id(void);
+
+/* Replaces the rules, NULL or "" searches all FAT partitions again.
+ * Returns 0, -EINVAL for malformed rules or -ENOMEM. */
+int probe_filter_set(const char *rules);
+
+/* Identifies the rules in effect, 0 if there are none. */
+uint32_t probe_filter_id(void);
+
+/* Checks part against the rules. The volume label of a partition found
+ * without reading its boot sector is read from offset in devpath first, if
+ * a rule needs it. */
+bool probe_filter_match(PedPartition *part, const char *devpath,
+			off_t offset);
@@ -0,0 +1,45 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2026
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include "env_api.h"
+
+#define EBG_VENDOR_GUID "da047dff-e83e-41ca-a69c-a34c54fb438e"
+#define ENV_SNAPSHOT_FILE                                                      \
+	"/sys/firmware/efi/efivars/" ENV_SNAPSHOT_VAR_NAME "-" EBG_VENDOR_GUID
+#define ENV_SNAPSHOT_STALE_FILE "/run/efibootguard/snapshot.stale"
+
+/*
+ * The environment snapshot of the boot loader, see BG_ENVSNAPSHOT, locates
+ * the config partitions through /dev/disk/by-partuuid and answers state
+ * queries without reading them. Its values only hold until the first
+ * environment is written in this boot, which leaves a marker in /run.
+ */
+void env_snapshot_enable(bool enable);
+bool env_snapshot_enabled(void);
+
+/* Reads the snapshot from the efivarfs file path. Returns false if there is
+ * none or it does not cover all config partitions. */
+bool env_snapshot_read(const char *path, BG_ENVSNAPSHOT *snapshot);
+
+/* Fills cfgpart with the partitions of the snapshot, if all of them exist.
+ * The devpaths are allocated from probe_arena. */
+bool env_snapshot_load(const char *path, CONFIG_PART *cfgpart);
+
+/* Returns the global update state of the snapshot like
+ * ebg_env_getglobalstate(), or -1 if the snapshot is not usable or stale. */
+int env_snapshot_globalstate(const char *path, const char *stale_path);
+
+/* Marks the snapshot values as stale, must precede any write of a config
+ * partition. */
+void env_snapshot_invalidate(const char *path, const char *stale_path);
@@ -0,0 +1,69 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2026
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include "ebgenv.h"
+
+/*
+ * Every traced phase has a USDT probe pair in the provider libebgenv,
+ * <event>_start(detail) and <event>_done(detail, bytes, result), when built
+ * with --enable-usdt. The probes are single no-ops until a tracer attaches,
+ * e.g.
+ *   bpftrace -e 'usdt:./bg_setenv:libebgenv:read_env_done { ... }'
+ */
+#ifdef USDT_TRACING
+#include <sys/sdt.h>
+#define BG_USDT_START(event, detail)                                           \
+	DTRACE_PROBE1(libebgenv, event##_start, detail)
+#define BG_USDT_DONE(event, detail, bytes, result)                             \
+	DTRACE_PROBE3(libebgenv, event##_done, detail, bytes, result)
+#else
+#define BG_USDT_START(event, detail)                                           \
+	do {                                                                   \
+	} while (0)
+#define BG_USDT_DONE(event, detail, bytes, result)                             \
+	do {                                                                   \
+	} while (0)
+#endif
+
+typedef struct {
+	/* 0 if no callback was registered when the phase started */
+	uint64_t start_ns;
+} BG_TRACE_SPAN;
+
+extern ebgenv_trace_cb_t bgenv_trace_cb;
+
+extern uint64_t bgenv_trace_now(void);
+extern void bgenv_trace_emit(const char *event, const char *detail,
+			     uint64_t bytes, int result, uint64_t start_ns);
+
+#define BG_TRACE_START(span, event, detail)                                    \
+	do {                                                                   \
+		BG_USDT_START(event, detail);                                  \
+		(span).start_ns =                                              \
+		    __atomic_load_n(&bgenv_trace_cb, __ATOMIC_RELAXED)         \
+			? bgenv_trace_now()                                    \
+			: 0;                                                   \
+	} while (0)
+
+/* true if the callback wants the phase, for byte counts that cost time */
+#define BG_TRACE_ACTIVE(span) ((span).start_ns != 0)
+
+#define BG_TRACE_DONE(span, event, detail, bytes, result)                      \
+	do {                                                                   \
+		BG_USDT_DONE(event, detail, bytes, result);                    \
+		if ((span).start_ns) {                                         \
+			bgenv_trace_emit(#event, detail, bytes, result,        \
+					 (span).start_ns);                     \
+		}                                                              \
+	} while (0)
@@ -14,10 +14,13 @@
 
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define ENV_FILE_NAME L"BGENV.DAT"
 #define FAT_ENV_FILENAME "BGENV.DAT"
+/* FAT_ENV_FILENAME in 8.3 directory entry form */
+#define FAT_ENV_SHORT_NAME "BGENV   DAT"
 #define ENV_STRING_LENGTH 255
 
 #define USTATE_OK 0
@@ -40,9 +43,155 @@ struct _BG_ENVDATA {
 	uint8_t ustate;
 	uint16_t watchdog_timeout_sec;
 	uint32_t revision;
+#if ENV_NUM_COUNTERS > 0
+	/* named by ENV_COUNTER_NAMES, see ENV_COUNTERS_OFFSET */
+	uint32_t counters[ENV_NUM_COUNTERS];
+#endif
 	uint8_t userdata[ENV_MEM_USERVARS];
 	uint32_t crc32;
 };
 #pragma pack(pop)
 
 typedef struct _BG_ENVDATA BG_ENVDATA;
+
+/*
+ * The ENV_NUM_COUNTERS counters configured with --with-env-counters
+ * immediately precede userdata. The boot loader increments all of them
+ * whenever it boots an environment, saturating at UINT32_MAX, and
+ * userspace resets them.
+ */
+#define ENV_COUNTERS_SIZE (ENV_NUM_COUNTERS * sizeof(uint32_t))
+#define ENV_COUNTERS_OFFSET (offsetof(BG_ENVDATA, userdata) - ENV_COUNTERS_SIZE)
+
+/*
+ * Compact file format: the fixed fields with a checksum of their own,
+ * followed by only the userdata_len bytes of userdata that are in use.
+ * The fields that change on every update or boot come first, so that they
+ * share the first sector with the header checksum. A file of
+ * sizeof(BG_ENVDATA) bytes without the magic is in the original format 1.
+ *
+ * Format 3 has the same layout, but the uservar records are sorted by key
+ * and each one is stored with the length of the prefix its key shares with
+ * the previous key, in one byte, followed by the rest of the key and the
+ * record fields. Namespaced keys then only take the bytes that differ.
+ */
+#define ENV_FORMAT_V1 1
+#define ENV_FORMAT_V2 2
+#define ENV_FORMAT_V3 3
+
+#define ENV_FORMAT_COMPACT(format)                                             \
+	((format) == ENV_FORMAT_V2 || (format) == ENV_FORMAT_V3)
+
+#define ENV_V2_MAGIC 0x32564745 /* "EGV2" */
+
+#pragma pack(push)
+#pragma pack(1)
+struct _BG_ENVHDR_V2 {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t header_size;
+	/* of the header_size - ENV_V2_CRC_START bytes following this field */
+	uint32_t crc32;
+	uint8_t in_progress;
+	uint8_t ustate;
+	uint16_t watchdog_timeout_sec;
+	uint32_t revision;
+	uint32_t userdata_len;
+	uint32_t userdata_crc32;
+#if ENV_NUM_COUNTERS > 0
+	uint32_t counters[ENV_NUM_COUNTERS];
+#endif
+	uint16_t kernelfile[ENV_STRING_LENGTH];
+	uint16_t kernelparams[ENV_STRING_LENGTH];
+};
+#pragma pack(pop)
+
+typedef struct _BG_ENVHDR_V2 BG_ENVHDR_V2;
+
+#define ENV_V2_CRC_START (offsetof(BG_ENVHDR_V2, crc32) + sizeof(uint32_t))
+/* the leading part of the header that changes on state transitions and
+ * boots, it includes the counters */
+#define ENV_V2_HOT_SIZE offsetof(BG_ENVHDR_V2, kernelfile)
+#define ENV_V2_COUNTERS_OFFSET (ENV_V2_HOT_SIZE - ENV_COUNTERS_SIZE)
+
+/*
+ * A format 2 file may be followed by a log of user variable updates: the
+ * uservar area is padded to ENV_LOG_SLOT_SIZE, followed by one slot with
+ * the BG_ENVLOG_HDR and the given number of record slots. Each slot holds
+ * one BG_ENVLOG_REC and the uservar record it stores, in the encoding of
+ * the uservar area. Records of the current generation are appended
+ * starting at slot generation % slots with ascending sequence numbers,
+ * and are replayed onto the uservars in that order. Rewriting the file
+ * starts a new generation with an empty log.
+ */
+#define ENV_LOG_SLOT_SIZE 512
+#define ENV_LOG_MAX_SLOTS 64
+#define ENV_LOG_HDR_MAGIC 0x484c4745 /* "EGLH" */
+#define ENV_LOG_REC_MAGIC 0x524c4745 /* "EGLR" */
+
+#pragma pack(push)
+#pragma pack(1)
+struct _BG_ENVLOG_HDR {
+	uint32_t magic;
+	/* of the remaining fields */
+	uint32_t crc32;
+	uint16_t slot_size;
+	uint16_t slots;
+	uint32_t generation;
+};
+
+struct _BG_ENVLOG_REC {
+	uint32_t magic;
+	/* of the remaining fields and the len bytes of the uservar record */
+	uint32_t crc32;
+	uint32_t generation;
+	uint32_t seq;
+	uint32_t len;
+};
+#pragma pack(pop)
+
+typedef struct _BG_ENVLOG_HDR BG_ENVLOG_HDR;
+typedef struct _BG_ENVLOG_REC BG_ENVLOG_REC;
+
+#define ENV_LOG_CRC_START (offsetof(BG_ENVLOG_HDR, crc32) + sizeof(uint32_t))
+#define ENV_LOG_REC_CRC_START                                                  \
+	(offsetof(BG_ENVLOG_REC, crc32) + sizeof(uint32_t))
+#define ENV_LOG_REC_MAX_LEN (ENV_LOG_SLOT_SIZE - sizeof(BG_ENVLOG_REC))
+
+/*
+ * The boot loader publishes the state of the config partitions it chose
+ * the environment from in the volatile EFI variable ENV_SNAPSHOT_VAR of its
+ * vendor GUID, so that userspace can query it without probing. Entries of
+ * partitions without a valid environment are zero apart from part_uuid.
+ */
+#define ENV_SNAPSHOT_VAR L"EbgEnvSnapshot"
+#define ENV_SNAPSHOT_VAR_NAME "EbgEnvSnapshot"
+#define ENV_SNAPSHOT_MAGIC 0x53564745 /* "EGVS" */
+#define ENV_SNAPSHOT_VERSION 1
+#define ENV_SNAPSHOT_UUID_LEN 36
+
+#pragma pack(push)
+#pragma pack(1)
+struct _BG_ENVSNAPSHOT_PART {
+	/* unique GPT partition GUID in lower case, not terminated */
+	uint8_t part_uuid[ENV_SNAPSHOT_UUID_LEN];
+	uint8_t valid;
+	uint8_t in_progress;
+	uint8_t ustate;
+	uint8_t reserved;
+	uint32_t revision;
+};
+
+struct _BG_ENVSNAPSHOT {
+	uint32_t magic;
+	uint16_t version;
+	/* number of config partitions found */
+	uint8_t count;
+	/* index of the partition booted from */
+	uint8_t booted;
+	struct _BG_ENVSNAPSHOT_PART part[ENV_NUM_CONFIG_PARTS];
+};
+#pragma pack(pop)
+
+typedef struct _BG_ENVSNAPSHOT_PART BG_ENVSNAPSHOT_PART;
+typedef struct _BG_ENVSNAPSHOT BG_ENVSNAPSHOT;
@@ -0,0 +1,64 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2026
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#pragma once
+
+#include <efi.h>
+#include <efilib.h>
+
+#define FAT_DISK_CACHE_SIZE 4096
+
+/*
+ * Geometry of a FAT volume accessed through EFI_DISK_IO_PROTOCOL, plus a
+ * small window of the FAT so that following a cluster chain does not cost
+ * one disk request per cluster.
+ */
+typedef struct _FAT_DISK {
+	EFI_DISK_IO *disk_io;
+	EFI_BLOCK_IO *block_io;
+	UINT32 media_id;
+	UINT32 fat_bits;
+	UINT32 cluster_size;
+	UINT64 fat_start;
+	UINT64 fat_size;
+	UINT64 root_dir_start;
+	UINT32 root_dir_entries;
+	UINT32 root_cluster;
+	UINT64 data_start;
+	UINT32 total_clusters;
+	UINT64 cache_start;
+	UINTN cache_len;
+	UINT8 cache[FAT_DISK_CACHE_SIZE];
+} FAT_DISK;
+
+typedef struct _FAT_DISK_FILE {
+	UINT32 first_cluster;
+	UINT32 size;
+} FAT_DISK_FILE;
+
+/* Opens the FAT volume whose partition has exactly the given device path. */
+EFI_STATUS fat_disk_open(EFI_DEVICE_PATH *devpath, FAT_DISK *disk);
+
+/* Looks up a file by its 11 character, space padded 8.3 directory entry
+ * name in the root directory. Returns EFI_NOT_FOUND if it does not exist. */
+EFI_STATUS fat_disk_find_root_file(FAT_DISK *disk, const CHAR8 *name,
+				   FAT_DISK_FILE *file);
+
+/* Reads or overwrites len bytes of the file at offset, which must lie
+ * within the file. The file is never resized, so no FAT or directory
+ * metadata is modified. */
+EFI_STATUS fat_disk_file_access(FAT_DISK *disk, const FAT_DISK_FILE *file,
+				UINT64 offset, VOID *buffer, UINTN len,
+				BOOLEAN write);
+
+/* Opens the volume and looks up the environment file in one go. */
+EFI_STATUS fat_disk_open_cfg(EFI_DEVICE_PATH *devpath, FAT_DISK *disk,
+			     FAT_DISK_FILE *file);
@@ -14,12 +14,43 @@
 
 #pragma once
 
+#include "envdata.h"
+
 typedef struct _BG_INTERFACE_PARAMS {
 	CHAR16 *loader_device_part_uuid;
 } BG_INTERFACE_PARAMS;
 
+#define BG_TIMING_MAX_PHASES 8
+
+typedef struct _BG_TIMING_PHASE {
+	const CHAR16 *name;
+	UINT64 usec;
+} BG_TIMING_PHASE;
+
+/*
+ * Boot phase timestamps of one loader stage. All times are in microseconds
+ * since the counter was reset by the firmware, 0 if no usable counter is
+ * available on this architecture.
+ */
+typedef struct _BG_TIMING {
+	const CHAR16 *phases_var;
+	UINT64 init_usec;
+	UINT64 last_usec;
+	UINTN count;
+	BG_TIMING_PHASE phase[BG_TIMING_MAX_PHASES];
+} BG_TIMING;
+
 // systemd bootloader interface vendor id
 extern EFI_GUID vendor_guid;
+// vendor id of EFI Boot Guard's own variables
+extern EFI_GUID ebg_vendor_guid;
 
 EFI_STATUS set_bg_interface_vars(const BG_INTERFACE_PARAMS *params);
 CHAR16 *disk_get_part_uuid(EFI_HANDLE *handle);
+CHAR16 *devpath_get_part_uuid(EFI_DEVICE_PATH *dp);
+EFI_STATUS set_bg_env_snapshot(const BG_ENVSNAPSHOT *snapshot);
+
+UINT64 time_usec(VOID);
+VOID timing_init(BG_TIMING *timing, const CHAR16 *phases_var);
+VOID timing_phase(BG_TIMING *timing, const CHAR16 *name);
+EFI_STATUS set_bg_timing_vars(const BG_TIMING *timing);
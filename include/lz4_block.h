@@ -0,0 +1,25 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2026
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/* Compresses len bytes of src into at most cap bytes of dst, in the LZ4
+ * block format. Returns the compressed size, or 0 if it does not fit. */
+uint32_t lz4_block_compress(const uint8_t *src, uint32_t len, uint8_t *dst,
+			    uint32_t cap);
+
+/* Decompresses the LZ4 block of len bytes at src, which must expand to
+ * exactly dstlen bytes. Returns 0 on success or -EINVAL if the block is
+ * malformed. */
+int lz4_block_decompress(const uint8_t *src, uint32_t len, uint8_t *dst,
+			 uint32_t dstlen);
@@ -17,5 +17,9 @@
 #include <efi.h>
 #include <efilib.h>
 
+/*
+ * Returns the first structure of type in table, or one with Raw == NULL if
+ * there is none. The structures are indexed by type on the first call.
+ */
 SMBIOS_STRUCTURE_POINTER smbios_find_struct(SMBIOS_STRUCTURE_TABLE *table,
 					    UINT16 type);
@@ -31,5 +31,13 @@
 #define read_cfg_file(file, len, buffer)				\
 	(file)->Read((file), (len), (buffer))
 
-EFI_STATUS enumerate_cfg_parts(UINTN *config_volumes, UINTN *maxHandles);
-UINTN filter_cfg_parts(UINTN *config_volumes, UINTN maxHandles);
+/* Finds the volumes from first_volume on holding a config file and leaves
+ * the files open for reading. They have to be closed with
+ * close_cfg_parts(). */
+EFI_STATUS enumerate_cfg_parts(UINTN first_volume, UINTN *config_volumes,
+			       EFI_FILE_HANDLE *config_files,
+			       UINTN *maxHandles);
+UINTN filter_cfg_parts(UINTN *config_volumes, EFI_FILE_HANDLE *config_files,
+		       UINTN maxHandles);
+VOID close_cfg_parts(UINTN *config_volumes, EFI_FILE_HANDLE *config_files,
+		     UINTN numHandles);
@@ -16,6 +16,36 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include "ebgenv.h"
+
+/* With compression enabled, values of at least this many bytes are stored
+ * LZ4 compressed when that makes them smaller, see USERVAR_TYPE_COMPRESSED. */
+#ifndef USERVAR_COMPRESS_MIN_SIZE
+#define USERVAR_COMPRESS_MIN_SIZE 256
+#endif
+
+/* Off by default, since versions of the library before compression return
+ * the compressed bytes as the value. Reading works either way. */
+void bgenv_set_compress_uservars(bool enable);
+bool bgenv_compress_uservars(void);
+
+/* In-memory open-addressing index over the records of one uservar area.
+ * Slots hold record offset + 1 (0 marks a free slot) and the key hash;
+ * used caches the number of bytes occupied by records.
+ * The index is optional: a zeroed USERVAR_INDEX is simply built on first
+ * use and every function accepts NULL to operate without one.
+ */
+typedef struct {
+	uint32_t offset;
+	uint32_t hash;
+} USERVAR_SLOT;
+
+typedef struct {
+	USERVAR_SLOT *slots;
+	uint32_t size;
+	uint32_t count;
+	uint32_t used;
+} USERVAR_INDEX;
 
 void bgenv_map_uservar(uint8_t *udata, char **key, uint64_t *type,
 		       uint8_t **val, uint32_t *record_size,
@@ -28,8 +58,48 @@ int bgenv_set_uservar(uint8_t *udata, char *key, uint64_t type, void *data,
 
 uint8_t *bgenv_find_uservar(uint8_t *udata, char *key);
 uint8_t *bgenv_next_uservar(uint8_t *udata);
+/* Stores a record of record_size bytes at p, in the uservar encoding. */
+void bgenv_serialize_uservar(uint8_t *p, char *key, uint64_t type,
+			     void *data, uint32_t record_size);
+
+/* Size of the value of the record var as set by the caller, which differs
+ * from the stored size for compressed values. */
+uint32_t bgenv_uservar_size(uint8_t *var);
+/* Copies at most maxlen bytes of the value of var to buf, decompressing it
+ * if needed. Returns 0 or -errno. */
+int bgenv_uservar_read(uint8_t *var, void *buf, uint32_t maxlen);
 
 void bgenv_del_uservar(uint8_t *udata, uint8_t *var);
 uint32_t bgenv_user_free(uint8_t *udata);
 
 bool bgenv_validate_uservars(uint8_t *udata);
+
+/* Copies the records of src that keep accepts, all of them if keep is NULL,
+ * to dst in one pass and zeroes the rest of dst. dst may be src to filter
+ * an area in place, which invalidates its index. Returns the bytes in use. */
+uint32_t bgenv_copy_uservars(uint8_t *dst, uint8_t *src, ebgenv_keep_cb_t keep,
+			     void *priv);
+
+/* Stores the records of udata front-coded in key order into out, as in
+ * format 3 files, and sets len to the coded size. Fails if that would take
+ * max bytes or more. */
+bool bgenv_front_code_uservars(uint8_t *udata, uint8_t *out, uint32_t max,
+			       uint32_t *len);
+/* Restores the uservar area udata from len front-coded bytes. Returns
+ * false if they are malformed. */
+bool bgenv_expand_uservars(const uint8_t *in, uint32_t len, uint8_t *udata);
+
+bool bgenv_uservar_index_build(USERVAR_INDEX *idx, uint8_t *udata);
+void bgenv_uservar_index_free(USERVAR_INDEX *idx);
+int bgenv_get_uservar_indexed(USERVAR_INDEX *idx, uint8_t *udata, char *key,
+			      uint64_t *type, void *data, uint32_t maxlen);
+uint8_t *bgenv_find_uservar_indexed(USERVAR_INDEX *idx, uint8_t *udata,
+				    char *key);
+int bgenv_set_uservar_indexed(USERVAR_INDEX *idx, uint8_t *udata, char *key,
+			      uint64_t type, void *data, uint32_t datalen);
+void bgenv_del_uservar_indexed(USERVAR_INDEX *idx, uint8_t *udata,
+			       uint8_t *var);
+uint32_t bgenv_user_free_indexed(USERVAR_INDEX *idx, uint8_t *udata);
+
+int bgenv_set_uservar_batch(USERVAR_INDEX *idx, uint8_t *udata,
+			    const ebgenv_batch_op_t *ops, uint32_t count);
@@ -24,6 +24,7 @@ typedef struct _VOLUME_DESC {
 	EFI_DEVICE_PATH *devpath;
 	CHAR16 *fslabel;
 	CHAR16 *fscustomlabel;
+	BOOLEAN labels_read;
 	EFI_FILE_HANDLE root;
 } VOLUME_DESC;
 
@@ -33,22 +34,69 @@ extern UINTN volume_count;
 typedef enum { DOSFSLABEL, CUSTOMLABEL, NOLABEL } LABELMODE;
 
 VOID __attribute__((noreturn)) error_exit(CHAR16 *message, EFI_STATUS status);
+UINT32 crc32_update(UINT32 crc, const VOID *buffer, UINTN len);
+/* Updates the CRC of a size byte buffer after len bytes at offset changed
+ * from old to new, at a cost that does not depend on size. */
+UINT32 crc32_patch(UINT32 crc, UINTN size, UINTN offset, const VOID *old,
+		   const VOID *new, UINTN len);
 CHAR16 *get_volume_label(EFI_FILE_HANDLE fh);
+CHAR16 *volume_label(VOLUME_DESC *v);
+CHAR16 *volume_custom_label(VOLUME_DESC *v);
+/* Opens the volumes on the boot medium only. The returned array has room for
+ * all volumes, get_deferred_volumes() appends the remaining ones to it and
+ * returns how many it added. */
 EFI_STATUS get_volumes(VOLUME_DESC **volumes, UINTN *count);
+UINTN get_deferred_volumes(VOLUME_DESC *volumes, UINTN *count);
 EFI_STATUS close_volumes(VOLUME_DESC *volumes, UINTN count);
 EFI_DEVICE_PATH *FileDevicePathFromConfig(EFI_HANDLE device,
 					  CHAR16 *payloadpath);
+EFI_STATUS PreloadFile(EFI_DEVICE_PATH *dp, EFI_PHYSICAL_ADDRESS *buffer,
+		       UINTN *size);
 CHAR16 *GetBootMediumPath(CHAR16 *input);
+VOID SetBootMedium(EFI_DEVICE_PATH *dp);
 BOOLEAN IsOnBootMedium(EFI_DEVICE_PATH *dp);
 
 typedef EFI_STATUS (*WATCHDOG_PROBE)(EFI_PCI_IO *, UINT16, UINT16, UINTN);
+
+typedef struct _WATCHDOG_PCI_ID {
+	UINT16 vendor_id;
+	UINT16 device_id;
+} WATCHDOG_PCI_ID;
+
+/*
+ * Entry of the .wdfuncs section. PCI drivers are only called for devices
+ * listed in their zero-terminated pci_ids table, drivers without a table
+ * are called once, with a NULL pci_io, before any PCI device is probed.
+ * The alignment keeps the entries densely packed so that the section can
+ * be walked as an array.
+ */
+typedef struct _WATCHDOG_DRIVER {
+	WATCHDOG_PROBE probe;
+	const WATCHDOG_PCI_ID *pci_ids;
+} __attribute__((aligned(2 * sizeof(VOID *)))) WATCHDOG_DRIVER;
+
 #define _CONCAT(prefix, func) prefix  ## func
 #define CONCAT(prefix, func) _CONCAT(prefix, func)
-#define WATCHDOG_REGISTER(_func)                                               \
-	__attribute__((used, section(".wdfuncs"))) static WATCHDOG_PROBE       \
-		CONCAT(wdfuncs##_, _func) = (WATCHDOG_PROBE)_func;
+#define WATCHDOG_REGISTER_PCI(_func, _pci_ids)                                 \
+	__attribute__((used, section(".wdfuncs"))) static WATCHDOG_DRIVER      \
+		CONCAT(wdfuncs##_, _func) = {(WATCHDOG_PROBE)_func, _pci_ids};
+#define WATCHDOG_REGISTER(_func) WATCHDOG_REGISTER_PCI(_func, NULL)
 
 VOID PrintC(const UINT8 color, const CHAR16 *fmt, ...);
+
+#if defined(BUFFERED_LOG)
+/* size of the boot log ring buffer in characters */
+#ifndef LOG_BUFFER_SIZE
+#define LOG_BUFFER_SIZE 8192
+#endif
+
+VOID LogPrint(const CHAR16 *fmt, ...);
+VOID FlushLog(VOID);
+#else
+static inline VOID FlushLog(VOID)
+{
+}
+#endif
 #define ERROR(fmt, ...)                                                        \
 	do {                                                                   \
 		PrintC(EFI_LIGHTRED, L"ERROR: ");                              \
@@ -61,9 +109,13 @@ VOID PrintC(const UINT8 color, const CHAR16 *fmt, ...);
 		PrintC(EFI_LIGHTGRAY, fmt, ##__VA_ARGS__);                     \
 	} while (0)
 
-#if !defined(SILENT_BOOT)
+#if defined(SILENT_BOOT)
+#define INFO(fmt, ...) do { } while (0)
+#elif defined(BUFFERED_LOG)
+/* informational messages only go to the log, not to the console */
 #define INFO(fmt, ...)                                                         \
-	PrintC(EFI_LIGHTGRAY, fmt, ##__VA_ARGS__)
+	LogPrint(fmt, ##__VA_ARGS__)
 #else
-#define INFO(fmt, ...) do { } while (0)
+#define INFO(fmt, ...)                                                         \
+	PrintC(EFI_LIGHTGRAY, fmt, ##__VA_ARGS__)
 #endif
@@ -45,6 +45,25 @@ typedef struct {
 	UINT32 SizeDtStruct;
 } FDT_HEADER;
 
+#define DTB_INDEX_MAGIC	0x49425444	/* "DTBI" */
+
+/*
+ * Layout of the .dtbidx section written by bg_gen_unified_kernel: a table
+ * of the root compatible strings of all .dtb-* sections, sorted by their
+ * FNV-1a hash, followed by the strings. NameOffset is relative to the
+ * start of the section.
+ */
+typedef struct {
+	UINT32 Magic;
+	UINT32 Count;
+} DTB_INDEX;
+
+typedef struct {
+	UINT32 Hash;
+	UINT32 NameOffset;
+	UINT32 VirtualAddress;
+} DTB_INDEX_ENTRY;
+
 #ifndef EfiDtbTableGuid
 static EFI_GUID gEfiDtbTableGuid = {
 	0xb1b621d5, 0xf19c, 0x41a5,
@@ -154,6 +173,60 @@ BOOLEAN match_fdt(const VOID *fdt, const CHAR8 *compatible)
 	return strcmpa(compatible, alt_compatible) == 0;
 }
 
+static UINT32 fnv1a_hash(const CHAR8 *str)
+{
+	UINT32 hash = 2166136261U;
+
+	while (*str) {
+		hash = (hash ^ *str++) * 16777619U;
+	}
+	return hash;
+}
+
+const VOID *find_indexed_fdt(const VOID *image_base, const VOID *index,
+			     UINTN index_size, const CHAR8 *compatible)
+{
+	const DTB_INDEX *header = index;
+	const DTB_INDEX_ENTRY *entries =
+		(const DTB_INDEX_ENTRY *) (header + 1);
+	UINT32 hash, lo, hi, mid;
+
+	if (!compatible) {
+		error_exit(L"Found .dtb section but no firmware DTB",
+			   EFI_NOT_FOUND);
+	}
+	if (index_size < sizeof(*header) || header->Magic != DTB_INDEX_MAGIC ||
+	    header->Count > (index_size - sizeof(*header)) /
+			    sizeof(*entries)) {
+		error_exit(L"Invalid .dtbidx section", EFI_INVALID_PARAMETER);
+	}
+
+	/* find the first entry of the hash, then compare the strings */
+	hash = fnv1a_hash(compatible);
+	lo = 0;
+	hi = header->Count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (entries[mid].Hash < hash) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	for (; lo < header->Count && entries[lo].Hash == hash; lo++) {
+		if (entries[lo].NameOffset >= index_size) {
+			error_exit(L"Invalid .dtbidx section",
+				   EFI_INVALID_PARAMETER);
+		}
+		if (strcmpa(compatible, (const CHAR8 *) index +
+					entries[lo].NameOffset) == 0) {
+			return (const UINT8 *) image_base +
+			       entries[lo].VirtualAddress;
+		}
+	}
+	return NULL;
+}
+
 static EFI_STATUS clone_fdt(const VOID *fdt, UINTN size,
 			    EFI_PHYSICAL_ADDRESS *fdt_buffer)
 {
@@ -166,8 +239,8 @@ static EFI_STATUS clone_fdt(const VOID *fdt, UINTN size,
 		error(L"Error allocating device tree buffer", status);
 		return status;
 	}
-	CopyMem((VOID *)(uintptr_t)*fdt_buffer, (VOID*)fdt,
-		BE32_TO_HOST(header->TotalSize));
+	mem_copy((VOID *)(uintptr_t)*fdt_buffer, fdt,
+		 BE32_TO_HOST(header->TotalSize));
 	return EFI_SUCCESS;
 }
 
@@ -27,9 +27,17 @@ typedef struct {
 	 {0xac, 0x74, 0xca, 0x55, 0x52, 0x31, 0xcc, 0x68}}
 
 typedef struct {
-	EFI_LOAD_FILE_PROTOCOL protocol;
 	const void *addr;
 	UINTN size;
+	BOOLEAN compressed;
+} INITRD_PART;
+
+/* The parts are handed out one after the other, as a single initrd. */
+typedef struct {
+	EFI_LOAD_FILE_PROTOCOL protocol;
+	INITRD_PART parts[MAX_INITRD_PARTS];
+	UINTN count;
+	UINTN size;
 } INITRD_LOADER;
 
 #ifndef EfiLoadFile2Protocol
@@ -80,20 +88,57 @@ static EFIAPI EFI_STATUS initrd_load_file(EFI_LOAD_FILE_PROTOCOL *this,
 		return EFI_BUFFER_TOO_SMALL;
 	}
 
-	CopyMem(buffer, (VOID*)loader->addr, loader->size);
+	for (UINTN n = 0; n < loader->count; n++) {
+		const INITRD_PART *part = &loader->parts[n];
+
+		if (part->compressed) {
+			/* expand straight into the buffer of the kernel */
+			const COMPRESSED_SECTION *header = part->addr;
+			EFI_STATUS status = decompress_section(header, buffer);
+
+			if (EFI_ERROR(status)) {
+				return status;
+			}
+			mem_zero((UINT8 *) buffer + header->Size,
+				 part->size - header->Size);
+		} else {
+			mem_copy(buffer, part->addr, part->size);
+		}
+		buffer = (UINT8 *) buffer + part->size;
+	}
 	*buffer_size = loader->size;
 
 	return EFI_SUCCESS;
 }
 
-VOID install_initrd_loader(VOID *initrd, UINTN initrd_size)
+VOID add_initrd_part(VOID *initrd, UINTN initrd_size, BOOLEAN compressed)
+{
+	INITRD_PART *part;
+
+	if (initrd_loader.count == MAX_INITRD_PARTS) {
+		error_exit(L"Too many initrd sections", EFI_OUT_OF_RESOURCES);
+	}
+	part = &initrd_loader.parts[initrd_loader.count++];
+	part->addr = initrd;
+	part->size = initrd_size;
+	part->compressed = compressed;
+	if (compressed) {
+		/* the kernel expects each cpio archive to be 4-byte aligned */
+		part->size = (((const COMPRESSED_SECTION *) initrd)->Size + 3) &
+			     ~(UINTN) 3;
+	}
+	initrd_loader.size += part->size;
+}
+
+VOID install_initrd_loader(VOID)
 {
 	EFI_STATUS status;
 
-	initrd_loader.protocol.LoadFile = initrd_load_file;
-	initrd_loader.addr = initrd;
-	initrd_loader.size = initrd_size;
+	if (initrd_loader.count == 0) {
+		return;
+	}
 
+	initrd_loader.protocol.LoadFile = initrd_load_file;
 	status = BS->InstallMultipleProtocolInterfaces(
 			&initrd_handle, &DevicePathProtocol,
 			&initrd_device_path, &EfiLoadFile2Protocol,
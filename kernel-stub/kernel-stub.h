@@ -14,13 +14,38 @@
 
 #include <efi.h>
 
+/*
+ * Header of the LZ4 compressed .kernelz and .initrdz sections, followed by
+ * an LZ4 block of BlockSize bytes that expands to Size bytes. For the
+ * kernel, ImageSize and Alignment are its SizeOfImage and SectionAlignment
+ * so that its buffer can be set up before decompressing into it.
+ */
+typedef struct {
+	UINT32 Size;
+	UINT32 BlockSize;
+	UINT32 ImageSize;
+	UINT32 Alignment;
+} __attribute__((packed)) COMPRESSED_SECTION;
+
+EFI_STATUS decompress_section(const COMPRESSED_SECTION *section,
+			      VOID *buffer);
+
+/* Bulk copy and zeroing of large, non-overlapping buffers. */
+VOID mem_copy(VOID *dst, const VOID *src, UINTN len);
+VOID mem_zero(VOID *dst, UINTN len);
+
 VOID error(CHAR16 *message, EFI_STATUS status);
 VOID __attribute__((noreturn)) error_exit(CHAR16 *message, EFI_STATUS status);
 VOID info(CHAR16 *message);
 
 const VOID *get_fdt_compatible(VOID);
 BOOLEAN match_fdt(const VOID *fdt, const CHAR8 *compatible);
+const VOID *find_indexed_fdt(const VOID *image_base, const VOID *index,
+			     UINTN index_size, const CHAR8 *compatible);
 EFI_STATUS replace_fdt(const VOID *fdt);
 
-VOID install_initrd_loader(VOID *initrd, UINTN initrd_size);
+#define MAX_INITRD_PARTS	16
+
+VOID add_initrd_part(VOID *initrd, UINTN initrd_size, BOOLEAN compressed);
+VOID install_initrd_loader(VOID);
 VOID uninstall_initrd_loader(VOID);
@@ -18,6 +18,7 @@
 #include "kernel-stub.h"
 #include "version.h"
 #include "loader_interface.h"
+#include "lz4_block.h"
 
 typedef struct {
 	UINT8 Ignore[60];
@@ -52,9 +53,18 @@ typedef struct {
 	CHAR8 Name[8];
 	UINT32 VirtualSize;
 	UINT32 VirtualAddress;
-	UINT8 Ignore[24];
+	UINT32 SizeOfRawData;
+	UINT8 Ignore[16];
+	UINT32 Characteristics;
 } __attribute__((packed)) SECTION;
 
+#ifndef IMAGE_SCN_MEM_EXECUTE
+#define IMAGE_SCN_MEM_EXECUTE	0x20000000
+#endif
+#ifndef IMAGE_SCN_MEM_WRITE
+#define IMAGE_SCN_MEM_WRITE	0x80000000
+#endif
+
 static EFI_HANDLE this_image;
 static EFI_LOADED_IMAGE kernel_image;
 
@@ -82,6 +92,17 @@ VOID __attribute__((noreturn)) error_exit(CHAR16 *message, EFI_STATUS status)
 	__builtin_unreachable();
 }
 
+EFI_STATUS decompress_section(const COMPRESSED_SECTION *section,
+			      VOID *buffer)
+{
+	if (lz4_block_decompress((const UINT8 *) (section + 1),
+				 section->BlockSize, buffer,
+				 section->Size) != 0) {
+		return EFI_VOLUME_CORRUPTED;
+	}
+	return EFI_SUCCESS;
+}
+
 static const PE_HEADER *get_pe_header(const VOID *image)
 {
 	const DOS_HEADER *dos_header = image;
@@ -96,15 +117,33 @@ static const SECTION *get_sections(const PE_HEADER *pe_header)
 				  pe_header->Coff.SizeOfOptionalHeader);
 }
 
+/*
+ * The kernel can run right where the firmware loaded the .kernel section if
+ * that is mapped executable and writable, is aligned as the kernel requires
+ * and reserves room for the complete kernel image, including its bss.
+ */
+static BOOLEAN kernel_runs_in_place(const SECTION *kernel_section,
+				    const VOID *kernel_source,
+				    const PE_HEADER *pe_header)
+{
+	const UINT32 chars = IMAGE_SCN_MEM_EXECUTE | IMAGE_SCN_MEM_WRITE;
+	UINTN alignment = pe_header->Opt.SectionAlignment;
+
+	return (kernel_section->Characteristics & chars) == chars &&
+	       ((uintptr_t) kernel_source & (alignment - 1)) == 0 &&
+	       kernel_section->VirtualSize >= pe_header->Opt.SizeOfImage;
+}
+
 EFI_STATUS efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *system_table)
 {
 	const SECTION *cmdline_section = NULL;
 	const SECTION *kernel_section = NULL;
-	const SECTION *initrd_section = NULL;
+	const SECTION *dtbidx_section = NULL;
 	EFI_HANDLE kernel_handle = NULL;
 	BOOLEAN has_dtbs = FALSE;
+	BOOLEAN kernel_compressed = FALSE;
 	const VOID *kernel_source;
-	EFI_PHYSICAL_ADDRESS kernel_buffer;
+	EFI_PHYSICAL_ADDRESS kernel_buffer = 0;
 	EFI_PHYSICAL_ADDRESS aligned_kernel_buffer;
 	const CHAR8 *fdt_compatible;
 	VOID *fdt, *alt_fdt = NULL;
@@ -113,12 +152,16 @@ EFI_STATUS efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *system_table)
 	const PE_HEADER *pe_header;
 	const SECTION *section;
 	EFI_STATUS status, cleanup_status;
-	UINTN n, kernel_pages;
+	UINTN n, kernel_pages = 0, kernel_size;
+	UINTN size_of_image, section_alignment;
 	BG_INTERFACE_PARAMS bg_interface_params;
+	BG_TIMING timing;
 
 	this_image = image_handle;
 	InitializeLib(image_handle, system_table);
 
+	timing_init(&timing, L"EbgStubTimePhasesUSec");
+
 	Print(L"Unified kernel stub (EFI Boot Guard %s)\n",
 	      L"" EFIBOOTGUARD_VERSION);
 
@@ -144,18 +187,40 @@ EFI_STATUS efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *system_table)
 			cmdline_section = section;
 		} else if (CompareMem(section->Name, ".kernel", 8) == 0) {
 			kernel_section = section;
-		} else if (CompareMem(section->Name, ".initrd", 8) == 0) {
-			initrd_section = section;
+		} else if (CompareMem(section->Name, ".kernelz", 8) == 0) {
+			kernel_section = section;
+			kernel_compressed = TRUE;
+		} else if (CompareMem(section->Name, ".initrd", 8) == 0 ||
+			   CompareMem(section->Name, ".ird-", 5) == 0) {
+			add_initrd_part((UINT8 *) stub_image->ImageBase +
+					section->VirtualAddress,
+					section->VirtualSize, FALSE);
+		} else if (CompareMem(section->Name, ".initrdz", 8) == 0 ||
+			   CompareMem(section->Name, ".irdz-", 6) == 0) {
+			add_initrd_part((UINT8 *) stub_image->ImageBase +
+					section->VirtualAddress,
+					section->VirtualSize, TRUE);
+		} else if (CompareMem(section->Name, ".dtbidx", 8) == 0) {
+			dtbidx_section = section;
 		} else if (CompareMem(section->Name, ".dtb-", 5) == 0) {
 			has_dtbs = TRUE;
 			fdt = (UINT8 *) stub_image->ImageBase +
 				section->VirtualAddress;
-			if (match_fdt(fdt, fdt_compatible)) {
+			/* no need to parse them if they are indexed */
+			if (!dtbidx_section && match_fdt(fdt, fdt_compatible)) {
 				alt_fdt = fdt;
 			}
 		}
 	}
 
+	if (dtbidx_section && has_dtbs) {
+		alt_fdt = (VOID *) find_indexed_fdt(
+			stub_image->ImageBase,
+			(UINT8 *) stub_image->ImageBase +
+			dtbidx_section->VirtualAddress,
+			dtbidx_section->VirtualSize, fdt_compatible);
+	}
+
 	if (!kernel_section) {
 		error_exit(L"Missing .kernel section", EFI_NOT_FOUND);
 	}
@@ -166,50 +231,100 @@ EFI_STATUS efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *system_table)
 		kernel_image.LoadOptionsSize = cmdline_section->VirtualSize;
 	}
 
-	if (initrd_section) {
-		install_initrd_loader(
-			(UINT8 *) stub_image->ImageBase +
-			initrd_section->VirtualAddress,
-			initrd_section->VirtualSize);
-	}
+	install_initrd_loader();
+
+	timing_phase(&timing, L"sections");
 
-	/*
-	 * Allocate new home for the kernel image. This is needed because
-	 *  - its section is either not executable or not writable
-	 *  - section alignment in virtual memory may not fit
-	 *
-	 * The new buffer size is based from SizeOfImage, aligned according to
-	 * the kernels SectionAlignment. As SectionAlignment may be larger than
-	 * the page size, over-allocate in order to adjust the base as needed.
-	 */
 	kernel_source = (UINT8 *) stub_image->ImageBase +
 		kernel_section->VirtualAddress;
 
-	pe_header = get_pe_header(kernel_source);
-
-	kernel_pages = EFI_SIZE_TO_PAGES(pe_header->Opt.SizeOfImage +
-					 pe_header->Opt.SectionAlignment);
-	status = BS->AllocatePages(AllocateAnyPages, EfiLoaderData,
-				   kernel_pages, &kernel_buffer);
-	if (EFI_ERROR(status)) {
-		error(L"Error allocating memory for kernel image", status);
-		goto cleanup_initrd;
+	if (kernel_compressed) {
+		const COMPRESSED_SECTION *header = kernel_source;
+
+		kernel_size = header->Size;
+		size_of_image = header->ImageSize;
+		section_alignment = header->Alignment;
+		if (kernel_size > size_of_image) {
+			error(L"Invalid compressed kernel image",
+			      EFI_LOAD_ERROR);
+			status = EFI_LOAD_ERROR;
+			goto cleanup_initrd;
+		}
+	} else {
+		pe_header = get_pe_header(kernel_source);
+		size_of_image = pe_header->Opt.SizeOfImage;
+		section_alignment = pe_header->Opt.SectionAlignment;
+
+		/* only the file image of the kernel is initialized, the rest
+		 * of SizeOfImage is bss */
+		kernel_size = kernel_section->VirtualSize;
+		if (kernel_section->SizeOfRawData < kernel_size) {
+			kernel_size = kernel_section->SizeOfRawData;
+		}
+		if (kernel_size > size_of_image) {
+			kernel_size = size_of_image;
+		}
 	}
 
-	aligned_kernel_buffer =
-		align_addr(kernel_buffer, pe_header->Opt.SectionAlignment);
-	if ((uintptr_t) aligned_kernel_buffer != aligned_kernel_buffer) {
-		error(L"Alignment overflow for kernel image", EFI_LOAD_ERROR);
-		goto cleanup_buffer;
-	}
+	if (!kernel_compressed &&
+	    kernel_runs_in_place(kernel_section, kernel_source, pe_header)) {
+		kernel_image.ImageBase = (VOID *) kernel_source;
+	} else {
+		/*
+		 * Allocate new home for the kernel image. This is needed
+		 * because
+		 *  - its section is either not executable or not writable
+		 *  - section alignment in virtual memory may not fit
+		 *  - it is compressed
+		 *
+		 * The new buffer size is based from SizeOfImage, aligned
+		 * according to the kernels SectionAlignment. As
+		 * SectionAlignment may be larger than the page size,
+		 * over-allocate in order to adjust the base as needed.
+		 */
+		kernel_pages = EFI_SIZE_TO_PAGES(size_of_image +
+						 section_alignment);
+		status = BS->AllocatePages(AllocateAnyPages, EfiLoaderData,
+					   kernel_pages, &kernel_buffer);
+		if (EFI_ERROR(status)) {
+			error(L"Error allocating memory for kernel image",
+			      status);
+			goto cleanup_initrd;
+		}
 
-	kernel_image.ImageBase = (VOID *) (uintptr_t) aligned_kernel_buffer;
-	kernel_image.ImageSize = kernel_section->VirtualSize;
+		aligned_kernel_buffer = align_addr(kernel_buffer,
+						   section_alignment);
+		if ((uintptr_t) aligned_kernel_buffer !=
+		    aligned_kernel_buffer) {
+			error(L"Alignment overflow for kernel image",
+			      EFI_LOAD_ERROR);
+			goto cleanup_buffer;
+		}
 
-	CopyMem(kernel_image.ImageBase, (VOID*)kernel_source, kernel_image.ImageSize);
+		kernel_image.ImageBase =
+			(VOID *) (uintptr_t) aligned_kernel_buffer;
+		if (kernel_compressed) {
+			status = decompress_section(kernel_source,
+						    kernel_image.ImageBase);
+			if (EFI_ERROR(status)) {
+				error(L"Error decompressing kernel image",
+				      status);
+				goto cleanup_buffer;
+			}
+		} else {
+			mem_copy(kernel_image.ImageBase, kernel_source,
+				 kernel_size);
+		}
+	}
+
+	kernel_image.ImageSize = kernel_size;
 	/* Clear the rest so that .bss is definitely zero. */
-	SetMem((UINT8 *) kernel_image.ImageBase + kernel_image.ImageSize,
-	       pe_header->Opt.SizeOfImage - kernel_image.ImageSize, 0);
+	mem_zero((UINT8 *) kernel_image.ImageBase + kernel_image.ImageSize,
+		 size_of_image - kernel_image.ImageSize);
+
+	pe_header = get_pe_header(kernel_image.ImageBase);
+
+	timing_phase(&timing, L"copy");
 
 	status = BS->InstallMultipleProtocolInterfaces(
 			&kernel_handle, &LoadedImageProtocol, &kernel_image,
@@ -231,6 +346,7 @@ EFI_STATUS efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *system_table)
 		}
 		info(L"Using firmware-provided device tree");
 	}
+	timing_phase(&timing, L"fdt");
 
 	UINT16 *boot_medium_uuidstr =
 		disk_get_part_uuid(stub_image->DeviceHandle);
@@ -241,6 +357,11 @@ EFI_STATUS efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *system_table)
 	}
 	FreePool(boot_medium_uuidstr);
 
+	status = set_bg_timing_vars(&timing);
+	if (EFI_ERROR(status) && status != EFI_UNSUPPORTED) {
+		info(L"WARNING: Could not set boot timing variables");
+	}
+
 	kernel_entry = (EFI_IMAGE_ENTRY_POINT)
 		((UINT8 *) kernel_image.ImageBase +
 		 pe_header->Opt.AddressOfEntryPoint);
@@ -258,7 +379,9 @@ cleanup_protocols:
 		}
 	}
 cleanup_buffer:
-	BS->FreePages(kernel_buffer, kernel_pages);
+	if (kernel_pages) {
+		BS->FreePages(kernel_buffer, kernel_pages);
+	}
 cleanup_initrd:
 	uninstall_initrd_loader();
 
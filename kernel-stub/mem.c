@@ -0,0 +1,166 @@
+/*
+ * EFI Boot Guard, unified kernel stub
+ *
+ * Copyright (c) Siemens AG, 2026
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+/*
+ * Bulk copy and zeroing for the kernel, initrd and device tree buffers,
+ * which are megabytes in size. The generic CopyMem and SetMem of gnu-efi
+ * move single bytes, and the stub is built unoptimized. Only general
+ * purpose registers may be used, so there is no SIMD variant. The buffers
+ * do not overlap.
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "kernel-stub.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#ifdef __x86_64__
+#define REP_MOVS_WORD "rep movsq"
+#define REP_STOS_WORD "rep stosq"
+#else
+#define REP_MOVS_WORD "rep movsl"
+#define REP_STOS_WORD "rep stosl"
+#endif
+
+/* Enhanced REP MOVSB/STOSB, CPUID.(EAX=7,ECX=0):EBX[9], makes the byte
+ * variants the fastest for large sizes. */
+static BOOLEAN has_erms(VOID)
+{
+	static INTN erms = -1;
+	UINT32 eax, ebx, ecx, edx;
+
+	if (erms < 0) {
+		__asm__ __volatile__("cpuid"
+				     : "=a"(eax), "=b"(ebx), "=c"(ecx),
+				       "=d"(edx)
+				     : "a"(0), "c"(0));
+		erms = 0;
+		if (eax >= 7) {
+			__asm__ __volatile__("cpuid"
+					     : "=a"(eax), "=b"(ebx), "=c"(ecx),
+					       "=d"(edx)
+					     : "a"(7), "c"(0));
+			erms = (ebx >> 9) & 1;
+		}
+	}
+	return erms;
+}
+
+VOID mem_copy(VOID *dst, const VOID *src, UINTN len)
+{
+	if (!has_erms()) {
+		UINTN words = len / sizeof(UINTN);
+
+		__asm__ __volatile__(REP_MOVS_WORD
+				     : "+D"(dst), "+S"(src), "+c"(words)
+				     :
+				     : "memory");
+		len %= sizeof(UINTN);
+	}
+	__asm__ __volatile__("rep movsb"
+			     : "+D"(dst), "+S"(src), "+c"(len)
+			     :
+			     : "memory");
+}
+
+VOID mem_zero(VOID *dst, UINTN len)
+{
+	if (!has_erms()) {
+		UINTN words = len / sizeof(UINTN);
+
+		__asm__ __volatile__(REP_STOS_WORD
+				     : "+D"(dst), "+c"(words)
+				     : "a"(0)
+				     : "memory");
+		len %= sizeof(UINTN);
+	}
+	__asm__ __volatile__("rep stosb"
+			     : "+D"(dst), "+c"(len)
+			     : "a"(0)
+			     : "memory");
+}
+
+#elif defined(__aarch64__)
+
+/* 64 bytes per iteration through four register pairs */
+VOID mem_copy(VOID *dst, const VOID *src, UINTN len)
+{
+	UINT8 *d = dst;
+	const UINT8 *s = src;
+
+	for (; len >= 64; len -= 64, d += 64, s += 64) {
+		__asm__ __volatile__("ldp x2, x3, [%1]\n\t"
+				     "ldp x4, x5, [%1, #16]\n\t"
+				     "ldp x6, x7, [%1, #32]\n\t"
+				     "ldp x8, x9, [%1, #48]\n\t"
+				     "stp x2, x3, [%0]\n\t"
+				     "stp x4, x5, [%0, #16]\n\t"
+				     "stp x6, x7, [%0, #32]\n\t"
+				     "stp x8, x9, [%0, #48]"
+				     :
+				     : "r"(d), "r"(s)
+				     : "x2", "x3", "x4", "x5", "x6", "x7", "x8",
+				       "x9", "memory");
+	}
+	while (len--) {
+		*d++ = *s++;
+	}
+}
+
+/* Zeroes whole cache lines with DC ZVA unless DCZID_EL0.DZP prohibits it,
+ * which also saves reading them in first. */
+VOID mem_zero(VOID *dst, UINTN len)
+{
+	UINT8 *d = dst;
+	UINT64 dczid;
+
+	__asm__ __volatile__("mrs %0, dczid_el0" : "=r"(dczid));
+	if (!(dczid & 0x10)) {
+		UINTN block = 4UL << (dczid & 0xf);
+
+		while (len > 0 && ((UINTN)d & (block - 1))) {
+			*d++ = 0;
+			len--;
+		}
+		for (; len >= block; len -= block, d += block) {
+			__asm__ __volatile__("dc zva, %0"
+					     :
+					     : "r"(d)
+					     : "memory");
+		}
+	}
+	for (; len >= 16; len -= 16, d += 16) {
+		__asm__ __volatile__("stp xzr, xzr, [%0]"
+				     :
+				     : "r"(d)
+				     : "memory");
+	}
+	while (len--) {
+		*d++ = 0;
+	}
+}
+
+#else
+
+/* the firmware's own implementations are usually tuned for the platform */
+VOID mem_copy(VOID *dst, const VOID *src, UINTN len)
+{
+	BS->CopyMem(dst, (VOID *)src, len);
+}
+
+VOID mem_zero(VOID *dst, UINTN len)
+{
+	BS->SetMem(dst, len, 0);
+}
+
+#endif
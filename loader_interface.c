@@ -22,23 +22,169 @@ EFI_GUID vendor_guid = {0x4a67b082,
 			0x41cf,
 			{0xb6, 0xc7, 0x44, 0x0b, 0x29, 0xbb, 0x8c, 0x4f}};
 
+EFI_GUID ebg_vendor_guid = {0xda047dff,
+			    0xe83e,
+			    0x41ca,
+			    {0xa6, 0x9c, 0xa3, 0x4c, 0x54, 0xfb, 0x43, 0x8e}};
+
+static const UINT32 interface_attribs =
+	EFI_VARIABLE_BOOTSERVICE_ACCESS | EFI_VARIABLE_RUNTIME_ACCESS;
+
+/* only set a variable if not set by a previous stage loader */
+static EFI_STATUS set_var_once(CHAR16 *name, EFI_GUID *guid, UINTN size,
+			       VOID *data)
+{
+	UINTN readsize = 0;
+
+	if (RT->GetVariable(name, guid, NULL, &readsize, NULL) !=
+	    EFI_NOT_FOUND) {
+		return EFI_SUCCESS;
+	}
+	return RT->SetVariable(name, guid, interface_attribs, size, data);
+}
+
 EFI_STATUS set_bg_interface_vars(const BG_INTERFACE_PARAMS *params)
 {
-	EFI_STATUS status = EFI_SUCCESS;
-	UINT32 attribs =
-		EFI_VARIABLE_BOOTSERVICE_ACCESS | EFI_VARIABLE_RUNTIME_ACCESS;
+	return set_var_once(L"LoaderDevicePartUUID", &vendor_guid,
+			    StrLen(params->loader_device_part_uuid) *
+				    sizeof(UINT16),
+			    params->loader_device_part_uuid);
+}
 
-	// only set this if not set by a previous stage loader
-	UINTN readsize = 0;
-	if (RT->GetVariable(L"LoaderDevicePartUUID", &vendor_guid, NULL,
-			    &readsize, NULL) == EFI_NOT_FOUND) {
-		status = RT->SetVariable(
-			L"LoaderDevicePartUUID", &vendor_guid, attribs,
-			StrLen(params->loader_device_part_uuid) *
-				sizeof(UINT16),
-			params->loader_device_part_uuid);
+#if defined(__x86_64__) || defined(__i386__)
+static UINT64 read_counter(VOID)
+{
+	UINT32 lo, hi;
+
+	__asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((UINT64)hi << 32) | lo;
+}
+
+static UINT64 counter_freq(VOID)
+{
+	static UINT64 freq;
+	UINT64 start;
+
+	/* the TSC rate is not architecturally exposed, calibrate it once */
+	if (freq == 0) {
+		start = read_counter();
+		(VOID) BS->Stall(1000);
+		freq = (read_counter() - start) * 1000;
+	}
+	return freq;
+}
+#elif defined(__aarch64__)
+static UINT64 read_counter(VOID)
+{
+	UINT64 val;
+
+	__asm__ __volatile__("isb; mrs %0, cntvct_el0" : "=r"(val));
+	return val;
+}
+
+static UINT64 counter_freq(VOID)
+{
+	UINT64 freq;
+
+	__asm__ __volatile__("mrs %0, cntfrq_el0" : "=r"(freq));
+	return freq;
+}
+#else
+static UINT64 read_counter(VOID)
+{
+	return 0;
+}
+
+static UINT64 counter_freq(VOID)
+{
+	return 0;
+}
+#endif
+
+UINT64 time_usec(VOID)
+{
+	UINT64 ticks = read_counter();
+	UINT64 freq = counter_freq();
+
+	if (ticks == 0 || freq == 0) {
+		return 0;
+	}
+	/* split the conversion so that ticks * 10^6 cannot overflow */
+	return (ticks / freq) * 1000000 + (ticks % freq) * 1000000 / freq;
+}
+
+VOID timing_init(BG_TIMING *timing, const CHAR16 *phases_var)
+{
+	ZeroMem(timing, sizeof(*timing));
+	timing->phases_var = phases_var;
+	timing->init_usec = time_usec();
+	timing->last_usec = timing->init_usec;
+}
+
+/* account the time since the previous phase (or init) to the given name */
+VOID timing_phase(BG_TIMING *timing, const CHAR16 *name)
+{
+	UINT64 now = time_usec();
+
+	if (timing->count < BG_TIMING_MAX_PHASES) {
+		timing->phase[timing->count].name = name;
+		timing->phase[timing->count].usec = now - timing->last_usec;
+		timing->count++;
 	}
-	return status;
+	timing->last_usec = now;
+}
+
+static EFI_STATUS set_time_var(CHAR16 *name, UINT64 usec)
+{
+	CHAR16 buffer[21];
+	UINTN len;
+
+	len = SPrint(buffer, sizeof(buffer), L"%ld", (INT64)usec);
+	return set_var_once(name, &vendor_guid, len * sizeof(CHAR16), buffer);
+}
+
+/*
+ * Publish LoaderTimeInitUSec and LoaderTimeExecUSec as defined by the
+ * systemd Boot Loader Interface, unless an earlier stage already did, and
+ * the per-phase breakdown as "name=usec" pairs in the stage's own variable
+ * under the EBG vendor GUID.
+ */
+EFI_STATUS set_bg_timing_vars(const BG_TIMING *timing)
+{
+	CHAR16 phases[BG_TIMING_MAX_PHASES * 32];
+	EFI_STATUS status;
+	UINTN len = 0;
+
+	if (timing->init_usec == 0) {
+		return EFI_UNSUPPORTED;
+	}
+
+	status = set_time_var(L"LoaderTimeInitUSec", timing->init_usec);
+	if (EFI_ERROR(status)) {
+		return status;
+	}
+	status = set_time_var(L"LoaderTimeExecUSec", time_usec());
+	if (EFI_ERROR(status)) {
+		return status;
+	}
+
+	for (UINTN n = 0; n < timing->count; n++) {
+		len += SPrint(phases + len, sizeof(phases) - len * sizeof(CHAR16),
+			      L"%s%s=%ld", len > 0 ? L" " : L"",
+			      timing->phase[n].name,
+			      (INT64)timing->phase[n].usec);
+	}
+	return set_var_once((CHAR16 *)timing->phases_var, &ebg_vendor_guid,
+			    len * sizeof(CHAR16), phases);
+}
+
+/* Publishes the state of the config partitions for userspace, replacing
+ * that of a previous stage. */
+EFI_STATUS set_bg_env_snapshot(const BG_ENVSNAPSHOT *snapshot)
+{
+	return RT->SetVariable(ENV_SNAPSHOT_VAR, &ebg_vendor_guid,
+			       interface_attribs, sizeof(*snapshot),
+			       (VOID *)snapshot);
 }
 
 CHAR16 *disk_get_part_uuid(EFI_HANDLE *handle)
@@ -49,7 +195,11 @@ CHAR16 *disk_get_part_uuid(EFI_HANDLE *handle)
 	if (EFI_ERROR(err)) {
 		return NULL;
 	}
+	return devpath_get_part_uuid(dp);
+}
 
+CHAR16 *devpath_get_part_uuid(EFI_DEVICE_PATH *dp)
+{
 	for (; !IsDevicePathEnd(dp); dp = NextDevicePathNode(dp)) {
 		if (dp->Type != MEDIA_DEVICE_PATH ||
 		    dp->SubType != MEDIA_HARDDRIVE_DP) {
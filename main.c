@@ -24,26 +24,194 @@
 #include "utils.h"
 #include "loader_interface.h"
 
-extern const unsigned long wdfuncs_start[];
-extern const unsigned long wdfuncs_end[];
+extern WATCHDOG_DRIVER wdfuncs_start[];
+extern WATCHDOG_DRIVER wdfuncs_end[];
 extern CHAR16 *boot_medium_path;
 
 #define PCI_GET_VENDOR_ID(id)	(UINT16)(id)
 #define PCI_GET_PRODUCT_ID(id)	(UINT16)((id) >> 16)
 
+static BOOLEAN pci_id_match(const WATCHDOG_DRIVER *driver, UINT16 vendor_id,
+			    UINT16 device_id)
+{
+	const WATCHDOG_PCI_ID *id;
 
-static EFI_STATUS probe_watchdogs(UINTN timeout)
+	for (id = driver->pci_ids; id->vendor_id != 0; id++) {
+		if (id->vendor_id == vendor_id && id->device_id == device_id) {
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/*
+ * Watchdog that was set up successfully on a previous boot. Stored in a
+ * non-volatile variable so that the next boot can try it before scanning
+ * all PCI devices. vendor_id is 0 for drivers not bound to a PCI device.
+ */
+typedef struct {
+	UINT32 driver;
+	UINT16 vendor_id;
+	UINT16 device_id;
+	UINT16 segment;
+	UINT8 bus;
+	UINT8 device;
+	UINT8 function;
+	UINT8 reserved[3];
+} WATCHDOG_CACHE;
+
+#define WATCHDOG_CACHE_VAR	L"EbgWatchdogCache"
+
+static BOOLEAN read_watchdog_cache(WATCHDOG_CACHE *cache)
 {
-	if (wdfuncs_end - wdfuncs_start - 1 == 0) {
-		if (timeout > 0) {
-			ERROR(L"No watchdog drivers registered, but timeout is non-zero.\n");
+	UINTN size = sizeof(*cache);
+	EFI_STATUS status;
+
+	status = RT->GetVariable(WATCHDOG_CACHE_VAR, &ebg_vendor_guid, NULL,
+				 &size, cache);
+	return status == EFI_SUCCESS && size == sizeof(*cache);
+}
+
+static VOID write_watchdog_cache(WATCHDOG_CACHE *cache)
+{
+	UINT32 attribs = EFI_VARIABLE_NON_VOLATILE |
+			 EFI_VARIABLE_BOOTSERVICE_ACCESS |
+			 EFI_VARIABLE_RUNTIME_ACCESS;
+	EFI_STATUS status;
+
+	status = RT->SetVariable(WATCHDOG_CACHE_VAR, &ebg_vendor_guid, attribs,
+				 cache ? sizeof(*cache) : 0, cache);
+	if (EFI_ERROR(status) && (cache || status != EFI_NOT_FOUND)) {
+		WARNING(L"Cannot update watchdog cache: %r\n", status);
+	}
+}
+
+static EFI_STATUS read_pci_id(EFI_PCI_IO *pci_io, UINT16 *vendor_id,
+			      UINT16 *device_id)
+{
+	EFI_STATUS status;
+	UINT32 value;
+
+	status = pci_io->Pci.Read(pci_io, EfiPciIoWidthUint32, PCI_VENDOR_ID,
+				  1, &value);
+	if (EFI_ERROR(status)) {
+		return status;
+	}
+	*vendor_id = PCI_GET_VENDOR_ID(value);
+	*device_id = PCI_GET_PRODUCT_ID(value);
+	return EFI_SUCCESS;
+}
+
+static BOOLEAN pci_location_match(EFI_PCI_IO *pci_io,
+				  const WATCHDOG_CACHE *cache)
+{
+	UINTN segment, bus, device, function;
+
+	if (EFI_ERROR(pci_io->GetLocation(pci_io, &segment, &bus, &device,
+					  &function))) {
+		return FALSE;
+	}
+	return segment == cache->segment && bus == cache->bus &&
+	       device == cache->device && function == cache->function;
+}
+
+static VOID set_cache_location(EFI_PCI_IO *pci_io, WATCHDOG_CACHE *cache)
+{
+	UINTN segment, bus, device, function;
+
+	if (EFI_ERROR(pci_io->GetLocation(pci_io, &segment, &bus, &device,
+					  &function))) {
+		/* not cacheable, the next boot will scan again */
+		cache->driver = 0;
+		return;
+	}
+	cache->segment = segment;
+	cache->bus = bus;
+	cache->device = device;
+	cache->function = function;
+}
+
+/*
+ * Retry the watchdog recorded in the cache. Anything that does not match
+ * the recorded driver, location or IDs exactly is treated as changed
+ * hardware and leaves the decision to the full scan.
+ */
+static EFI_STATUS probe_cached_watchdog(const WATCHDOG_CACHE *cache,
+					UINTN timeout)
+{
+	const WATCHDOG_DRIVER *driver;
+	UINTN handle_count = 0;
+	EFI_HANDLE *handle_buffer = NULL;
+	EFI_PCI_IO_PROTOCOL *pci_io;
+	UINT16 vendor_id, device_id;
+	EFI_STATUS status;
+
+	if (cache->driver == 0 ||
+	    cache->driver >= (UINTN)(wdfuncs_end - wdfuncs_start)) {
+		return EFI_UNSUPPORTED;
+	}
+	driver = wdfuncs_start + cache->driver;
+
+	if (cache->vendor_id == 0) {
+		if (driver->pci_ids) {
 			return EFI_UNSUPPORTED;
 		}
-		return EFI_SUCCESS;
+		return driver->probe(NULL, 0, 0, timeout);
 	}
-	if (timeout == 0) {
-		WARNING(L"Watchdog is disabled.\n");
-		return EFI_SUCCESS;
+	if (!driver->pci_ids ||
+	    !pci_id_match(driver, cache->vendor_id, cache->device_id)) {
+		return EFI_UNSUPPORTED;
+	}
+
+	status = BS->LocateHandleBuffer(ByProtocol, &PciIoProtocol, NULL,
+					&handle_count, &handle_buffer);
+	if (EFI_ERROR(status)) {
+		return status;
+	}
+
+	status = EFI_NOT_FOUND;
+	for (UINTN index = 0; index < handle_count; index++) {
+		if (EFI_ERROR(BS->OpenProtocol(
+			    handle_buffer[index], &PciIoProtocol,
+			    (VOID **)&pci_io, this_image, NULL,
+			    EFI_OPEN_PROTOCOL_BY_HANDLE_PROTOCOL))) {
+			continue;
+		}
+		if (pci_location_match(pci_io, cache)) {
+			if (read_pci_id(pci_io, &vendor_id, &device_id) ==
+				    EFI_SUCCESS &&
+			    vendor_id == cache->vendor_id &&
+			    device_id == cache->device_id) {
+				status = driver->probe(pci_io, vendor_id,
+						       device_id, timeout);
+			} else {
+				status = EFI_UNSUPPORTED;
+			}
+		}
+		(VOID) BS->CloseProtocol(handle_buffer[index], &PciIoProtocol,
+					 this_image, NULL);
+		if (status != EFI_NOT_FOUND) {
+			break;
+		}
+	}
+	FreePool(handle_buffer);
+
+	return status;
+}
+
+static EFI_STATUS scan_watchdogs(UINTN timeout, WATCHDOG_CACHE *found)
+{
+	const WATCHDOG_DRIVER *driver;
+
+	ZeroMem(found, sizeof(*found));
+
+	/* Drivers not bound to a PCI device get a single chance, first. */
+	for (driver = wdfuncs_start + 1; driver < wdfuncs_end; driver++) {
+		if (!driver->pci_ids &&
+		    driver->probe(NULL, 0, 0, timeout) == EFI_SUCCESS) {
+			found->driver = driver - wdfuncs_start;
+			return EFI_SUCCESS;
+		}
 	}
 
 	UINTN handle_count = 0;
@@ -60,7 +228,8 @@ static EFI_STATUS probe_watchdogs(UINTN timeout)
 	}
 
 	EFI_PCI_IO_PROTOCOL *pci_io;
-	UINT32 value;
+	UINT16 vendor_id, device_id;
+	status = EFI_UNSUPPORTED;
 	for (UINTN index = 0; index < handle_count; index++) {
 		status = BS->OpenProtocol(handle_buffer[index], &PciIoProtocol,
 					  (VOID **)&pci_io, this_image, NULL,
@@ -71,8 +240,7 @@ static EFI_STATUS probe_watchdogs(UINTN timeout)
 			return status;
 		}
 
-		status = pci_io->Pci.Read(pci_io, EfiPciIoWidthUint32,
-					  PCI_VENDOR_ID, 1, &value);
+		status = read_pci_id(pci_io, &vendor_id, &device_id);
 		if (EFI_ERROR(status)) {
 			WARNING(
 			    L"Cannot not read from PCI device, skipping: %r\n",
@@ -83,12 +251,21 @@ static EFI_STATUS probe_watchdogs(UINTN timeout)
 			continue;
 		}
 
-		const unsigned long *entry = wdfuncs_start;
-		for (entry++; entry < wdfuncs_end; entry++) {
-			WATCHDOG_PROBE probe = (WATCHDOG_PROBE) *entry;
-			if ((status = probe(pci_io, PCI_GET_VENDOR_ID(value),
-					    PCI_GET_PRODUCT_ID(value),
-					    timeout)) == EFI_SUCCESS) {
+		/* Only call into the drivers that claim this device. */
+		status = EFI_UNSUPPORTED;
+		for (driver = wdfuncs_start + 1; driver < wdfuncs_end;
+		     driver++) {
+			if (!driver->pci_ids ||
+			    !pci_id_match(driver, vendor_id, device_id)) {
+				continue;
+			}
+			status = driver->probe(pci_io, vendor_id, device_id,
+					       timeout);
+			if (status == EFI_SUCCESS) {
+				found->driver = driver - wdfuncs_start;
+				found->vendor_id = vendor_id;
+				found->device_id = device_id;
+				set_cache_location(pci_io, found);
 				break;
 			}
 		}
@@ -105,6 +282,105 @@ static EFI_STATUS probe_watchdogs(UINTN timeout)
 	return status;
 }
 
+static EFI_STATUS load_payload(EFI_DEVICE_PATH *dp, EFI_HANDLE *handle)
+{
+#if defined(PRELOAD_PAYLOAD)
+	EFI_PHYSICAL_ADDRESS buffer;
+	EFI_STATUS status;
+	UINTN size;
+
+	status = PreloadFile(dp, &buffer, &size);
+	if (status == EFI_SUCCESS) {
+		status = BS->LoadImage(FALSE, this_image, dp,
+				       (VOID *)(UINTN)buffer, size, handle);
+		(VOID) BS->FreePages(buffer, EFI_SIZE_TO_PAGES(size));
+		return status;
+	}
+	WARNING(L"Cannot preload payload, loading it via its path: %r\n",
+		status);
+#endif
+	return BS->LoadImage(TRUE, this_image, dp, NULL, 0, handle);
+}
+
+static EFI_STATUS probe_watchdogs(UINTN timeout)
+{
+	WATCHDOG_CACHE cache, found;
+	BOOLEAN cached;
+	EFI_STATUS status;
+
+	if (wdfuncs_end - wdfuncs_start - 1 == 0) {
+		if (timeout > 0) {
+			ERROR(L"No watchdog drivers registered, but timeout is non-zero.\n");
+			return EFI_UNSUPPORTED;
+		}
+		return EFI_SUCCESS;
+	}
+	if (timeout == 0) {
+		WARNING(L"Watchdog is disabled.\n");
+		return EFI_SUCCESS;
+	}
+
+	cached = read_watchdog_cache(&cache);
+	if (cached && probe_cached_watchdog(&cache, timeout) == EFI_SUCCESS) {
+		return EFI_SUCCESS;
+	}
+
+	status = scan_watchdogs(timeout, &found);
+	if (status == EFI_SUCCESS && found.driver != 0) {
+		/* avoid needless flash writes when nothing changed */
+		if (!cached || CompareMem(&cache, &found, sizeof(cache)) != 0) {
+			write_watchdog_cache(&found);
+		}
+	} else if (cached) {
+		write_watchdog_cache(NULL);
+	}
+
+	return status;
+}
+
+#if ENV_BOOT_DELAY > 0
+/* Starts the boot delay. Everything up to wait_boot_delay() happens within
+ * it instead of adding to it. */
+static EFI_EVENT start_boot_delay(VOID)
+{
+	EFI_EVENT timer;
+
+	if (BS->CreateEvent(EVT_TIMER, 0, NULL, NULL, &timer) != EFI_SUCCESS) {
+		return NULL;
+	}
+	if (BS->SetTimer(timer, TimerRelative,
+			 ENV_BOOT_DELAY * 10000000ULL) != EFI_SUCCESS) {
+		(VOID) BS->CloseEvent(timer);
+		return NULL;
+	}
+	return timer;
+}
+
+/* Waits for the rest of the boot delay, which a key press cuts short. */
+static VOID wait_boot_delay(EFI_EVENT timer)
+{
+	EFI_EVENT events[2];
+	EFI_INPUT_KEY key;
+	UINTN count = 1;
+	UINTN index;
+
+	if (!timer) {
+		BS->Stall(1000 * 1000 * ENV_BOOT_DELAY);
+		return;
+	}
+	events[0] = timer;
+	if (ST->ConIn) {
+		events[count++] = ST->ConIn->WaitForKey;
+	}
+	if (BS->WaitForEvent(count, events, &index) == EFI_SUCCESS &&
+	    index == 1) {
+		(VOID) ST->ConIn->ReadKeyStroke(ST->ConIn, &key);
+		INFO(L"Boot delay skipped.\n");
+	}
+	(VOID) BS->CloseEvent(timer);
+}
+#endif
+
 EFI_STATUS efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *system_table)
 {
 	EFI_DEVICE_PATH *payload_dev_path;
@@ -114,18 +390,30 @@ EFI_STATUS efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *system_table)
 	BG_STATUS bg_status;
 	BG_LOADER_PARAMS bg_loader_params;
 	BG_INTERFACE_PARAMS bg_interface_params;
+	BG_TIMING timing;
 	CHAR16 *tmp;
+#if ENV_BOOT_DELAY > 0
+	EFI_EVENT boot_delay;
+#endif
+
+	timing_init(&timing, L"EbgTimePhasesUSec");
 
 	ZeroMem(&bg_loader_params, sizeof(bg_loader_params));
 
 	this_image = image_handle;
 	InitializeLib(this_image, system_table);
 
-#if !defined(SILENT_BOOT)
+#if defined(BUFFERED_LOG)
+	INFO(L"EFI Boot Guard %s\n", L"" EFIBOOTGUARD_VERSION);
+#elif !defined(SILENT_BOOT)
 	(VOID) ST->ConOut->ClearScreen(ST->ConOut);
 	PrintC(EFI_CYAN, L"EFI Boot Guard %s\n", L"" EFIBOOTGUARD_VERSION);
 #endif
 
+#if ENV_BOOT_DELAY > 0
+	boot_delay = start_boot_delay();
+#endif
+
 	status = BS->OpenProtocol(this_image, &LoadedImageProtocol,
 				  (VOID **)&loaded_image, this_image, NULL,
 				  EFI_OPEN_PROTOCOL_GET_PROTOCOL);
@@ -134,6 +422,7 @@ EFI_STATUS efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *system_table)
 			   status);
 	}
 
+	SetBootMedium(DevicePathFromHandle(loaded_image->DeviceHandle));
 	tmp = DevicePathToStr(DevicePathFromHandle(loaded_image->DeviceHandle));
 	boot_medium_path = GetBootMediumPath(tmp);
 	FreePool(tmp);
@@ -143,6 +432,7 @@ EFI_STATUS efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *system_table)
 	if (EFI_ERROR(status)) {
 		error_exit(L"Cannot get volumes installed on system", status);
 	}
+	timing_phase(&timing, L"volumes");
 
 	INFO(L"Loading configuration...\n");
 
@@ -163,6 +453,8 @@ EFI_STATUS efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *system_table)
 		}
 	}
 
+	timing_phase(&timing, L"config");
+
 	payload_dev_path = FileDevicePathFromConfig(
 	    loaded_image->DeviceHandle, bg_loader_params.payload_path);
 	if (!payload_dev_path) {
@@ -179,13 +471,14 @@ EFI_STATUS efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *system_table)
 	if (EFI_ERROR(status)) {
 		error_exit(L"Cannot probe watchdog", status);
 	}
+	timing_phase(&timing, L"watchdog");
 
 	/* Load and start image */
-	status = BS->LoadImage(TRUE, this_image, payload_dev_path, NULL, 0,
-			       &payload_handle);
+	status = load_payload(payload_dev_path, &payload_handle);
 	if (EFI_ERROR(status)) {
 		error_exit(L"Cannot load specified kernel image", status);
 	}
+	timing_phase(&timing, L"loadimage");
 
 	UINT16 *boot_medium_uuidstr =
 		disk_get_part_uuid(loaded_image->DeviceHandle);
@@ -215,7 +508,16 @@ EFI_STATUS efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *system_table)
 	INFO(L"Starting %s with watchdog set to %d seconds ...\n",
 	     bg_loader_params.payload_path, bg_loader_params.timeout);
 
-	BS->Stall(1000 * 1000 * ENV_BOOT_DELAY);
+#if ENV_BOOT_DELAY > 0
+	wait_boot_delay(boot_delay);
+#endif
+
+	status = set_bg_timing_vars(&timing);
+	if (EFI_ERROR(status) && status != EFI_UNSUPPORTED) {
+		WARNING(L"Cannot set boot timing variables: %r\n", status);
+	}
+
+	FlushLog();
 
 	return BS->StartImage(payload_handle, NULL, NULL);
 }
@@ -0,0 +1,299 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2026
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+/*
+ * Runs a sequence of bg_setenv and bg_printenv commands against a single
+ * probe of the config partitions. All modified environments are written
+ * once, after the last command succeeded.
+ */
+
+#include "ebgenv.h"
+
+#include "bg_envtools.h"
+#include "bg_batch.h"
+#include "bg_printenv.h"
+#include "bg_setenv.h"
+
+static char tool_doc[] =
+	"Runs the bg_setenv and bg_printenv commands read from FILE, one per "
+	"line or separated by NUL characters, and writes the changes once "
+	"at the end. Lines starting with # are ignored.";
+
+/* if you change these, do not forget to update completion/common.py */
+static struct argp_option options_batch[] = {
+	OPT("batch", 'B', "FILE", 0,
+	    "Read commands from FILE, - for standard input"),
+	OPT("image", 'I', "IMAGE", 0,
+	    "Use the config partitions in the disk image file IMAGE"),
+	OPT("all", 'A', 0, 0,
+	    "search on all devices instead of root device only"),
+	OPT("cache", 'C', 0, 0,
+	    "cache the probed config partitions in /run/efibootguard"),
+	OPT("shared-mounts", 'U', 0, 0,
+	    "share the mounts of config partitions with concurrent calls"),
+	OPT("group-sync", 'Y', 0, 0,
+	    "flush each written environment once instead of mounting sync"),
+	OPT("match", 'M', "RULES", 0,
+	    "only probe the FAT partitions matching any of RULES"),
+	OPT("disk-order", 'D', "ORDER", 0,
+	    "with --all, probe the disks in ORDER"),
+	OPT("stop-early", 'E', 0, 0,
+	    "with --all, stop after the first disks with all config partitions"),
+	OPT("stats", 'S', 0, 0,
+	    "print device, I/O and timing statistics to stderr at exit"),
+	OPT("verbose", 'v', 0, 0, "Be verbose"),
+	{0},
+};
+
+struct arguments_batch {
+	struct arguments_common common;
+	char *path;
+};
+
+static error_t parse_batch_opt(int key, char *arg, struct argp_state *state)
+{
+	struct arguments_batch *arguments = state->input;
+
+	switch (key) {
+	case 'B':
+		arguments->path = arg;
+		break;
+	case 'A':
+	case 'C':
+	case 'D':
+	case 'E':
+	case 'I':
+	case 'M':
+	case 'S':
+	case 'U':
+	case 'Y':
+	case 'v':
+		return parse_common_opt(key, arg, false, &arguments->common);
+	case ARGP_KEY_ARG:
+		argp_usage(state);
+		break;
+	case ARGP_KEY_END:
+		if (!arguments->path) {
+			argp_usage(state);
+		}
+		break;
+	default:
+		return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+/* Reads all of path, or of stdin for "-", into a NUL terminated buffer. */
+static char *read_commands(const char *path, size_t *len)
+{
+	FILE *f = stdin;
+	char *buf = NULL;
+	size_t size = 0;
+	size_t n;
+
+	*len = 0;
+	if (strcmp(path, "-") != 0) {
+		f = fopen(path, "r");
+		if (!f) {
+			fprintf(stderr, "Error opening %s: %s\n", path,
+				strerror(errno));
+			return NULL;
+		}
+	}
+	do {
+		if (size - *len < 4096) {
+			char *tmp = realloc(buf, size + 65536 + 1);
+
+			if (!tmp) {
+				fprintf(stderr, "Error allocating memory.\n");
+				free(buf);
+				buf = NULL;
+				goto out;
+			}
+			buf = tmp;
+			size += 65536;
+		}
+		n = fread(buf + *len, 1, size - *len, f);
+		*len += n;
+	} while (n > 0);
+	if (ferror(f)) {
+		fprintf(stderr, "Error reading %s.\n", path);
+		free(buf);
+		buf = NULL;
+		goto out;
+	}
+	buf[*len] = '\0';
+out:
+	if (f != stdin) {
+		fclose(f);
+	}
+	return buf;
+}
+
+/* Splits cmd in place into words separated by blanks. Single and double
+ * quotes and backslashes work like in the shell, without any expansion.
+ * Returns the number of words or -1 for unbalanced quotes. */
+static int split_command(char *cmd, char **argv, int max)
+{
+	char *in = cmd;
+	char *out = cmd;
+	int argc = 0;
+
+	for (;;) {
+		char quote = 0;
+
+		while (*in == ' ' || *in == '\t' || *in == '\n' ||
+		       *in == '\r') {
+			in++;
+		}
+		if (*in == '\0') {
+			return argc;
+		}
+		if (argc == max) {
+			return -1;
+		}
+		argv[argc++] = out;
+		while (*in != '\0') {
+			if (quote) {
+				if (*in == quote) {
+					quote = 0;
+				} else if (quote == '"' && *in == '\\' &&
+					   (in[1] == '"' || in[1] == '\\')) {
+					*out++ = *++in;
+				} else {
+					*out++ = *in;
+				}
+			} else if (*in == '\'' || *in == '"') {
+				quote = *in;
+			} else if (*in == '\\' && in[1] != '\0') {
+				*out++ = *++in;
+			} else if (*in == ' ' || *in == '\t' || *in == '\n' ||
+				   *in == '\r') {
+				break;
+			} else {
+				*out++ = *in;
+			}
+			in++;
+		}
+		if (quote) {
+			return -1;
+		}
+		if (*in != '\0') {
+			in++;
+		}
+		*out++ = '\0';
+	}
+}
+
+static error_t run_command(char *cmd, BGENV *pending[ENV_NUM_CONFIG_PARTS])
+{
+	/* every word takes at least two characters */
+	int max = strlen(cmd) / 2 + 2;
+	char **argv;
+	int argc;
+	error_t e;
+
+	argv = calloc(max + 1, sizeof(char *));
+	if (!argv) {
+		fprintf(stderr, "Error allocating memory.\n");
+		return ENOMEM;
+	}
+	argc = split_command(cmd, argv, max);
+	if (argc < 0) {
+		fprintf(stderr, "Error, unbalanced quotes in command.\n");
+		e = 1;
+	} else if (argc == 0 || argv[0][0] == '#') {
+		e = 0;
+	} else if (strcmp(argv[0], "bg_setenv") == 0 ||
+		   strcmp(argv[0], "setenv") == 0) {
+		e = bg_setenv_batched(argc, argv, pending);
+	} else if (strcmp(argv[0], "bg_printenv") == 0 ||
+		   strcmp(argv[0], "printenv") == 0) {
+		e = bg_printenv_batched(argc, argv);
+	} else {
+		fprintf(stderr, "Unknown command: %s\n", argv[0]);
+		e = 1;
+	}
+	free(argv);
+	return e;
+}
+
+/* This is the entrypoint for bg_setenv --batch and bg_printenv --batch. */
+error_t bg_batch(int argc, char **argv)
+{
+	struct argp argp_batch = {
+		.options = options_batch,
+		.parser = parse_batch_opt,
+		.doc = tool_doc,
+	};
+	struct arguments_batch arguments = { 0 };
+	BGENV *pending[ENV_NUM_CONFIG_PARTS] = { NULL };
+	char *commands, *cmd;
+	unsigned int line = 1;
+	size_t len;
+	char sep;
+	int result = 0;
+	error_t e;
+
+	e = argp_parse(&argp_batch, argc, argv, 0, 0, &arguments);
+	if (e) {
+		return e;
+	}
+
+	commands = read_commands(arguments.path, &len);
+	if (!commands) {
+		return 1;
+	}
+	/* NUL separation allows line breaks within values */
+	sep = memchr(commands, '\0', len) ? '\0' : '\n';
+
+	if (!init_environments(&arguments.common)) {
+		free(commands);
+		return 1;
+	}
+
+	for (cmd = commands; cmd < commands + len; line++) {
+		char *end = memchr(cmd, sep, commands + len - cmd);
+
+		if (!end) {
+			end = commands + len;
+		}
+		*end = '\0';
+		if (run_command(cmd, pending)) {
+			/* leave all environments as they were */
+			fprintf(stderr, "Error in %s %u of %s.\n",
+				sep ? "line" : "command", line,
+				arguments.path);
+			fprintf(stderr, "Batch aborted, no changes written.\n");
+			result = 1;
+			goto cleanup;
+		}
+		cmd = end + 1;
+	}
+
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS && pending[i]; i++) {
+		if (!bgenv_write(pending[i])) {
+			fprintf(stderr, "Error storing environment.\n");
+			result = 1;
+		}
+	}
+	if (pending[0] && !result) {
+		fprintf(stdout, "Environment update was successful.\n");
+	}
+
+cleanup:
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		bgenv_close(pending[i]);
+	}
+	bgenv_finalize();
+	free(commands);
+	return result;
+}
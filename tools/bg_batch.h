@@ -0,0 +1,19 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2026
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#ifndef __bg_batch_h_
+#define __bg_batch_h_
+
+#include <errno.h>
+
+error_t bg_batch(int argc, char **argv);
+
+#endif
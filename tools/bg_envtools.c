@@ -14,6 +14,7 @@
  */
 
 #include <sys/stat.h>
+#include <time.h>
 #include "env_config_file.h"
 #include "version.h"
 
@@ -61,6 +62,110 @@ int parse_int(char *arg)
 	return (int)i;
 }
 
+/* library phases summed up by --stats */
+enum {
+	STATS_PROBE_DEVICES,
+	STATS_PROBE_FILE,
+	STATS_MOUNT,
+	STATS_UNMOUNT,
+	STATS_READ,
+	STATS_WRITE,
+	STATS_WRITE_BLOCKS,
+	STATS_WRITE_LOG,
+	STATS_CRC32,
+	STATS_SET_USERVAR,
+	STATS_DEL_USERVAR,
+	STATS_SET_BATCH,
+	STATS_NUM_PHASES
+};
+
+static const char *stats_phases[STATS_NUM_PHASES] = {
+	"ped_device_probe_all", "probe_config_file", "mount_partition",
+	"unmount_partition",    "read_env",          "write_env",
+	"write_env_blocks",     "write_log_slot",    "crc32",
+	"set_uservar",          "del_uservar",       "set_uservar_batch",
+};
+
+static struct {
+	uint64_t calls;
+	uint64_t bytes;
+	uint64_t ns;
+} stats[STATS_NUM_PHASES];
+
+static uint64_t stats_start_ns;
+
+static uint64_t stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* called from the probing threads as well */
+static void stats_record(const ebgenv_trace_event_t *ev, void *priv)
+{
+	(void)priv;
+	for (int i = 0; i < STATS_NUM_PHASES; i++) {
+		if (strcmp(ev->event, stats_phases[i]) == 0) {
+			__atomic_add_fetch(&stats[i].calls, 1,
+					   __ATOMIC_RELAXED);
+			__atomic_add_fetch(&stats[i].bytes, ev->bytes,
+					   __ATOMIC_RELAXED);
+			__atomic_add_fetch(&stats[i].ns, ev->duration_ns,
+					   __ATOMIC_RELAXED);
+			return;
+		}
+	}
+}
+
+static void stats_print(void)
+{
+	uint64_t total_ns = stats_now() - stats_start_ns;
+
+	ebg_set_trace_callback(NULL, NULL);
+	fprintf(stderr, "\nStatistics:\n");
+	fprintf(stderr, "  devices scanned:    %llu\n",
+		(unsigned long long)stats[STATS_PROBE_DEVICES].bytes);
+	fprintf(stderr, "  partitions probed:  %llu\n",
+		(unsigned long long)stats[STATS_PROBE_FILE].calls);
+	fprintf(stderr, "  partitions mounted: %llu\n",
+		(unsigned long long)stats[STATS_MOUNT].calls);
+	fprintf(stderr, "  bytes read:         %llu\n",
+		(unsigned long long)stats[STATS_READ].bytes);
+	fprintf(stderr, "  bytes written:      %llu\n",
+		(unsigned long long)(stats[STATS_WRITE].bytes +
+				     stats[STATS_WRITE_BLOCKS].bytes +
+				     stats[STATS_WRITE_LOG].bytes));
+	fprintf(stderr, "  bytes hashed:       %llu\n",
+		(unsigned long long)stats[STATS_CRC32].bytes);
+	/* phases nest and run in parallel, their times overlap */
+	fprintf(stderr, "  %-22s %8s %12s %12s\n", "phase", "calls", "bytes",
+		"ms");
+	for (int i = 0; i < STATS_NUM_PHASES; i++) {
+		if (stats[i].calls == 0) {
+			continue;
+		}
+		fprintf(stderr, "  %-22s %8llu %12llu %12.3f\n",
+			stats_phases[i], (unsigned long long)stats[i].calls,
+			(unsigned long long)stats[i].bytes,
+			stats[i].ns / 1e6);
+	}
+	fprintf(stderr, "  %-22s %34.3f\n", "total wall time",
+		total_ns / 1e6);
+}
+
+/* Collects the library phases from now on and prints them at exit. */
+static void stats_enable(void)
+{
+	if (stats_start_ns) {
+		return;
+	}
+	stats_start_ns = stats_now();
+	ebg_set_trace_callback(stats_record, NULL);
+	atexit(stats_print);
+}
+
 error_t parse_common_opt(int key, char *arg, bool compat_mode,
 			 struct arguments_common *arguments)
 {
@@ -71,6 +176,38 @@ error_t parse_common_opt(int key, char *arg, bool compat_mode,
 		found = true;
 		arguments->search_all_devices = true;
 		break;
+	case 'C':
+		found = true;
+		arguments->probe_cache = true;
+		break;
+	case 'U':
+		found = true;
+		arguments->shared_mounts = true;
+		break;
+	case 'Y':
+		found = true;
+		arguments->group_sync = true;
+		break;
+	case 'I':
+		found = true;
+		arguments->image = arg;
+		break;
+	case 'M':
+		found = true;
+		arguments->probe_filter = arg;
+		break;
+	case 'D':
+		found = true;
+		arguments->probe_order = arg;
+		break;
+	case 'E':
+		found = true;
+		arguments->stop_early = true;
+		break;
+	case 'S':
+		found = true;
+		stats_enable();
+		break;
 	case 'f':
 		found = true;
 		free(arguments->envfilepath);
@@ -136,22 +273,76 @@ error_t parse_common_opt(int key, char *arg, bool compat_mode,
 	return 0;
 }
 
-bool get_env(char *configfilepath, BG_ENVDATA *data)
+bool init_environments(const struct arguments_common *arguments)
+{
+	if (arguments->verbosity) {
+		ebg_set_opt_bool(EBG_OPT_VERBOSE, true);
+	}
+	if (arguments->probe_filter &&
+	    ebg_set_probe_filter(arguments->probe_filter) != 0) {
+		fprintf(stderr, "Invalid probe filter rules %s.\n",
+			arguments->probe_filter);
+		return false;
+	}
+	if (arguments->image) {
+		if (!bgenv_init_image(arguments->image)) {
+			fprintf(stderr, "Error reading the environments in %s.\n",
+				arguments->image);
+			return false;
+		}
+		return true;
+	}
+	if (arguments->search_all_devices) {
+		ebg_set_opt_bool(EBG_OPT_PROBE_ALL_DEVICES, true);
+	}
+	if (arguments->probe_order &&
+	    ebg_set_probe_order(arguments->probe_order) != 0) {
+		fprintf(stderr, "Invalid disk order %s.\n",
+			arguments->probe_order);
+		return false;
+	}
+	if (arguments->stop_early) {
+		ebg_set_opt_bool(EBG_OPT_PROBE_STOP_EARLY, true);
+	}
+	if (arguments->probe_cache) {
+		ebg_set_opt_bool(EBG_OPT_PROBE_CACHE, true);
+	}
+	if (arguments->shared_mounts) {
+		ebg_set_opt_bool(EBG_OPT_SHARED_MOUNTS, true);
+	}
+	if (arguments->group_sync) {
+		ebg_set_opt_bool(EBG_OPT_GROUP_SYNC, true);
+	}
+	if (!bgenv_init()) {
+		fprintf(stderr, "Error initializing FAT environment.\n");
+		return false;
+	}
+	return true;
+}
+
+bool get_env(char *configfilepath, BG_ENVDATA *data, int *format,
+	     ENV_LOG *log)
 {
 	FILE *config;
-	bool result = true;
+	uint8_t *buf;
+	size_t len;
+	bool result;
 
 	if (!(config = open_config_file(configfilepath, "rb"))) {
 		return false;
 	}
+	/* room for a file of either format */
+	buf = malloc(ENV_FILE_MAX_SIZE);
+	if (!buf) {
+		fclose(config);
+		return false;
+	}
 
-	if (!(fread(data, sizeof(BG_ENVDATA), 1, config) == 1)) {
+	len = fread(buf, 1, ENV_FILE_MAX_SIZE, config);
+	if (ferror(config)) {
 		VERBOSE(stderr, "Error reading environment data from %s\n",
 			configfilepath);
-		if (feof(config)) {
-			VERBOSE(stderr, "End of file encountered.\n");
-		}
-		result = false;
+		len = 0;
 	}
 
 	if (fclose(config)) {
@@ -159,13 +350,7 @@ bool get_env(char *configfilepath, BG_ENVDATA *data)
 			"Error closing environment file after reading.\n");
 	};
 
-	if (result == false) {
-		return false;
-	}
-
-	/* enforce NULL-termination of strings */
-	data->kernelfile[ENV_STRING_LENGTH - 1] = 0;
-	data->kernelparams[ENV_STRING_LENGTH - 1] = 0;
-
-	return validate_envdata(data);
+	result = bgenv_decode(data, buf, len, format, log);
+	free(buf);
+	return result;
 }
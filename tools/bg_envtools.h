@@ -35,8 +35,30 @@
 	      "Set environment partition to use. If no partition is "          \
 	      "specified, the one with the smallest revision value above "     \
 	      "zero is selected.")                                             \
+	, OPT("image", 'I', "IMAGE", 0,                                       \
+	      "Use the config partitions in the disk image file IMAGE "        \
+	      "instead of probing the devices.")                               \
 	, OPT("all", 'A', 0, 0,                                                \
 	      "search on all devices instead of root device only")             \
+	, OPT("cache", 'C', 0, 0,                                              \
+	      "cache the probed config partitions in /run/efibootguard")      \
+	, OPT("shared-mounts", 'U', 0, 0,                                      \
+	      "share the mounts of config partitions with concurrent calls " \
+	      "under /run/efibootguard/mnt")                                  \
+	, OPT("group-sync", 'Y', 0, 0,                                         \
+	      "mount config partitions without the sync option and flush "   \
+	      "each written environment once")                                \
+	, OPT("match", 'M', "RULES", 0,                                        \
+	      "only probe the FAT partitions matching any of the comma "     \
+	      "separated RULES type=GUID, uuid=GUID, name=GLOB, label=GLOB")  \
+	, OPT("disk-order", 'D', "ORDER", 0,                                   \
+	      "with --all, probe the disks in the comma separated ORDER of "  \
+	      "boot, controller and other")                                   \
+	, OPT("stop-early", 'E', 0, 0,                                         \
+	      "with --all, stop probing after the first group of disks that " \
+	      "completes the config partitions")                              \
+	, OPT("stats", 'S', 0, 0,                                              \
+	      "print device, I/O and timing statistics to stderr at exit")    \
 	, OPT("verbose", 'v', 0, 0, "Be verbose")                              \
 	, OPT("version", 'V', 0, 0, "Print version")
 
@@ -50,6 +72,21 @@ struct arguments_common {
 	bool part_specified;
 	/* inspect all devices for bootenvs instead of current root only */
 	bool search_all_devices;
+	/* reuse the result of an earlier probe if nothing changed */
+	bool probe_cache;
+	/* mount config partitions to mount points shared between processes */
+	bool shared_mounts;
+	/* flush written environments once instead of mounting with sync */
+	bool group_sync;
+	/* disk image file to use instead of the devices */
+	char *image;
+	/* rules limiting the probed partitions, see ebg_set_probe_filter() */
+	char *probe_filter;
+	/* disk groups to probe with search_all_devices, see
+	 * ebg_set_probe_order() */
+	char *probe_order;
+	/* stop after the first disk group that has all config partitions */
+	bool stop_early;
 };
 
 int parse_int(char *arg);
@@ -60,6 +97,10 @@ uint8_t str2ustate(char *str);
 error_t parse_common_opt(int key, char *arg, bool compat_mode,
 			 struct arguments_common *arguments);
 
-bool get_env(char *configfilepath, BG_ENVDATA *data);
+/* Applies the probing options of arguments and loads the environments. */
+bool init_environments(const struct arguments_common *arguments);
+
+bool get_env(char *configfilepath, BG_ENVDATA *data, int *format,
+	     ENV_LOG *log);
 
 #endif
@@ -0,0 +1,363 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2026
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+/*
+ * Bulk generation of environment files from a template and a CSV file of
+ * per-device overrides, e.g. serial numbers, for factory provisioning.
+ */
+
+#include <stddef.h>
+
+#include "ebgenv.h"
+#include "uservars.h"
+#include "env_parallel.h"
+
+#include "bg_generate.h"
+
+#define GENERATE_CRC_SIZE (sizeof(BG_ENVDATA) - sizeof(uint32_t))
+
+struct generate_row {
+	char *line;
+	char **fields;
+	unsigned int lineno;
+	int error;
+};
+
+struct generate_ctx {
+	const BG_ENVDATA *template;
+	/* bytes of the template uservar area in use */
+	size_t template_used;
+	int format;
+	const ENV_LOG *log;
+	/* column names, the first one is that of the file column */
+	char **keys;
+	int nkeys;
+	struct generate_row *rows;
+};
+
+/* Splits a CSV line in place into at most max fields. Fields may be quoted
+ * with double quotes, "" stands for a literal quote. Returns the number of
+ * fields or -1 for malformed quoting. */
+static int split_csv(char *line, char **fields, int max)
+{
+	char *in = line;
+	char *out = line;
+	int count = 0;
+
+	line[strcspn(line, "\r\n")] = '\0';
+	for (;;) {
+		if (count == max) {
+			return max + 1;
+		}
+		fields[count++] = out;
+		if (*in == '"') {
+			for (in++;; in++) {
+				if (*in == '\0') {
+					return -1;
+				}
+				if (*in == '"') {
+					if (in[1] != '"') {
+						break;
+					}
+					in++;
+				}
+				*out++ = *in;
+			}
+			in++;
+			if (*in != ',' && *in != '\0') {
+				return -1;
+			}
+		} else {
+			while (*in != ',' && *in != '\0') {
+				*out++ = *in++;
+			}
+		}
+		if (*in == '\0') {
+			*out = '\0';
+			return count;
+		}
+		in++;
+		*out++ = '\0';
+	}
+}
+
+static size_t uservars_used(const BG_ENVDATA *data)
+{
+	return ENV_MEM_USERVARS - bgenv_user_free((uint8_t *)data->userdata);
+}
+
+/* Derives the checksum of data from that of the template by only hashing
+ * the span of bytes that differ. Both uservar areas are zero behind their
+ * used part. */
+static uint32_t derive_crc(const struct generate_ctx *ctx,
+			   const BG_ENVDATA *data)
+{
+	const uint8_t *a = (const uint8_t *)ctx->template;
+	const uint8_t *b = (const uint8_t *)data;
+	size_t used = uservars_used(data);
+	size_t lo = 0;
+	size_t hi = offsetof(BG_ENVDATA, userdata) +
+		    (used > ctx->template_used ? used : ctx->template_used);
+
+	while (lo < hi && a[lo] == b[lo]) {
+		lo++;
+	}
+	if (lo == hi) {
+		return ctx->template->crc32;
+	}
+	while (a[hi - 1] == b[hi - 1]) {
+		hi--;
+	}
+	return bgenv_crc32_patch(ctx->template->crc32, GENERATE_CRC_SIZE, lo,
+				 a + lo, b + lo, hi - lo);
+}
+
+static int write_file(const char *path, const void *data, size_t len)
+{
+	FILE *of = fopen(path, "wb");
+	int error = 0;
+
+	if (!of) {
+		return errno;
+	}
+	if (fwrite(data, len, 1, of) != 1) {
+		error = errno ? errno : EIO;
+	}
+	if (fclose(of) && !error) {
+		error = errno;
+	}
+	return error;
+}
+
+static void generate_row(size_t index, void *arg)
+{
+	struct generate_ctx *ctx = arg;
+	struct generate_row *row = &ctx->rows[index];
+	ebgenv_batch_op_t *ops;
+	uint8_t *buf = NULL;
+	BGENV env = { 0 };
+	uint32_t count = 0;
+	int ret;
+
+	env.data = malloc(sizeof(BG_ENVDATA));
+	ops = calloc(ctx->nkeys ? ctx->nkeys : 1, sizeof(ebgenv_batch_op_t));
+	if (!env.data || !ops) {
+		row->error = ENOMEM;
+		goto cleanup;
+	}
+	memcpy(env.data, ctx->template, sizeof(BG_ENVDATA));
+
+	/* empty cells keep the value of the template */
+	for (int i = 0; i < ctx->nkeys; i++) {
+		char *value = row->fields[i + 1];
+
+		if (*value == '\0') {
+			continue;
+		}
+		ops[count].key = ctx->keys[i + 1];
+		ops[count].datatype = USERVAR_TYPE_DEFAULT |
+				      USERVAR_TYPE_STRING_ASCII;
+		ops[count].value = (uint8_t *)value;
+		ops[count].datalen = strlen(value) + 1;
+		count++;
+	}
+	ret = bgenv_set_batch(&env, ops, count);
+	if (ret) {
+		row->error = -ret;
+		goto cleanup;
+	}
+	env.data->crc32 = derive_crc(ctx, env.data);
+
+	if (ENV_FORMAT_COMPACT(ctx->format)) {
+		ENV_LOG log = *ctx->log;
+		size_t len;
+
+		buf = malloc(ENV_FILE_MAX_SIZE);
+		if (!buf) {
+			row->error = ENOMEM;
+			goto cleanup;
+		}
+		len = bgenv_encode_v2(env.data, ctx->format, buf, &log);
+		row->error = write_file(row->fields[0], buf, len);
+	} else {
+		row->error = write_file(row->fields[0], env.data,
+					sizeof(BG_ENVDATA));
+	}
+
+cleanup:
+	bgenv_uservar_index_free(&env.uservar_index);
+	free(env.unpacked);
+	free(env.data);
+	free(ops);
+	free(buf);
+}
+
+static void free_rows(struct generate_row *rows, size_t count)
+{
+	for (size_t i = 0; i < count; i++) {
+		free(rows[i].line);
+		free(rows[i].fields);
+	}
+}
+
+/* Runs the rows of a chunk in parallel and reports them in input order.
+ * Returns the number of files written. */
+static size_t run_chunk(struct generate_ctx *ctx, size_t count,
+			bool verbosity, int *result)
+{
+	size_t written = 0;
+
+	bgenv_parallel_for(count, generate_row, ctx);
+	for (size_t i = 0; i < count; i++) {
+		struct generate_row *row = &ctx->rows[i];
+
+		if (row->error) {
+			fprintf(stderr, "Error generating %s (line %u): %s\n",
+				row->fields[0], row->lineno,
+				strerror(row->error));
+			*result = 1;
+			continue;
+		}
+		if (verbosity) {
+			fprintf(stdout, "Output written to %s.\n",
+				row->fields[0]);
+		}
+		written++;
+	}
+	return written;
+}
+
+int generate_env_files(const BG_ENVDATA *template, int format,
+		       const ENV_LOG *log, const char *overrides,
+		       bool verbosity)
+{
+	struct generate_ctx ctx = {
+		.template = template,
+		.template_used = uservars_used(template),
+		.format = format,
+		.log = log,
+	};
+	FILE *in = stdin;
+	char *header = NULL;
+	size_t size = 0;
+	size_t count = 0;
+	size_t written = 0;
+	unsigned int lineno = 1;
+	bool aborted = false;
+	int ncolumns;
+	int result = 0;
+
+	if (strcmp(overrides, "-") != 0) {
+		in = fopen(overrides, "r");
+		if (!in) {
+			fprintf(stderr, "Error opening %s: %s\n", overrides,
+				strerror(errno));
+			return 1;
+		}
+	}
+	if (getline(&header, &size, in) < 0) {
+		fprintf(stderr, "Error, %s has no header line.\n", overrides);
+		result = 1;
+		goto cleanup;
+	}
+
+	/* every field takes at least one character */
+	ncolumns = strlen(header) + 1;
+	ctx.keys = calloc(ncolumns, sizeof(char *));
+	ctx.rows = calloc(GENERATE_CHUNK_ROWS, sizeof(struct generate_row));
+	if (!ctx.keys || !ctx.rows) {
+		fprintf(stderr, "Error allocating memory.\n");
+		result = 1;
+		goto cleanup;
+	}
+	ncolumns = split_csv(header, ctx.keys, ncolumns);
+	if (ncolumns < 1) {
+		fprintf(stderr, "Error, malformed header line in %s.\n",
+			overrides);
+		result = 1;
+		goto cleanup;
+	}
+	/* the first column names the output file */
+	ctx.nkeys = ncolumns - 1;
+	for (int i = 1; i < ncolumns; i++) {
+		if (*ctx.keys[i] == '\0') {
+			fprintf(stderr, "Error, empty variable name in the "
+					"header line of %s.\n", overrides);
+			result = 1;
+			goto cleanup;
+		}
+	}
+
+	for (;;) {
+		struct generate_row *row = &ctx.rows[count];
+		ssize_t len;
+
+		size = 0;
+		row->line = NULL;
+		len = getline(&row->line, &size, in);
+		lineno++;
+		if (len < 0) {
+			free(row->line);
+			row->line = NULL;
+			break;
+		}
+		if (row->line[strspn(row->line, " \t\r\n")] == '\0') {
+			free(row->line);
+			continue;
+		}
+		row->lineno = lineno;
+		row->error = 0;
+		row->fields = calloc(ncolumns + 1, sizeof(char *));
+		if (!row->fields) {
+			fprintf(stderr, "Error allocating memory.\n");
+			count++;
+			aborted = true;
+			break;
+		}
+		count++;
+		if (split_csv(row->line, row->fields, ncolumns) != ncolumns ||
+		    *row->fields[0] == '\0') {
+			fprintf(stderr, "Error, line %u of %s does not have "
+					"%d fields with a file name.\n",
+				lineno, overrides, ncolumns);
+			aborted = true;
+			break;
+		}
+		if (count == GENERATE_CHUNK_ROWS) {
+			written += run_chunk(&ctx, count, verbosity, &result);
+			free_rows(ctx.rows, count);
+			count = 0;
+		}
+	}
+	if (!aborted && ferror(in)) {
+		fprintf(stderr, "Error reading %s.\n", overrides);
+		aborted = true;
+	}
+	/* rows are only generated up to the first unreadable line */
+	if (aborted) {
+		result = 1;
+	} else {
+		written += run_chunk(&ctx, count, verbosity, &result);
+	}
+	fprintf(stdout, "%zu environment files written.\n", written);
+
+cleanup:
+	if (ctx.rows) {
+		free_rows(ctx.rows, count);
+	}
+	free(ctx.rows);
+	free(ctx.keys);
+	free(header);
+	if (in != stdin) {
+		fclose(in);
+	}
+	return result;
+}
@@ -0,0 +1,31 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2026
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#ifndef __bg_generate_h_
+#define __bg_generate_h_
+
+#include "env_api.h"
+
+/* number of override rows handed to the worker threads at once */
+#define GENERATE_CHUNK_ROWS 1024
+
+/*
+ * Writes one environment file per data row of the CSV file overrides, or of
+ * stdin for "-". The first column of the header row names the output file,
+ * the others name the variables to set. Each file is a copy of template
+ * with the variables of its row applied, stored in format. The template
+ * checksum must be valid. Returns 0 if all files were written.
+ */
+int generate_env_files(const BG_ENVDATA *template, int format,
+		       const ENV_LOG *log, const char *overrides,
+		       bool verbosity);
+
+#endif
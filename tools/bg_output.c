@@ -0,0 +1,415 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2026
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+/*
+ * Machine-readable output of bg_printenv, JSON Lines and binary TLV.
+ */
+
+#include <stdarg.h>
+#include <unistd.h>
+
+#include "uservars.h"
+
+#include "bg_output.h"
+
+void bg_writer_init(struct bg_writer *w, int fd)
+{
+	memset(w, 0, sizeof(*w));
+	w->fd = fd;
+}
+
+static void bg_writer_flush(struct bg_writer *w)
+{
+	size_t done = 0;
+
+	while (!w->failed && done < w->len) {
+		ssize_t n = write(w->fd, w->buf + done, w->len - done);
+
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			w->failed = true;
+			break;
+		}
+		done += n;
+	}
+	w->len = 0;
+}
+
+bool bg_writer_finish(struct bg_writer *w)
+{
+	bg_writer_flush(w);
+	free(w->buf);
+	w->buf = NULL;
+	w->size = 0;
+	return !w->failed;
+}
+
+/* Returns room for len more bytes, or NULL. */
+static uint8_t *bg_writer_reserve(struct bg_writer *w, size_t len)
+{
+	if (w->failed) {
+		return NULL;
+	}
+	if (w->len + len > w->size) {
+		size_t size = w->size ? w->size : BG_WRITER_FLUSH_SIZE;
+		uint8_t *buf;
+
+		while (size < w->len + len) {
+			size *= 2;
+		}
+		buf = realloc(w->buf, size);
+		if (!buf) {
+			w->failed = true;
+			return NULL;
+		}
+		w->buf = buf;
+		w->size = size;
+	}
+	return w->buf + w->len;
+}
+
+static void bg_put(struct bg_writer *w, const void *data, size_t len)
+{
+	uint8_t *p = bg_writer_reserve(w, len);
+
+	if (p) {
+		memcpy(p, data, len);
+		w->len += len;
+	}
+}
+
+static void bg_puts(struct bg_writer *w, const char *s)
+{
+	bg_put(w, s, strlen(s));
+}
+
+static void bg_printf(struct bg_writer *w, const char *fmt, ...)
+{
+	char tmp[64];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+	va_end(ap);
+	if (len > 0 && (size_t)len < sizeof(tmp)) {
+		bg_put(w, tmp, len);
+	}
+}
+
+/* Ends a unit of output and passes it on once enough is collected. */
+static void bg_writer_end_record(struct bg_writer *w)
+{
+	if (w->len >= BG_WRITER_FLUSH_SIZE) {
+		bg_writer_flush(w);
+	}
+}
+
+static void json_string(struct bg_writer *w, const char *s, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	/* the worst case is a \u00XX escape for every byte */
+	uint8_t *p = bg_writer_reserve(w, 6 * len + 2);
+	uint8_t *start = p;
+
+	if (!p) {
+		return;
+	}
+	*p++ = '"';
+	for (size_t i = 0; i < len; i++) {
+		uint8_t c = s[i];
+
+		if (c == '"' || c == '\\') {
+			*p++ = '\\';
+			*p++ = c;
+		} else if (c < 0x20 || c >= 0x7f) {
+			/* non-ASCII bytes are taken as Latin-1, like the
+			 * conversion of the UTF-16 kernel strings */
+			*p++ = '\\';
+			*p++ = 'u';
+			*p++ = '0';
+			*p++ = '0';
+			*p++ = hex[c >> 4];
+			*p++ = hex[c & 0xf];
+		} else {
+			*p++ = c;
+		}
+	}
+	*p++ = '"';
+	w->len += p - start;
+}
+
+static void json_hex(struct bg_writer *w, const uint8_t *data, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	uint8_t *p = bg_writer_reserve(w, 2 * len + 2);
+	uint8_t *start = p;
+
+	if (!p) {
+		return;
+	}
+	*p++ = '"';
+	for (size_t i = 0; i < len; i++) {
+		*p++ = hex[data[i] >> 4];
+		*p++ = hex[data[i] & 0xf];
+	}
+	*p++ = '"';
+	w->len += p - start;
+}
+
+static uint64_t get_unsigned(const uint8_t *data, uint32_t size)
+{
+	uint64_t v = 0;
+
+	memcpy(&v, data, size < sizeof(v) ? size : sizeof(v));
+	return v;
+}
+
+static int64_t get_signed(const uint8_t *data, uint32_t size)
+{
+	uint64_t v = get_unsigned(data, size);
+	unsigned int shift = 64 - 8 * (size < 8 ? size : 8);
+
+	/* sign extension of the stored width */
+	return shift < 64 ? (int64_t)(v << shift) >> shift : 0;
+}
+
+/* Calls fn with the value of every user variable, uncompressed. */
+static void for_each_uservar(uint8_t *udata,
+			     void (*fn)(struct bg_writer *w, const char *key,
+					uint64_t type, const uint8_t *data,
+					uint32_t size, bool first),
+			     struct bg_writer *w)
+{
+	uint8_t *unpacked = NULL;
+	bool first = true;
+
+	for (; *udata; udata = bgenv_next_uservar(udata)) {
+		char *key;
+		uint64_t type;
+		uint8_t *data;
+		uint32_t rsize, dsize;
+
+		bgenv_map_uservar(udata, &key, &type, &data, &rsize, &dsize);
+		if (type & USERVAR_TYPE_COMPRESSED) {
+			uint8_t *tmp;
+
+			dsize = bgenv_uservar_size(udata);
+			tmp = realloc(unpacked, dsize ? dsize : 1);
+			if (!tmp) {
+				w->failed = true;
+				break;
+			}
+			unpacked = tmp;
+			if (bgenv_uservar_read(udata, unpacked, dsize)) {
+				continue;
+			}
+			data = unpacked;
+			type &= ~USERVAR_TYPE_COMPRESSED;
+		}
+		fn(w, key, type, data, dsize, first);
+		first = false;
+	}
+	free(unpacked);
+}
+
+static void json_uservar(struct bg_writer *w, const char *key, uint64_t type,
+			 const uint8_t *data, uint32_t size, bool first)
+{
+	uint64_t std = type & USERVAR_STANDARD_TYPE_MASK;
+
+	if (!first) {
+		bg_puts(w, ",");
+	}
+	json_string(w, key, strlen(key));
+	bg_printf(w, ":{\"type\":%llu,\"value\":", (long long unsigned)type);
+	if (std == USERVAR_TYPE_STRING_ASCII) {
+		json_string(w, (const char *)data, strnlen((const char *)data,
+							   size));
+	} else if (std >= USERVAR_TYPE_UINT8 && std <= USERVAR_TYPE_UINT64) {
+		bg_printf(w, "%llu",
+			  (long long unsigned)get_unsigned(data, size));
+	} else if (std >= USERVAR_TYPE_SINT8 && std <= USERVAR_TYPE_SINT64) {
+		bg_printf(w, "%lld", (long long)get_signed(data, size));
+	} else if (std == USERVAR_TYPE_BOOL && size >= 1) {
+		bg_puts(w, data[0] ? "true" : "false");
+	} else if (std == USERVAR_TYPE_CHAR && size >= 1) {
+		json_string(w, (const char *)data, 1);
+	} else {
+		json_hex(w, data, size);
+	}
+	bg_puts(w, "}");
+}
+
+void bg_output_json(struct bg_writer *w, BG_ENVDATA *env, int index,
+		    const struct fields *output_fields)
+{
+	char buffer[ENV_STRING_LENGTH + 1];
+	const char *sep = "";
+
+	bg_puts(w, "{");
+	if (index >= 0) {
+		bg_printf(w, "\"partition\":%d", index);
+		sep = ",";
+	}
+	if (output_fields->in_progress) {
+		bg_printf(w, "%s\"in_progress\":%s", sep,
+			  env->in_progress ? "true" : "false");
+		sep = ",";
+	}
+	if (output_fields->revision) {
+		bg_printf(w, "%s\"revision\":%u", sep, env->revision);
+		sep = ",";
+	}
+	if (output_fields->kernel) {
+		str16to8(buffer, env->kernelfile);
+		bg_printf(w, "%s\"kernel\":", sep);
+		json_string(w, buffer, strlen(buffer));
+		sep = ",";
+	}
+	if (output_fields->kernelargs) {
+		str16to8(buffer, env->kernelparams);
+		bg_printf(w, "%s\"kernelargs\":", sep);
+		json_string(w, buffer, strlen(buffer));
+		sep = ",";
+	}
+	if (output_fields->wdog_timeout) {
+		bg_printf(w, "%s\"watchdog_timeout\":%u", sep,
+			  env->watchdog_timeout_sec);
+		sep = ",";
+	}
+	if (output_fields->ustate) {
+		bg_printf(w, "%s\"ustate\":%u", sep, env->ustate);
+		sep = ",";
+	}
+#if ENV_NUM_COUNTERS > 0
+	if (output_fields->counters) {
+		bg_printf(w, "%s\"counters\":{", sep);
+		for (unsigned int i = 0; i < ENV_NUM_COUNTERS; i++) {
+			bg_printf(w, "%s\"%s\":%u", i ? "," : "",
+				  bgenv_counter_name(i), env->counters[i]);
+		}
+		bg_puts(w, "}");
+		sep = ",";
+	}
+#endif
+	if (output_fields->user) {
+		bg_printf(w, "%s\"user\":{", sep);
+		for_each_uservar(env->userdata, json_uservar, w);
+		bg_puts(w, "}");
+	}
+	bg_puts(w, "}\n");
+	bg_writer_end_record(w);
+}
+
+static void tlv_header(struct bg_writer *w, uint16_t tag, uint32_t len)
+{
+	uint8_t hdr[6] = {
+		tag & 0xff, tag >> 8,
+		len & 0xff, (len >> 8) & 0xff, (len >> 16) & 0xff, len >> 24,
+	};
+
+	bg_put(w, hdr, sizeof(hdr));
+}
+
+static void tlv_uint(struct bg_writer *w, uint16_t tag, uint32_t value,
+		     uint32_t size)
+{
+	uint8_t le[4] = {
+		value & 0xff, (value >> 8) & 0xff, (value >> 16) & 0xff,
+		value >> 24,
+	};
+
+	tlv_header(w, tag, size);
+	bg_put(w, le, size);
+}
+
+static void tlv_string(struct bg_writer *w, uint16_t tag, const char *s)
+{
+	uint32_t len = strlen(s);
+
+	tlv_header(w, tag, len);
+	bg_put(w, s, len);
+}
+
+static void tlv_uservar(struct bg_writer *w, const char *key, uint64_t type,
+			const uint8_t *data, uint32_t size, bool first)
+{
+	uint16_t keylen = strlen(key);
+	uint8_t le[8];
+
+	(void)first;
+	tlv_header(w, BG_TLV_USERVAR, 2 + keylen + 8 + size);
+	le[0] = keylen & 0xff;
+	le[1] = keylen >> 8;
+	bg_put(w, le, 2);
+	bg_put(w, key, keylen);
+	for (int i = 0; i < 8; i++) {
+		le[i] = type >> (8 * i);
+	}
+	bg_put(w, le, 8);
+	bg_put(w, data, size);
+}
+
+void bg_output_tlv(struct bg_writer *w, BG_ENVDATA *env, int index,
+		   const struct fields *output_fields)
+{
+	char buffer[ENV_STRING_LENGTH + 1];
+
+	tlv_uint(w, BG_TLV_ENV, index >= 0 ? (uint32_t)index : 0xffffffff, 4);
+	if (output_fields->in_progress) {
+		tlv_uint(w, BG_TLV_IN_PROGRESS, env->in_progress, 1);
+	}
+	if (output_fields->revision) {
+		tlv_uint(w, BG_TLV_REVISION, env->revision, 4);
+	}
+	if (output_fields->kernel) {
+		tlv_string(w, BG_TLV_KERNEL, str16to8(buffer, env->kernelfile));
+	}
+	if (output_fields->kernelargs) {
+		tlv_string(w, BG_TLV_KERNELARGS,
+			   str16to8(buffer, env->kernelparams));
+	}
+	if (output_fields->wdog_timeout) {
+		tlv_uint(w, BG_TLV_WATCHDOG_TIMEOUT,
+			 env->watchdog_timeout_sec, 2);
+	}
+	if (output_fields->ustate) {
+		tlv_uint(w, BG_TLV_USTATE, env->ustate, 1);
+	}
+#if ENV_NUM_COUNTERS > 0
+	if (output_fields->counters) {
+		for (unsigned int i = 0; i < ENV_NUM_COUNTERS; i++) {
+			const char *name = bgenv_counter_name(i);
+			uint16_t len = strlen(name);
+			uint8_t le[6] = {
+				len & 0xff, len >> 8,
+				env->counters[i] & 0xff,
+				(env->counters[i] >> 8) & 0xff,
+				(env->counters[i] >> 16) & 0xff,
+				env->counters[i] >> 24,
+			};
+
+			tlv_header(w, BG_TLV_COUNTER, 2 + len + 4);
+			bg_put(w, le, 2);
+			bg_put(w, name, len);
+			bg_put(w, le + 2, 4);
+		}
+	}
+#endif
+	if (output_fields->user) {
+		for_each_uservar(env->userdata, tlv_uservar, w);
+	}
+	tlv_header(w, BG_TLV_END, 0);
+	bg_writer_end_record(w);
+}
@@ -0,0 +1,64 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2026
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#ifndef __bg_output_h_
+#define __bg_output_h_
+
+#include "env_api.h"
+#include "bg_printenv.h"
+
+/* output is flushed whenever this much is buffered, and at the end */
+#define BG_WRITER_FLUSH_SIZE (256 * 1024)
+
+/* Collects output in memory so that it is passed to the kernel in few
+ * large writes. */
+struct bg_writer {
+	int fd;
+	uint8_t *buf;
+	size_t len;
+	size_t size;
+	/* a write or allocation failed, further output is dropped */
+	bool failed;
+};
+
+/* Tags of the TLV output. Each record is a little-endian 16 bit tag, a
+ * 32 bit length and the value. */
+enum bg_tlv_tag {
+	/* end of an environment, no value */
+	BG_TLV_END = 0,
+	/* start of an environment, u32 config partition index or
+	 * 0xffffffff for a file */
+	BG_TLV_ENV = 1,
+	BG_TLV_IN_PROGRESS = 2,		/* u8 */
+	BG_TLV_REVISION = 3,		/* u32 */
+	BG_TLV_KERNEL = 4,		/* string without terminator */
+	BG_TLV_KERNELARGS = 5,		/* string without terminator */
+	BG_TLV_WATCHDOG_TIMEOUT = 6,	/* u16 */
+	BG_TLV_USTATE = 7,		/* u8 */
+	/* u16 name length, name, u32 value */
+	BG_TLV_COUNTER = 8,
+	/* u16 key length, key, u64 USERVAR_TYPE_*, data as stored */
+	BG_TLV_USERVAR = 16,
+};
+
+void bg_writer_init(struct bg_writer *w, int fd);
+/* Writes out what is buffered and releases the buffer. Returns false if
+ * any output was lost. */
+bool bg_writer_finish(struct bg_writer *w);
+
+/* Emits env as one line of JSON, or as TLV records. index is the config
+ * partition, or -1 if env was read from a file. */
+void bg_output_json(struct bg_writer *w, BG_ENVDATA *env, int index,
+		    const struct fields *output_fields);
+void bg_output_tlv(struct bg_writer *w, BG_ENVDATA *env, int index,
+		   const struct fields *output_fields);
+
+#endif
@@ -13,9 +13,15 @@
  * SPDX-License-Identifier:	GPL-2.0
  */
 
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
 #include "uservars.h"
 
 #include "bg_envtools.h"
+#include "bg_output.h"
 #include "bg_printenv.h"
 
 static char tool_doc[] =
@@ -29,12 +35,23 @@ static struct argp_option options_printenv[] = {
 	OPT("output", 'o', "LIST", 0,
 	    "Comma-separated list of fields which are printed. "
 	    "Available fields: in_progress, revision, kernel, kernelargs, "
-	    "watchdog_timeout, ustate, user. "
+	    "watchdog_timeout, ustate, user, counters. "
 	    "If omitted, all available fields are printed."),
 	OPT("raw", 'r', 0, 0, "Raw output mode, e.g. for shell scripting"),
+	OPT("output-format", 'O', "FORMAT", 0,
+	    "Print text (default), json (one JSON object per line and "
+	    "environment) or tlv (binary records)"),
+	OPT("watch", 'w', "SECONDS", OPTION_ARG_OPTIONAL,
+	    "Keep running and print the environments again whenever one of "
+	    "the printed fields changes. Changes are noticed through inotify "
+	    "and by rereading the environments every SECONDS (default 5, 0 "
+	    "for never)."),
 	{0},
 };
 
+/* rereading interval of --watch for changes inotify does not report */
+#define WATCH_DEFAULT_INTERVAL 5
+
 /* Arguments used by bg_printenv. */
 struct arguments_printenv {
 	struct arguments_common common;
@@ -42,9 +59,20 @@ struct arguments_printenv {
 	/* a bitset to decide which fields are printed */
 	struct fields output_fields;
 	bool raw;
+	/* OUTPUT_* */
+	int output_format;
+	bool watch;
+	/* seconds between rereading the environments, 0 for never */
+	int watch_interval;
 };
 
-const struct fields ALL_FIELDS = {1, 1, 1, 1, 1, 1, 1};
+enum { OUTPUT_TEXT, OUTPUT_JSON, OUTPUT_TLV };
+
+/* machine-readable output goes through the writer instead of stdio */
+static int output_format = OUTPUT_TEXT;
+static struct bg_writer writer;
+
+const struct fields ALL_FIELDS = {1, 1, 1, 1, 1, 1, 1, 1};
 
 static error_t parse_output_fields(char *fields, struct fields *output_fields)
 {
@@ -66,6 +94,8 @@ static error_t parse_output_fields(char *fields, struct fields *output_fields)
 			output_fields->ustate = true;
 		} else if (strcmp(token, "user") == 0) {
 			output_fields->user = true;
+		} else if (strcmp(token, "counters") == 0) {
+			output_fields->counters = true;
 		} else {
 			fprintf(stderr, "Unknown output field: %s\n", token);
 			return 1;
@@ -76,33 +106,57 @@ static error_t parse_output_fields(char *fields, struct fields *output_fields)
 
 static void dump_uservars(uint8_t *udata, bool raw)
 {
-	char *key, *value;
+	char *key, *value, *unpacked = NULL;
 	uint64_t type;
 	uint32_t rsize, dsize;
 	uint64_t val_unum;
 	int64_t val_snum;
+	/* values are not aligned within the uservar area */
+	union {
+		uint8_t u8;
+		uint16_t u16;
+		uint32_t u32;
+		uint64_t u64;
+		int8_t s8;
+		int16_t s16;
+		int32_t s32;
+		int64_t s64;
+	} num;
 
-	while (*udata) {
+	for (; *udata; free(unpacked), unpacked = NULL,
+		       udata = bgenv_next_uservar(udata)) {
 		bgenv_map_uservar(udata, &key, &type, (uint8_t **)&value,
 				  &rsize, &dsize);
 		fprintf(stdout, "%s", key);
+		if (type & USERVAR_TYPE_COMPRESSED) {
+			dsize = bgenv_uservar_size(udata);
+			unpacked = malloc(dsize ? dsize : 1);
+			if (!unpacked ||
+			    bgenv_uservar_read(udata, unpacked, dsize)) {
+				fprintf(stdout, " ( Value is not readable )\n");
+				continue;
+			}
+			value = unpacked;
+		}
 		type &= USERVAR_STANDARD_TYPE_MASK;
+		memset(&num, 0, sizeof(num));
+		memcpy(&num, value, dsize < sizeof(num) ? dsize : sizeof(num));
 		if (type == USERVAR_TYPE_STRING_ASCII) {
 			fprintf(stdout, raw ? "=%s\n" : " = %s\n", value);
 		} else if (type >= USERVAR_TYPE_UINT8 &&
 			   type <= USERVAR_TYPE_UINT64) {
 			switch(type) {
 			case USERVAR_TYPE_UINT8:
-				val_unum = *((uint8_t *) value);
+				val_unum = num.u8;
 				break;
 			case USERVAR_TYPE_UINT16:
-				val_unum = *((uint16_t *) value);
+				val_unum = num.u16;
 				break;
 			case USERVAR_TYPE_UINT32:
-				val_unum = *((uint32_t *) value);
+				val_unum = num.u32;
 				break;
 			case USERVAR_TYPE_UINT64:
-				val_unum = *((uint64_t *) value);
+				val_unum = num.u64;
 				break;
 			}
 			fprintf(stdout, raw ? "=%llu\n" : " = %llu\n",
@@ -111,16 +165,16 @@ static void dump_uservars(uint8_t *udata, bool raw)
 			   type <= USERVAR_TYPE_SINT64) {
 			switch(type) {
 			case USERVAR_TYPE_SINT8:
-				val_snum = *((int8_t *) value);
+				val_snum = num.s8;
 				break;
 			case USERVAR_TYPE_SINT16:
-				val_snum = *((int16_t *) value);
+				val_snum = num.s16;
 				break;
 			case USERVAR_TYPE_SINT32:
-				val_snum = *((int32_t *) value);
+				val_snum = num.s32;
 				break;
 			case USERVAR_TYPE_SINT64:
-				val_snum = *((int64_t *) value);
+				val_snum = num.s64;
 				break;
 			}
 			fprintf(stdout, raw ? "=%lld\n" : " = %lld\n",
@@ -139,8 +193,6 @@ static void dump_uservars(uint8_t *udata, bool raw)
 				fprintf(stdout, " ( Type is not printable )\n");
 			}
 		}
-
-		udata = bgenv_next_uservar(udata);
 	}
 }
 
@@ -199,6 +251,22 @@ void dump_env(BG_ENVDATA *env, const struct fields *output_fields, bool raw)
 				(uint8_t)env->ustate, ustate2str(env->ustate));
 		}
 	}
+#if ENV_NUM_COUNTERS > 0
+	if (output_fields->counters) {
+		for (unsigned int i = 0; i < ENV_NUM_COUNTERS; i++) {
+			const char *name = bgenv_counter_name(i);
+
+			if (raw) {
+				fprintf(stdout, "%s=%u\n", name,
+					env->counters[i]);
+			} else {
+				fprintf(stdout, "%s:%*s%u\n", name,
+					(int)(17 - strlen(name)), "",
+					env->counters[i]);
+			}
+		}
+	}
+#endif
 	if (output_fields->user) {
 		if (!raw) {
 			fprintf(stdout, "\n");
@@ -211,10 +279,42 @@ void dump_env(BG_ENVDATA *env, const struct fields *output_fields, bool raw)
 	}
 }
 
+static void output_env(BG_ENVDATA *env, int index,
+		       const struct fields *output_fields, bool raw)
+{
+	switch (output_format) {
+	case OUTPUT_JSON:
+		bg_output_json(&writer, env, index, output_fields);
+		break;
+	case OUTPUT_TLV:
+		bg_output_tlv(&writer, env, index, output_fields);
+		break;
+	default:
+		dump_env(env, output_fields, raw);
+		break;
+	}
+}
+
+/* index of the config partition whose environment env is */
+static int env_index(BGENV *env)
+{
+	int index = -1;
+
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS && index < 0; i++) {
+		BGENV *part = bgenv_open_by_index(i);
+
+		if (part && part->data == env->data) {
+			index = i;
+		}
+		bgenv_close(part);
+	}
+	return index;
+}
+
 void dump_envs(const struct fields *output_fields, bool raw)
 {
 	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
-		if (!raw) {
+		if (!raw && output_format == OUTPUT_TEXT) {
 			fprintf(stdout, "\n----------------------------\n");
 			fprintf(stdout, " Config Partition #%d ", i);
 		}
@@ -225,7 +325,7 @@ void dump_envs(const struct fields *output_fields, bool raw)
 				i);
 			return;
 		}
-		dump_env(env->data, output_fields, raw);
+		output_env(env->data, i, output_fields, raw);
 		bgenv_close(env);
 	}
 }
@@ -237,7 +337,7 @@ static void dump_latest_env(const struct fields *output_fields, bool raw)
 		fprintf(stderr, "Failed to retrieve latest environment.\n");
 		return;
 	}
-	dump_env(env->data, output_fields, raw);
+	output_env(env->data, env_index(env), output_fields, raw);
 	bgenv_close(env);
 }
 
@@ -249,20 +349,44 @@ static void dump_env_by_index(uint32_t index, struct fields output_fields,
 		fprintf(stderr, "Failed to retrieve latest environment.\n");
 		return;
 	}
-	dump_env(env->data, &output_fields, raw);
+	output_env(env->data, index, &output_fields, raw);
 	bgenv_close(env);
 }
 
+static void begin_output(int format)
+{
+	output_format = format;
+	if (output_format != OUTPUT_TEXT) {
+		/* keep the order with what stdio already buffered */
+		fflush(stdout);
+		bg_writer_init(&writer, STDOUT_FILENO);
+	}
+}
+
+static int end_output(void)
+{
+	if (output_format == OUTPUT_TEXT) {
+		return 0;
+	}
+	output_format = OUTPUT_TEXT;
+	if (!bg_writer_finish(&writer)) {
+		fprintf(stderr, "Error writing output: %s\n", strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
 static int printenv_from_file(char *envfilepath, const struct fields *output_fields,
-			      bool raw)
+			      bool raw, int format)
 {
 	int success = 0;
 	BG_ENVDATA data;
 
-	success = get_env(envfilepath, &data);
+	success = get_env(envfilepath, &data, NULL, NULL);
 	if (success) {
-		dump_env(&data, output_fields, raw);
-		return 0;
+		begin_output(format);
+		output_env(&data, -1, output_fields, raw);
+		return end_output();
 	} else {
 		fprintf(stderr, "Error reading environment file.\n");
 		return 1;
@@ -284,6 +408,29 @@ static error_t parse_printenv_opt(int key, char *arg, struct argp_state *state)
 	case 'r':
 		arguments->raw = true;
 		break;
+	case 'O':
+		if (strcmp(arg, "text") == 0) {
+			arguments->output_format = OUTPUT_TEXT;
+		} else if (strcmp(arg, "json") == 0) {
+			arguments->output_format = OUTPUT_JSON;
+		} else if (strcmp(arg, "tlv") == 0) {
+			arguments->output_format = OUTPUT_TLV;
+		} else {
+			fprintf(stderr, "Unknown output format: %s\n", arg);
+			e = 1;
+		}
+		break;
+	case 'w':
+		arguments->watch = true;
+		if (arg) {
+			arguments->watch_interval = parse_int(arg);
+			if (errno || arguments->watch_interval < 0) {
+				fprintf(stderr, "Invalid watch interval: %s\n",
+					arg);
+				e = 1;
+			}
+		}
+		break;
 	case ARGP_KEY_ARG:
 		/* too many arguments - program terminates with call to
 		 * argp_usage with non-zero return code */
@@ -296,8 +443,8 @@ static error_t parse_printenv_opt(int key, char *arg, struct argp_state *state)
 	return e;
 }
 
-/* This is the entrypoint for the command bg_printenv. */
-error_t bg_printenv(int argc, char **argv)
+static error_t parse_printenv(int argc, char **argv,
+			      struct arguments_printenv *arguments)
 {
 	struct argp argp_printenv = {
 		.options = options_printenv,
@@ -305,16 +452,16 @@ error_t bg_printenv(int argc, char **argv)
 		.doc = tool_doc,
 	};
 
-	struct arguments_printenv arguments = {
-		.output_fields = ALL_FIELDS,
-	};
+	memset(arguments, 0, sizeof(struct arguments_printenv));
+	arguments->output_fields = ALL_FIELDS;
+	arguments->watch_interval = WATCH_DEFAULT_INTERVAL;
 
-	error_t e = argp_parse(&argp_printenv, argc, argv, 0, 0, &arguments);
+	error_t e = argp_parse(&argp_printenv, argc, argv, 0, 0, arguments);
 	if (e) {
 		return e;
 	}
 
-	const struct arguments_common *common = &arguments.common;
+	const struct arguments_common *common = &arguments->common;
 
 	/* count the number of arguments which result in bg_printenv
 	 * operating on a single partition; to avoid ambiguity, we only
@@ -322,12 +469,20 @@ error_t bg_printenv(int argc, char **argv)
 	int counter = 0;
 	if (common->envfilepath) ++counter;
 	if (common->part_specified) ++counter;
-	if (arguments.current) ++counter;
+	if (arguments->current) ++counter;
 	if (counter > 1) {
 		fprintf(stderr, "Error, only one of -c/-f/-p can be set.\n");
 		return 1;
 	}
-	if (arguments.raw && counter != 1) {
+	if (common->envfilepath && common->image) {
+		fprintf(stderr, "Error, -f and -I cannot be used together.\n");
+		return 1;
+	}
+	if (common->envfilepath && arguments->watch) {
+		fprintf(stderr, "Error, -f and -w cannot be used together.\n");
+		return 1;
+	}
+	if (arguments->raw && counter != 1) {
 		/* raw mode makes only sense if applied to a single
 		 * partition */
 		fprintf(stderr, "Error, raw is set but "
@@ -335,42 +490,266 @@ error_t bg_printenv(int argc, char **argv)
 				"Must use -r and -c/-f/-p simultaneously.\n");
 		return 1;
 	}
+	if (arguments->raw && arguments->output_format != OUTPUT_TEXT) {
+		fprintf(stderr, "Error, raw mode only applies to text "
+				"output.\n");
+		return 1;
+	}
+	return 0;
+}
+
+static int print_selected_envs(const struct arguments_printenv *arguments)
+{
+	begin_output(arguments->output_format);
+	if (arguments->current) {
+		if (!arguments->raw && output_format == OUTPUT_TEXT) {
+			fprintf(stdout, "Using latest config partition\n");
+		}
+		dump_latest_env(&arguments->output_fields, arguments->raw);
+	} else if (arguments->common.part_specified) {
+		if (!arguments->raw && output_format == OUTPUT_TEXT) {
+			fprintf(stdout, "Using config partition #%d\n",
+				arguments->common.which_part);
+		}
+		dump_env_by_index(arguments->common.which_part,
+				  arguments->output_fields, arguments->raw);
+	} else {
+		dump_envs(&arguments->output_fields, arguments->raw);
+	}
+	return end_output();
+}
+
+static volatile sig_atomic_t watch_quit;
+
+static void on_watch_signal(int sig)
+{
+	(void)sig;
+	watch_quit = 1;
+}
+
+static bool fields_differ(const BG_ENVDATA *a, const BG_ENVDATA *b,
+			  const struct fields *f)
+{
+	return (f->in_progress && a->in_progress != b->in_progress) ||
+	       (f->revision && a->revision != b->revision) ||
+	       (f->kernel && memcmp(a->kernelfile, b->kernelfile,
+				    sizeof(a->kernelfile)) != 0) ||
+	       (f->kernelargs && memcmp(a->kernelparams, b->kernelparams,
+					sizeof(a->kernelparams)) != 0) ||
+	       (f->wdog_timeout &&
+		a->watchdog_timeout_sec != b->watchdog_timeout_sec) ||
+	       (f->ustate && a->ustate != b->ustate) ||
+	       (f->counters && memcmp((const uint8_t *)a + ENV_COUNTERS_OFFSET,
+				      (const uint8_t *)b + ENV_COUNTERS_OFFSET,
+				      ENV_COUNTERS_SIZE) != 0) ||
+	       (f->user && memcmp(a->userdata, b->userdata,
+				  sizeof(a->userdata)) != 0);
+}
+
+/* Watches the files that writes of the environments go to: the device or
+ * image file for raw access and, for a mounted partition, its mount point,
+ * in which the environment file is rewritten. Returns the number of
+ * watches added. */
+static int add_watches(int fd)
+{
+	int count = 0;
+
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		BGENV *env = bgenv_open_by_index(i);
+		CONFIG_PART *part = env ? env->desc : NULL;
+
+		if (part && part->devpath &&
+		    inotify_add_watch(fd, part->devpath, IN_CLOSE_WRITE) >= 0) {
+			count++;
+		}
+		if (part && !part->not_mounted && part->mountpoint &&
+		    inotify_add_watch(fd, part->mountpoint,
+				      IN_CLOSE_WRITE | IN_MOVED_TO) >= 0) {
+			count++;
+		}
+		bgenv_close(env);
+	}
+	return count;
+}
+
+/* Prints the selected environments whose printed fields differ from
+ * known, or all of them if all is set, and updates known. */
+static int print_changes(const struct arguments_printenv *arguments,
+			 BG_ENVDATA *known, int *known_latest, bool all)
+{
+	int latest = -1;
+
+	if (arguments->current) {
+		BGENV *env = bgenv_open_latest();
+
+		latest = env ? env_index(env) : -1;
+		bgenv_close(env);
+	}
+	begin_output(arguments->output_format);
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		BGENV *env = bgenv_open_by_index(i);
+		bool changed;
+
+		if (!env) {
+			fprintf(stderr, "Error, could not read environment "
+					"for index %d\n", i);
+			end_output();
+			return 1;
+		}
+		changed = all || fields_differ(env->data, &known[i],
+					       &arguments->output_fields);
+		memcpy(&known[i], env->data, sizeof(BG_ENVDATA));
+		if (arguments->current) {
+			/* also when another environment became the latest */
+			changed = i == latest &&
+				  (changed || latest != *known_latest);
+		} else if (arguments->common.part_specified) {
+			changed = changed &&
+				  i == arguments->common.which_part;
+		}
+		if (changed) {
+			if (!arguments->raw && output_format == OUTPUT_TEXT) {
+				fprintf(stdout,
+					"\n----------------------------\n");
+				fprintf(stdout, " Config Partition #%d ", i);
+			}
+			output_env(env->data, i, &arguments->output_fields,
+				   arguments->raw);
+		}
+		bgenv_close(env);
+	}
+	*known_latest = latest;
+	fflush(stdout);
+	return end_output();
+}
+
+/* Prints the selected environments, and then again whenever they change,
+ * until interrupted. The partitions are only probed once. */
+static int watch_envs(const struct arguments_printenv *arguments)
+{
+	struct sigaction sa = { .sa_handler = on_watch_signal };
+	struct pollfd pfd = { .events = POLLIN };
+	int timeout = arguments->watch_interval * 1000;
+	int known_latest = -1;
+	BG_ENVDATA *known;
+	int result = 0;
+
+	if (timeout == 0) {
+		timeout = -1;
+	}
+	known = calloc(ENV_NUM_CONFIG_PARTS, sizeof(BG_ENVDATA));
+	if (!known) {
+		fprintf(stderr, "Error allocating memory.\n");
+		return 1;
+	}
+	pfd.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (pfd.fd < 0 || add_watches(pfd.fd) == 0) {
+		if (timeout < 0) {
+			fprintf(stderr, "Error, cannot watch the config "
+					"partitions, set an interval.\n");
+			result = 1;
+			goto out;
+		}
+		VERBOSE(stderr, "Cannot watch the config partitions, "
+			"rereading them every %d seconds.\n",
+			arguments->watch_interval);
+	}
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	result = print_changes(arguments, known, &known_latest, true);
+	while (!watch_quit && result == 0) {
+		char events[4096];
+		int ret = poll(&pfd, 1, timeout);
+
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "Error polling: %s\n", strerror(errno));
+			result = 1;
+			break;
+		}
+		/* the events only say that something was written */
+		while (ret > 0 && read(pfd.fd, events, sizeof(events)) > 0) {
+		}
+		if (!bgenv_reload()) {
+			fprintf(stderr, "Error rereading environments.\n");
+			result = 1;
+			break;
+		}
+		result = print_changes(arguments, known, &known_latest, false);
+	}
+out:
+	if (pfd.fd >= 0) {
+		close(pfd.fd);
+	}
+	free(known);
+	return result;
+}
+
+/* This is the entrypoint for the command bg_printenv. */
+error_t bg_printenv(int argc, char **argv)
+{
+	struct arguments_printenv arguments;
+
+	error_t e = parse_printenv(argc, argv, &arguments);
+	if (e) {
+		return e;
+	}
+
+	const struct arguments_common *common = &arguments.common;
 
 	if (common->envfilepath) {
 		e = printenv_from_file(common->envfilepath,
-				       &arguments.output_fields, arguments.raw);
+				       &arguments.output_fields, arguments.raw,
+				       arguments.output_format);
 		free(common->envfilepath);
 		return e;
 	}
 
 	/* not in file mode */
-	if (arguments.common.search_all_devices) {
-		ebg_set_opt_bool(EBG_OPT_PROBE_ALL_DEVICES, true);
-	}
-	if (arguments.common.verbosity) {
-		ebg_set_opt_bool(EBG_OPT_VERBOSE, true);
-	}
-	if (!bgenv_init()) {
-		fprintf(stderr, "Error initializing FAT environment.\n");
+	if (!init_environments(&arguments.common)) {
 		return 1;
 	}
 
-	if (arguments.current) {
-		if (!arguments.raw) {
-			fprintf(stdout, "Using latest config partition\n");
-		}
-		dump_latest_env(&arguments.output_fields, arguments.raw);
-	} else if (common->part_specified) {
-		if (!arguments.raw) {
-			fprintf(stdout, "Using config partition #%d\n",
-				arguments.common.which_part);
-		}
-		dump_env_by_index(common->which_part, arguments.output_fields,
-				  arguments.raw);
+	if (arguments.watch) {
+		e = watch_envs(&arguments);
 	} else {
-		dump_envs(&arguments.output_fields, arguments.raw);
+		e = print_selected_envs(&arguments);
 	}
 
 	bgenv_finalize();
-	return 0;
+	return e;
+}
+
+error_t bg_printenv_batched(int argc, char **argv)
+{
+	struct arguments_printenv arguments;
+
+	error_t e = parse_printenv(argc, argv, &arguments);
+	if (e) {
+		return e;
+	}
+
+	if (arguments.common.envfilepath) {
+		e = printenv_from_file(arguments.common.envfilepath,
+				       &arguments.output_fields, arguments.raw,
+				       arguments.output_format);
+		free(arguments.common.envfilepath);
+		return e;
+	}
+	if (arguments.watch) {
+		fprintf(stderr, "Error, -w cannot be used with --batch.\n");
+		return 1;
+	}
+	if (arguments.common.search_all_devices ||
+	    arguments.common.probe_cache || arguments.common.image) {
+		fprintf(stderr, "Error, -A, -C and -I must be passed along "
+				"with --batch.\n");
+		return 1;
+	}
+
+	/* shows the changes of earlier commands, even if not yet written */
+	return print_selected_envs(&arguments);
 }
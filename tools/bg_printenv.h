@@ -26,6 +26,7 @@ struct fields {
 	unsigned int wdog_timeout : 1;
 	unsigned int ustate : 1;
 	unsigned int user : 1;
+	unsigned int counters : 1;
 };
 
 extern const struct fields ALL_FIELDS;
@@ -35,4 +36,8 @@ void dump_env(BG_ENVDATA *env, const struct fields *output_fields, bool raw);
 
 error_t bg_printenv(int argc, char **argv);
 
+/* Runs one bg_printenv command of a batch on the environments loaded by
+ * bgenv_init(), which includes the changes of earlier commands. */
+error_t bg_printenv_batched(int argc, char **argv);
+
 #endif
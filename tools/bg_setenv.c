@@ -21,6 +21,7 @@
 #include "bg_envtools.h"
 #include "bg_setenv.h"
 #include "bg_printenv.h"
+#include "bg_generate.h"
 
 static char tool_doc[] =
 	"bg_setenv - Environment tool for the EFI Boot Guard";
@@ -42,6 +43,25 @@ static struct argp_option options_setenv[] = {
 	    "use this option multiple times."),
 	OPT("in_progress", 'i', "IN_PROGRESS", 0,
 	    "Set in_progress variable to simulate a running update process."),
+	OPT("format", 'F', "FORMAT", 0,
+	    "Store the environment in file format 1 (full size), 2 (compact) "
+	    "or 3 (compact with front-coded variable names). Formats 2 and 3 "
+	    "need a boot loader that supports them. Without this option, the "
+	    "existing format is kept."),
+	OPT("log-slots", 'L', "SLOTS", 0,
+	    "Reserve SLOTS sectors (at most 64, 0 to remove) for a log of "
+	    "user variable updates, which libebgenv can append to instead of "
+	    "rewriting the environment. Implies format 2 unless SLOTS is 0. "
+	    "Without this option, an existing log is kept."),
+	OPT("generate", 'G', "OVERRIDES", 0,
+	    "Write one environment file per line of the CSV file OVERRIDES "
+	    "(- for standard input), whose header names the file column and "
+	    "the variables to set. The environment built from the other "
+	    "options, based on the -f file if given, serves as template."),
+	OPT("compress", 'Z', 0, 0,
+	    "Store user variables of 256 bytes or more LZ4 compressed. "
+	    "Versions of libebgenv without compression support read the "
+	    "compressed bytes instead of the value."),
 	{0},
 };
 
@@ -54,6 +74,12 @@ struct arguments_setenv {
 	/* whether to keep existing entries in BGENV before applying new
 	 * settings */
 	bool preserve_env;
+	/* ENV_FORMAT_* to store the environment in, 0 to keep it */
+	int format;
+	/* number of update log slots, -1 to keep them */
+	int log_slots;
+	/* CSV file of per-file overrides for bulk generation */
+	char *overrides;
 };
 
 typedef enum { ENV_TASK_SET, ENV_TASK_DEL } BGENV_TASK;
@@ -68,6 +94,7 @@ struct env_action {
 };
 
 STAILQ_HEAD(stailhead, env_action) head = STAILQ_HEAD_INITIALIZER(head);
+static struct stailhead done = STAILQ_HEAD_INITIALIZER(done);
 
 static void journal_free_action(struct env_action *action)
 {
@@ -288,12 +315,42 @@ static error_t parse_setenv_opt(int key, char *arg, struct argp_state *state)
 		arguments->auto_update = true;
 		break;
 	case 'x':
+		/* without a '=', there is neither a value nor a deletion */
+		if (arg[0] == '=' || !strchr(arg, '=')) {
+			fprintf(stderr, "Error, expected KEY=VALUE or KEY= "
+					"instead of %s.\n", arg);
+			return 1;
+		}
 		/* Set user-defined variable(s) */
 		e = set_uservars(arg);
 		break;
 	case 'P':
 		arguments->preserve_env = true;
 		break;
+	case 'F':
+		i = parse_int(arg);
+		if (errno || (i != ENV_FORMAT_V1 && !ENV_FORMAT_COMPACT(i))) {
+			fprintf(stderr, "Invalid environment format: %s\n",
+				arg);
+			return 1;
+		}
+		arguments->format = i;
+		break;
+	case 'L':
+		i = parse_int(arg);
+		if (errno || i < 0 || i > ENV_LOG_MAX_SLOTS) {
+			fprintf(stderr, "Invalid number of log slots: %s\n",
+				arg);
+			return 1;
+		}
+		arguments->log_slots = i;
+		break;
+	case 'G':
+		arguments->overrides = arg;
+		break;
+	case 'Z':
+		ebg_set_opt_bool(EBG_OPT_COMPRESS_USERVARS, true);
+		break;
 	case ARGP_KEY_ARG:
 		/* too many arguments - program terminates with call to
 		 * argp_usage with non-zero return code */
@@ -311,46 +368,145 @@ static error_t parse_setenv_opt(int key, char *arg, struct argp_state *state)
 
 static void update_environment(BGENV *env, bool verbosity)
 {
+	struct env_action *action;
+	ebgenv_batch_op_t *ops;
+	uint32_t count = 0;
+	int ret;
+
 	if (verbosity) {
 		fprintf(stdout, "Processing journal...\n");
 	}
 
-	while (!STAILQ_EMPTY(&head)) {
-		struct env_action *action = STAILQ_FIRST(&head);
+	STAILQ_FOREACH(action, &head, journal) {
+		count++;
+	}
+	ops = calloc(count ? count : 1, sizeof(ebgenv_batch_op_t));
 
-		journal_process_action(env, action);
+	/* Collect all sets and deletes into one batch, so that the user
+	 * variable area is rewritten only once. ustate is special since it
+	 * may affect all environments. */
+	count = 0;
+	while (!STAILQ_EMPTY(&head)) {
+		action = STAILQ_FIRST(&head);
+
+		if (!ops || (action->task == ENV_TASK_SET &&
+			     strcmp(action->key, "ustate") == 0)) {
+			journal_process_action(env, action);
+			STAILQ_REMOVE_HEAD(&head, journal);
+			journal_free_action(action);
+			continue;
+		}
+		ops[count].key = action->key;
+		ops[count].datatype = action->type;
+		if (action->task == ENV_TASK_SET) {
+			VERBOSE(stdout,
+				"Task = SET, key = %s, type = %llu, val = %s\n",
+				action->key,
+				(long long unsigned int)action->type,
+				(char *)action->data);
+			ops[count].value = action->data;
+			ops[count].datalen = strlen((char *)action->data) + 1;
+		} else {
+			VERBOSE(stdout, "Task = DEL, key = %s\n", action->key);
+			ops[count].value = (uint8_t *)"";
+			ops[count].datalen = 1;
+		}
+		count++;
+		/* the batch still references key and data */
 		STAILQ_REMOVE_HEAD(&head, journal);
-		journal_free_action(action);
+		STAILQ_INSERT_TAIL(&done, action, journal);
 	}
 
-	env->data->crc32 =
-		bgenv_crc32(0, env->data,
-			    sizeof(BG_ENVDATA) - sizeof(env->data->crc32));
+	if (count) {
+		ret = bgenv_set_batch(env, ops, count);
+		if (ret) {
+			fprintf(stderr, "Error applying changes: %s.\n",
+				strerror(-ret));
+		}
+	}
+	free(ops);
+	while (!STAILQ_EMPTY(&done)) {
+		action = STAILQ_FIRST(&done);
+		STAILQ_REMOVE_HEAD(&done, journal);
+		journal_free_action(action);
+	}
 
+	bgenv_update_crc(env);
 }
 
-static int dumpenv_to_file(char *envfilepath, bool verbosity, bool preserve_env)
+/* Builds the environment from the journal, on top of the one in
+ * envfilepath if preserve_env is set. */
+static bool journal_to_env(char *envfilepath, bool verbosity,
+			   bool preserve_env, int format, int log_slots,
+			   BG_ENVDATA *data, int *file_format, ENV_LOG *log)
 {
-	/* execute journal and write to file */
-	int result = 0;
 	BGENV env;
-	BG_ENVDATA data;
+	bool result = false;
 
 	memset(&env, 0, sizeof(BGENV));
-	memset(&data, 0, sizeof(BG_ENVDATA));
-	env.data = &data;
-
-	if (preserve_env && !get_env(envfilepath, &data)) {
-		return 1;
+	memset(data, 0, sizeof(BG_ENVDATA));
+	memset(log, 0, sizeof(ENV_LOG));
+	env.data = data;
+	*file_format = ENV_FORMAT_V1;
+
+	if (preserve_env &&
+	    !get_env(envfilepath, data, file_format, log)) {
+		goto out;
+	}
+	if (log_slots >= 0) {
+		log->slots = log_slots;
 	}
+	if (format) {
+		*file_format = format;
+	} else if (log->slots) {
+		*file_format = ENV_FORMAT_V2;
+	}
+	/* logged updates are part of data, start a new generation */
+	log->generation++;
 
 	update_environment(&env, verbosity);
 	if (verbosity) {
 		dump_env(env.data, &ALL_FIELDS, false);
 	}
-	FILE *of = fopen(envfilepath, "wb");
+	result = true;
+
+out:
+	/* built by the uservar accesses of the journal */
+	bgenv_uservar_index_free(&env.uservar_index);
+	free(env.unpacked);
+	return result;
+}
+
+static int dumpenv_to_file(char *envfilepath, bool verbosity, bool preserve_env,
+			   int format, int log_slots)
+{
+	/* execute journal and write to file */
+	int result = 0;
+	int file_format;
+	ENV_LOG log;
+	BG_ENVDATA data;
+	uint8_t *buf = NULL;
+	const void *out = &data;
+	size_t len = sizeof(BG_ENVDATA);
+	FILE *of;
+
+	if (!journal_to_env(envfilepath, verbosity, preserve_env, format,
+			    log_slots, &data, &file_format, &log)) {
+		return 1;
+	}
+	if (ENV_FORMAT_COMPACT(file_format)) {
+		buf = malloc(ENV_FILE_MAX_SIZE);
+		if (!buf) {
+			fprintf(stderr, "Error allocating output buffer.\n");
+			result = 1;
+			goto cleanup;
+		}
+		len = bgenv_encode_v2(&data, file_format, buf, &log);
+		out = buf;
+	}
+	of = fopen(envfilepath, "wb");
 	if (of) {
-		if (fwrite(&data, sizeof(BG_ENVDATA), 1, of) != 1) {
+		if (fwrite(out, len, 1, of) != 1) {
 			fprintf(stderr,
 				"Error writing to output file: %s\n",
 				strerror(errno));
@@ -368,94 +524,109 @@ static int dumpenv_to_file(char *envfilepath, bool verbosity, bool preserve_env)
 		result = 1;
 	}
 
+cleanup:
+	free(buf);
 	return result;
 }
 
-/* This is the entrypoint for the command bg_setenv. */
-error_t bg_setenv(int argc, char **argv)
+/* Writes the files of the overrides file, the journal applied to the -f
+ * file, if any, is the template shared by all of them. */
+static int generate_to_files(struct arguments_setenv *arguments)
 {
-	if (argc < 2) {
-		printf("No task to perform. Please specify at least one"
-		       " optional argument. See --help for further"
-		       " information.\n");
+	static BG_ENVDATA template;
+	int file_format;
+	ENV_LOG log;
+	int result;
+
+	if (!journal_to_env(arguments->common.envfilepath,
+			    arguments->common.verbosity,
+			    arguments->common.envfilepath != NULL,
+			    arguments->format, arguments->log_slots, &template,
+			    &file_format, &log)) {
+		free(arguments->common.envfilepath);
 		return 1;
 	}
+	result = generate_env_files(&template, file_format, &log,
+				    arguments->overrides,
+				    arguments->common.verbosity);
+	free(arguments->common.envfilepath);
+	return result;
+}
 
+static error_t parse_setenv(int argc, char **argv,
+			    struct arguments_setenv *arguments)
+{
 	struct argp argp_setenv = {
 		.options = options_setenv,
 		.parser = parse_setenv_opt,
 		.doc = tool_doc,
 	};
 
-	struct arguments_setenv arguments;
-	memset(&arguments, 0, sizeof(struct arguments_setenv));
+	if (argc < 2) {
+		printf("No task to perform. Please specify at least one"
+		       " optional argument. See --help for further"
+		       " information.\n");
+		return 1;
+	}
+
+	memset(arguments, 0, sizeof(struct arguments_setenv));
+	arguments->log_slots = -1;
 
 	STAILQ_INIT(&head);
 
 	error_t e;
-	e = argp_parse(&argp_setenv, argc, argv, 0, 0, &arguments);
+	e = argp_parse(&argp_setenv, argc, argv, 0, 0, arguments);
 	if (e) {
 		return e;
 	}
 
-	if (arguments.auto_update && arguments.common.part_specified) {
+	if (arguments->common.envfilepath && arguments->common.image) {
+		fprintf(stderr, "Error, -f and -I cannot be used together.\n");
+		return 1;
+	}
+	if (arguments->overrides &&
+	    (arguments->common.image || arguments->auto_update ||
+	     arguments->common.part_specified)) {
+		fprintf(stderr, "Error, -G cannot be used with -I, -p or -u.\n");
+		return 1;
+	}
+	if (arguments->auto_update && arguments->common.part_specified) {
 		fprintf(stderr, "Error, both automatic and manual partition "
 				"selection. Cannot use -p and -u "
 				"simultaneously.\n");
 		return 1;
 	}
+	return 0;
+}
 
-	int result = 0;
-
-	/* arguments are parsed, journal is filled */
-
-	/* is output to file or input from file ? */
-	if (arguments.common.envfilepath) {
-		result = dumpenv_to_file(arguments.common.envfilepath,
-					 arguments.common.verbosity,
-					 arguments.preserve_env);
-		free(arguments.common.envfilepath);
-		return result;
-	}
-
-	/* not in file mode */
-	if (arguments.common.search_all_devices) {
-		ebg_set_opt_bool(EBG_OPT_PROBE_ALL_DEVICES, true);
-	}
-	if (arguments.common.verbosity) {
-		ebg_set_opt_bool(EBG_OPT_VERBOSE, true);
-	}
-	if (!bgenv_init()) {
-		fprintf(stderr, "Error initializing FAT environment.\n");
-		return 1;
-	}
+/* Opens the environment selected by arguments and applies the journal to
+ * it. The caller writes and closes the returned handle. */
+static BGENV *apply_setenv(const struct arguments_setenv *arguments)
+{
+	BGENV *env_new = NULL;
+	BGENV *env_current;
 
-	if (arguments.common.verbosity) {
+	if (arguments->common.verbosity) {
 		dump_envs(&ALL_FIELDS, false);
 	}
 
-	BGENV *env_new = NULL;
-	BGENV *env_current;
-
-	if (arguments.auto_update) {
+	if (arguments->auto_update) {
 		/* clone latest environment */
 
 		env_current = bgenv_open_latest();
 		if (!env_current) {
 			fprintf(stderr, "Failed to retrieve latest environment."
 					"\n");
-			result = 1;
-			goto cleanup;
+			return NULL;
 		}
 		env_new = bgenv_open_oldest();
 		if (!env_new) {
 			fprintf(stderr, "Failed to retrieve oldest environment."
 					"\n");
 			bgenv_close(env_current);
-			result = 1;
-			goto cleanup;
+			return NULL;
 		}
-		if (arguments.common.verbosity) {
+		if (arguments->common.verbosity) {
 			fprintf(stdout,
 				"Updating environment with revision %u\n",
 				env_new->data->revision);
@@ -464,48 +635,148 @@ error_t bg_setenv(int argc, char **argv)
 		if (!env_current->data || !env_new->data) {
 			fprintf(stderr, "Invalid environment data pointer.\n");
 			bgenv_close(env_current);
-			result = 1;
-			goto cleanup;
+			bgenv_close(env_new);
+			return NULL;
 		}
 
 		memcpy((char *)env_new->data, (char *)env_current->data,
 		       sizeof(BG_ENVDATA));
 		env_new->data->revision = env_current->data->revision + 1;
+		bgenv_mark_dirty(env_new, 0, sizeof(BG_ENVDATA));
 
 		bgenv_close(env_current);
 	} else {
-		if (arguments.common.part_specified) {
+		if (arguments->common.part_specified) {
 			fprintf(stdout, "Using config partition #%d\n",
-				arguments.common.which_part);
+				arguments->common.which_part);
 			env_new = bgenv_open_by_index(
-				arguments.common.which_part);
+				arguments->common.which_part);
 		} else {
 			env_new = bgenv_open_latest();
 		}
 		if (!env_new) {
 			fprintf(stderr, "Failed to retrieve environment by "
 					"index.\n");
-			result = 1;
-			goto cleanup;
+			return NULL;
 		}
 	}
 
-	update_environment(env_new, arguments.common.verbosity);
+	update_environment(env_new, arguments->common.verbosity);
+	if (arguments->log_slots >= 0) {
+		bgenv_set_log_slots(env_new, arguments->log_slots);
+		if (arguments->log_slots && !arguments->format) {
+			bgenv_set_format(env_new, ENV_FORMAT_V2);
+		}
+	}
+	if (arguments->format) {
+		bgenv_set_format(env_new, arguments->format);
+	}
 
-	if (arguments.common.verbosity) {
+	if (arguments->common.verbosity) {
 		fprintf(stdout, "New environment data:\n");
 		fprintf(stdout, "---------------------\n");
 		dump_env(env_new->data, &ALL_FIELDS, false);
 	}
-	if (!bgenv_write(env_new)) {
+	return env_new;
+}
+
+static int setenv_to_file(struct arguments_setenv *arguments)
+{
+	int result;
+
+	result = dumpenv_to_file(arguments->common.envfilepath,
+				 arguments->common.verbosity,
+				 arguments->preserve_env, arguments->format,
+				 arguments->log_slots);
+	free(arguments->common.envfilepath);
+	return result;
+}
+
+/* This is the entrypoint for the command bg_setenv. */
+error_t bg_setenv(int argc, char **argv)
+{
+	struct arguments_setenv arguments;
+	error_t e;
+
+	e = parse_setenv(argc, argv, &arguments);
+	if (e) {
+		return e;
+	}
+
+	int result = 0;
+
+	/* arguments are parsed, journal is filled */
+
+	if (arguments.overrides) {
+		return generate_to_files(&arguments);
+	}
+
+	/* is output to file or input from file ? */
+	if (arguments.common.envfilepath) {
+		return setenv_to_file(&arguments);
+	}
+
+	/* not in file mode */
+	if (!init_environments(&arguments.common)) {
+		return 1;
+	}
+
+	BGENV *env_new = apply_setenv(&arguments);
+
+	if (!env_new) {
+		result = 1;
+	} else if (!bgenv_write(env_new)) {
 		fprintf(stderr, "Error storing environment.\n");
 		result = 1;
 	} else {
 		fprintf(stdout, "Environment update was successful.\n");
 	}
 
-cleanup:
 	bgenv_close(env_new);
 	bgenv_finalize();
 	return result;
 }
+
+error_t bg_setenv_batched(int argc, char **argv,
+			  BGENV *pending[ENV_NUM_CONFIG_PARTS])
+{
+	struct arguments_setenv arguments;
+	error_t e;
+
+	e = parse_setenv(argc, argv, &arguments);
+	if (e) {
+		return e;
+	}
+	if (arguments.overrides) {
+		return generate_to_files(&arguments);
+	}
+	if (arguments.common.envfilepath) {
+		return setenv_to_file(&arguments);
+	}
+	if (arguments.common.search_all_devices ||
+	    arguments.common.probe_cache || arguments.common.image) {
+		fprintf(stderr, "Error, -A, -C and -I must be passed along "
+				"with --batch.\n");
+		return 1;
+	}
+
+	BGENV *env_new = apply_setenv(&arguments);
+
+	if (!env_new) {
+		return 1;
+	}
+	/* a later command may modify an environment again, all changes end
+	 * up in the same in-memory copy */
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		if (pending[i] && pending[i]->data == env_new->data) {
+			bgenv_close(env_new);
+			return 0;
+		}
+		if (!pending[i]) {
+			pending[i] = env_new;
+			return 0;
+		}
+	}
+	bgenv_close(env_new);
+	return 0;
+}
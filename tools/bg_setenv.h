@@ -18,6 +18,14 @@
 
 #include <errno.h>
 
+#include "env_api.h"
+
 error_t bg_setenv(int argc, char **argv);
 
+/* Runs one bg_setenv command of a batch on the environments loaded by
+ * bgenv_init(). Modified environments are not written but added to
+ * pending, which holds one handle per config partition. */
+error_t bg_setenv_batched(int argc, char **argv,
+			  BGENV *pending[ENV_NUM_CONFIG_PARTS]);
+
 #endif
@@ -0,0 +1,676 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2026
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+/*
+ * ebgenvd probes the config partitions once and serves their environments
+ * from memory over a Unix socket. The protocol is line based, see
+ * docs/TOOLS.md.
+ */
+
+#include <fcntl.h>
+#include <grp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "ebgenv.h"
+
+#include "bg_envtools.h"
+
+#define EBGENVD_SOCKET "/run/ebgenvd.sock"
+#define EBGENVD_MAX_CLIENTS 64
+/* a SET of the largest possible, fully escaped value */
+#define EBGENVD_MAX_LINE (2 * ENV_MEM_USERVARS + 256)
+/* replies queued for a client that does not read them */
+#define EBGENVD_MAX_QUEUE (2 * EBGENVD_MAX_LINE)
+
+static char tool_doc[] =
+	"ebgenvd - Environment daemon for the EFI Boot Guard";
+
+/* if you change these, do not forget to update docs/TOOLS.md */
+static struct argp_option options_ebgenvd[] = {
+	OPT("socket", 's', "PATH", 0,
+	    "Listen on PATH instead of " EBGENVD_SOCKET),
+	OPT("group", 'g', "GROUP", 0,
+	    "Let members of GROUP connect and read the environments"),
+	OPT("image", 'I', "IMAGE", 0,
+	    "Use the config partitions in the disk image file IMAGE"),
+	OPT("all", 'A', 0, 0,
+	    "search on all devices instead of root device only"),
+	OPT("cache", 'C', 0, 0,
+	    "cache the probed config partitions in /run/efibootguard"),
+	OPT("shared-mounts", 'U', 0, 0,
+	    "share the mounts of config partitions with concurrent calls"),
+	OPT("group-sync", 'Y', 0, 0,
+	    "flush each written environment once instead of mounting sync"),
+	OPT("match", 'M', "RULES", 0,
+	    "only probe the FAT partitions matching any of RULES"),
+	OPT("disk-order", 'D', "ORDER", 0,
+	    "with --all, probe the disks in ORDER"),
+	OPT("stop-early", 'E', 0, 0,
+	    "with --all, stop after the first disks with all config partitions"),
+	OPT("verbose", 'v', 0, 0, "Be verbose"),
+	OPT("version", 'V', 0, 0, "Print version"),
+	{0},
+};
+
+struct arguments_ebgenvd {
+	struct arguments_common common;
+	char *socket_path;
+	char *group;
+};
+
+struct client {
+	int fd;
+	/* uid 0 or the daemon's user may modify environments */
+	bool may_write;
+	bool subscribed;
+	/* a send failed or too many replies are queued */
+	bool broken;
+	/* config partition used by GET and SET, -1 for the latest one */
+	int part;
+	char *buf;
+	size_t len;
+	/* replies not sent yet, commands are not read while there are any */
+	char *out;
+	size_t out_len;
+};
+
+static struct client clients[EBGENVD_MAX_CLIENTS];
+static size_t num_clients;
+
+/* the committed state that subscribers are notified about */
+static uint32_t known_revision[ENV_NUM_CONFIG_PARTS];
+static uint8_t known_ustate[ENV_NUM_CONFIG_PARTS];
+static bool pending[ENV_NUM_CONFIG_PARTS];
+
+static volatile sig_atomic_t quit;
+static volatile sig_atomic_t reload;
+
+static error_t parse_ebgenvd_opt(int key, char *arg, struct argp_state *state)
+{
+	struct arguments_ebgenvd *arguments = state->input;
+
+	switch (key) {
+	case 's':
+		arguments->socket_path = arg;
+		break;
+	case 'g':
+		arguments->group = arg;
+		break;
+	case ARGP_KEY_ARG:
+		argp_usage(state);
+		break;
+	default:
+		return parse_common_opt(key, arg, false, &arguments->common);
+	}
+	return 0;
+}
+
+static void on_signal(int sig)
+{
+	if (sig == SIGHUP) {
+		reload = 1;
+	} else {
+		quit = 1;
+	}
+}
+
+/* Only root and the daemon's user may connect, unless a group is given
+ * whose members may read the environments as well. */
+static int listen_socket(const char *path, const char *group)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	gid_t gid = (gid_t)-1;
+	int fd;
+
+	if (group) {
+		struct group *gr = getgrnam(group);
+
+		if (!gr) {
+			fprintf(stderr, "Unknown group %s.\n", group);
+			return -1;
+		}
+		gid = gr->gr_gid;
+	}
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path %s is too long.\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (fd < 0) {
+		fprintf(stderr, "Error creating socket: %s\n", strerror(errno));
+		return -1;
+	}
+	/* a stale socket of an earlier instance */
+	(void)unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    chown(path, (uid_t)-1, gid) < 0 ||
+	    chmod(path, group ? 0660 : 0600) < 0 || listen(fd, 16) < 0) {
+		fprintf(stderr, "Error listening on %s: %s\n", path,
+			strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void drop_client(size_t i)
+{
+	close(clients[i].fd);
+	free(clients[i].buf);
+	free(clients[i].out);
+	clients[i] = clients[--num_clients];
+}
+
+/* Sends as much of the queued replies as the socket takes. */
+static bool flush_client(struct client *c)
+{
+	ssize_t n;
+
+	if (!c->out_len) {
+		return true;
+	}
+	n = send(c->fd, c->out, c->out_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (n < 0) {
+		if (errno == EAGAIN || errno == EINTR) {
+			return true;
+		}
+		c->broken = true;
+		return false;
+	}
+	c->out_len -= n;
+	memmove(c->out, c->out + n, c->out_len);
+	return true;
+}
+
+/* Replies that do not fit into the socket buffer are queued and sent when
+ * the client is writable again. A client that lets the queue grow beyond
+ * EBGENVD_MAX_QUEUE is disconnected instead of consuming memory. */
+static bool send_line(struct client *c, const char *line, size_t len)
+{
+	char *out;
+
+	if (c->broken) {
+		return false;
+	}
+	if (c->out_len + len > EBGENVD_MAX_QUEUE) {
+		c->broken = true;
+		return false;
+	}
+	out = realloc(c->out, c->out_len + len);
+	if (!out) {
+		c->broken = true;
+		return false;
+	}
+	memcpy(out + c->out_len, line, len);
+	c->out = out;
+	c->out_len += len;
+	return flush_client(c);
+}
+
+static bool reply(struct client *c, const char *fmt, ...)
+{
+	char *line;
+	va_list ap;
+	int len;
+	bool res;
+
+	va_start(ap, fmt);
+	len = vasprintf(&line, fmt, ap);
+	va_end(ap);
+	if (len < 0) {
+		return false;
+	}
+	res = send_line(c, line, len);
+	free(line);
+	return res;
+}
+
+static bool reply_error(struct client *c, int err)
+{
+	return reply(c, "ERR %d %s\n", err, strerror(err));
+}
+
+/* Sends a value with line breaks and backslashes escaped. */
+static bool reply_value(struct client *c, const char *value)
+{
+	size_t len = strlen(value);
+	char *line = malloc(2 * len + 5);
+	char *p = line;
+	bool res;
+
+	if (!line) {
+		return reply_error(c, ENOMEM);
+	}
+	p += sprintf(p, "OK ");
+	for (size_t i = 0; i < len; i++) {
+		if (value[i] == '\n') {
+			*p++ = '\\';
+			*p++ = 'n';
+			continue;
+		}
+		if (value[i] == '\\') {
+			*p++ = '\\';
+		}
+		*p++ = value[i];
+	}
+	*p++ = '\n';
+	res = send_line(c, line, p - line);
+	free(line);
+	return res;
+}
+
+static void unescape(char *s)
+{
+	char *out = s;
+
+	for (; *s; s++) {
+		if (*s == '\\' && s[1] == 'n') {
+			*out++ = '\n';
+			s++;
+		} else if (*s == '\\' && s[1] == '\\') {
+			*out++ = '\\';
+			s++;
+		} else {
+			*out++ = *s;
+		}
+	}
+	*out = '\0';
+}
+
+static BGENV *open_env(const struct client *c)
+{
+	if (c->part < 0) {
+		return bgenv_open_latest();
+	}
+	return bgenv_open_by_index(c->part);
+}
+
+static void snapshot_state(void)
+{
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		BGENV *env = bgenv_open_by_index(i);
+
+		if (env) {
+			known_revision[i] = env->data->revision;
+			known_ustate[i] = env->data->ustate;
+		}
+		bgenv_close(env);
+	}
+}
+
+/* Tells subscribers about config partitions whose revision or ustate
+ * changed since the last call. */
+static void notify_changes(void)
+{
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		BGENV *env = bgenv_open_by_index(i);
+
+		if (!env) {
+			continue;
+		}
+		if (env->data->revision != known_revision[i] ||
+		    env->data->ustate != known_ustate[i]) {
+			known_revision[i] = env->data->revision;
+			known_ustate[i] = env->data->ustate;
+			for (size_t j = 0; j < num_clients; j++) {
+				if (clients[j].subscribed) {
+					(void)reply(&clients[j],
+						    "EVENT %d %u %u\n", i,
+						    known_revision[i],
+						    known_ustate[i]);
+				}
+			}
+		}
+		bgenv_close(env);
+	}
+}
+
+static void reload_envs(void)
+{
+	if (!bgenv_reload()) {
+		fprintf(stderr, "Error reloading the environments.\n");
+		return;
+	}
+	memset(pending, 0, sizeof(pending));
+	notify_changes();
+}
+
+static int commit_envs(void)
+{
+	int res = 0;
+
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		if (!pending[i]) {
+			continue;
+		}
+		BGENV *env = bgenv_open_by_index(i);
+
+		if (!env || !bgenv_write(env)) {
+			res = EIO;
+		} else {
+			pending[i] = false;
+		}
+		bgenv_close(env);
+	}
+	return res;
+}
+
+static int cmd_get(struct client *c, char *key)
+{
+	const char *str;
+	uint32_t u32;
+	int res;
+
+	BGENV *env = open_env(c);
+	if (!env) {
+		return ENOENT;
+	}
+	res = bgenv_get_str(env, key, &str);
+	if (res == 0) {
+		(void)reply_value(c, str);
+	} else if (res == -EINVAL) {
+		res = bgenv_get_u32(env, key, &u32);
+		if (res == 0) {
+			(void)reply(c, "OK %u\n", u32);
+		}
+	}
+	bgenv_close(env);
+	return -res;
+}
+
+static int cmd_set(struct client *c, char *key, char *value)
+{
+	uint64_t type = USERVAR_TYPE_DEFAULT | USERVAR_TYPE_STRING_ASCII;
+	int res;
+
+	if (!c->may_write) {
+		return EPERM;
+	}
+	BGENV *env = open_env(c);
+	if (!env) {
+		return ENOENT;
+	}
+	if (value) {
+		unescape(value);
+	} else {
+		/* deleting, like bg_setenv -x KEY= */
+		type = USERVAR_TYPE_DEFAULT | USERVAR_TYPE_DELETED;
+		value = "";
+	}
+	res = bgenv_set(env, key, type, value, strlen(value) + 1);
+	if (res == 0) {
+		bgenv_update_crc(env);
+		for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+			BGENV *part = bgenv_open_by_index(i);
+
+			if (part && part->data == env->data) {
+				pending[i] = true;
+			}
+			bgenv_close(part);
+		}
+	}
+	bgenv_close(env);
+	return -res;
+}
+
+static int cmd_use(struct client *c, char *arg)
+{
+	int i;
+
+	if (strcmp(arg, "latest") == 0) {
+		c->part = -1;
+		return 0;
+	}
+	i = parse_int(arg);
+	if (errno || i < 0 || i >= ENV_NUM_CONFIG_PARTS) {
+		return EINVAL;
+	}
+	c->part = i;
+	return 0;
+}
+
+static void handle_command(struct client *c, char *line)
+{
+	char *cmd = strtok(line, " ");
+	char *arg = strtok(NULL, " ");
+	/* the value of SET is the rest of the line, including blanks */
+	char *rest = strtok(NULL, "");
+	int res;
+
+	VERBOSE(stdout, "Command: %s %s\n", cmd ? cmd : "",
+		arg ? arg : "");
+
+	if (!cmd) {
+		res = EINVAL;
+	} else if (strcmp(cmd, "GET") == 0 && arg && !rest) {
+		res = cmd_get(c, arg);
+		if (res == 0) {
+			return;
+		}
+	} else if (strcmp(cmd, "SET") == 0 && arg) {
+		res = cmd_set(c, arg, rest ? rest : "");
+	} else if (strcmp(cmd, "DEL") == 0 && arg && !rest) {
+		res = cmd_set(c, arg, NULL);
+	} else if (strcmp(cmd, "USE") == 0 && arg && !rest) {
+		res = cmd_use(c, arg);
+	} else if (strcmp(cmd, "COMMIT") == 0 && !arg) {
+		res = c->may_write ? commit_envs() : EPERM;
+		if (res == 0) {
+			(void)reply(c, "OK\n");
+			notify_changes();
+			return;
+		}
+	} else if (strcmp(cmd, "RELOAD") == 0 && !arg) {
+		res = c->may_write ? 0 : EPERM;
+		if (res == 0) {
+			(void)reply(c, "OK\n");
+			reload_envs();
+			return;
+		}
+	} else if (strcmp(cmd, "SUBSCRIBE") == 0 && !arg) {
+		c->subscribed = true;
+		res = 0;
+	} else {
+		res = EINVAL;
+	}
+
+	if (res) {
+		(void)reply_error(c, res);
+	} else {
+		(void)reply(c, "OK\n");
+	}
+}
+
+static void accept_client(int listen_fd)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	int fd;
+
+	fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (fd < 0) {
+		return;
+	}
+	if (num_clients == EBGENVD_MAX_CLIENTS ||
+	    getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+		close(fd);
+		return;
+	}
+	clients[num_clients] = (struct client){
+		.fd = fd,
+		.may_write = cred.uid == 0 || cred.uid == geteuid(),
+		.part = -1,
+	};
+	num_clients++;
+}
+
+/* Handles the complete lines received, until a reply has to wait for the
+ * client to read. Returns false if the client misbehaved. */
+static bool process_lines(struct client *c)
+{
+	char *line = c->buf, *end;
+
+	while (!c->out_len && !c->broken &&
+	       (end = memchr(line, '\n', c->buf + c->len - line))) {
+		*end = '\0';
+		if (end > line && end[-1] == '\r') {
+			end[-1] = '\0';
+		}
+		handle_command(c, line);
+		line = end + 1;
+	}
+	c->len -= line - c->buf;
+	memmove(c->buf, line, c->len);
+	c->buf[c->len] = '\0';
+	if (c->broken) {
+		return false;
+	}
+	/* an overlong line can never be completed */
+	return c->len < EBGENVD_MAX_LINE ||
+	       memchr(c->buf, '\n', c->len) != NULL;
+}
+
+/* Returns false if the client disconnected or misbehaved. */
+static bool read_client(struct client *c)
+{
+	ssize_t n;
+
+	if (!c->buf) {
+		c->buf = malloc(EBGENVD_MAX_LINE + 1);
+		if (!c->buf) {
+			return false;
+		}
+	}
+	n = recv(c->fd, c->buf + c->len, EBGENVD_MAX_LINE - c->len, 0);
+	if (n <= 0) {
+		return n < 0 && errno == EAGAIN;
+	}
+	c->len += n;
+	return process_lines(c);
+}
+
+/* Returns false if the client disconnected or misbehaved. */
+static bool service_client(struct client *c, short revents)
+{
+	if (revents & POLLOUT) {
+		if (!flush_client(c)) {
+			return false;
+		}
+		/* continue with the commands that waited for the reply */
+		if (!c->out_len && c->buf && !process_lines(c)) {
+			return false;
+		}
+	}
+	if (revents & (POLLIN | POLLHUP | POLLERR)) {
+		/* with replies pending, only POLLOUT is polled for */
+		if (c->out_len || !read_client(c)) {
+			return false;
+		}
+	}
+	return !c->broken;
+}
+
+static int serve(int listen_fd)
+{
+	struct pollfd fds[EBGENVD_MAX_CLIENTS + 1];
+
+	while (!quit) {
+		if (reload) {
+			reload = 0;
+			reload_envs();
+		}
+		/* subscribers that could not take an event */
+		for (size_t i = num_clients; i > 0; i--) {
+			if (clients[i - 1].broken) {
+				drop_client(i - 1);
+			}
+		}
+		fds[0].fd = listen_fd;
+		fds[0].events = POLLIN;
+		for (size_t i = 0; i < num_clients; i++) {
+			fds[i + 1].fd = clients[i].fd;
+			fds[i + 1].events =
+				clients[i].out_len ? POLLOUT : POLLIN;
+		}
+		if (poll(fds, num_clients + 1, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "Error polling: %s\n", strerror(errno));
+			return 1;
+		}
+		/* backwards, so that dropping a client does not skip one */
+		for (size_t i = num_clients; i > 0; i--) {
+			if (fds[i].revents &&
+			    !service_client(&clients[i - 1], fds[i].revents)) {
+				drop_client(i - 1);
+			}
+		}
+		if (fds[0].revents & POLLIN) {
+			accept_client(listen_fd);
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct argp argp_ebgenvd = {
+		.options = options_ebgenvd,
+		.parser = parse_ebgenvd_opt,
+		.doc = tool_doc,
+	};
+	struct arguments_ebgenvd arguments = {
+		.socket_path = EBGENVD_SOCKET,
+	};
+	struct sigaction sa = { .sa_handler = on_signal };
+	int listen_fd;
+	int result;
+
+	error_t e = argp_parse(&argp_ebgenvd, argc, argv, 0, 0, &arguments);
+	if (e) {
+		return e;
+	}
+
+	if (!init_environments(&arguments.common)) {
+		return 1;
+	}
+	snapshot_state();
+
+	listen_fd = listen_socket(arguments.socket_path, arguments.group);
+	if (listen_fd < 0) {
+		bgenv_finalize();
+		return 1;
+	}
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+
+	result = serve(listen_fd);
+
+	/* uncommitted changes are discarded */
+	while (num_clients) {
+		drop_client(num_clients - 1);
+	}
+	close(listen_fd);
+	(void)unlink(arguments.socket_path);
+	bgenv_finalize();
+	return result;
+}
@@ -19,8 +19,15 @@
 #include "ebgpart.h"
 #include <sys/sysmacros.h>
 #include "fat.h"
+#include "env_arena.h"
+#include "env_trace.h"
+
+/* provided by env/env_api_crc32.c */
+extern uint32_t bgenv_crc32(uint32_t, const void *, size_t);
 
 static PedDevice *first_device = NULL;
+/* everything the list of first_device points to */
+static BG_ARENA ped_arena;
 static PedDisk g_ped_dummy_disk;
 static char buffer[37];
 
@@ -73,58 +80,40 @@ static EbgFileSystemType type_to_fstype(char t)
 	return FS_TYPE_UNKNOWN;
 }
 
-/**
- * @brief Determines the FAT bit size of a disk or partition.
- *
- * @param fd        File descriptor to inspect.
- * @param e         A pointer to the EFI partition entry.
- *
- * @return >0: FAT bit size of the disk or partition
- *         =0: non-FAT partition
- *         <0: I/O error
- **/
-static int check_GPT_FAT_entry(int fd, const struct EFIpartitionentry *e)
+/* Type GUIDs in their on-disk byte order */
+static const uint8_t gpt_guid_fat_ntfs[16] = {
+	0xA2, 0xA0, 0xD0, 0xEB, 0xE5, 0xB9, 0x33, 0x44,
+	0x87, 0xC0, 0x68, 0xB6, 0xB7, 0x26, 0x99, 0xC7,
+};
+static const uint8_t gpt_guid_esp[16] = {
+	0x28, 0x73, 0x2A, 0xC1, 0x1F, 0xF8, 0xD2, 0x11,
+	0xBA, 0x4B, 0x00, 0xA0, 0xC9, 0x3E, 0xC9, 0x3B,
+};
+
+static bool is_GPT_FAT_entry(const struct EFIpartitionentry *e)
 {
-	char *guid_str = GUID_to_str(e->type_GUID);
-	if (strcmp(GPT_PARTITION_GUID_FAT_NTFS, guid_str) != 0 &&
-	    strcmp(GPT_PARTITION_GUID_ESP, guid_str) != 0) {
-		VERBOSE(stderr, "GPT entry has unsupported GUID: %s\n",
-			guid_str);
-		return 0;
-	}
-	VERBOSE(stdout, "GPT Partition has a FAT/NTFS GUID\n");
-
-	/* Save current file offset */
-	off64_t curr = lseek64(fd, 0, SEEK_CUR);
-	if (curr == -1) {
-		VERBOSE(stderr, "Error getting current seek position: %s\n",
-			strerror(errno));
-		return -1;
-	}
+	return memcmp(e->type_GUID, gpt_guid_fat_ntfs, 16) == 0 ||
+	       memcmp(e->type_GUID, gpt_guid_esp, 16) == 0;
+}
 
-	/* seek to partition start */
-	off64_t offset_start = (off64_t)e->start_LBA * LB_SIZE;
-	if (lseek64(fd, offset_start, SEEK_SET) == -1) {
-		VERBOSE(stderr, "Error seeking to partition start: %s\n",
-			strerror(errno));
-		return -1;
-	}
+static bool is_GPT_empty_entry(const struct EFIpartitionentry *e)
+{
+	static const uint8_t zero[16];
 
-	/* read FAT header */
-	struct fat_boot_sector header;
-	if (read(fd, &header, sizeof(header)) != sizeof(header)) {
-		VERBOSE(stderr, "Error reading FAT header: %s\n",
-			strerror(errno));
-		return -1;
-	}
+	return memcmp(e->type_GUID, zero, 16) == 0;
+}
 
-	/* restore pos */
-	if (lseek64(fd, curr, SEEK_SET) == -1) {
-		VERBOSE(stderr, "Error restoring seek position (%s)",
-			strerror(errno));
-		return -1;
+/* Non-ASCII characters of the UTF-16 name become '?'. */
+static void GPT_name_to_str(const struct EFIpartitionentry *e, char *name)
+{
+	int i;
+
+	for (i = 0; i < 36 && e->name[i]; i++) {
+		uint16_t c = e->name[i];
+
+		name[i] = c >= 0x20 && c < 0x7f ? (char)c : '?';
 	}
-	return determine_FAT_bits(&header, verbosity);
+	name[i] = '\0';
 }
 
 static inline EbgFileSystemType fat_size_to_fs_type(int fat_size)
@@ -148,57 +137,116 @@ static inline EbgFileSystemType fat_size_to_fs_type(int fat_size)
 	}
 }
 
-static void read_GPT_entries(int fd, uint64_t table_LBA, uint32_t num,
-			     PedDevice *dev)
+/* Upper bound for the partition entry array, the spec minimum is 16 KiB */
+#define GPT_MAX_TABLE_SIZE (1024 * 1024)
+
+static void read_GPT_entries(int fd, const struct EFIHeader *hdr,
+			     PedDevice *dev, BG_ARENA *arena)
 {
-	off64_t offset;
-	struct EFIpartitionentry e;
+	uint32_t num = hdr->partitions;
+	uint32_t entsize = hdr->partitionentrysize;
+	off64_t offset = LB_SIZE * (off64_t)hdr->partitiontable_LBA;
+	PedPartition **list_end = &dev->part_list;
 	PedPartition *tmpp;
+	uint8_t *table;
+	size_t size;
+	uint32_t count;
 
-	offset = LB_SIZE * table_LBA;
-	if (lseek64(fd, offset, SEEK_SET) != offset) {
-		VERBOSE(stderr, "Error seeking EFI partition table\n");
+	if (entsize < sizeof(struct EFIpartitionentry) || entsize % 8 != 0 ||
+	    num == 0 || num > GPT_MAX_TABLE_SIZE / entsize) {
+		VERBOSE(stderr, "Invalid EFI partition table geometry\n");
+		return;
+	}
+	size = (size_t)num * entsize;
+	table = malloc(size);
+	if (!table) {
+		VERBOSE(stderr, "Out of memory\n");
 		return;
 	}
+	/* the whole entry array in one go */
+	if (pread64(fd, table, size, offset) != (ssize_t)size) {
+		VERBOSE(stderr, "Error reading partition table\n");
+		VERBOSE(stderr, "(%s)\n", strerror(errno));
+		goto out;
+	}
+	if (bgenv_crc32(0, table, size) != hdr->partitiontable_CRC32) {
+		VERBOSE(stderr, "Partition table CRC32 mismatch\n");
+		goto out;
+	}
 
-	PedPartition **list_end = &dev->part_list;
+	for (count = 0; count < num; count++) {
+		const struct EFIpartitionentry *e =
+			(const void *)(table + (size_t)count * entsize);
 
-	for (uint32_t i = 0; i < num; i++) {
-		if (read(fd, &e, sizeof(e)) != sizeof(e)) {
-			VERBOSE(stderr, "Error reading partition entry\n");
-			VERBOSE(stderr, "(%s)\n", strerror(errno));
-			return;
+		if (is_GPT_empty_entry(e)) {
+			break;
 		}
-		if ((*((uint64_t *)&e.type_GUID[0]) == 0) &&
-		    (*((uint64_t *)&e.type_GUID[8]) == 0)) {
-			return;
+		/* let the kernel fetch all FAT boot sectors at once */
+		if (is_GPT_FAT_entry(e)) {
+			(void)posix_fadvise64(fd,
+					      (off64_t)e->start_LBA * LB_SIZE,
+					      sizeof(struct fat_boot_sector),
+					      POSIX_FADV_WILLNEED);
 		}
-		VERBOSE(stdout, "%u: %s\n", i, GUID_to_str(e.type_GUID));
+	}
+
+	for (uint32_t i = 0; i < count; i++) {
+		const struct EFIpartitionentry *e =
+			(const void *)(table + (size_t)i * entsize);
+		int result = 0;
 
-		tmpp = calloc(sizeof(PedPartition), 1);
+		VERBOSE(stdout, "%u: %s\n", i, GUID_to_str(e->type_GUID));
+
+		tmpp = bgenv_arena_alloc(arena, sizeof(PedPartition));
 		if (!tmpp) {
 			VERBOSE(stderr, "Out of memory\n");
-			return;
+			goto out;
 		}
 		tmpp->num = i + 1;
-
-		int result = check_GPT_FAT_entry(fd, &e);
-		if (result < 0) {
-			VERBOSE(stderr, "%u: I/O error, skipping device\n", i);
-			free(tmpp);
-			dev->part_list = NULL;
-			continue;
+		tmpp->start_LBA = e->start_LBA;
+		tmpp->gpt = true;
+		memcpy(tmpp->type_GUID, e->type_GUID, 16);
+		memcpy(tmpp->partition_GUID, e->partition_GUID, 16);
+		GPT_name_to_str(e, tmpp->name);
+
+		if (is_GPT_FAT_entry(e)) {
+			struct fat_boot_sector header;
+
+			VERBOSE(stdout, "GPT Partition has a FAT/NTFS GUID\n");
+			if (pread64(fd, &header, sizeof(header),
+				    (off64_t)e->start_LBA * LB_SIZE) !=
+			    sizeof(header)) {
+				VERBOSE(stderr,
+					"%u: I/O error, skipping device\n", i);
+				/* the entries stay in the arena until the
+				 * device goes */
+				dev->part_list = NULL;
+				goto out;
+			}
+			result = determine_FAT_bits(&header, verbosity);
+			/* kept for the probe filter, which saves a read */
+			if (result > 0) {
+				fat_volume_label(&header, result, tmpp->label);
+				tmpp->label_read = true;
+			}
+		} else {
+			VERBOSE(stderr, "GPT entry has unsupported GUID: %s\n",
+				GUID_to_str(e->type_GUID));
 		}
 		tmpp->fs_type = fat_size_to_fs_type(result);
 
 		*list_end = tmpp;
 		list_end = &((*list_end)->next);
 	}
+
+out:
+	free(table);
 }
 
 static void scanLogicalVolumes(int fd, off64_t extended_start_LBA,
 			       struct Masterbootrecord *ebr, int i,
-			       PedPartition *partition, int lognum)
+			       PedPartition *partition, int lognum,
+			       BG_ARENA *arena)
 {
 	struct Masterbootrecord next_ebr;
 
@@ -231,24 +279,24 @@ static void scanLogicalVolumes(int fd, off64_t extended_start_LBA,
 		if (t == MBR_TYPE_EXTENDED || t == MBR_TYPE_EXTENDED_LBA) {
 			VERBOSE(stdout, "Next EBR found.\n");
 			scanLogicalVolumes(fd, extended_start_LBA, &next_ebr, j,
-					   partition, lognum + 1);
+					   partition, lognum + 1, arena);
 			continue;
 		}
-		partition->next = calloc(sizeof(PedPartition), 1);
+		partition->next = bgenv_arena_alloc(arena,
+						    sizeof(PedPartition));
 		if (!partition->next) {
-			goto scl_out_of_mem;
+			VERBOSE(stderr, "Out of memory\n");
+			return;
 		}
 		partition = partition->next;
 		partition->num = lognum;
+		partition->start_LBA = offset + next_ebr.parttable[j].start_LBA;
 		partition->fs_type = type_to_fstype(t);
 	}
-	return;
-scl_out_of_mem:
-	VERBOSE(stderr, "Out of memory\n");
-	free(partition->next);
 }
 
-static bool check_partition_table(PedDevice *dev)
+/* The partitions found are allocated from arena. */
+static bool check_partition_table(PedDevice *dev, BG_ARENA *arena)
 {
 	int fd;
 	struct Masterbootrecord mbr;
@@ -309,23 +357,26 @@ static bool check_partition_table(PedDevice *dev)
 				efihdr.partitions);
 			VERBOSE(stdout, "Partition Table @ LBA %llu\n",
 				(unsigned long long)efihdr.partitiontable_LBA);
-			read_GPT_entries(fd, efihdr.partitiontable_LBA,
-					 efihdr.partitions, dev);
+			read_GPT_entries(fd, &efihdr, dev, arena);
 			break;
 		}
-		tmp = calloc(sizeof(PedPartition), 1);
+		tmp = bgenv_arena_alloc(arena, sizeof(PedPartition));
 		if (!tmp) {
-			goto cpt_out_of_mem;
+			close(fd);
+			VERBOSE(stderr,
+				"Out of mem while checking partition table\n.");
+			return false;
 		}
 
 		tmp->num = i + 1;
+		tmp->start_LBA = mbr.parttable[i].start_LBA;
 
 		*list_end = tmp;
 		list_end = &((*list_end)->next);
 
 		if (t == MBR_TYPE_EXTENDED || t == MBR_TYPE_EXTENDED_LBA) {
 			tmp->fs_type = FS_TYPE_EXTENDED;
-			scanLogicalVolumes(fd, 0, &mbr, i, tmp, 5);
+			scanLogicalVolumes(fd, 0, &mbr, i, tmp, 5, arena);
 			/* Could be we still have MBR entries after
 			 * logical volumes */
 			while ((*list_end)->next) {
@@ -334,12 +385,6 @@ static bool check_partition_table(PedDevice *dev)
 		} else {
 			tmp->fs_type = type_to_fstype(t);
 		}
-		continue;
-	cpt_out_of_mem:
-		close(fd);
-		VERBOSE(stderr, "Out of mem while checking partition table\n.");
-		free(tmp);
-		return false;
 	}
 	close(fd);
 	if (numpartitions == 0) {
@@ -348,38 +393,104 @@ static bool check_partition_table(PedDevice *dev)
 	return true;
 }
 
-static int scan_devdir(unsigned int fmajor, unsigned int fminor, char *fullname,
-		       unsigned int maxlen)
+/* block device nodes in DEVDIR, collected once per probe run */
+struct devnode {
+	dev_t rdev;
+	char *name;
+};
+
+static struct devnode *devnodes;
+static size_t num_devnodes;
+static bool devnodes_scanned;
+
+static void free_devnodes(void)
+{
+	for (size_t i = 0; i < num_devnodes; i++) {
+		free(devnodes[i].name);
+	}
+	free(devnodes);
+	devnodes = NULL;
+	num_devnodes = 0;
+	devnodes_scanned = false;
+}
+
+static void scan_devdir(void)
 {
-	int result = -1;
+	struct dirent *devfile;
+	size_t capacity = 0;
 
+	devnodes_scanned = true;
 	DIR *devdir = opendir(DEVDIR);
 	if (!devdir) {
 		VERBOSE(stderr, "Failed to open %s\n", DEVDIR);
-		return result;
+		return;
 	}
-	while (true) {
-		struct dirent *devfile = readdir(devdir);
-		if (!devfile) {
-			break;
-		}
-		(void)snprintf(fullname, maxlen, "%s/%s", DEVDIR,
-			       devfile->d_name);
+	while ((devfile = readdir(devdir))) {
 		struct stat statbuf;
-		if (stat(fullname, &statbuf) == -1) {
-			VERBOSE(stderr, "stat failed on %s\n", fullname);
-			break;
+
+		/* skip entries that cannot be block devices without a stat */
+		if (devfile->d_type != DT_BLK && devfile->d_type != DT_UNKNOWN) {
+			continue;
 		}
-		if (major(statbuf.st_rdev) == fmajor &&
-		    minor(statbuf.st_rdev) == fminor) {
-			VERBOSE(stdout, "Node found: %s\n", fullname);
-			result = 0;
+		if (fstatat(dirfd(devdir), devfile->d_name, &statbuf, 0) == -1 ||
+		    !S_ISBLK(statbuf.st_mode)) {
+			continue;
+		}
+		if (num_devnodes == capacity) {
+			size_t n = capacity ? capacity * 2 : 64;
+			struct devnode *tmp = realloc(devnodes,
+						      n * sizeof(*devnodes));
+			if (!tmp) {
+				break;
+			}
+			devnodes = tmp;
+			capacity = n;
+		}
+		devnodes[num_devnodes].name = strdup(devfile->d_name);
+		if (!devnodes[num_devnodes].name) {
 			break;
 		}
+		devnodes[num_devnodes].rdev = statbuf.st_rdev;
+		num_devnodes++;
 	}
 	closedir(devdir);
+}
 
-	return result;
+/* Resolves a device number to its node, preferring the /dev/block symlinks
+ * maintained by udev over a single pass over DEVDIR. */
+static int find_devnode(unsigned int fmajor, unsigned int fminor,
+			char *fullname, unsigned int maxlen)
+{
+	dev_t rdev = makedev(fmajor, fminor);
+	struct stat statbuf;
+	char *path;
+
+	(void)snprintf(fullname, maxlen, "%s/block/%u:%u", DEVDIR, fmajor,
+		       fminor);
+	path = realpath(fullname, NULL);
+	if (path) {
+		if (stat(path, &statbuf) == 0 && S_ISBLK(statbuf.st_mode) &&
+		    statbuf.st_rdev == rdev && strlen(path) < maxlen) {
+			strcpy(fullname, path);
+			free(path);
+			VERBOSE(stdout, "Node found: %s\n", fullname);
+			return 0;
+		}
+		free(path);
+	}
+
+	if (!devnodes_scanned) {
+		scan_devdir();
+	}
+	for (size_t i = 0; i < num_devnodes; i++) {
+		if (devnodes[i].rdev == rdev) {
+			(void)snprintf(fullname, maxlen, "%s/%s", DEVDIR,
+				       devnodes[i].name);
+			VERBOSE(stdout, "Node found: %s\n", fullname);
+			return 0;
+		}
+	}
+	return -1;
 }
 
 static int get_major_minor(char *filename, unsigned int *major, unsigned int *minor)
@@ -404,9 +515,14 @@ void ped_device_probe_all(char *rootdev)
 {
 	struct dirent *sysblockfile = NULL;
 	char fullname[DEV_FILENAME_LEN+16];
+	/* traced instead of a byte count */
+	uint64_t ndevices = 0;
+	BG_TRACE_SPAN span;
 
+	BG_TRACE_START(span, ped_device_probe_all, rootdev);
 	DIR *sysblockdir = opendir(SYSBLOCKDIR);
 	if (!sysblockdir) {
+		BG_TRACE_DONE(span, ped_device_probe_all, rootdev, 0, -errno);
 		VERBOSE(stderr, "Could not open %s\n", SYSBLOCKDIR);
 		return;
 	}
@@ -426,8 +542,8 @@ void ped_device_probe_all(char *rootdev)
 			devname = sysblockfile->d_name;
 		}
 
-		(void)snprintf(fullname, sizeof(fullname), "/sys/block/%s/dev",
-			       devname);
+		(void)snprintf(fullname, sizeof(fullname), "%s/%s/dev",
+			       SYSBLOCKDIR, devname);
 		/* Get major and minor revision from /sys/block/sdX/dev */
 		unsigned int fmajor, fminor;
 		if (get_major_minor(fullname, &fmajor, &fminor) < 0) {
@@ -443,57 +559,76 @@ void ped_device_probe_all(char *rootdev)
 		if (stat(fullname, &statbuf) == -1) {
 			/* Node with same name not found in /dev, thus search
 			* for node with identical Major and Minor revision */
-			if (scan_devdir(fmajor, fminor, fullname,
-					sizeof(fullname)) != 0) {
+			if (find_devnode(fmajor, fminor, fullname,
+					 sizeof(fullname)) != 0) {
 				continue;
 			}
 		}
-		/* This is a block device, so add it to the list*/
-		PedDevice *dev = calloc(sizeof(PedDevice), 1);
+		/* This is a block device, so add it to the list. Devices
+		 * without partition table stay in the arena until the list
+		 * is released, they are few and small. */
+		PedDevice *dev = bgenv_arena_alloc(&ped_arena,
+						   sizeof(PedDevice));
 		if (!dev) {
 			continue;
 		}
-		if (asprintf(&dev->model, "%s", "N/A") == -1) {
-			dev->model = NULL;
-			goto pedprobe_error;
-		}
-		if (asprintf(&dev->path, "%s", fullname) == -1) {
-			dev->path = NULL;
-			goto pedprobe_error;
-		}
-		if (check_partition_table(dev)) {
+		dev->model = bgenv_arena_strdup(&ped_arena, "N/A");
+		dev->path = bgenv_arena_strdup(&ped_arena, fullname);
+		if (dev->model && dev->path &&
+		    check_partition_table(dev, &ped_arena)) {
 			add_block_dev(dev);
-			continue;
+			ndevices++;
 		}
-pedprobe_error:
-		free(dev->model);
-		free(dev->path);
-		free(dev);
 	} while (sysblockfile);
 
 	closedir(sysblockdir);
+	free_devnodes();
+	BG_TRACE_DONE(span, ped_device_probe_all, rootdev, ndevices, 0);
 }
 
-static inline void ped_partition_destroy(PedPartition *p)
+/* An image device lives in an arena of its own, which it is the first
+ * allocation of. */
+struct image_device {
+	PedDevice dev;
+	BG_ARENA arena;
+};
+
+PedDevice *ped_device_open_image(const char *path)
 {
-	free(p);
+	BG_ARENA arena = {0};
+	struct image_device *image;
+
+	image = bgenv_arena_alloc(&arena, sizeof(*image));
+	if (!image) {
+		return NULL;
+	}
+	image->dev.model = bgenv_arena_strdup(&arena, "image");
+	image->dev.path = bgenv_arena_strdup(&arena, path);
+	if (!image->dev.model || !image->dev.path ||
+	    !check_partition_table(&image->dev, &arena)) {
+		bgenv_arena_release(&arena);
+		return NULL;
+	}
+	image->arena = arena;
+	return &image->dev;
 }
 
-static void ped_device_destroy(PedDevice *d)
+void ped_device_close(PedDevice *dev)
 {
-	if (!d) {
+	BG_ARENA arena;
+
+	if (!dev) {
 		return;
 	}
-	free(d->model);
-	free(d->path);
-	PedPartition *p = d->part_list;
-	while (p) {
-		PedPartition *tmpp = p;
+	/* the arena must not be cleared inside the memory it frees */
+	arena = ((struct image_device *)dev)->arena;
+	bgenv_arena_release(&arena);
+}
 
-		p = p->next;
-		ped_partition_destroy(tmpp);
-	}
-	free(d);
+void ped_device_free_all(void)
+{
+	bgenv_arena_release(&ped_arena);
+	first_device = NULL;
 }
 
 PedDevice *ped_device_get_next(const PedDevice *dev)
@@ -505,15 +640,7 @@ PedDevice *ped_device_get_next(const PedDevice *dev)
 		return dev->next;
 	}
 	/* free all memory */
-	PedDevice *d = first_device;
-
-	while (d) {
-		PedDevice *tmpd = d;
-
-		d = d->next;
-		ped_device_destroy(tmpd);
-	}
-	first_device = NULL;
+	ped_device_free_all();
 	return NULL;
 }
 
@@ -11,9 +11,13 @@
  * SPDX-License-Identifier:	GPL-2.0
  */
 
+#include <ctype.h>
+#include <errno.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <linux/types.h>
 #include <linux/byteorder/little_endian.h>
@@ -185,3 +189,388 @@ int determine_FAT_bits(const struct fat_boot_sector *sector, bool verbosity)
 		return (total_clusters > MAX_FAT12) ? 16 : 12;
 	}
 }
+
+bool fat_volume_label(const struct fat_boot_sector *sector, int fat_bits,
+		      char label[MSDOS_NAME + 1])
+{
+	const uint8_t *name = sector->fat16.vol_label;
+	uint8_t signature = sector->fat16.signature;
+	int len = MSDOS_NAME;
+
+	if (fat_bits == 32) {
+		name = sector->fat32.vol_label;
+		signature = sector->fat32.signature;
+	}
+	/* only the extended boot signature 0x29 comes with a label */
+	if (signature != 0x29) {
+		return false;
+	}
+	while (len > 0 && name[len - 1] == ' ') {
+		len--;
+	}
+	memcpy(label, name, len);
+	label[len] = '\0';
+	return len > 0 && strcmp(label, "NO NAME") != 0;
+}
+
+/*
+ * Minimal raw access to files in the root directory of a FAT volume, used
+ * to read and update BGENV.DAT without mounting the partition. Only files
+ * of unchanged size are rewritten, so no FAT or directory metadata is ever
+ * modified.
+ */
+
+static int fat_pread_full(int fd, void *buf, size_t len, off_t off)
+{
+	uint8_t *p = buf;
+
+	while (len) {
+		ssize_t r = pread(fd, p, len, off);
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -errno;
+		}
+		if (r == 0) {
+			return -EIO;
+		}
+		p += r;
+		off += r;
+		len -= r;
+	}
+	return 0;
+}
+
+static int fat_pwrite_full(int fd, const void *buf, size_t len, off_t off)
+{
+	const uint8_t *p = buf;
+
+	while (len) {
+		ssize_t r = pwrite(fd, p, len, off);
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -errno;
+		}
+		p += r;
+		off += r;
+		len -= r;
+	}
+	return 0;
+}
+
+int fat_open_volume(int fd, struct fat_volume *vol, bool verbosity)
+{
+	return fat_open_volume_at(fd, 0, vol, verbosity);
+}
+
+int fat_open_volume_at(int fd, off_t base, struct fat_volume *vol,
+		       bool verbosity)
+{
+	struct fat_boot_sector sector;
+	struct fat_bios_param_block bpb;
+	uint32_t total_sectors;
+	uint32_t fat_length;
+	uint32_t rootdir_sectors;
+	uint32_t data_start;
+	int ret;
+
+	memset(vol, 0, sizeof(*vol));
+	ret = fat_pread_full(fd, &sector, sizeof(sector), base);
+	if (ret) {
+		return ret;
+	}
+	if (fat_read_bpb(NULL, &sector, !verbosity, &bpb)) {
+		return -EINVAL;
+	}
+	vol->fat_bits = determine_FAT_bits(&sector, verbosity);
+	if (vol->fat_bits <= 0) {
+		return -EINVAL;
+	}
+
+	total_sectors = bpb.fat_sectors ? bpb.fat_sectors : bpb.fat_total_sect;
+	fat_length = bpb.fat_fat_length ? bpb.fat_fat_length
+					: bpb.fat32_length;
+	rootdir_sectors = (bpb.fat_dir_entries *
+			   sizeof(struct msdos_dir_entry) +
+			   bpb.fat_sector_size - 1) / bpb.fat_sector_size;
+	data_start = bpb.fat_reserved + bpb.fat_fats * fat_length +
+		     rootdir_sectors;
+	if (data_start >= total_sectors) {
+		return -EINVAL;
+	}
+
+	vol->fd = fd;
+	vol->sector_size = bpb.fat_sector_size;
+	vol->cluster_size = bpb.fat_sector_size * bpb.fat_sec_per_clus;
+	vol->fat_start = base + (off_t)bpb.fat_reserved * bpb.fat_sector_size;
+	vol->fat_size = (off_t)fat_length * bpb.fat_sector_size;
+	vol->root_dir_start = vol->fat_start +
+			      (off_t)bpb.fat_fats * vol->fat_size;
+	vol->root_dir_entries = bpb.fat_dir_entries;
+	vol->root_cluster = bpb.fat32_root_cluster;
+	vol->data_start = base + (off_t)data_start * bpb.fat_sector_size;
+	vol->total_clusters = (total_sectors - data_start) /
+			      bpb.fat_sec_per_clus;
+	vol->vol_id = vol->fat_bits == 32 ? bpb.fat32_vol_id : bpb.fat16_vol_id;
+	return 0;
+}
+
+static bool fat_cluster_valid(const struct fat_volume *vol, uint32_t cluster)
+{
+	return cluster >= 2 && cluster < vol->total_clusters + 2;
+}
+
+static int fat_next_cluster(const struct fat_volume *vol, uint32_t cluster,
+			    uint32_t *next)
+{
+	uint8_t buf[4];
+	size_t bytes = vol->fat_bits == 32 ? 4 : 2;
+	off_t off;
+	int ret;
+
+	switch (vol->fat_bits) {
+	case 12:
+		off = cluster + cluster / 2;
+		break;
+	case 16:
+		off = (off_t)cluster * 2;
+		break;
+	default:
+		off = (off_t)cluster * 4;
+		break;
+	}
+	if (off + (off_t)bytes > vol->fat_size) {
+		return -EINVAL;
+	}
+	ret = fat_pread_full(vol->fd, buf, bytes, vol->fat_start + off);
+	if (ret) {
+		return ret;
+	}
+	switch (vol->fat_bits) {
+	case 12:
+		*next = get_unaligned_le16(buf);
+		*next = (cluster & 1) ? *next >> 4 : *next & 0xFFF;
+		break;
+	case 16:
+		*next = get_unaligned_le16(buf);
+		break;
+	default:
+		*next = get_unaligned_le32(buf) & 0x0FFFFFFF;
+		break;
+	}
+	return 0;
+}
+
+static off_t fat_cluster_offset(const struct fat_volume *vol, uint32_t cluster)
+{
+	return vol->data_start + (off_t)(cluster - 2) * vol->cluster_size;
+}
+
+/* Convert "NAME.EXT" to the space padded 8.3 directory entry form. */
+static bool fat_short_name(const char *name, uint8_t out[MSDOS_NAME])
+{
+	const char *dot = strchr(name, '.');
+	size_t base = dot ? (size_t)(dot - name) : strlen(name);
+	size_t ext = dot ? strlen(dot + 1) : 0;
+
+	if (base == 0 || base > 8 || ext > 3) {
+		return false;
+	}
+	memset(out, ' ', MSDOS_NAME);
+	for (size_t i = 0; i < base; i++) {
+		out[i] = toupper((unsigned char)name[i]);
+	}
+	for (size_t i = 0; i < ext; i++) {
+		out[8 + i] = toupper((unsigned char)dot[1 + i]);
+	}
+	return true;
+}
+
+/* Returns 1 if found, 0 if the end of the directory was reached, -1 if
+ * more entries follow. */
+static int fat_match_dirents(const struct msdos_dir_entry *de, size_t count,
+			     const uint8_t name[MSDOS_NAME],
+			     struct fat_file *file)
+{
+	for (size_t i = 0; i < count; i++) {
+		if (de[i].name[0] == 0) {
+			return 0;
+		}
+		if (de[i].name[0] == DELETED_FLAG ||
+		    (de[i].attr & (ATTR_VOLUME | ATTR_DIR))) {
+			continue;
+		}
+		if (memcmp(de[i].name, name, MSDOS_NAME) == 0) {
+			file->first_cluster = le16_to_cpu(de[i].start) |
+				(uint32_t)le16_to_cpu(de[i].starthi) << 16;
+			file->size = le32_to_cpu(de[i].size);
+			return 1;
+		}
+	}
+	return -1;
+}
+
+int fat_find_root_file(const struct fat_volume *vol, const char *name,
+		       struct fat_file *file)
+{
+	uint8_t sname[MSDOS_NAME];
+	struct msdos_dir_entry *de;
+	size_t count;
+	int ret = -ENOENT;
+
+	if (!fat_short_name(name, sname)) {
+		return -EINVAL;
+	}
+
+	if (vol->fat_bits != 32) {
+		/* fixed size root directory */
+		count = vol->root_dir_entries;
+		de = malloc(count * sizeof(*de));
+		if (!de) {
+			return -ENOMEM;
+		}
+		ret = fat_pread_full(vol->fd, de, count * sizeof(*de),
+				     vol->root_dir_start);
+		if (ret == 0) {
+			ret = fat_match_dirents(de, count, sname, file) == 1
+				      ? 0 : -ENOENT;
+		}
+		free(de);
+		return ret;
+	}
+
+	/* FAT32: root directory is a cluster chain */
+	count = vol->cluster_size / sizeof(*de);
+	de = malloc(vol->cluster_size);
+	if (!de) {
+		return -ENOMEM;
+	}
+	uint32_t cluster = vol->root_cluster;
+	for (uint32_t n = 0; n < vol->total_clusters; n++) {
+		int m;
+
+		if (!fat_cluster_valid(vol, cluster)) {
+			ret = -ENOENT;
+			break;
+		}
+		ret = fat_pread_full(vol->fd, de, vol->cluster_size,
+				     fat_cluster_offset(vol, cluster));
+		if (ret) {
+			break;
+		}
+		m = fat_match_dirents(de, count, sname, file);
+		if (m >= 0) {
+			ret = m == 1 ? 0 : -ENOENT;
+			break;
+		}
+		ret = fat_next_cluster(vol, cluster, &cluster);
+		if (ret) {
+			break;
+		}
+		ret = -ENOENT;
+	}
+	free(de);
+	return ret;
+}
+
+int fat_file_access(const struct fat_volume *vol, const struct fat_file *file,
+		    uint32_t offset, void *buf, size_t len, bool write)
+{
+	uint8_t *p = buf;
+	uint32_t cluster = file->first_cluster;
+	size_t skip = offset % vol->cluster_size;
+	int ret;
+
+	if (offset > file->size || len > file->size - offset) {
+		return -EINVAL;
+	}
+	for (uint32_t n = offset / vol->cluster_size; n > 0; n--) {
+		if (!fat_cluster_valid(vol, cluster)) {
+			return -EIO;
+		}
+		ret = fat_next_cluster(vol, cluster, &cluster);
+		if (ret) {
+			return ret;
+		}
+	}
+	while (len) {
+		/* coalesce physically contiguous clusters into one request */
+		uint32_t start = cluster;
+		size_t run = 0;
+
+		for (;;) {
+			uint32_t next;
+
+			if (!fat_cluster_valid(vol, cluster)) {
+				return -EIO;
+			}
+			run += vol->cluster_size;
+			if (run - skip >= len) {
+				run = len + skip;
+				break;
+			}
+			ret = fat_next_cluster(vol, cluster, &next);
+			if (ret) {
+				return ret;
+			}
+			if (next != cluster + 1) {
+				cluster = next;
+				break;
+			}
+			cluster = next;
+		}
+		run -= skip;
+		if (write) {
+			ret = fat_pwrite_full(vol->fd, p, run,
+					      fat_cluster_offset(vol, start) +
+						      skip);
+		} else {
+			ret = fat_pread_full(vol->fd, p, run,
+					     fat_cluster_offset(vol, start) +
+						     skip);
+		}
+		if (ret) {
+			return ret;
+		}
+		p += run;
+		len -= run;
+		skip = 0;
+	}
+	return 0;
+}
+
+int fat_file_extent(const struct fat_volume *vol, const struct fat_file *file,
+		    off_t *offset)
+{
+	uint32_t clusters = (file->size + vol->cluster_size - 1) /
+			    vol->cluster_size;
+	uint32_t cluster = file->first_cluster;
+	int ret;
+
+	for (uint32_t n = 0; n < clusters; n++) {
+		uint32_t next;
+
+		if (!fat_cluster_valid(vol, cluster)) {
+			return -EIO;
+		}
+		if (n + 1 == clusters) {
+			break;
+		}
+		ret = fat_next_cluster(vol, cluster, &next);
+		if (ret) {
+			return ret;
+		}
+		if (next != cluster + 1) {
+			return -ENOTSUP;
+		}
+		cluster = next;
+	}
+	if (clusters == 0) {
+		return -EINVAL;
+	}
+	*offset = fat_cluster_offset(vol, file->first_cluster);
+	return 0;
+}
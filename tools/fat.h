@@ -12,6 +12,9 @@
  */
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
 #include <linux/msdos_fs.h>
 #include "ebgpart.h"
 
@@ -23,3 +26,71 @@
  * occurs during the determination process, the function returns a value less than or equal to 0.
  */
 int determine_FAT_bits(const struct fat_boot_sector *sector, bool verbosity);
+
+/**
+ * Copies the volume label of the boot sector of a volume with fat_bits to
+ * label, without trailing blanks. Returns false if the volume has no label.
+ */
+bool fat_volume_label(const struct fat_boot_sector *sector, int fat_bits,
+		      char label[MSDOS_NAME + 1]);
+
+/*
+ * Geometry of a FAT volume accessed through a raw block device, as needed
+ * to locate files in its root directory.
+ */
+struct fat_volume {
+	int fd;
+	int fat_bits;
+	uint32_t sector_size;
+	uint32_t cluster_size;
+	off_t fat_start;
+	off_t fat_size;
+	off_t root_dir_start;
+	uint32_t root_dir_entries;
+	uint32_t root_cluster;
+	off_t data_start;
+	uint32_t total_clusters;
+	uint32_t vol_id;
+};
+
+struct fat_file {
+	uint32_t first_cluster;
+	uint32_t size;
+};
+
+/**
+ * Reads the boot sector from fd and fills in the volume geometry.
+ * Returns 0 on success or a negative errno value.
+ */
+int fat_open_volume(int fd, struct fat_volume *vol, bool verbosity);
+
+/**
+ * Like fat_open_volume(), for a volume that starts base bytes into fd, such
+ * as a partition of a disk image.
+ */
+int fat_open_volume_at(int fd, off_t base, struct fat_volume *vol,
+		       bool verbosity);
+
+/**
+ * Looks up the 8.3 file name in the root directory of the volume.
+ * Returns 0 if found, -ENOENT if it does not exist, or another negative
+ * errno value on failure.
+ */
+int fat_find_root_file(const struct fat_volume *vol, const char *name,
+		       struct fat_file *file);
+
+/**
+ * Reads or overwrites len bytes of the file at offset, following its
+ * cluster chain. The range must lie within the file, which is never
+ * resized.
+ */
+int fat_file_access(const struct fat_volume *vol, const struct fat_file *file,
+		    uint32_t offset, void *buf, size_t len, bool write);
+
+/**
+ * Stores the offset of the file in the volume's device in offset if its
+ * clusters are consecutive. Returns 0, -ENOTSUP if the file is fragmented,
+ * or another negative errno value on failure.
+ */
+int fat_file_extent(const struct fat_volume *vol, const struct fat_file *file,
+		    off_t *offset);
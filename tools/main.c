@@ -13,11 +13,18 @@
  * SPDX-License-Identifier:	GPL-2.0
  */
 
+#include "bg_batch.h"
 #include "bg_printenv.h"
 #include "bg_setenv.h"
 
 int main(int argc, char **argv)
 {
+	/* --batch selects its own set of options, so it must come first */
+	if (argc > 1 && (strncmp(argv[1], "-B", 2) == 0 ||
+			 strcmp(argv[1], "--batch") == 0 ||
+			 strncmp(argv[1], "--batch=", 8) == 0)) {
+		return bg_batch(argc, argv);
+	}
 	if (strstr(argv[0], "bg_setenv")) {
 		return bg_setenv(argc, argv);
 	} else {
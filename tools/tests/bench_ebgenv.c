@@ -0,0 +1,254 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2026
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+/*
+ * Microbenchmarks of the libebgenv hot paths, run with "make bench".
+ *
+ * Every result is printed as one tab separated line
+ *   bench <name> <parameter> <iterations> <ns per operation>
+ * so that runs can be compared with standard tools. EBG_BENCH_MIN_MS sets
+ * the minimum measuring time per benchmark, 200 ms by default.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <env_api.h>
+#include <uservars.h>
+#include <fat.h>
+
+#define BENCH_VALUE_SIZE 32
+
+typedef void (*bench_fn)(void *ctx);
+
+static uint64_t min_ns = 200 * 1000000ULL;
+
+/* the compiler must not drop the results of the measured calls */
+static volatile uint64_t sink;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Doubles the number of iterations until a run takes at least min_ns. */
+static void run_bench(const char *name, const char *param, bench_fn fn,
+		      void *ctx)
+{
+	uint64_t iterations = 1;
+	uint64_t elapsed;
+
+	for (;;) {
+		uint64_t start = now_ns();
+
+		for (uint64_t i = 0; i < iterations; i++) {
+			fn(ctx);
+		}
+		elapsed = now_ns() - start;
+		if (elapsed >= min_ns || iterations >= (1ULL << 40)) {
+			break;
+		}
+		iterations *= 2;
+	}
+	printf("bench\t%s\t%s\t%llu\t%.2f\n", name, param,
+	       (unsigned long long)iterations, (double)elapsed / iterations);
+	fflush(stdout);
+}
+
+struct crc_ctx {
+	const uint8_t *buf;
+	size_t size;
+};
+
+static void bench_crc32(void *arg)
+{
+	struct crc_ctx *ctx = arg;
+
+	sink += bgenv_crc32(0, ctx->buf, ctx->size);
+}
+
+static void crc32_benchmarks(void)
+{
+	static const size_t sizes[] = {
+		16, 64, 256, 1024, 4096, 65536, sizeof(BG_ENVDATA),
+	};
+	static uint8_t buf[sizeof(BG_ENVDATA)];
+	char param[32];
+
+	for (size_t i = 0; i < sizeof(buf); i++) {
+		buf[i] = (uint8_t)(i * 131 + 7);
+	}
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		struct crc_ctx ctx = { .buf = buf, .size = sizes[i] };
+
+		snprintf(param, sizeof(param), "size=%zu", sizes[i]);
+		run_bench("crc32", param, bench_crc32, &ctx);
+	}
+}
+
+struct uservar_ctx {
+	uint8_t *udata;
+	char last[16];
+	char value[BENCH_VALUE_SIZE];
+};
+
+static void bench_find(void *arg)
+{
+	struct uservar_ctx *ctx = arg;
+
+	sink += (uintptr_t)bgenv_find_uservar(ctx->udata, ctx->last);
+}
+
+static void bench_find_miss(void *arg)
+{
+	struct uservar_ctx *ctx = arg;
+
+	sink += (uintptr_t)bgenv_find_uservar(ctx->udata, "missing");
+}
+
+static void bench_set(void *arg)
+{
+	struct uservar_ctx *ctx = arg;
+
+	ctx->value[0]++;
+	sink += bgenv_set_uservar(ctx->udata, ctx->last,
+				  USERVAR_TYPE_DEFAULT, ctx->value,
+				  sizeof(ctx->value));
+}
+
+static void bench_set_del(void *arg)
+{
+	struct uservar_ctx *ctx = arg;
+	uint8_t *var;
+
+	bgenv_set_uservar(ctx->udata, "bench", USERVAR_TYPE_DEFAULT,
+			  ctx->value, sizeof(ctx->value));
+	var = bgenv_find_uservar(ctx->udata, "bench");
+	if (var) {
+		bgenv_del_uservar(ctx->udata, var);
+	}
+	sink += (uintptr_t)var;
+}
+
+static void bench_validate(void *arg)
+{
+	struct uservar_ctx *ctx = arg;
+
+	sink += bgenv_validate_uservars(ctx->udata);
+}
+
+/* Adds variables of BENCH_VALUE_SIZE bytes, which take record bytes each,
+ * until percent of the area is used. 100 percent leaves room for the
+ * record of bench_set_del() only. */
+static unsigned int fill_uservars(struct uservar_ctx *ctx, unsigned int n,
+				  uint32_t record, int percent)
+{
+	uint32_t target = (uint64_t)ENV_MEM_USERVARS * percent / 100;
+
+	for (;;) {
+		uint32_t free = bgenv_user_free(ctx->udata);
+		char key[16];
+
+		if (ENV_MEM_USERVARS - free + record > target ||
+		    free < 2 * record) {
+			return n;
+		}
+		snprintf(key, sizeof(key), "var%05u", n);
+		if (bgenv_set_uservar(ctx->udata, key, USERVAR_TYPE_DEFAULT,
+				      ctx->value, sizeof(ctx->value))) {
+			return n;
+		}
+		memcpy(ctx->last, key, sizeof(key));
+		n++;
+	}
+}
+
+static void uservar_benchmarks(void)
+{
+	static const int levels[] = { 0, 25, 50, 75, 100 };
+	static uint8_t udata[ENV_MEM_USERVARS];
+	struct uservar_ctx ctx = { .udata = udata };
+	unsigned int count = 0;
+	uint32_t record;
+	char param[32];
+
+	memset(ctx.value, 'v', sizeof(ctx.value) - 1);
+	/* measure the size of one record, "bench" is not any longer */
+	bgenv_set_uservar(udata, "var00000", USERVAR_TYPE_DEFAULT, ctx.value,
+			  sizeof(ctx.value));
+	record = ENV_MEM_USERVARS - bgenv_user_free(udata);
+	memset(udata, 0, sizeof(udata));
+
+	for (size_t i = 0; i < sizeof(levels) / sizeof(levels[0]); i++) {
+		unsigned int used;
+
+		count = fill_uservars(&ctx, count, record, levels[i]);
+		used = ENV_MEM_USERVARS - bgenv_user_free(udata);
+		snprintf(param, sizeof(param), "fill=%d%%,vars=%u", levels[i],
+			 count);
+		if (count) {
+			run_bench("find_uservar", param, bench_find, &ctx);
+			run_bench("set_uservar", param, bench_set, &ctx);
+		}
+		run_bench("find_uservar_miss", param, bench_find_miss, &ctx);
+		run_bench("set_del_uservar", param, bench_set_del, &ctx);
+		run_bench("validate_uservars", param, bench_validate, &ctx);
+		if (ENV_MEM_USERVARS - bgenv_user_free(udata) != used) {
+			fprintf(stderr, "uservar area changed size\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static void u16_to_le(uint16_t value, uint8_t out[2])
+{
+	out[0] = value & 0xff;
+	out[1] = value >> 8;
+}
+
+static void bench_fat_bits(void *arg)
+{
+	sink += determine_FAT_bits(arg, false);
+}
+
+static void fat_benchmarks(void)
+{
+	struct fat_boot_sector sector = {
+		.sec_per_clus = 4,
+		.reserved = 1,
+		.fats = 2,
+		.media = 0xf8,
+		.fat_length = 40,
+	};
+
+	u16_to_le(512, sector.sector_size);
+	u16_to_le(512, sector.dir_entries);
+	u16_to_le(40000, sector.sectors);
+	run_bench("determine_FAT_bits", "fat16", bench_fat_bits, &sector);
+}
+
+int main(void)
+{
+	const char *ms = getenv("EBG_BENCH_MIN_MS");
+
+	if (ms) {
+		min_ns = strtoull(ms, NULL, 10) * 1000000ULL;
+	}
+	crc32_benchmarks();
+	uservar_benchmarks();
+	fat_benchmarks();
+	return 0;
+}
@@ -0,0 +1,524 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2026
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+/*
+ * Benchmark of the config partition probe on a fake device tree.
+ *
+ * The probe code is built with SYSBLOCKDIR and DEVDIR pointing below
+ * bench-root in a temporary directory, where sparse image files stand in
+ * for the disks and their partitions. The file system calls of the probe
+ * are counted through linker wrappers, which can also delay every read to
+ * simulate slow media. Each phase is reported as one tab separated line
+ *   probe <phase> <parameters> <wall time in us> <call>=<count>...
+ * averaged over all repetitions.
+ */
+
+#include <dirent.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <env_api.h>
+#include <ebgpart.h>
+#include <env_config_partitions.h>
+#include "fat_image.h"
+
+#define GPT_ENTRY_SIZE 128
+#define FIRST_PART_LBA 2048
+
+enum {
+	CALL_OPEN,
+	CALL_READ,
+	CALL_PREAD,
+	CALL_LSEEK,
+	CALL_STAT,
+	CALL_FOPEN,
+	CALL_OPENDIR,
+	CALL_REALPATH,
+	CALL_COUNT
+};
+
+static const char *call_names[CALL_COUNT] = {
+	"open", "read", "pread", "lseek", "stat", "fopen", "opendir",
+	"realpath",
+};
+
+static uint64_t calls[CALL_COUNT];
+static unsigned int read_latency_us;
+
+static void count_call(int call)
+{
+	__atomic_fetch_add(&calls[call], 1, __ATOMIC_RELAXED);
+}
+
+static void delay_read(void)
+{
+	struct timespec ts = {
+		.tv_sec = read_latency_us / 1000000,
+		.tv_nsec = (read_latency_us % 1000000) * 1000L,
+	};
+
+	if (read_latency_us) {
+		nanosleep(&ts, NULL);
+	}
+}
+
+/* Wrappers of the calls made by the probe, see BENCH_PROBE_WRAP. Both the
+ * plain and the large file variants are wrapped, so that the counts do not
+ * depend on _FILE_OFFSET_BITS. */
+
+int __real_open(const char *path, int flags, ...);
+int __wrap_open(const char *path, int flags, ...);
+int __real_open64(const char *path, int flags, ...);
+int __wrap_open64(const char *path, int flags, ...);
+ssize_t __real_read(int fd, void *buf, size_t count);
+ssize_t __wrap_read(int fd, void *buf, size_t count);
+ssize_t __real_pread(int fd, void *buf, size_t count, off_t offset);
+ssize_t __wrap_pread(int fd, void *buf, size_t count, off_t offset);
+ssize_t __real_pread64(int fd, void *buf, size_t count, off64_t offset);
+ssize_t __wrap_pread64(int fd, void *buf, size_t count, off64_t offset);
+off64_t __real_lseek64(int fd, off64_t offset, int whence);
+off64_t __wrap_lseek64(int fd, off64_t offset, int whence);
+int __real_stat(const char *path, struct stat *st);
+int __wrap_stat(const char *path, struct stat *st);
+int __real_stat64(const char *path, struct stat64 *st);
+int __wrap_stat64(const char *path, struct stat64 *st);
+int __real_fstatat(int dirfd, const char *path, struct stat *st, int flags);
+int __wrap_fstatat(int dirfd, const char *path, struct stat *st, int flags);
+int __real_fstatat64(int dirfd, const char *path, struct stat64 *st,
+		     int flags);
+int __wrap_fstatat64(int dirfd, const char *path, struct stat64 *st,
+		     int flags);
+FILE *__real_fopen(const char *path, const char *mode);
+FILE *__wrap_fopen(const char *path, const char *mode);
+FILE *__real_fopen64(const char *path, const char *mode);
+FILE *__wrap_fopen64(const char *path, const char *mode);
+DIR *__real_opendir(const char *path);
+DIR *__wrap_opendir(const char *path);
+char *__real_realpath(const char *path, char *resolved);
+char *__wrap_realpath(const char *path, char *resolved);
+
+int __wrap_open(const char *path, int flags, ...)
+{
+	va_list ap;
+	int mode;
+
+	va_start(ap, flags);
+	mode = va_arg(ap, int);
+	va_end(ap);
+	count_call(CALL_OPEN);
+	return __real_open(path, flags, mode);
+}
+
+int __wrap_open64(const char *path, int flags, ...)
+{
+	va_list ap;
+	int mode;
+
+	va_start(ap, flags);
+	mode = va_arg(ap, int);
+	va_end(ap);
+	count_call(CALL_OPEN);
+	return __real_open64(path, flags, mode);
+}
+
+ssize_t __wrap_read(int fd, void *buf, size_t count)
+{
+	count_call(CALL_READ);
+	delay_read();
+	return __real_read(fd, buf, count);
+}
+
+ssize_t __wrap_pread(int fd, void *buf, size_t count, off_t offset)
+{
+	count_call(CALL_PREAD);
+	delay_read();
+	return __real_pread(fd, buf, count, offset);
+}
+
+ssize_t __wrap_pread64(int fd, void *buf, size_t count, off64_t offset)
+{
+	count_call(CALL_PREAD);
+	delay_read();
+	return __real_pread64(fd, buf, count, offset);
+}
+
+off64_t __wrap_lseek64(int fd, off64_t offset, int whence)
+{
+	count_call(CALL_LSEEK);
+	return __real_lseek64(fd, offset, whence);
+}
+
+int __wrap_stat(const char *path, struct stat *st)
+{
+	count_call(CALL_STAT);
+	return __real_stat(path, st);
+}
+
+int __wrap_stat64(const char *path, struct stat64 *st)
+{
+	count_call(CALL_STAT);
+	return __real_stat64(path, st);
+}
+
+int __wrap_fstatat(int dirfd, const char *path, struct stat *st, int flags)
+{
+	count_call(CALL_STAT);
+	return __real_fstatat(dirfd, path, st, flags);
+}
+
+int __wrap_fstatat64(int dirfd, const char *path, struct stat64 *st,
+		     int flags)
+{
+	count_call(CALL_STAT);
+	return __real_fstatat64(dirfd, path, st, flags);
+}
+
+FILE *__wrap_fopen(const char *path, const char *mode)
+{
+	count_call(CALL_FOPEN);
+	return __real_fopen(path, mode);
+}
+
+FILE *__wrap_fopen64(const char *path, const char *mode)
+{
+	count_call(CALL_FOPEN);
+	return __real_fopen64(path, mode);
+}
+
+DIR *__wrap_opendir(const char *path)
+{
+	count_call(CALL_OPENDIR);
+	return __real_opendir(path);
+}
+
+char *__wrap_realpath(const char *path, char *resolved)
+{
+	count_call(CALL_REALPATH);
+	return __real_realpath(path, resolved);
+}
+
+struct layout {
+	unsigned int disks;
+	unsigned int parts;
+	unsigned int gpt_entries;
+	bool mbr;
+};
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(EXIT_FAILURE);
+}
+
+static void write_at(int fd, const void *buf, size_t len, off_t offset)
+{
+	if (pwrite(fd, buf, len, offset) != (ssize_t)len) {
+		die("pwrite");
+	}
+}
+
+static void write_text(const char *path, const char *text)
+{
+	FILE *f = fopen(path, "w");
+
+	if (!f || fputs(text, f) == EOF || fclose(f)) {
+		die(path);
+	}
+}
+
+/* Creates the FAT image of a partition and returns its boot sector. */
+static void create_partition(const char *path, bool config,
+			     struct fat_boot_sector *sector)
+{
+	static uint8_t env[sizeof(BG_ENVDATA)];
+	char tmp[] = "bench-root/part.XXXXXX";
+	int fd;
+
+	fd = create_fat16_image(tmp, env, config ? sizeof(env) : 1);
+	if (fd < 0) {
+		die("create_fat16_image");
+	}
+	if (!config) {
+		/* keep the file system but hide the environment */
+		write_at(fd, "OTHER   DAT", MSDOS_NAME,
+			 IMG_ROOT_START + 2 * sizeof(struct msdos_dir_entry));
+	}
+	if (pread(fd, sector, sizeof(*sector), 0) != sizeof(*sector)) {
+		die("pread");
+	}
+	close(fd);
+	if (rename(tmp, path)) {
+		die("rename");
+	}
+}
+
+static void write_gpt(int fd, const struct layout *l, uint64_t disk_lba)
+{
+	static const uint8_t fat_guid[16] = {
+		0xA2, 0xA0, 0xD0, 0xEB, 0xE5, 0xB9, 0x33, 0x44,
+		0x87, 0xC0, 0x68, 0xB6, 0xB7, 0x26, 0x99, 0xC7,
+	};
+	size_t size = (size_t)l->gpt_entries * GPT_ENTRY_SIZE;
+	uint8_t *table = calloc(1, size);
+	struct EFIHeader hdr;
+
+	if (!table) {
+		die("calloc");
+	}
+	for (unsigned int i = 0; i < l->parts; i++) {
+		struct EFIpartitionentry *e =
+			(void *)(table + (size_t)i * GPT_ENTRY_SIZE);
+
+		memcpy(e->type_GUID, fat_guid, sizeof(fat_guid));
+		e->partition_GUID[0] = i + 1;
+		e->start_LBA = FIRST_PART_LBA + (uint64_t)i * IMG_SECTORS;
+		e->end_LBA = e->start_LBA + IMG_SECTORS - 1;
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.signature, "EFI PART", 8);
+	hdr.revision = 0x10000;
+	hdr.header_size = 92;
+	hdr.this_LBA = 1;
+	hdr.backup_LBA = disk_lba - 1;
+	hdr.firstentry_LBA = FIRST_PART_LBA;
+	hdr.lastentry_LBA = disk_lba - 34;
+	hdr.partitiontable_LBA = 2;
+	hdr.partitions = l->gpt_entries;
+	hdr.partitionentrysize = GPT_ENTRY_SIZE;
+	hdr.partitiontable_CRC32 = bgenv_crc32(0, table, size);
+	hdr.header_crc32 = bgenv_crc32(0, &hdr, hdr.header_size);
+	write_at(fd, &hdr, sizeof(hdr), LB_SIZE);
+	write_at(fd, table, size, 2 * LB_SIZE);
+	free(table);
+}
+
+/* Creates the disks, the last ENV_NUM_CONFIG_PARTS partitions hold the
+ * environments so that the whole tree must be scanned. */
+static void create_tree(const struct layout *l)
+{
+	unsigned int total = l->disks * l->parts;
+	uint64_t disk_lba = FIRST_PART_LBA + (uint64_t)l->parts * IMG_SECTORS +
+			    34;
+	char path[DEV_FILENAME_LEN];
+	char text[32];
+
+	if (mkdir("bench-root", 0755) || mkdir("bench-root/sys", 0755) ||
+	    mkdir(SYSBLOCKDIR, 0755) || mkdir(DEVDIR, 0755)) {
+		die("mkdir");
+	}
+	for (unsigned int d = 0; d < l->disks; d++) {
+		struct Masterbootrecord mbr;
+		int fd;
+
+		snprintf(path, sizeof(path), "%s/bench%03u", SYSBLOCKDIR, d);
+		if (mkdir(path, 0755)) {
+			die("mkdir");
+		}
+		snprintf(path, sizeof(path), "%s/bench%03u/dev", SYSBLOCKDIR,
+			 d);
+		snprintf(text, sizeof(text), "%u:%u\n", 240 + d / 256,
+			 d % 256);
+		write_text(path, text);
+
+		snprintf(path, sizeof(path), "%s/bench%03u", DEVDIR, d);
+		fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0 || ftruncate(fd, disk_lba * LB_SIZE)) {
+			die(path);
+		}
+		memset(&mbr, 0, sizeof(mbr));
+		mbr.mbrsignature = 0xaa55;
+		if (l->mbr) {
+			for (unsigned int i = 0; i < l->parts; i++) {
+				mbr.parttable[i].partition_type =
+					MBR_TYPE_FAT16;
+				mbr.parttable[i].start_LBA =
+					FIRST_PART_LBA + i * IMG_SECTORS;
+				mbr.parttable[i].num_Sectors = IMG_SECTORS;
+			}
+		} else {
+			mbr.parttable[0].partition_type = MBR_TYPE_GPT;
+			mbr.parttable[0].start_LBA = 1;
+			mbr.parttable[0].num_Sectors = 0xffffffff;
+			write_gpt(fd, l, disk_lba);
+		}
+		write_at(fd, &mbr, sizeof(mbr), 0);
+
+		for (unsigned int i = 0; i < l->parts; i++) {
+			struct fat_boot_sector sector;
+			unsigned int index = d * l->parts + i;
+
+			snprintf(path, sizeof(path), "%s/bench%03u%u", DEVDIR,
+				 d, i + 1);
+			create_partition(path,
+					 index >= total - ENV_NUM_CONFIG_PARTS,
+					 &sector);
+			write_at(fd, &sector, sizeof(sector),
+				 (FIRST_PART_LBA + (off_t)i * IMG_SECTORS) *
+					 LB_SIZE);
+		}
+		close(fd);
+	}
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag,
+			struct FTW *ftw)
+{
+	return remove(path);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void report(const char *phase, const char *param, uint64_t elapsed,
+		   unsigned int runs)
+{
+	printf("probe\t%s\t%s\t%llu", phase, param,
+	       (unsigned long long)(elapsed / runs / 1000));
+	for (int i = 0; i < CALL_COUNT; i++) {
+		printf("\t%s=%llu", call_names[i],
+		       (unsigned long long)(calls[i] / runs));
+	}
+	printf("\n");
+	fflush(stdout);
+}
+
+static void scan_devices(void)
+{
+	PedDevice *dev = NULL;
+
+	ped_device_probe_all(NULL);
+	/* walking to the end frees the list */
+	while ((dev = ped_device_get_next(dev))) {
+	}
+}
+
+static bool probe_all(void)
+{
+	CONFIG_PART parts[ENV_NUM_CONFIG_PARTS];
+	bool found;
+
+	memset(parts, 0, sizeof(parts));
+	found = probe_config_partitions(parts, true);
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		free(parts[i].mountpoint);
+	}
+	bgenv_arena_release(&probe_arena);
+	return found;
+}
+
+static void run_phase(const char *phase, const char *param, void (*fn)(void),
+		      bool (*check)(void), unsigned int runs)
+{
+	uint64_t elapsed = 0;
+
+	memset(calls, 0, sizeof(calls));
+	for (unsigned int i = 0; i < runs; i++) {
+		uint64_t start = now_ns();
+
+		if (fn) {
+			fn();
+		} else if (!check()) {
+			fprintf(stderr, "%s: config partitions not found\n",
+				phase);
+			exit(EXIT_FAILURE);
+		}
+		elapsed += now_ns() - start;
+	}
+	report(phase, param, elapsed, runs);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-d DISKS] [-p PARTS] [-e GPT_ENTRIES] [-m] "
+		"[-l READ_LATENCY_US] [-r RUNS] [-k]\n"
+		"  -m  use MBR instead of GPT partition tables\n"
+		"  -k  keep the device tree in the temporary directory\n",
+		prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	struct layout l = { .disks = 100, .parts = 4, .gpt_entries = 128 };
+	char dir[] = "/tmp/ebg-bench-probe.XXXXXX";
+	unsigned int runs = 5;
+	unsigned int latency = 0;
+	bool keep = false;
+	char param[128];
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:p:e:ml:r:k")) != -1) {
+		switch (opt) {
+		case 'd':
+			l.disks = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			l.parts = strtoul(optarg, NULL, 0);
+			break;
+		case 'e':
+			l.gpt_entries = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			l.mbr = true;
+			break;
+		case 'l':
+			latency = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			runs = strtoul(optarg, NULL, 0);
+			break;
+		case 'k':
+			keep = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (l.disks == 0 || l.disks > 1000 || l.parts == 0 || runs == 0 ||
+	    l.disks * l.parts < ENV_NUM_CONFIG_PARTS ||
+	    (l.mbr && l.parts > 4) ||
+	    (!l.mbr && (l.gpt_entries < l.parts || l.gpt_entries > 8192))) {
+		usage(argv[0]);
+	}
+
+	if (!mkdtemp(dir) || chdir(dir)) {
+		die(dir);
+	}
+	create_tree(&l);
+	read_latency_us = latency;
+
+	snprintf(param, sizeof(param),
+		 "disks=%u,parts=%u,table=%s,entries=%u,latency_us=%u",
+		 l.disks, l.parts, l.mbr ? "mbr" : "gpt",
+		 l.mbr ? 4 : l.gpt_entries, read_latency_us);
+	run_phase("scan_devices", param, scan_devices, NULL, runs);
+	run_phase("probe_config_partitions", param, NULL, probe_all, runs);
+
+	if (keep) {
+		fprintf(stderr, "Device tree kept in %s\n", dir);
+	} else if (chdir("/") ||
+		   nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS)) {
+		perror("cleanup");
+	}
+	return 0;
+}
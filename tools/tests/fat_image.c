@@ -0,0 +1,113 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2026
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "fat_image.h"
+
+static void u16_to_le(uint16_t value, uint8_t out[2])
+{
+	out[0] = (value >> 0) & 0xFF;
+	out[1] = (value >> 8) & 0xFF;
+}
+
+off_t img_cluster_offset(uint32_t cluster)
+{
+	return IMG_DATA_START + (off_t)(cluster - 2) * IMG_CLUSTER_SIZE;
+}
+
+/*
+ * Writes a FAT16 image with BGENV.DAT in the root directory. Unless
+ * contiguous, the cluster chain of the file is split into two runs to
+ * exercise the chain walk.
+ */
+static int create_image(char *path, const uint8_t *data, size_t size,
+			bool contiguous)
+{
+	struct fat_boot_sector sector = {
+		.sec_per_clus = IMG_SEC_PER_CLUS,
+		.reserved = 1,
+		.fats = 2,
+		.media = 0xf8,
+		.fat_length = IMG_FAT_LENGTH,
+	};
+	struct msdos_dir_entry de[3];
+	uint32_t clusters = (size + IMG_CLUSTER_SIZE - 1) / IMG_CLUSTER_SIZE;
+	uint32_t split = contiguous ? 0 : clusters / 2;
+	uint32_t cluster = 2;
+	size_t done = 0;
+	int fd;
+
+	fd = mkstemp(path);
+	if (fd < 0) {
+		return -1;
+	}
+	if (ftruncate(fd, (off_t)IMG_SECTORS * IMG_SECTOR_SIZE)) {
+		goto error;
+	}
+
+	u16_to_le(IMG_SECTOR_SIZE, sector.sector_size);
+	u16_to_le(IMG_DIR_ENTRIES, sector.dir_entries);
+	u16_to_le(IMG_SECTORS, sector.sectors);
+	if (pwrite(fd, &sector, sizeof(sector), 0) != sizeof(sector)) {
+		goto error;
+	}
+
+	/* an LFN entry, a deleted entry and the file itself */
+	memset(de, 0, sizeof(de));
+	memcpy(de[0].name, "B\0G\0E\0N\0V\0\0", MSDOS_NAME);
+	de[0].attr = ATTR_EXT;
+	memcpy(de[1].name, "\xe5GENV   DAT", MSDOS_NAME);
+	memcpy(de[2].name, "BGENV   DAT", MSDOS_NAME);
+	de[2].attr = ATTR_ARCH;
+	de[2].start = cluster;
+	de[2].size = size;
+	if (pwrite(fd, de, sizeof(de), IMG_ROOT_START) != sizeof(de)) {
+		goto error;
+	}
+
+	for (uint32_t i = 0; i < clusters; i++) {
+		uint32_t next = (i + 1 == split) ? 1000 : cluster + 1;
+		size_t len = size - done < IMG_CLUSTER_SIZE ? size - done
+							    : IMG_CLUSTER_SIZE;
+		uint8_t entry[2];
+
+		if (i + 1 == clusters) {
+			next = 0xFFFF;
+		}
+		u16_to_le(next, entry);
+		if (pwrite(fd, entry, 2, IMG_FAT_START + cluster * 2) != 2 ||
+		    pwrite(fd, data + done, len, img_cluster_offset(cluster)) !=
+			    (ssize_t)len) {
+			goto error;
+		}
+		done += len;
+		cluster = next;
+	}
+	return fd;
+
+error:
+	close(fd);
+	unlink(path);
+	return -1;
+}
+
+int create_fat16_image(char *path, const uint8_t *data, size_t size)
+{
+	return create_image(path, data, size, false);
+}
+
+int create_fat16_image_contiguous(char *path, const uint8_t *data,
+				  size_t size)
+{
+	return create_image(path, data, size, true);
+}
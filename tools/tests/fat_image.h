@@ -0,0 +1,42 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2026
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <fat.h>
+
+/* FAT16 image geometry used by the tests */
+#define IMG_SECTOR_SIZE 512
+#define IMG_SEC_PER_CLUS 4
+#define IMG_FAT_LENGTH 40
+#define IMG_DIR_ENTRIES 512
+#define IMG_SECTORS 40000
+#define IMG_FAT_START IMG_SECTOR_SIZE
+#define IMG_ROOT_START \
+	(IMG_FAT_START + 2 * IMG_FAT_LENGTH * IMG_SECTOR_SIZE)
+#define IMG_DATA_START \
+	(IMG_ROOT_START + IMG_DIR_ENTRIES * sizeof(struct msdos_dir_entry))
+#define IMG_CLUSTER_SIZE (IMG_SECTOR_SIZE * IMG_SEC_PER_CLUS)
+
+off_t img_cluster_offset(uint32_t cluster);
+
+/*
+ * Creates a FAT16 image from the mkstemp() template path, with BGENV.DAT
+ * holding size bytes of data. Returns the open file descriptor or -1.
+ */
+int create_fat16_image(char *path, const uint8_t *data, size_t size);
+
+/* Like create_fat16_image(), with the file in consecutive clusters. */
+int create_fat16_image_contiguous(char *path, const uint8_t *data,
+				  size_t size);
@@ -40,7 +40,8 @@ bool probe_config_partitions_custom_fake(CONFIG_PART *cfgpart, bool probe_all)
 		rootdev = get_rootdev_from_efi();
 	}
 	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
-		cfgpart[i].devpath = strdup(devpath);
+		cfgpart[i].devpath = bgenv_arena_strdup(&probe_arena,
+							 devpath);
 	}
 	free(rootdev);
 	return true;
@@ -107,6 +108,66 @@ START_TEST(env_api_fat_test_bgenv_init_retval)
 }
 END_TEST
 
+START_TEST(env_api_fat_test_ctx)
+{
+	ebgenv_ctx_t *ctx;
+	ebgenv_t e = { };
+	int ret;
+
+	RESET_FAKE(probe_config_partitions);
+	RESET_FAKE(read_env);
+	RESET_FAKE(get_rootdev_from_efi);
+
+	/* Test if ebg_ctx_new fails if no config partitions are found
+	 */
+	probe_config_partitions_fake.return_val = false;
+	ret = ebg_ctx_new(&ctx);
+	ck_assert_int_eq(ret, EIO);
+	ck_assert(ctx == NULL);
+
+	/* Test if environments are probed and read only once while a
+	 * context exists
+	 */
+	RESET_FAKE(probe_config_partitions);
+	probe_config_partitions_fake.custom_fake = probe_config_partitions_custom_fake;
+	read_env_fake.custom_fake = read_env_custom_fake;
+	ebg_set_opt_bool(EBG_OPT_PROBE_ALL_DEVICES, true);
+
+	ret = ebg_ctx_new(&ctx);
+	ck_assert_int_eq(ret, 0);
+	for (int i = 0; i < 2; i++) {
+		ret = ebg_env_open_current(&e);
+		ck_assert_int_eq(ret, 0);
+		ret = ebg_env_close(&e);
+		ck_assert_int_eq(ret, 0);
+	}
+	ck_assert_int_eq(probe_config_partitions_fake.call_count, 1);
+	ck_assert_int_eq(read_env_fake.call_count, ENV_NUM_CONFIG_PARTS);
+
+	/* Test if a refresh rereads the environments, but only while no
+	 * environment is open
+	 */
+	ret = ebg_env_open_current(&e);
+	ck_assert_int_eq(ret, 0);
+	ret = ebg_ctx_refresh(ctx);
+	ck_assert_int_eq(ret, EBUSY);
+	(void)ebg_env_close(&e);
+
+	ret = ebg_ctx_refresh(ctx);
+	ck_assert_int_eq(ret, 0);
+	ck_assert_int_eq(probe_config_partitions_fake.call_count, 1);
+	ck_assert_int_eq(read_env_fake.call_count, 2 * ENV_NUM_CONFIG_PARTS);
+
+	/* Test if freeing the last context finalizes the library
+	 */
+	ebg_ctx_free(ctx);
+	ret = ebg_env_open_current(&e);
+	ck_assert_int_eq(ret, 0);
+	ck_assert_int_eq(probe_config_partitions_fake.call_count, 2);
+	(void)ebg_env_close(&e);
+}
+END_TEST
+
 Suite *ebg_test_suite(void)
 {
 	Suite *s;
@@ -116,6 +177,7 @@ Suite *ebg_test_suite(void)
 
 	tc_core = tcase_create("Core");
 	tcase_add_test(tc_core, env_api_fat_test_bgenv_init_retval);
+	tcase_add_test(tc_core, env_api_fat_test_ctx);
 	suite_add_tcase(s, tc_core);
 
 	return s;
@@ -0,0 +1,145 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2026
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+#include <fff.h>
+
+#include <env_api.h>
+
+DEFINE_FFF_GLOBALS;
+
+Suite *ebg_test_suite(void);
+
+/* bitwise reference implementation of the reflected 0xEDB88320 CRC */
+static uint32_t crc32_ref(uint32_t crc, const uint8_t *p, size_t size)
+{
+	crc = ~crc;
+	while (size--) {
+		crc ^= *p++;
+		for (int i = 0; i < 8; i++) {
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+		}
+	}
+	return ~crc;
+}
+
+START_TEST(test_crc32_check_value)
+{
+	const char *s = "123456789";
+
+	ck_assert_uint_eq(bgenv_crc32(0, s, strlen(s)), 0xCBF43926);
+	ck_assert_uint_eq(bgenv_crc32(0, s, 0), 0);
+}
+END_TEST
+
+START_TEST(test_crc32_matches_reference)
+{
+	uint8_t buf[1024 + 7];
+
+	for (size_t i = 0; i < sizeof(buf); i++) {
+		buf[i] = (uint8_t)(i * 131 + 7);
+	}
+
+	/* cover all alignments and tail lengths of the word-wise paths */
+	for (size_t off = 0; off < 8; off++) {
+		for (size_t len = 0; len <= 64; len++) {
+			ck_assert_uint_eq(bgenv_crc32(0, buf + off, len),
+					  crc32_ref(0, buf + off, len));
+		}
+		ck_assert_uint_eq(bgenv_crc32(0, buf + off, 1024),
+				  crc32_ref(0, buf + off, 1024));
+	}
+}
+END_TEST
+
+START_TEST(test_crc32_chained)
+{
+	uint8_t buf[4096];
+	uint32_t crc;
+
+	for (size_t i = 0; i < sizeof(buf); i++) {
+		buf[i] = (uint8_t)(i ^ (i >> 8));
+	}
+
+	crc = bgenv_crc32(0, buf, 1000);
+	crc = bgenv_crc32(crc, buf + 1000, sizeof(buf) - 1000);
+	ck_assert_uint_eq(crc, bgenv_crc32(0, buf, sizeof(buf)));
+}
+END_TEST
+
+START_TEST(test_crc32_patch)
+{
+	static uint8_t buf[ENV_MEM_USERVARS];
+	const size_t spans[][2] = {
+		{ 0, 1 }, { 3, 17 }, { 1020, 8 }, { 4096, 200 },
+		{ sizeof(buf) - 1, 1 }, { sizeof(buf) - 300, 300 },
+	};
+	uint32_t crc;
+
+	for (size_t i = 0; i < sizeof(buf); i++) {
+		buf[i] = (uint8_t)(i * 7 + (i >> 9));
+	}
+	crc = bgenv_crc32(0, buf, sizeof(buf));
+
+	for (size_t i = 0; i < sizeof(spans) / sizeof(spans[0]); i++) {
+		size_t off = spans[i][0];
+		size_t len = spans[i][1];
+		uint8_t new[300];
+
+		for (size_t j = 0; j < len; j++) {
+			new[j] = buf[off + j] ^ (uint8_t)(j + i + 1);
+		}
+		crc = bgenv_crc32_patch(crc, sizeof(buf), off, buf + off, new,
+					len);
+		memcpy(buf + off, new, len);
+		ck_assert_uint_eq(crc, bgenv_crc32(0, buf, sizeof(buf)));
+	}
+}
+END_TEST
+
+START_TEST(test_crc32_zeros)
+{
+	static uint8_t buf[8192];
+	uint32_t crc;
+
+	for (size_t i = 0; i < 100; i++) {
+		buf[i] = (uint8_t)(i * 3 + 1);
+	}
+	crc = bgenv_crc32(0, buf, 100);
+	ck_assert_uint_eq(bgenv_crc32_zeros(crc, 0), crc);
+	ck_assert_uint_eq(bgenv_crc32_zeros(crc, sizeof(buf) - 100),
+			  bgenv_crc32(0, buf, sizeof(buf)));
+	ck_assert_uint_eq(bgenv_crc32_zeros(0, 17), bgenv_crc32(0, buf + 100,
+								17));
+}
+END_TEST
+
+Suite *ebg_test_suite(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s = suite_create("crc32");
+
+	tc_core = tcase_create("Core");
+
+	tcase_add_test(tc_core, test_crc32_check_value);
+	tcase_add_test(tc_core, test_crc32_matches_reference);
+	tcase_add_test(tc_core, test_crc32_chained);
+	tcase_add_test(tc_core, test_crc32_patch);
+	tcase_add_test(tc_core, test_crc32_zeros);
+
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
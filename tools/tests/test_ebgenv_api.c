@@ -13,6 +13,7 @@
  */
 
 #include <stdlib.h>
+#include <poll.h>
 #include <check.h>
 #include <fff.h>
 #include <env_api.h>
@@ -200,6 +201,43 @@ START_TEST(ebgenv_api_ebg_env_create_new)
 }
 END_TEST
 
+static bool keep_unprefixed(const char *key, void *priv)
+{
+	return strncmp(key, priv, strlen(priv)) != 0;
+}
+
+START_TEST(ebgenv_api_ebg_env_create_new_filtered)
+{
+	uint64_t t = USERVAR_TYPE_DEFAULT | USERVAR_TYPE_STRING_ASCII;
+	BG_ENVDATA *latest = &envdata[ENV_NUM_CONFIG_PARTS - 1];
+	ebgenv_t e = { };
+	int ret;
+
+	init_test();
+	bgenv_init_fake.return_val = true;
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		envdata[i].revision = i + 1;
+	}
+	bgenv_set_uservar(latest->userdata, "tmp.a", t, "1", 2);
+	bgenv_set_uservar(latest->userdata, "keep", t, "2", 2);
+	bgenv_set_uservar(latest->userdata, "tmp.b", t, "3", 2);
+
+	ck_assert_int_eq(ebg_env_create_new_filtered(&e, NULL, NULL), EINVAL);
+	ret = ebg_env_create_new_filtered(&e, keep_unprefixed, "tmp.");
+	ck_assert_int_eq(ret, 0);
+	ck_assert(((BGENV *)e.bgenv)->data == &envdata[0]);
+	ck_assert_int_eq(((BGENV *)e.bgenv)->data->revision,
+			 ENV_NUM_CONFIG_PARTS + 1);
+	ck_assert_int_eq(((BGENV *)e.bgenv)->data->in_progress, 1);
+
+	ck_assert_int_eq(ebg_env_get(&e, "tmp.a", NULL), -ENOENT);
+	ck_assert_int_eq(ebg_env_get(&e, "tmp.b", NULL), -ENOENT);
+	ck_assert_int_eq(ebg_env_get(&e, "keep", NULL), 2);
+	ck_assert(bgenv_validate_uservars(((BGENV *)e.bgenv)->data->userdata));
+	(void)ebg_env_close(&e);
+}
+END_TEST
+
 START_TEST(ebgenv_api_ebg_env_open_current)
 {
 	ebgenv_t e = { };
@@ -244,6 +282,37 @@ START_TEST(ebgenv_api_ebg_env_open_current)
 }
 END_TEST
 
+START_TEST(ebgenv_api_ebg_env_open_current_ro)
+{
+	ebgenv_t e = { };
+	int ret;
+
+	init_test();
+
+	bgenv_init_fake.return_val = true;
+	ret = ebg_env_open_current_ro(&e);
+	ck_assert_int_eq(ret, 0);
+
+	/* Test if a read-only environment refuses modifications
+	 */
+	ret = ebg_env_set(&e, "kernelfile", "vmlinuz");
+	ck_assert_int_eq(ret, -EROFS);
+	ret = ebg_env_setglobalstate(&e, USTATE_OK);
+	ck_assert_int_eq(ret, -EROFS);
+	ret = ebg_env_finalize_update(&e);
+	ck_assert_int_eq(ret, EROFS);
+
+	/* Test if closing a read-only environment does not write it back,
+	 * even though its checksum is invalid
+	 */
+	RESET_FAKE(bgenv_write);
+	ret = ebg_env_close(&e);
+	ck_assert_int_eq(ret, 0);
+	ck_assert_int_eq(bgenv_write_fake.call_count, 0);
+	ck_assert(e.bgenv == NULL);
+}
+END_TEST
+
 START_TEST(ebgenv_api_ebg_env_get)
 {
 	ebgenv_t e = { };
@@ -392,6 +461,84 @@ START_TEST(ebgenv_api_ebg_env_get_ex)
 }
 END_TEST
 
+START_TEST(ebgenv_api_ebg_env_uservar_next)
+{
+	ebgenv_t e = { };
+	ebgenv_uservar_iter_t it;
+	ebgenv_uservar_view_t view;
+	uint8_t blob[300];
+	uint32_t u32;
+	int ret;
+
+	init_test();
+
+	/* Test if iterating without an environment fails
+	 */
+	ebg_env_uservar_iter_init(&e, &it);
+	ret = ebg_env_uservar_next(&e, &it, &view);
+	ck_assert_int_eq(ret, -EPERM);
+
+	e.bgenv = calloc(1, sizeof(BGENV));
+	ck_assert(e.bgenv != NULL);
+	((BGENV *)e.bgenv)->data = &envdata[0];
+
+	/* Test if an empty environment yields no variables
+	 */
+	ebg_env_uservar_iter_init(&e, &it);
+	ret = ebg_env_uservar_next(&e, &it, &view);
+	ck_assert_int_eq(ret, 0);
+
+	/* Test if all variables are returned in order, pointing into the
+	 * environment
+	 */
+	/* noise, so that the blob is stored as it is rather than compressed */
+	u32 = 1;
+	for (size_t i = 0; i < sizeof(blob); i++) {
+		u32 = u32 * 1103515245 + 12345;
+		blob[i] = (uint8_t)(u32 >> 24);
+	}
+	u32 = 0xdeadbeef;
+	ret = ebg_env_set(&e, "first", "value");
+	ck_assert_int_eq(ret, 0);
+	ret = ebg_env_set_ex(&e, "blob", 0x10000, blob, sizeof(blob));
+	ck_assert_int_eq(ret, 0);
+	ret = ebg_env_set_ex(&e, "num", USERVAR_TYPE_UINT32, (uint8_t *)&u32,
+			     sizeof(u32));
+	ck_assert_int_eq(ret, 0);
+
+	ebg_env_uservar_iter_init(&e, &it);
+	ret = ebg_env_uservar_next(&e, &it, &view);
+	ck_assert_int_eq(ret, 1);
+	ck_assert_str_eq(view.key, "first");
+	ck_assert(view.type == USERVAR_TYPE_STRING_ASCII);
+	ck_assert_uint_eq(view.datalen, strlen("value") + 1);
+	ck_assert_str_eq((const char *)view.data, "value");
+	ck_assert(view.data > envdata[0].userdata &&
+		  view.data < envdata[0].userdata + ENV_MEM_USERVARS);
+
+	ret = ebg_env_uservar_next(&e, &it, &view);
+	ck_assert_int_eq(ret, 1);
+	ck_assert_str_eq(view.key, "blob");
+	ck_assert(view.type == 0x10000);
+	ck_assert_uint_eq(view.datalen, sizeof(blob));
+	ck_assert_int_eq(memcmp(view.data, blob, sizeof(blob)), 0);
+
+	ret = ebg_env_uservar_next(&e, &it, &view);
+	ck_assert_int_eq(ret, 1);
+	ck_assert_str_eq(view.key, "num");
+	ck_assert_uint_eq(view.datalen, sizeof(u32));
+	memcpy(&u32, view.data, sizeof(u32));
+	ck_assert_uint_eq(u32, 0xdeadbeef);
+
+	ret = ebg_env_uservar_next(&e, &it, &view);
+	ck_assert_int_eq(ret, 0);
+	ret = ebg_env_uservar_next(&e, &it, &view);
+	ck_assert_int_eq(ret, 0);
+
+	bgenv_close((BGENV *)e.bgenv);
+}
+END_TEST
+
 START_TEST(ebgenv_api_ebg_env_user_free)
 {
 	ebgenv_t e = { };
@@ -519,6 +666,19 @@ START_TEST(ebgenv_api_ebg_env_getglobalstate)
 }
 END_TEST
 
+static BG_ENVDATA *write_order[ENV_NUM_CONFIG_PARTS];
+static int write_order_count;
+
+static bool bgenv_write_record_order(BGENV *env)
+{
+	int i = __atomic_fetch_add(&write_order_count, 1, __ATOMIC_SEQ_CST);
+
+	if (i < ENV_NUM_CONFIG_PARTS) {
+		write_order[i] = env->data;
+	}
+	return true;
+}
+
 START_TEST(ebgenv_api_ebg_env_setglobalstate)
 {
 #if ENV_NUM_CONFIG_PARTS > 1
@@ -581,6 +741,39 @@ START_TEST(ebgenv_api_ebg_env_setglobalstate)
 	ck_assert_int_eq(envdata[0].ustate, USTATE_OK);
 	ck_assert_int_eq(envdata[1].ustate, USTATE_OK);
 
+	/* Test if the environment with the highest revision is written
+	 * only after all others
+	 */
+	ebgenv_t e2 = { };
+	uint32_t revision[2] = { envdata[0].revision, envdata[1].revision };
+
+	e2.bgenv = calloc(1, sizeof(BGENV));
+	ck_assert(e2.bgenv != NULL);
+	((BGENV *)e2.bgenv)->data = calloc(1, sizeof(BG_ENVDATA));
+	ck_assert(((BGENV *)e2.bgenv)->data != NULL);
+
+	for (int latest = 0; latest < 2; latest++) {
+		envdata[0].ustate = USTATE_FAILED;
+		envdata[1].ustate = USTATE_FAILED;
+		envdata[0].revision = latest == 0 ? 10 : 5;
+		envdata[1].revision = latest == 1 ? 10 : 5;
+
+		RESET_FAKE(bgenv_write);
+		bgenv_write_fake.custom_fake = bgenv_write_record_order;
+		write_order_count = 0;
+
+		ret = ebg_env_setglobalstate(&e2, USTATE_OK);
+
+		ck_assert_int_eq(ret, 0);
+		ck_assert_int_eq(write_order_count, 2);
+		ck_assert(write_order[1] == &envdata[latest]);
+	}
+	RESET_FAKE(bgenv_write);
+	envdata[0].revision = revision[0];
+	envdata[1].revision = revision[1];
+	free(((BGENV *)e2.bgenv)->data);
+	free(e2.bgenv);
+
 	/* Test if ebg_env_setglobalstate sets current environment to TESTING
 	 */
 	envdata[0].ustate = USTATE_INSTALLED;
@@ -641,6 +834,59 @@ START_TEST(ebgenv_api_ebg_env_close)
 	ck_assert_int_eq(ret, 0);
 	ck_assert(e.bgenv == NULL);
 
+	/* Test if ebg_env_close does not write an unmodified environment
+	 */
+	e.bgenv = calloc(1, sizeof(BGENV));
+	ck_assert(e.bgenv != NULL);
+	((BGENV *)e.bgenv)->data = data;
+	RESET_FAKE(bgenv_write);
+	ret = ebg_env_close(&e);
+
+	ck_assert_int_eq(ret, 0);
+	ck_assert_int_eq(bgenv_write_fake.call_count, 0);
+
+	free(data);
+}
+END_TEST
+
+START_TEST(ebgenv_api_ebg_env_commit_async)
+{
+	ebgenv_t e = { };
+	ebgenv_commit_t *commit;
+	struct pollfd pfd = { .events = POLLIN };
+	void *data = calloc(1, sizeof(BG_ENVDATA));
+	int ret;
+
+	init_test();
+	RESET_FAKE(bgenv_write);
+	ck_assert_int_eq(ebg_env_commit_async(&e, &commit), EIO);
+
+	e.bgenv = calloc(1, sizeof(BGENV));
+	ck_assert(e.bgenv != NULL);
+	((BGENV *)e.bgenv)->data = data;
+
+	/* a failed write is reported by the commit */
+	bgenv_write_fake.return_val = false;
+	ck_assert_int_eq(ebg_env_commit_async(&e, &commit), 0);
+	pfd.fd = ebg_commit_fd(commit);
+	ck_assert_int_eq(poll(&pfd, 1, 10000), 1);
+	ck_assert_int_eq(ebg_commit_finish(commit), EIO);
+	ck_assert_int_eq(bgenv_write_fake.call_count, 1);
+
+	/* the environment stays open and is written by the next commit */
+	bgenv_write_fake.return_val = true;
+	ck_assert_int_eq(ebg_env_commit_async(&e, &commit), 0);
+	ck_assert_int_eq(ebg_commit_finish(commit), 0);
+	ck_assert_int_eq(bgenv_write_fake.call_count, 2);
+	ck_assert(e.bgenv != NULL);
+
+	/* closing waits for a commit in progress */
+	ck_assert_int_eq(ebg_env_commit_async(&e, &commit), 0);
+	ret = ebg_env_close(&e);
+	ck_assert_int_eq(ret, 0);
+	ck_assert(e.bgenv == NULL);
+	ck_assert_int_eq(ebg_commit_finish(commit), 0);
+
 	free(data);
 }
 END_TEST
@@ -706,15 +952,19 @@ Suite *ebg_test_suite(void)
 
 	tcase_add_test(tc_core, ebgenv_api_ebg_env_options);
 	tcase_add_test(tc_core, ebgenv_api_ebg_env_create_new);
+	tcase_add_test(tc_core, ebgenv_api_ebg_env_create_new_filtered);
 	tcase_add_test(tc_core, ebgenv_api_ebg_env_open_current);
+	tcase_add_test(tc_core, ebgenv_api_ebg_env_open_current_ro);
 	tcase_add_test(tc_core, ebgenv_api_ebg_env_get);
 	tcase_add_test(tc_core, ebgenv_api_ebg_env_set);
 	tcase_add_test(tc_core, ebgenv_api_ebg_env_set_ex);
 	tcase_add_test(tc_core, ebgenv_api_ebg_env_get_ex);
+	tcase_add_test(tc_core, ebgenv_api_ebg_env_uservar_next);
 	tcase_add_test(tc_core, ebgenv_api_ebg_env_user_free);
 	tcase_add_test(tc_core, ebgenv_api_ebg_env_getglobalstate);
 	tcase_add_test(tc_core, ebgenv_api_ebg_env_setglobalstate);
 	tcase_add_test(tc_core, ebgenv_api_ebg_env_close);
+	tcase_add_test(tc_core, ebgenv_api_ebg_env_commit_async);
 	tcase_add_test(tc_core, ebgenv_api_ebg_env_register_gc_var);
 
 	suite_add_tcase(s, tc_core);
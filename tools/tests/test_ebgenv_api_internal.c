@@ -90,6 +90,21 @@ START_TEST(ebgenv_api_internal_bgenv_str2enum)
 	e = bgenv_str2enum("ustate");
 	ck_assert(e == EBGENV_USTATE);
 
+	e = bgenv_str2enum("in_progress");
+	ck_assert(e == EBGENV_IN_PROGRESS);
+
+	/* Test if keys of the same length as a built-in key, or with a
+	 * built-in key as prefix, are not mistaken for it
+	 */
+	e = bgenv_str2enum("kernelfilf");
+	ck_assert(e == EBGENV_UNKNOWN);
+
+	e = bgenv_str2enum("ustates");
+	ck_assert(e == EBGENV_UNKNOWN);
+
+	e = bgenv_str2enum("watchdog_timeout_sec_and_more");
+	ck_assert(e == EBGENV_UNKNOWN);
+
 	/* Test if bgenv_str2enum returns EBGENV_UNKNOWN for empty and invalid
 	 * keys
 	 */
@@ -386,6 +401,139 @@ START_TEST(ebgenv_api_internal_bgenv_set)
 }
 END_TEST
 
+START_TEST(ebgenv_api_internal_bgenv_typed)
+{
+	const char *str;
+	uint32_t u32;
+	int res;
+
+	BGENV *handle = bgenv_open_latest();
+	ck_assert(handle != NULL);
+
+	/* Test if numeric built-in variables are accessible natively
+	 */
+	res = bgenv_set_u32(handle, "revision", 0x12345678);
+	ck_assert_int_eq(res, 0);
+	ck_assert_uint_eq(handle->data->revision, 0x12345678);
+	res = bgenv_get_u32(handle, "revision", &u32);
+	ck_assert_int_eq(res, 0);
+	ck_assert_uint_eq(u32, 0x12345678);
+
+	res = bgenv_set_u32(handle, "ustate", USTATE_TESTING);
+	ck_assert_int_eq(res, 0);
+	res = bgenv_get_u32(handle, "ustate", &u32);
+	ck_assert_int_eq(res, 0);
+	ck_assert_uint_eq(u32, USTATE_TESTING);
+
+	/* Test if values not fitting into a built-in variable are refused
+	 */
+	res = bgenv_set_u32(handle, "ustate", 256);
+	ck_assert_int_eq(res, -ERANGE);
+	res = bgenv_set_u32(handle, "watchdog_timeout_sec", 0x10000);
+	ck_assert_int_eq(res, -ERANGE);
+	res = bgenv_set_u32(handle, "kernelfile", 1);
+	ck_assert_int_eq(res, -EINVAL);
+
+	/* Test if numeric user variables are stored and converted
+	 */
+	res = bgenv_set_u32(handle, "counter", 42);
+	ck_assert_int_eq(res, 0);
+	res = bgenv_get_u32(handle, "counter", &u32);
+	ck_assert_int_eq(res, 0);
+	ck_assert_uint_eq(u32, 42);
+
+	uint64_t u64 = 1ULL << 32;
+	res = bgenv_set(handle, "big", USERVAR_TYPE_UINT64, &u64, sizeof(u64));
+	ck_assert_int_eq(res, 0);
+	res = bgenv_get_u32(handle, "big", &u32);
+	ck_assert_int_eq(res, -ERANGE);
+
+	res = bgenv_get_u32(handle, "missing", &u32);
+	ck_assert_int_eq(res, -ENOENT);
+
+	/* Test if string views follow modifications of the variable
+	 */
+	res = bgenv_set(handle, "kernelfile", 0, "vmlinuz", 8);
+	ck_assert_int_eq(res, 0);
+	res = bgenv_get_str(handle, "kernelfile", &str);
+	ck_assert_int_eq(res, 0);
+	ck_assert_str_eq(str, "vmlinuz");
+
+	res = bgenv_set(handle, "kernelfile", 0, "bzImage", 8);
+	ck_assert_int_eq(res, 0);
+	res = bgenv_get_str(handle, "kernelfile", &str);
+	ck_assert_int_eq(res, 0);
+	ck_assert_str_eq(str, "bzImage");
+
+	res = bgenv_set(handle, "greeting", USERVAR_TYPE_STRING_ASCII,
+			"hello", 6);
+	ck_assert_int_eq(res, 0);
+	res = bgenv_get_str(handle, "greeting", &str);
+	ck_assert_int_eq(res, 0);
+	ck_assert_str_eq(str, "hello");
+
+	res = bgenv_get_str(handle, "counter", &str);
+	ck_assert_int_eq(res, -EINVAL);
+
+	bgenv_close(handle);
+}
+END_TEST
+
+START_TEST(ebgenv_api_internal_bgenv_counters)
+{
+#if ENV_NUM_COUNTERS > 0
+	const char *name = bgenv_counter_name(0);
+	char buffer[16];
+	const char *str;
+	uint8_t *file;
+	uint32_t u32;
+	size_t len;
+	int res;
+
+	BGENV *handle = bgenv_open_latest();
+	ck_assert(handle != NULL);
+	ck_assert(name != NULL);
+	ck_assert_int_eq(bgenv_counter_index(name), 0);
+	ck_assert(bgenv_counter_name(ENV_NUM_COUNTERS) == NULL);
+
+	/* Test if counters are set and read like built-in variables and are
+	 * not stored as user variables
+	 */
+	res = bgenv_set(handle, (char *)name, 0, "7", 2);
+	ck_assert_int_eq(res, 0);
+	ck_assert_uint_eq(handle->data->counters[0], 7);
+	ck_assert(bgenv_find_uservar(handle->data->userdata,
+				     (char *)name) == NULL);
+	res = bgenv_get(handle, (char *)name, NULL, buffer, sizeof(buffer));
+	ck_assert_int_eq(res, 0);
+	ck_assert_str_eq(buffer, "7");
+
+	res = bgenv_set_u32(handle, (char *)name, 0xfedcba98);
+	ck_assert_int_eq(res, 0);
+	res = bgenv_get_u32(handle, (char *)name, &u32);
+	ck_assert_int_eq(res, 0);
+	ck_assert_uint_eq(u32, 0xfedcba98);
+	res = bgenv_get_str(handle, (char *)name, &str);
+	ck_assert_int_eq(res, -EINVAL);
+
+	/* Test if the compact format keeps the counters
+	 */
+	file = malloc(ENV_FILE_MAX_SIZE);
+	ck_assert(file != NULL);
+	len = bgenv_encode_v2(handle->data, ENV_FORMAT_V2, file, NULL);
+	memset(handle->data, 0, sizeof(BG_ENVDATA));
+	ck_assert(bgenv_decode(handle->data, file, len, NULL, NULL));
+	ck_assert_uint_eq(handle->data->counters[0], 0xfedcba98);
+	free(file);
+
+	bgenv_close(handle);
+#else
+	ck_assert_int_eq(bgenv_counter_index("boot_count"), -1);
+	ck_assert(bgenv_counter_name(0) == NULL);
+#endif
+}
+END_TEST
+
 START_TEST(ebgenv_api_internal_uservars)
 {
 	RESET_FAKE(write_env);
@@ -452,6 +600,8 @@ Suite *ebg_test_suite(void)
 	tcase_add_test(tc_core, ebgenv_api_internal_bgenv_create_new);
 	tcase_add_test(tc_core, ebgenv_api_internal_bgenv_get);
 	tcase_add_test(tc_core, ebgenv_api_internal_bgenv_set);
+	tcase_add_test(tc_core, ebgenv_api_internal_bgenv_typed);
+	tcase_add_test(tc_core, ebgenv_api_internal_bgenv_counters);
 	tcase_add_test(tc_core, ebgenv_api_internal_uservars);
 
 	suite_add_tcase(s, tc_core);
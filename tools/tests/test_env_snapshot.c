@@ -0,0 +1,199 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2026
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <check.h>
+#include <fff.h>
+
+#include <env_api.h>
+#include <ebgpart.h>
+#include <env_config_partitions.h>
+#include <env_snapshot.h>
+
+DEFINE_FFF_GLOBALS;
+
+Suite *ebg_test_suite(void);
+
+/* DEVDIR points into this directory, see Makefile.am */
+#define SNAPSHOT_ROOT "/tmp/test_env_snapshot"
+#define BY_PARTUUID DEVDIR "/disk/by-partuuid"
+
+static const char *uuids[] = {
+	"0fc63daf-8483-4772-8e79-3d69d8477de4",
+	"c12a7328-f81f-11d2-ba4b-00a0c93ec93b",
+	"ebd0a0a2-b9e5-4433-87c0-68b6b72699c7",
+};
+
+static char snapshot_path[] = SNAPSHOT_ROOT "/snapshot";
+static char stale_path[] = SNAPSHOT_ROOT "/run/snapshot.stale";
+static char targets[ENV_NUM_CONFIG_PARTS][PATH_MAX];
+
+static void init_snapshot(BG_ENVSNAPSHOT *snapshot)
+{
+	memset(snapshot, 0, sizeof(*snapshot));
+	snapshot->magic = ENV_SNAPSHOT_MAGIC;
+	snapshot->version = ENV_SNAPSHOT_VERSION;
+	snapshot->count = ENV_NUM_CONFIG_PARTS;
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		memcpy(snapshot->part[i].part_uuid, uuids[i % 3],
+		       ENV_SNAPSHOT_UUID_LEN);
+		snapshot->part[i].valid = 1;
+		snapshot->part[i].revision = i + 1;
+	}
+}
+
+/* writes the snapshot like efivarfs presents it, after the attributes */
+static void write_snapshot(const BG_ENVSNAPSHOT *snapshot, size_t len)
+{
+	uint32_t attributes = 6;
+	FILE *f = fopen(snapshot_path, "w");
+
+	ck_assert(f != NULL);
+	ck_assert_int_eq(fwrite(&attributes, sizeof(attributes), 1, f), 1);
+	ck_assert_int_eq(fwrite(snapshot, len, 1, f), 1);
+	ck_assert_int_eq(fclose(f), 0);
+}
+
+/* one partition device, a plain file, and its by-partuuid link each */
+static void setup_devices(void)
+{
+	ck_assert_int_eq(system("rm -rf " SNAPSHOT_ROOT " && mkdir -p "
+				BY_PARTUUID " " SNAPSHOT_ROOT "/run"),
+			 0);
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		char link[PATH_MAX];
+		FILE *f;
+
+		snprintf(targets[i], sizeof(targets[i]), "%s/part%d", DEVDIR,
+			 i + 1);
+		f = fopen(targets[i], "w");
+		ck_assert(f != NULL);
+		fclose(f);
+		snprintf(link, sizeof(link), "%s/%s", BY_PARTUUID,
+			 uuids[i % 3]);
+		ck_assert_int_eq(symlink(targets[i], link), 0);
+	}
+}
+
+START_TEST(env_snapshot_format)
+{
+	BG_ENVSNAPSHOT snapshot, loaded;
+
+	setup_devices();
+	ck_assert(!env_snapshot_read(snapshot_path, &loaded));
+
+	init_snapshot(&snapshot);
+	write_snapshot(&snapshot, sizeof(snapshot));
+	ck_assert(env_snapshot_read(snapshot_path, &loaded));
+	ck_assert(memcmp(&snapshot, &loaded, sizeof(snapshot)) == 0);
+
+	write_snapshot(&snapshot, sizeof(snapshot) - 1);
+	ck_assert(!env_snapshot_read(snapshot_path, &loaded));
+
+	snapshot.version++;
+	write_snapshot(&snapshot, sizeof(snapshot));
+	ck_assert(!env_snapshot_read(snapshot_path, &loaded));
+
+	/* a boot loader that found too few config partitions */
+	init_snapshot(&snapshot);
+	snapshot.count--;
+	write_snapshot(&snapshot, sizeof(snapshot));
+	ck_assert(!env_snapshot_read(snapshot_path, &loaded));
+
+	init_snapshot(&snapshot);
+	snapshot.part[0].part_uuid[0] = 'F';
+	write_snapshot(&snapshot, sizeof(snapshot));
+	ck_assert(!env_snapshot_read(snapshot_path, &loaded));
+}
+END_TEST
+
+START_TEST(env_snapshot_partitions)
+{
+	CONFIG_PART cfgpart[ENV_NUM_CONFIG_PARTS] = {0};
+	BG_ENVSNAPSHOT snapshot;
+	char link[PATH_MAX];
+
+	setup_devices();
+	init_snapshot(&snapshot);
+	write_snapshot(&snapshot, sizeof(snapshot));
+
+	ck_assert(env_snapshot_load(snapshot_path, cfgpart));
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		ck_assert_str_eq(cfgpart[i].devpath, targets[i]);
+		ck_assert(cfgpart[i].not_mounted);
+		cfgpart[i].devpath = NULL;
+	}
+	bgenv_arena_release(&probe_arena);
+
+	/* a partition of the snapshot has gone */
+	snprintf(link, sizeof(link), "%s/%s", BY_PARTUUID, uuids[0]);
+	ck_assert_int_eq(unlink(link), 0);
+	ck_assert(!env_snapshot_load(snapshot_path, cfgpart));
+	ck_assert_int_eq(env_snapshot_globalstate(snapshot_path, stale_path),
+			 -1);
+}
+END_TEST
+
+START_TEST(env_snapshot_state)
+{
+	BG_ENVSNAPSHOT snapshot;
+	int last = ENV_NUM_CONFIG_PARTS - 1;
+
+	setup_devices();
+	init_snapshot(&snapshot);
+	snapshot.part[last].ustate = USTATE_TESTING;
+	write_snapshot(&snapshot, sizeof(snapshot));
+	ck_assert_int_eq(env_snapshot_globalstate(snapshot_path, stale_path),
+			 USTATE_TESTING);
+
+	/* a rolled back update */
+	snapshot.part[0].revision = REVISION_FAILED;
+	snapshot.part[0].ustate = USTATE_FAILED;
+	write_snapshot(&snapshot, sizeof(snapshot));
+	ck_assert_int_eq(env_snapshot_globalstate(snapshot_path, stale_path),
+			 USTATE_FAILED);
+
+	/* writing an environment outdates the snapshot */
+	ck_assert(access(stale_path, F_OK) != 0);
+	env_snapshot_invalidate(snapshot_path, stale_path);
+	ck_assert(access(stale_path, F_OK) == 0);
+	ck_assert_int_eq(env_snapshot_globalstate(snapshot_path, stale_path),
+			 -1);
+
+	/* nothing to mark without a snapshot */
+	ck_assert_int_eq(unlink(stale_path), 0);
+	ck_assert_int_eq(unlink(snapshot_path), 0);
+	env_snapshot_invalidate(snapshot_path, stale_path);
+	ck_assert(access(stale_path, F_OK) != 0);
+
+	ck_assert_int_eq(system("rm -rf " SNAPSHOT_ROOT), 0);
+}
+END_TEST
+
+Suite *ebg_test_suite(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s = suite_create("env_snapshot");
+
+	tc_core = tcase_create("Core");
+	tcase_add_test(tc_core, env_snapshot_format);
+	tcase_add_test(tc_core, env_snapshot_partitions);
+	tcase_add_test(tc_core, env_snapshot_state);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
@@ -12,6 +12,7 @@
  */
 
 #include <stdlib.h>
+#include <unistd.h>
 #include <check.h>
 #include <fff.h>
 
@@ -20,11 +21,32 @@
 #include <bg_envtools.h>
 #include <fat.h>
 #include <linux_util.h>
+#include <env_config_partitions.h>
+#include <env_disk_utils.h>
+#include <test-interface.h>
+#include "fat_image.h"
 
 DEFINE_FFF_GLOBALS;
 
+extern BG_ENVDATA envdata[ENV_NUM_CONFIG_PARTS];
+
 Suite *ebg_test_suite(void);
 
+static char *log_image_path;
+
+bool probe_config_partitions_custom_fake(CONFIG_PART *cfgpart, bool probe_all);
+bool probe_config_partitions_custom_fake(CONFIG_PART *cfgpart, bool probe_all)
+{
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		cfgpart[i].devpath = bgenv_arena_strdup(&probe_arena,
+							 log_image_path);
+		cfgpart[i].not_mounted = true;
+	}
+	return true;
+}
+
+FAKE_VALUE_FUNC(bool, probe_config_partitions, CONFIG_PART *, bool);
+
 static inline void u16_to_le(u16 value, __u8 out[2]) {
     out[0] = (value >> 0) & 0xFF;
     out[1] = (value >> 8) & 0xFF;
@@ -321,6 +343,33 @@ START_TEST(test_determine_FAT_bits_fat16_swupdate)
 }
 END_TEST
 
+START_TEST(test_fat_volume_label)
+{
+	struct fat_boot_sector sector;
+	char label[MSDOS_NAME + 1];
+
+	memset(&sector, 0, sizeof(sector));
+	sector.fat16.signature = 0x29;
+	memcpy(sector.fat16.vol_label, "BOOTENV    ", MSDOS_NAME);
+	ck_assert(fat_volume_label(&sector, 16, label));
+	ck_assert_str_eq(label, "BOOTENV");
+
+	/* FAT32 keeps the label behind its longer BPB */
+	ck_assert(!fat_volume_label(&sector, 32, label));
+	sector.fat32.signature = 0x29;
+	memcpy(sector.fat32.vol_label, "CONFIG 1   ", MSDOS_NAME);
+	ck_assert(fat_volume_label(&sector, 32, label));
+	ck_assert_str_eq(label, "CONFIG 1");
+
+	memcpy(sector.fat16.vol_label, "NO NAME    ", MSDOS_NAME);
+	ck_assert(!fat_volume_label(&sector, 12, label));
+	/* the short extended boot signature has no label field */
+	sector.fat16.signature = 0x28;
+	memcpy(sector.fat16.vol_label, "BOOTENV    ", MSDOS_NAME);
+	ck_assert(!fat_volume_label(&sector, 16, label));
+}
+END_TEST
+
 START_TEST(test_determine_FAT_bits_squashfs)
 {
 	const unsigned char sector[] = {
@@ -383,6 +432,496 @@ START_TEST(test_determine_FAT_bits_squashfs)
 }
 END_TEST
 
+START_TEST(test_raw_config_file_access)
+{
+	static BG_ENVDATA env, out;
+	char path[] = "/tmp/test_fat_image.XXXXXX";
+	CONFIG_PART part = { .devpath = path, .not_mounted = true };
+	struct fat_volume vol;
+	struct fat_file file;
+	uint8_t *p = (uint8_t *)&env;
+	size_t split = (sizeof(env) + IMG_CLUSTER_SIZE - 1) / IMG_CLUSTER_SIZE / 2;
+	int fd;
+
+	for (size_t i = 0; i < sizeof(env); i++) {
+		p[i] = (uint8_t)(i * 13 + (i >> 11));
+	}
+	fd = create_fat16_image(path, p, sizeof(env));
+	ck_assert_int_ge(fd, 0);
+
+	ck_assert_int_eq(fat_open_volume(fd, &vol, true), 0);
+	ck_assert_int_eq(vol.fat_bits, 16);
+	ck_assert_int_eq(fat_find_root_file(&vol, "BGENV.DAT", &file), 0);
+	ck_assert_uint_eq(file.size, sizeof(env));
+	ck_assert_int_eq(fat_find_root_file(&vol, "OTHER.DAT", &file),
+			 -ENOENT);
+
+	/* existence probe, read, and size mismatch */
+	ck_assert_int_eq(raw_config_file_access(&part, NULL, 0, false), 0);
+	ck_assert_int_eq(raw_config_file_access(&part, &out, sizeof(out),
+						false), sizeof(env));
+	ck_assert_int_eq(memcmp(&env, &out, sizeof(env)), 0);
+	ck_assert_int_eq(raw_config_file_access(&part, &out, sizeof(out) - 1,
+						false), -EFBIG);
+	ck_assert_int_eq(raw_config_file_access(&part, &out, sizeof(out) - 1,
+						true), -EFBIG);
+
+	/* rewrite in place and verify both runs of the cluster chain */
+	for (size_t i = 0; i < sizeof(env); i++) {
+		p[i] ^= 0x5a;
+	}
+	ck_assert_int_eq(raw_config_file_access(&part, &env, sizeof(env),
+						true), 0);
+	memset(&out, 0, sizeof(out));
+	ck_assert_int_eq(pread(fd, &out, IMG_CLUSTER_SIZE,
+			       img_cluster_offset(1000)), IMG_CLUSTER_SIZE);
+	ck_assert_int_eq(memcmp(&out, p + split * IMG_CLUSTER_SIZE,
+				IMG_CLUSTER_SIZE), 0);
+	ck_assert_int_eq(raw_config_file_access(&part, &out, sizeof(out),
+						false), sizeof(env));
+	ck_assert_int_eq(memcmp(&env, &out, sizeof(env)), 0);
+
+	close(fd);
+	unlink(path);
+
+	/* a device that cannot be opened asks the caller to fall back */
+	ck_assert_int_eq(raw_config_file_access(&part, NULL, 0, false),
+			 -ENODEV);
+}
+END_TEST
+
+START_TEST(test_raw_config_file_access_offset)
+{
+	static BG_ENVDATA env, out;
+	static uint8_t sector[IMG_SECTOR_SIZE];
+	char path[] = "/tmp/test_fat_image.XXXXXX";
+	char disk[] = "/tmp/test_fat_disk.XXXXXX";
+	const off_t base = 2048 * IMG_SECTOR_SIZE;
+	CONFIG_PART part = { .devpath = disk, .not_mounted = true,
+			     .image = true, .offset = base };
+	struct fat_volume vol;
+	uint8_t *p = (uint8_t *)&env;
+	int fd, dfd;
+
+	for (size_t i = 0; i < sizeof(env); i++) {
+		p[i] = (uint8_t)(i * 7 + 3);
+	}
+	fd = create_fat16_image(path, p, sizeof(env));
+	ck_assert_int_ge(fd, 0);
+	dfd = mkstemp(disk);
+	ck_assert_int_ge(dfd, 0);
+
+	/* place the volume behind the space of a partition table */
+	for (off_t off = 0; off < (off_t)IMG_SECTORS * IMG_SECTOR_SIZE;
+	     off += IMG_SECTOR_SIZE) {
+		ck_assert_int_eq(pread(fd, sector, sizeof(sector), off),
+				 sizeof(sector));
+		ck_assert_int_eq(pwrite(dfd, sector, sizeof(sector),
+					base + off), sizeof(sector));
+	}
+	close(fd);
+	unlink(path);
+
+	ck_assert_int_eq(fat_open_volume_at(dfd, base, &vol, true), 0);
+	ck_assert_int_eq(vol.fat_bits, 16);
+	ck_assert_int_eq(vol.fat_start, base + IMG_FAT_START);
+	ck_assert_int_eq(vol.data_start, base + IMG_DATA_START);
+
+	ck_assert_int_eq(raw_config_file_access(&part, &out, sizeof(out),
+						false), sizeof(env));
+	ck_assert_int_eq(memcmp(&env, &out, sizeof(env)), 0);
+
+	for (size_t i = 0; i < sizeof(env); i++) {
+		p[i] ^= 0xa5;
+	}
+	ck_assert_int_eq(raw_config_file_access(&part, &env, sizeof(env),
+						true), 0);
+	ck_assert_int_eq(raw_config_file_access(&part, &out, sizeof(out),
+						false), sizeof(env));
+	ck_assert_int_eq(memcmp(&env, &out, sizeof(env)), 0);
+
+	/* the space in front of the volume is left alone */
+	ck_assert_int_eq(pread(dfd, sector, sizeof(sector), 0),
+			 sizeof(sector));
+	for (size_t i = 0; i < sizeof(sector); i++) {
+		ck_assert_int_eq(sector[i], 0);
+	}
+
+	close(dfd);
+	unlink(disk);
+}
+END_TEST
+
+START_TEST(test_raw_config_file_write_ranges)
+{
+	static BG_ENVDATA env, out;
+	char path[] = "/tmp/test_fat_image.XXXXXX";
+	CONFIG_PART part = { .devpath = path, .not_mounted = true };
+	/* unaligned, across a cluster and a run boundary, and the tail */
+	const ENV_RANGE ranges[] = {
+		{ 3, 10 },
+		{ IMG_CLUSTER_SIZE - 5, 10 },
+		{ 30 * IMG_CLUSTER_SIZE + 100, 3 * IMG_CLUSTER_SIZE },
+		{ sizeof(env) - 4, 4 },
+	};
+	uint8_t *p = (uint8_t *)&env;
+	uint8_t *o = (uint8_t *)&out;
+	struct fat_volume vol;
+	struct fat_file file;
+	int fd;
+
+	for (size_t i = 0; i < sizeof(env); i++) {
+		p[i] = (uint8_t)(i * 7 + (i >> 10));
+	}
+	fd = create_fat16_image(path, p, sizeof(env));
+	ck_assert_int_ge(fd, 0);
+
+	memcpy(&out, &env, sizeof(env));
+	for (size_t i = 0; i < sizeof(ranges) / sizeof(ranges[0]); i++) {
+		for (size_t j = 0; j < ranges[i].len; j++) {
+			o[ranges[i].offset + j] ^= 0xa5;
+		}
+	}
+	ck_assert_int_eq(raw_config_file_write_ranges(
+				 &part, &out, sizeof(out), ranges,
+				 sizeof(ranges) / sizeof(ranges[0])), 0);
+	ck_assert_int_eq(raw_config_file_access(&part, &env, sizeof(env),
+						false), sizeof(env));
+	ck_assert_int_eq(memcmp(&env, &out, sizeof(env)), 0);
+
+	/* offset reads agree with the whole file */
+	ck_assert_int_eq(fat_open_volume(fd, &vol, false), 0);
+	ck_assert_int_eq(fat_find_root_file(&vol, "BGENV.DAT", &file), 0);
+	memset(&out, 0, sizeof(out));
+	ck_assert_int_eq(fat_file_access(&vol, &file, ranges[2].offset, o,
+					 ranges[2].len, false), 0);
+	ck_assert_int_eq(memcmp(o, p + ranges[2].offset, ranges[2].len), 0);
+	ck_assert_int_eq(fat_file_access(&vol, &file, 1, o, sizeof(env),
+					 false), -EINVAL);
+
+	/* the file is never resized */
+	ck_assert_int_eq(raw_config_file_write_ranges(&part, &env,
+						      sizeof(env) - 1, ranges,
+						      1), -EFBIG);
+	close(fd);
+	unlink(path);
+}
+END_TEST
+
+START_TEST(test_read_write_env_formats)
+{
+	static BG_ENVDATA env, out;
+	static uint8_t buf[ENV_FILE_MAX_SIZE];
+	char path[] = "/tmp/test_fat_image.XXXXXX";
+	CONFIG_PART part = { .devpath = path, .not_mounted = true };
+	size_t len, v3_len;
+	int fd, format;
+
+	memset(&env, 0, sizeof(env));
+	str8to16(env.kernelfile, "C:BOOT:vmlinuz");
+	env.revision = 7;
+	env.ustate = USTATE_INSTALLED;
+	env.watchdog_timeout_sec = 30;
+	bgenv_set_uservar(env.userdata, "key", USERVAR_TYPE_DEFAULT |
+			  USERVAR_TYPE_STRING_ASCII, "value", 6);
+	env.crc32 = bgenv_crc32(0, &env, sizeof(env) - sizeof(env.crc32));
+
+	/* format 2 only stores the used part of the uservar area */
+	len = bgenv_encode_v2(&env, ENV_FORMAT_V2, buf, NULL);
+	ck_assert_uint_eq(len, sizeof(BG_ENVHDR_V2) + ENV_MEM_USERVARS -
+				       bgenv_user_free(env.userdata));
+	fd = create_fat16_image(path, buf, len);
+	ck_assert_int_ge(fd, 0);
+
+	ck_assert(read_env(&part, &out));
+	ck_assert_int_eq(part.env_format, ENV_FORMAT_V2);
+	ck_assert_int_eq(memcmp(&env, &out, sizeof(env)), 0);
+
+	/* format 3 decodes to the same data and keeps its format */
+	v3_len = bgenv_encode_v2(&env, ENV_FORMAT_V3, buf, NULL);
+	ck_assert_int_eq(((BG_ENVHDR_V2 *)buf)->version, ENV_FORMAT_V3);
+	ck_assert(bgenv_decode(&out, buf, v3_len, &format, NULL));
+	ck_assert_int_eq(format, ENV_FORMAT_V3);
+	ck_assert_int_eq(memcmp(&env, &out, sizeof(env)), 0);
+	len = bgenv_encode_v2(&env, ENV_FORMAT_V2, buf, NULL);
+
+	/* state changes keep the size, so they are written in place */
+	out.ustate = USTATE_TESTING;
+	ck_assert(write_env(&part, &out));
+	memset(&out, 0xff, sizeof(out));
+	ck_assert(read_env(&part, &out));
+	ck_assert_int_eq(out.ustate, USTATE_TESTING);
+	ck_assert_uint_eq(out.crc32, bgenv_crc32(0, &out, sizeof(out) -
+						 sizeof(out.crc32)));
+
+	/* a corrupted header invalidates the environment */
+	((BG_ENVHDR_V2 *)buf)->revision++;
+	ck_assert(!bgenv_decode(&out, buf, len, NULL, NULL));
+	ck_assert_int_eq(out.revision, 0);
+	close(fd);
+	unlink(path);
+
+	/* format 1 is still detected by its size */
+	strcpy(path, "/tmp/test_fat_image.XXXXXX");
+	fd = create_fat16_image(path, (uint8_t *)&env, sizeof(env));
+	ck_assert_int_ge(fd, 0);
+	ck_assert(read_env(&part, &out));
+	ck_assert_int_eq(part.env_format, ENV_FORMAT_V1);
+	ck_assert_int_eq(memcmp(&env, &out, sizeof(env)), 0);
+	close(fd);
+	unlink(path);
+}
+END_TEST
+
+START_TEST(test_env_update_log)
+{
+	static BG_ENVDATA env, out;
+	static uint8_t buf[ENV_FILE_MAX_SIZE];
+	char path[] = "/tmp/test_fat_image.XXXXXX";
+	CONFIG_PART part = { .devpath = path, .not_mounted = true };
+	ENV_LOG log = { .slots = 4, .generation = 1 };
+	BGENV *handle;
+	uint32_t count = 1;
+	uint64_t count64;
+	uint64_t type;
+	size_t len;
+	int fd, ret;
+
+	memset(&env, 0, sizeof(env));
+	env.revision = 3;
+	bgenv_set_uservar(env.userdata, "count", USERVAR_TYPE_UINT32, &count,
+			  sizeof(count));
+	env.crc32 = bgenv_crc32(0, &env, sizeof(env) - sizeof(env.crc32));
+
+	/* the log starts at a slot boundary behind the uservars */
+	len = bgenv_encode_v2(&env, ENV_FORMAT_V2, buf, &log);
+	ck_assert_uint_eq(log.offset % ENV_LOG_SLOT_SIZE, 0);
+	ck_assert_uint_eq(len, log.offset + 4 * ENV_LOG_SLOT_SIZE);
+	fd = create_fat16_image(path, buf, len);
+	ck_assert_int_ge(fd, 0);
+
+	ck_assert(read_env(&part, &out));
+	ck_assert_int_eq(memcmp(&env, &out, sizeof(env)), 0);
+	ck_assert_int_eq(part.log.slots, 4);
+	ck_assert_int_eq(part.log.generation, 1);
+	ck_assert_int_eq(part.log.used, 0);
+
+	log_image_path = path;
+	probe_config_partitions_fake.custom_fake =
+		probe_config_partitions_custom_fake;
+	ck_assert(bgenv_init());
+	handle = bgenv_open_by_index(0);
+	ck_assert(handle != NULL);
+
+	/* updates are appended to the log until it is full */
+	for (count = 2; count <= 5; count++) {
+		ret = bgenv_set_logged(handle, "count", USERVAR_TYPE_UINT32,
+				       &count, sizeof(count));
+		ck_assert_int_eq(ret, 0);
+		ck_assert(!bgenv_is_dirty(handle));
+	}
+	ck_assert(read_env(&part, &out));
+	ck_assert_int_eq(memcmp(handle->data, &out, sizeof(out)), 0);
+	ck_assert_int_eq(bgenv_get_uservar(out.userdata, "count", &type,
+					   &count, sizeof(count)), 0);
+	ck_assert_uint_eq(count, 5);
+	ck_assert_int_eq(part.log.used, 4);
+
+	/* a record lost to a torn write ends the replay */
+	ck_assert_int_ge(raw_config_file_access(&part, buf, sizeof(buf),
+						false), 0);
+	buf[part.log.offset + (1 + 2) % 4 * ENV_LOG_SLOT_SIZE + 30] ^= 1;
+	ck_assert(bgenv_decode(&out, buf, len, NULL, &log));
+	ck_assert_int_eq(log.used, 2);
+	ck_assert_int_eq(bgenv_get_uservar(out.userdata, "count", &type,
+					   &count, sizeof(count)), 0);
+	ck_assert_uint_eq(count, 3);
+
+	/* a full log is compacted by rewriting the environment */
+	count = 6;
+	ret = bgenv_set_logged(handle, "count", USERVAR_TYPE_UINT32, &count,
+			       sizeof(count));
+	ck_assert_int_eq(ret, 0);
+	ck_assert(bgenv_is_dirty(handle));
+	bgenv_update_crc(handle);
+	ck_assert(bgenv_write(handle));
+	ck_assert(read_env(&part, &out));
+	ck_assert_int_eq(memcmp(handle->data, &out, sizeof(out)), 0);
+	ck_assert_int_eq(part.log.generation, 2);
+	ck_assert_int_eq(part.log.used, 0);
+
+	/* the checksum is patched for records that are added or moved */
+	ret = bgenv_set_logged(handle, "label", USERVAR_TYPE_STRING_ASCII,
+			       "a", 2);
+	ck_assert_int_eq(ret, 0);
+	count64 = 7;
+	ret = bgenv_set_logged(handle, "count", USERVAR_TYPE_UINT64, &count64,
+			       sizeof(count64));
+	ck_assert_int_eq(ret, 0);
+	ret = bgenv_set_logged(handle, "label", USERVAR_TYPE_STRING_ASCII,
+			       "abc", 4);
+	ck_assert_int_eq(ret, 0);
+	ck_assert(!bgenv_is_dirty(handle));
+	ck_assert_uint_eq(handle->data->crc32,
+			  bgenv_crc32(0, handle->data,
+				      sizeof(env) - sizeof(env.crc32)));
+	ck_assert(read_env(&part, &out));
+	ck_assert_int_eq(memcmp(handle->data, &out, sizeof(out)), 0);
+	ck_assert_int_eq(part.log.used, 3);
+
+	/* keys of built-in variables are not logged */
+	ret = bgenv_set_logged(handle, "ustate", 0, "1", 2);
+	ck_assert_int_eq(ret, 0);
+	ck_assert(bgenv_is_dirty(handle));
+
+	bgenv_close(handle);
+	bgenv_finalize();
+	close(fd);
+	unlink(path);
+}
+END_TEST
+
+static unsigned int full_reads;
+
+static void count_full_reads(const ebgenv_trace_event_t *ev, void *priv)
+{
+	(void)priv;
+	if (strcmp(ev->event, "read_env") == 0) {
+		__atomic_add_fetch(&full_reads, 1, __ATOMIC_RELAXED);
+	}
+}
+
+START_TEST(test_lazy_uservars)
+{
+	static BG_ENVDATA env;
+	static uint8_t buf[ENV_FILE_MAX_SIZE];
+	char path[] = "/tmp/test_fat_image.XXXXXX";
+	BGENV *latest, *other;
+	const char *value;
+	size_t len;
+	int fd;
+
+	memset(&env, 0, sizeof(env));
+	env.revision = 5;
+	env.ustate = USTATE_INSTALLED;
+	bgenv_set_uservar(env.userdata, "key", USERVAR_TYPE_DEFAULT |
+			  USERVAR_TYPE_STRING_ASCII, "value", 6);
+	env.crc32 = bgenv_crc32(0, &env, sizeof(env) - sizeof(env.crc32));
+	len = bgenv_encode_v2(&env, ENV_FORMAT_V2, buf, NULL);
+	fd = create_fat16_image(path, buf, len);
+	ck_assert_int_ge(fd, 0);
+
+	log_image_path = path;
+	probe_config_partitions_fake.custom_fake =
+		probe_config_partitions_custom_fake;
+	full_reads = 0;
+	bgenv_set_lazy_uservars(true);
+	ebg_set_trace_callback(count_full_reads, NULL);
+	ck_assert(bgenv_init());
+
+	/* the headers are enough to pick the latest environment */
+	ck_assert_int_eq(full_reads, 0);
+	latest = bgenv_open_latest();
+	ck_assert(latest != NULL);
+	ck_assert_int_eq(latest->data->revision, 5);
+	ck_assert_int_eq(latest->data->ustate, USTATE_INSTALLED);
+	ck_assert_int_eq(latest->data->userdata[0], 0);
+
+	/* the first uservar access reads the whole file */
+	ck_assert_int_eq(bgenv_get_str(latest, "key", &value), 0);
+	ck_assert_str_eq(value, "value");
+	ck_assert_int_eq(full_reads, 1);
+	ck_assert_int_eq(memcmp(latest->data, &env, sizeof(env)), 0);
+	ck_assert_int_eq(bgenv_get_str(latest, "key", &value), 0);
+	ck_assert_int_eq(full_reads, 1);
+
+	/* and so does a modification, the first of equal revisions is the
+	 * latest */
+	other = bgenv_open_by_index(1);
+	ck_assert(other != NULL);
+	ck_assert_int_eq(bgenv_set(other, "ustate", 0, "2", 2), 0);
+	ck_assert_int_eq(full_reads, 2);
+	ck_assert_int_eq(other->data->ustate, 2);
+	ck_assert_int_eq(bgenv_get_str(other, "key", &value), 0);
+	ck_assert_str_eq(value, "value");
+
+	bgenv_close(other);
+	bgenv_close(latest);
+	bgenv_finalize();
+	ebg_set_trace_callback(NULL, NULL);
+	bgenv_set_lazy_uservars(false);
+	close(fd);
+	unlink(path);
+}
+END_TEST
+
+START_TEST(test_mapped_env)
+{
+	static BG_ENVDATA env, out;
+	char path[] = "/tmp/test_fat_image.XXXXXX";
+	CONFIG_PART part = { .devpath = path, .not_mounted = true };
+	struct fat_volume vol;
+	struct fat_file file;
+	BGENV *handle;
+	const char *value;
+	off_t offset;
+	int fd;
+
+	memset(&env, 0, sizeof(env));
+	env.revision = 3;
+	bgenv_set_uservar(env.userdata, "key", USERVAR_TYPE_DEFAULT |
+			  USERVAR_TYPE_STRING_ASCII, "value", 6);
+	env.crc32 = bgenv_crc32(0, &env, sizeof(env) - sizeof(env.crc32));
+
+	/* only files in consecutive clusters can be mapped */
+	fd = create_fat16_image(path, (uint8_t *)&env, sizeof(env));
+	ck_assert_int_ge(fd, 0);
+	ck_assert_int_eq(fat_open_volume(fd, &vol, false), 0);
+	ck_assert_int_eq(fat_find_root_file(&vol, "BGENV.DAT", &file), 0);
+	ck_assert_int_eq(fat_file_extent(&vol, &file, &offset), -ENOTSUP);
+	close(fd);
+	unlink(path);
+
+	strcpy(path, "/tmp/test_fat_image.XXXXXX");
+	fd = create_fat16_image_contiguous(path, (uint8_t *)&env, sizeof(env));
+	ck_assert_int_ge(fd, 0);
+	ck_assert_int_eq(fat_open_volume(fd, &vol, false), 0);
+	ck_assert_int_eq(fat_find_root_file(&vol, "BGENV.DAT", &file), 0);
+	ck_assert_int_eq(fat_file_extent(&vol, &file, &offset), 0);
+	ck_assert_int_eq(offset, img_cluster_offset(2));
+
+	log_image_path = path;
+	probe_config_partitions_fake.custom_fake =
+		probe_config_partitions_custom_fake;
+	bgenv_set_map_env(true);
+	ck_assert(bgenv_init());
+	handle = bgenv_open_by_index(0);
+	ck_assert(handle != NULL);
+	ck_assert(handle->data != &envdata[0]);
+	ck_assert_int_eq(memcmp(handle->data, &env, sizeof(env)), 0);
+
+	/* modifications stay private until the environment is written */
+	ck_assert_int_eq(bgenv_set(handle, "key", USERVAR_TYPE_DEFAULT |
+				   USERVAR_TYPE_STRING_ASCII, "other", 6), 0);
+	ck_assert_int_eq(raw_config_file_access(&part, &out, sizeof(out),
+						false), sizeof(out));
+	ck_assert_int_eq(memcmp(&out, &env, sizeof(env)), 0);
+	bgenv_update_crc(handle);
+	ck_assert(bgenv_write(handle));
+	ck_assert_int_eq(raw_config_file_access(&part, &out, sizeof(out),
+						false), sizeof(out));
+	ck_assert_int_eq(memcmp(&out, handle->data, sizeof(out)), 0);
+	ck_assert_int_eq(bgenv_get_str(handle, "key", &value), 0);
+	ck_assert_str_eq(value, "other");
+
+	bgenv_close(handle);
+	bgenv_finalize();
+	bgenv_set_map_env(false);
+	close(fd);
+	unlink(path);
+}
+END_TEST
+
 Suite *ebg_test_suite(void)
 {
 	Suite *s;
@@ -400,6 +939,14 @@ Suite *ebg_test_suite(void)
 	tcase_add_test(tc_core, test_determine_FAT_bits_32);
 	tcase_add_test(tc_core, test_determine_FAT_bits_fat16_swupdate);
 	tcase_add_test(tc_core, test_determine_FAT_bits_squashfs);
+	tcase_add_test(tc_core, test_fat_volume_label);
+	tcase_add_test(tc_core, test_raw_config_file_access);
+	tcase_add_test(tc_core, test_raw_config_file_access_offset);
+	tcase_add_test(tc_core, test_raw_config_file_write_ranges);
+	tcase_add_test(tc_core, test_read_write_env_formats);
+	tcase_add_test(tc_core, test_env_update_log);
+	tcase_add_test(tc_core, test_lazy_uservars);
+	tcase_add_test(tc_core, test_mapped_env);
 
 	suite_add_tcase(s, tc_core);
 
@@ -0,0 +1,192 @@
+/*
+ * EFI Boot Guard
+ *
+ * Copyright (c) Siemens AG, 2026
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * SPDX-License-Identifier:	GPL-2.0
+ */
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <check.h>
+#include <fff.h>
+
+#include <env_api.h>
+#include <env_config_partitions.h>
+#include <env_probe_cache.h>
+#include "fat_image.h"
+
+DEFINE_FFF_GLOBALS;
+
+Suite *ebg_test_suite(void);
+
+#define NUM_IMAGES (ENV_NUM_CONFIG_PARTS + 1)
+
+static char paths[NUM_IMAGES][32];
+static CONFIG_PART parts[NUM_IMAGES];
+static bool found[NUM_IMAGES];
+static char cache_path[] = "/tmp/test_probe_cache.XXXXXX";
+
+/* the second image has no environment file */
+static void setup_images(void)
+{
+	static uint8_t data[64];
+
+	for (int i = 0; i < NUM_IMAGES; i++) {
+		int fd;
+
+		strcpy(paths[i], "/tmp/test_probe_img.XXXXXX");
+		fd = create_fat16_image(paths[i], data, sizeof(data));
+		ck_assert_int_ge(fd, 0);
+		found[i] = i != 1;
+		if (!found[i]) {
+			ck_assert_int_eq(pwrite(fd, "OTHER   DAT", MSDOS_NAME,
+						IMG_ROOT_START + 2 *
+						sizeof(struct msdos_dir_entry)),
+					 MSDOS_NAME);
+		}
+		close(fd);
+		parts[i].devpath = paths[i];
+	}
+}
+
+static void free_parts(CONFIG_PART *cfgpart)
+{
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		cfgpart[i].devpath = NULL;
+	}
+	bgenv_arena_release(&probe_arena);
+}
+
+/* A uevent from elsewhere invalidates the cache between storing and
+ * loading it, so retry a few times. */
+static bool store_and_load(CONFIG_PART *cfgpart, uint64_t delta,
+			   bool stored_all, bool loaded_all)
+{
+	for (int retry = 0; retry < 3; retry++) {
+		uint64_t before, after;
+		bool result;
+
+		if (!probe_cache_seqnum(&before)) {
+			return false;
+		}
+		probe_cache_store(cache_path, before + delta, parts, found,
+				  NUM_IMAGES, stored_all);
+		result = probe_cache_load(cache_path, cfgpart, loaded_all);
+		if (!probe_cache_seqnum(&after) || before == after) {
+			return result;
+		}
+		if (result) {
+			free_parts(cfgpart);
+		}
+	}
+	return false;
+}
+
+START_TEST(probe_cache_roundtrip)
+{
+	CONFIG_PART cfgpart[ENV_NUM_CONFIG_PARTS];
+	uint32_t vol_id = 0x12345678;
+	uint64_t seqnum;
+	int fd;
+
+	if (!probe_cache_seqnum(&seqnum)) {
+		/* no sysfs, the cache is never used */
+		return;
+	}
+	ck_assert_int_ge(mkstemp(cache_path), 0);
+	setup_images();
+
+	memset(cfgpart, 0, sizeof(cfgpart));
+	ck_assert(store_and_load(cfgpart, 0, false, false));
+	ck_assert_str_eq(cfgpart[0].devpath, paths[0]);
+	ck_assert_str_eq(cfgpart[1].devpath, paths[2]);
+	ck_assert(cfgpart[0].not_mounted);
+	ck_assert(cfgpart[1].not_mounted);
+	free_parts(cfgpart);
+
+	/* outdated uevent sequence number and different probe scope */
+	ck_assert(!store_and_load(cfgpart, 1, false, false));
+	ck_assert(!store_and_load(cfgpart, 0, true, false));
+
+	/* a reformatted partition gets a new volume serial */
+	fd = open(paths[2], O_WRONLY);
+	ck_assert_int_ge(fd, 0);
+	ck_assert_int_eq(pwrite(fd, &vol_id, sizeof(vol_id),
+				offsetof(struct fat_boot_sector, fat16.vol_id)),
+			 sizeof(vol_id));
+	close(fd);
+	ck_assert(!probe_cache_load(cache_path, cfgpart, false));
+
+	/* a partition without cached environment file gains one */
+	ck_assert(store_and_load(cfgpart, 0, false, false));
+	free_parts(cfgpart);
+	fd = open(paths[1], O_WRONLY);
+	ck_assert_int_ge(fd, 0);
+	ck_assert_int_eq(pwrite(fd, "BGENV   DAT", MSDOS_NAME,
+				IMG_ROOT_START +
+					2 * sizeof(struct msdos_dir_entry)),
+			 MSDOS_NAME);
+	close(fd);
+	ck_assert(!probe_cache_load(cache_path, cfgpart, false));
+
+	for (int i = 0; i < NUM_IMAGES; i++) {
+		unlink(paths[i]);
+	}
+	unlink(cache_path);
+}
+END_TEST
+
+START_TEST(probe_arena_alloc)
+{
+	BG_ARENA arena = {0};
+	char *small[64];
+	uint8_t *big;
+
+	for (int i = 0; i < 64; i++) {
+		small[i] = bgenv_arena_alloc(&arena, i + 1);
+		ck_assert(small[i] != NULL);
+		ck_assert((uintptr_t)small[i] % _Alignof(max_align_t) == 0);
+		for (int j = 0; j <= i; j++) {
+			ck_assert_int_eq(small[i][j], 0);
+		}
+		memset(small[i], 0xff, i + 1);
+	}
+	/* larger than a chunk, must not disturb the small objects */
+	big = bgenv_arena_alloc(&arena, 4 * BG_ARENA_CHUNK_SIZE);
+	ck_assert(big != NULL);
+	for (size_t i = 0; i < 4 * BG_ARENA_CHUNK_SIZE; i++) {
+		ck_assert_int_eq(big[i], 0);
+	}
+	for (int i = 0; i < 64; i++) {
+		ck_assert_int_eq((uint8_t)small[i][i], 0xff);
+	}
+	ck_assert_str_eq(bgenv_arena_strdup(&arena, "/dev/sda1"), "/dev/sda1");
+
+	bgenv_arena_release(&arena);
+	ck_assert(arena.chunks == NULL);
+	ck_assert(bgenv_arena_alloc(&arena, 0) != NULL);
+	bgenv_arena_release(&arena);
+}
+END_TEST
+
+Suite *ebg_test_suite(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s = suite_create("probe_cache");
+
+	tc_core = tcase_create("Core");
+	tcase_add_test(tc_core, probe_cache_roundtrip);
+	tcase_add_test(tc_core, probe_arena_alloc);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
@@ -12,12 +12,15 @@
  * SPDX-License-Identifier:	GPL-2.0
  */
 
+#include <errno.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <check.h>
 #include <fff.h>
 #include <env_api.h>
 #include <env_config_file.h>
 #include <env_config_partitions.h>
+#include <ebgenv.h>
 #include <fake_devices.h>
 
 DEFINE_FFF_GLOBALS;
@@ -40,6 +43,115 @@ FAKE_VALUE_FUNC(bool, read_env, CONFIG_PART *, BG_ENVDATA *);
 FAKE_VOID_FUNC(ped_device_probe_all, char *);
 FAKE_VALUE_FUNC(PedDevice *, ped_device_get_next, const PedDevice *);
 
+/* nobrain_a is the boot disk, it shares its controller with nobrain_b */
+#define FAKE_BOOT_UUID "00000000-0000-0000-0000-0000000000aa"
+#define FAKE_PCI "/sys/devices/pci0000:00"
+
+static unsigned int probed;
+/* with a fake boot disk, the partitions that hold an environment */
+static const char *const *fake_envs;
+
+FILE *__wrap_fopen(const char *path, const char *mode);
+FILE *__real_fopen(const char *path, const char *mode);
+FILE *__wrap_fopen64(const char *path, const char *mode);
+FILE *__real_fopen64(const char *path, const char *mode);
+char *__wrap_realpath(const char *path, char *resolved);
+char *__real_realpath(const char *path, char *resolved);
+bool __wrap_probe_config_file(CONFIG_PART *cfgpart);
+bool __real_probe_config_file(CONFIG_PART *cfgpart);
+
+/* LoaderDevicePartUUID, its attributes followed by the UTF-16 string */
+static FILE *fake_efivar(const char *path, const char *mode)
+{
+	static uint16_t var[2 + sizeof(FAKE_BOOT_UUID) - 1];
+
+	if (!fake_envs || !strstr(path, "/LoaderDevicePartUUID-")) {
+		return NULL;
+	}
+	for (size_t i = 0; i < sizeof(FAKE_BOOT_UUID) - 1; i++) {
+		var[2 + i] = FAKE_BOOT_UUID[i];
+	}
+	return fmemopen(var, sizeof(var), mode);
+}
+
+FILE *__wrap_fopen(const char *path, const char *mode)
+{
+	FILE *f = fake_efivar(path, mode);
+
+	return f ? f : __real_fopen(path, mode);
+}
+
+FILE *__wrap_fopen64(const char *path, const char *mode)
+{
+	FILE *f = fake_efivar(path, mode);
+
+	return f ? f : __real_fopen64(path, mode);
+}
+
+/* The sysfs paths of the fake disks, nobrain_c is on another controller */
+char *__wrap_realpath(const char *path, char *resolved)
+{
+	const char *name;
+	char *res = NULL;
+
+	if (!fake_envs) {
+		return __real_realpath(path, resolved);
+	}
+	if (strcmp(path, "/dev/disk/by-partuuid/" FAKE_BOOT_UUID) == 0) {
+		res = strdup("/dev/nobrain_a0");
+	} else if (strcmp(path, "/sys/class/block/nobrain_a0/..") == 0) {
+		res = strdup(FAKE_PCI "/0000:00:1f.2/block/nobrain_a");
+	} else if (strncmp(path, "/sys/class/block/nobrain_", 25) == 0) {
+		name = path + 17;
+		if (asprintf(&res, FAKE_PCI "/%s/block/%s",
+			     name[8] == 'c' ? "0000:00:1c.0" : "0000:00:1f.2",
+			     name) < 0) {
+			res = NULL;
+		}
+	} else if (strcmp(path, FAKE_PCI "/0000:00:1f.2/subsystem") == 0 ||
+		   strcmp(path, FAKE_PCI "/0000:00:1c.0/subsystem") == 0) {
+		res = strdup("/sys/bus/pci");
+	}
+	return res;
+}
+
+bool __wrap_probe_config_file(CONFIG_PART *cfgpart)
+{
+	if (!fake_envs) {
+		return __real_probe_config_file(cfgpart);
+	}
+	for (const char *const *p = fake_envs; *p; p++) {
+		if (strcmp(cfgpart->devpath, *p) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void count_probes(const ebgenv_trace_event_t *event, void *priv)
+{
+	if (strcmp(event->event, "probe_config_file") == 0) {
+		probed++;
+	}
+}
+
+/* Returns the number of partitions probed with rules, UINT_MAX if they
+ * are rejected. */
+static unsigned int probe_filtered(const char *rules)
+{
+	RESET_FAKE(ped_device_probe_all);
+	RESET_FAKE(ped_device_get_next);
+	ped_device_get_next_fake.custom_fake = ped_device_get_next_custom_fake;
+
+	if (ebg_set_probe_filter(rules) != 0) {
+		return UINT_MAX;
+	}
+	probed = 0;
+	/* none of the fake partitions holds an environment */
+	(void)bgenv_init();
+	return probed;
+}
+
 START_TEST(env_api_fat_test_probe_config_partitions)
 {
 	bool result;
@@ -82,6 +194,114 @@ START_TEST(env_api_fat_test_probe_config_partitions)
 }
 END_TEST
 
+START_TEST(env_api_fat_test_probe_filter)
+{
+	/* C12A7328-F81F-11D2-BA4B-00A0C93EC93B in on-disk byte order */
+	static const uint8_t esp[16] = {
+		0x28, 0x73, 0x2A, 0xC1, 0x1F, 0xF8, 0xD2, 0x11,
+		0xBA, 0x4B, 0x00, 0xA0, 0xC9, 0x3E, 0xC9, 0x3B,
+	};
+	PedPartition *p;
+
+	allocate_fake_devices(1);
+	for (int i = 0; i < 3; i++) {
+		add_fake_partition(0);
+	}
+	/* two GPT partitions and one without GPT entry */
+	p = fake_devices[0].part_list;
+	p->gpt = true;
+	strcpy(p->name, "ebg-config0");
+	p->label_read = true;
+	p = p->next;
+	p->gpt = true;
+	memcpy(p->type_GUID, esp, sizeof(esp));
+	strcpy(p->name, "data");
+	p->label_read = true;
+	strcpy(p->label, "DATA");
+	p = p->next;
+	p->label_read = true;
+	strcpy(p->label, "BOOTENV");
+
+	ebg_set_trace_callback(count_probes, NULL);
+	ck_assert_int_eq(probe_filtered(NULL), 3);
+	ck_assert_int_eq(probe_filtered("name=EBG-config*"), 1);
+	ck_assert_int_eq(probe_filtered(
+		"type=c12a7328-f81f-11d2-ba4b-00a0c93ec93b"), 1);
+	ck_assert_int_eq(probe_filtered("label=bootenv,name=ebg-*"), 2);
+	ck_assert_int_eq(probe_filtered("label=*ENV"), 1);
+	ck_assert_int_eq(probe_filtered("uuid=00000000-0000-0000-0000-"
+					"000000000001"), 0);
+
+	ck_assert_int_eq(ebg_set_probe_filter("size=1"), -EINVAL);
+	ck_assert_int_eq(ebg_set_probe_filter("type=C12A7328"), -EINVAL);
+	ck_assert_int_eq(ebg_set_probe_filter("label="), -EINVAL);
+	/* a rejected filter keeps the last one */
+	ck_assert_int_eq(probe_filtered("label=*ENV"), 1);
+	ck_assert_int_eq(probe_filtered(""), 3);
+
+	/* without a boot disk, the order does not matter */
+	ck_assert_int_eq(ebg_set_probe_order("other,boot"), 0);
+	ebg_set_opt_bool(EBG_OPT_PROBE_ALL_DEVICES, true);
+	ck_assert_int_eq(probe_filtered(NULL), 3);
+	ebg_set_opt_bool(EBG_OPT_PROBE_ALL_DEVICES, false);
+	ck_assert_int_eq(ebg_set_probe_order("boot,disk"), -EINVAL);
+	ck_assert_int_eq(ebg_set_probe_order("boot,boot"), -EINVAL);
+	ck_assert_int_eq(ebg_set_probe_order(",boot"), -EINVAL);
+	ck_assert_int_eq(ebg_set_probe_order(NULL), 0);
+
+	ebg_set_trace_callback(NULL, NULL);
+	free_fake_devices();
+}
+END_TEST
+
+START_TEST(env_api_fat_test_probe_duplicate_on_other_controller)
+{
+	/* all config partitions on the boot disk, another one on a disk of
+	 * a different controller */
+	static const char *const envs[] = {
+#if ENV_NUM_CONFIG_PARTS > 1
+		"/dev/nobrain_a1",
+#endif
+		"/dev/nobrain_a0", "/dev/nobrain_c0", NULL,
+	};
+
+	RESET_FAKE(ped_device_probe_all);
+	RESET_FAKE(ped_device_get_next);
+	RESET_FAKE(read_env);
+	ped_device_get_next_fake.custom_fake = ped_device_get_next_custom_fake;
+	read_env_fake.custom_fake = read_env_custom_fake;
+
+	allocate_fake_devices(3);
+	for (int i = 0; i < ENV_NUM_CONFIG_PARTS; i++) {
+		add_fake_partition(0);
+	}
+	add_fake_partition(1);
+	add_fake_partition(2);
+
+	fake_envs = envs;
+	ebg_set_opt_bool(EBG_OPT_PROBE_ALL_DEVICES, true);
+
+	/* the duplicate is found although the boot disk is complete */
+	ck_assert(!bgenv_init());
+
+	/* unless probing stops after the boot disk */
+	ebg_set_opt_bool(EBG_OPT_PROBE_STOP_EARLY, true);
+	ck_assert(bgenv_init());
+	bgenv_finalize();
+
+	/* leaving out the other controller has the same effect */
+	ebg_set_opt_bool(EBG_OPT_PROBE_STOP_EARLY, false);
+	ck_assert_int_eq(ebg_set_probe_order("controller,boot"), 0);
+	ck_assert(bgenv_init());
+	bgenv_finalize();
+
+	ck_assert_int_eq(ebg_set_probe_order(NULL), 0);
+	ebg_set_opt_bool(EBG_OPT_PROBE_ALL_DEVICES, false);
+	fake_envs = NULL;
+	free_fake_devices();
+}
+END_TEST
+
 Suite *ebg_test_suite(void)
 {
 	Suite *s;
@@ -91,6 +311,9 @@ Suite *ebg_test_suite(void)
 
 	tc_core = tcase_create("Core");
 	tcase_add_test(tc_core, env_api_fat_test_probe_config_partitions);
+	tcase_add_test(tc_core, env_api_fat_test_probe_filter);
+	tcase_add_test(tc_core,
+		       env_api_fat_test_probe_duplicate_on_other_controller);
 	suite_add_tcase(s, tc_core);
 
 	return s;
@@ -17,6 +17,7 @@
 
 #include <env_api.h>
 #include <uservars.h>
+#include <lz4_block.h>
 #include <bg_envtools.h>
 
 DEFINE_FFF_GLOBALS;
@@ -75,7 +76,7 @@ START_TEST(bgenv_get_from_manipulated)
 
 	/* load our manipulated BGENV */
 	memset(&data, 0, sizeof(data));
-	bool result = get_env(configfilepath, &data);
+	bool result = get_env(configfilepath, &data, NULL, NULL);
 
 	/* ensure that we did not write invalid data */
 	BGENV bgenv = {.desc = configfilepath, .data = &data};
@@ -97,6 +98,404 @@ START_TEST(bgenv_get_from_manipulated)
 }
 END_TEST
 
+START_TEST(bgenv_uservar_index_consistency)
+{
+	static BG_ENVDATA data;
+	USERVAR_INDEX idx = {0};
+	char key[32];
+	char value[64];
+	int res;
+
+	memset(&data, 0, sizeof(data));
+	for (int i = 0; i < 200; i++) {
+		snprintf(key, sizeof(key), "ns.component%d.field", i);
+		snprintf(value, sizeof(value), "value%d", i);
+		res = bgenv_set_uservar_indexed(&idx, data.userdata, key,
+						USERVAR_TYPE_DEFAULT |
+						USERVAR_TYPE_STRING_ASCII,
+						value, strlen(value) + 1);
+		ck_assert_int_eq(res, 0);
+	}
+	/* delete every third key, grow every fifth */
+	for (int i = 0; i < 200; i += 3) {
+		snprintf(key, sizeof(key), "ns.component%d.field", i);
+		res = bgenv_set_uservar_indexed(&idx, data.userdata, key,
+						USERVAR_TYPE_DELETED, "", 1);
+		ck_assert_int_eq(res, 0);
+	}
+	for (int i = 0; i < 200; i += 5) {
+		snprintf(key, sizeof(key), "ns.component%d.field", i);
+		snprintf(value, sizeof(value), "a much longer value %d", i);
+		res = bgenv_set_uservar_indexed(&idx, data.userdata, key,
+						USERVAR_TYPE_DEFAULT |
+						USERVAR_TYPE_STRING_ASCII,
+						value, strlen(value) + 1);
+		ck_assert_int_eq(res, 0);
+	}
+
+	for (int i = 0; i < 210; i++) {
+		snprintf(key, sizeof(key), "ns.component%d.field", i);
+		ck_assert_ptr_eq(bgenv_find_uservar_indexed(&idx, data.userdata,
+							    key),
+				 bgenv_find_uservar(data.userdata, key));
+	}
+	ck_assert_ptr_null(bgenv_find_uservar_indexed(&idx, data.userdata,
+						      "ns.component3.field"));
+	ck_assert_ptr_nonnull(bgenv_find_uservar_indexed(&idx, data.userdata,
+							 "ns.component5.field"));
+	ck_assert_int_eq(bgenv_user_free_indexed(&idx, data.userdata),
+			 bgenv_user_free(data.userdata));
+
+	bgenv_uservar_index_free(&idx);
+}
+END_TEST
+
+START_TEST(bgenv_uservar_resize_last)
+{
+	static BG_ENVDATA data;
+	USERVAR_INDEX idx = {0};
+	uint64_t t = USERVAR_TYPE_DEFAULT | USERVAR_TYPE_UINT32;
+	uint64_t type;
+	uint32_t u32 = 4;
+	uint64_t u64 = 8;
+	uint8_t *var;
+	char *key;
+	int res;
+
+	memset(&data, 0, sizeof(data));
+	res = bgenv_set_uservar_indexed(&idx, data.userdata, "a", t, &u32,
+					sizeof(u32));
+	ck_assert_int_eq(res, 0);
+	/* the last record grows and ends up where it was */
+	res = bgenv_set_uservar_indexed(&idx, data.userdata, "a",
+					USERVAR_TYPE_DEFAULT |
+					USERVAR_TYPE_UINT64, &u64, sizeof(u64));
+	ck_assert_int_eq(res, 0);
+	res = bgenv_set_uservar_indexed(&idx, data.userdata, "b", t, &u32,
+					sizeof(u32));
+	ck_assert_int_eq(res, 0);
+
+	var = bgenv_find_uservar_indexed(&idx, data.userdata, "a");
+	ck_assert_ptr_nonnull(var);
+	ck_assert_ptr_eq(var, bgenv_find_uservar(data.userdata, "a"));
+	bgenv_map_uservar(var, &key, &type, NULL, NULL, NULL);
+	ck_assert_str_eq(key, "a");
+	ck_assert_uint_eq(type, USERVAR_TYPE_DEFAULT | USERVAR_TYPE_UINT64);
+	ck_assert_ptr_eq(bgenv_find_uservar_indexed(&idx, data.userdata, "b"),
+			 bgenv_find_uservar(data.userdata, "b"));
+	ck_assert_int_eq(bgenv_user_free_indexed(&idx, data.userdata),
+			 bgenv_user_free(data.userdata));
+
+	bgenv_uservar_index_free(&idx);
+}
+END_TEST
+
+START_TEST(bgenv_uservar_batch)
+{
+	static BG_ENVDATA data;
+	static uint8_t before[ENV_MEM_USERVARS];
+	static uint8_t noise[ENV_MEM_USERVARS];
+	uint64_t t = USERVAR_TYPE_DEFAULT | USERVAR_TYPE_STRING_ASCII;
+	uint32_t lcg = 1;
+	char out[16];
+	int res;
+
+	memset(&data, 0, sizeof(data));
+	bgenv_set_uservar(data.userdata, "keep", t, "k", 2);
+	bgenv_set_uservar(data.userdata, "drop", t, "d", 2);
+	bgenv_set_uservar(data.userdata, "grow", t, "g", 2);
+
+	ebgenv_batch_op_t ops[] = {
+		{ "grow", t, (uint8_t *)"old", 4 },
+		{ "drop", USERVAR_TYPE_DELETED, (uint8_t *)"", 1 },
+		{ "new", t, (uint8_t *)"n", 2 },
+		{ "grow", t, (uint8_t *)"grown", 6 },
+	};
+	res = bgenv_set_uservar_batch(NULL, data.userdata, ops, 4);
+	ck_assert_int_eq(res, 0);
+
+	ck_assert_ptr_null(bgenv_find_uservar(data.userdata, "drop"));
+	res = bgenv_get_uservar(data.userdata, "keep", NULL, out, sizeof(out));
+	ck_assert_int_eq(res, 0);
+	ck_assert_str_eq(out, "k");
+	res = bgenv_get_uservar(data.userdata, "grow", NULL, out, sizeof(out));
+	ck_assert_int_eq(res, 0);
+	ck_assert_str_eq(out, "grown");
+	res = bgenv_get_uservar(data.userdata, "new", NULL, out, sizeof(out));
+	ck_assert_int_eq(res, 0);
+	ck_assert_str_eq(out, "n");
+	ck_assert(bgenv_validate_uservars(data.userdata));
+
+	/* a batch that does not fit must not change anything */
+	memcpy(before, data.userdata, sizeof(before));
+	ebgenv_batch_op_t big[] = {
+		{ "keep", USERVAR_TYPE_DELETED, (uint8_t *)"", 1 },
+		{ "huge", t, noise, ENV_MEM_USERVARS },
+	};
+	/* incompressible, so that it cannot fit in any form */
+	for (size_t i = 0; i < sizeof(noise); i++) {
+		lcg = lcg * 1103515245 + 12345;
+		noise[i] = lcg >> 24;
+	}
+	res = bgenv_set_uservar_batch(NULL, data.userdata, big, 2);
+	ck_assert_int_eq(res, -ENOMEM);
+	ck_assert(memcmp(before, data.userdata, sizeof(before)) == 0);
+}
+END_TEST
+
+START_TEST(bgenv_uservar_unaligned)
+{
+	static uint64_t area[ENV_MEM_USERVARS / sizeof(uint64_t) + 1];
+	/* records of keys with odd lengths in an odd place */
+	uint8_t *udata = (uint8_t *)area + 1;
+	uint64_t t = USERVAR_TYPE_DEFAULT | USERVAR_TYPE_UINT64;
+	uint64_t value = 0x0123456789abcdefULL;
+	uint64_t type, out;
+	uint32_t rsize, dsize;
+	uint8_t *var;
+	char *key;
+	void *val;
+
+	memset(area, 0, sizeof(area));
+	ck_assert_int_eq(bgenv_set_uservar(udata, "a", t, &value,
+					   sizeof(value)), 0);
+	value++;
+	ck_assert_int_eq(bgenv_set_uservar(udata, "bcd", t, &value,
+					   sizeof(value)), 0);
+	ck_assert(bgenv_validate_uservars(udata));
+
+	var = bgenv_find_uservar(udata, "bcd");
+	ck_assert_ptr_nonnull(var);
+	bgenv_map_uservar(var, &key, &type, (uint8_t **)&val, &rsize, &dsize);
+	ck_assert_str_eq(key, "bcd");
+	ck_assert(type == t);
+	ck_assert(dsize == sizeof(uint64_t));
+	ck_assert(rsize == 4 + sizeof(uint32_t) + sizeof(uint64_t) + dsize);
+	memcpy(&out, val, sizeof(out));
+	ck_assert(out == 0x0123456789abcdefULL + 1);
+}
+END_TEST
+
+START_TEST(bgenv_uservar_front_coding)
+{
+	static uint8_t udata[ENV_MEM_USERVARS];
+	static uint8_t coded[ENV_MEM_USERVARS];
+	static uint8_t out[ENV_MEM_USERVARS];
+	uint64_t t = USERVAR_TYPE_DEFAULT | USERVAR_TYPE_STRING_ASCII;
+	uint32_t used, len;
+	char value[16];
+
+	memset(udata, 0, sizeof(udata));
+	bgenv_set_uservar(udata, "swupdate.rootfs.version", t, "2", 2);
+	bgenv_set_uservar(udata, "serial", t, "1234", 5);
+	bgenv_set_uservar(udata, "swupdate.kernel.version", t, "6", 2);
+	bgenv_set_uservar(udata, "swupdate.kernel.state", t, "ok", 3);
+	used = ENV_MEM_USERVARS - bgenv_user_free(udata);
+
+	ck_assert(bgenv_front_code_uservars(udata, coded, sizeof(coded),
+					    &len));
+	ck_assert(len < used);
+	ck_assert(bgenv_expand_uservars(coded, len, out));
+	ck_assert(bgenv_validate_uservars(out));
+	ck_assert(ENV_MEM_USERVARS - bgenv_user_free(out) == used);
+
+	/* the records come back sorted by key */
+	ck_assert_str_eq((char *)out, "serial");
+	ck_assert_str_eq((char *)bgenv_next_uservar(out),
+			 "swupdate.kernel.state");
+	ck_assert_int_eq(bgenv_get_uservar(out, "swupdate.rootfs.version",
+					   NULL, value, sizeof(value)), 0);
+	ck_assert_str_eq(value, "2");
+	ck_assert_int_eq(bgenv_get_uservar(out, "swupdate.kernel.version",
+					   NULL, value, sizeof(value)), 0);
+	ck_assert_str_eq(value, "6");
+
+	/* an area that does not fit below max cannot be coded */
+	ck_assert(!bgenv_front_code_uservars(udata, coded, len, &len));
+
+	/* prefixes longer than the previous key and truncated records are
+	 * rejected */
+	ck_assert(bgenv_front_code_uservars(udata, coded, sizeof(coded),
+					    &len));
+	coded[0] = 1;
+	ck_assert(!bgenv_expand_uservars(coded, len, out));
+	coded[0] = 0;
+	ck_assert(!bgenv_expand_uservars(coded, len - 1, out));
+	ck_assert(bgenv_expand_uservars(coded, 0, out));
+	ck_assert(out[0] == 0);
+}
+END_TEST
+
+START_TEST(bgenv_uservar_compression)
+{
+	static BG_ENVDATA data;
+	static uint8_t text[2 * ENV_MEM_USERVARS];
+	static uint8_t out[sizeof(text)];
+	uint8_t noise[1024], block[1024], *var, *val;
+	uint64_t t = USERVAR_TYPE_DEFAULT | USERVAR_TYPE_STRING_ASCII;
+	uint64_t type;
+	uint32_t size, lcg = 1;
+	int res;
+
+	for (size_t i = 0; i < sizeof(text); i++) {
+		text[i] = "kernel-params-"[i % 14] + (i / 997) % 3;
+	}
+	for (size_t i = 0; i < sizeof(noise); i++) {
+		lcg = lcg * 1103515245 + 12345;
+		noise[i] = lcg >> 24;
+	}
+
+	/* round trips of the codec, including the length escapes */
+	for (uint32_t len = 0; len <= sizeof(noise); len += 17) {
+		size = lz4_block_compress(text, len, block, sizeof(block));
+		ck_assert(size != 0);
+		ck_assert_int_eq(lz4_block_decompress(block, size, out, len),
+				 0);
+		ck_assert(memcmp(out, text, len) == 0);
+		size = lz4_block_compress(noise, len, block, sizeof(block));
+		if (size) {
+			ck_assert_int_eq(
+				lz4_block_decompress(block, size, out, len),
+				0);
+			ck_assert(memcmp(out, noise, len) == 0);
+		}
+	}
+	size = lz4_block_compress(text, 1000, block, sizeof(block));
+	ck_assert_int_eq(lz4_block_decompress(block, size - 1, out, 1000),
+			 -EINVAL);
+	ck_assert_int_eq(lz4_block_decompress(block, size, out, 999),
+			 -EINVAL);
+
+	/* off by default, for older readers of the environment */
+	memset(&data, 0, sizeof(data));
+	res = bgenv_set_uservar(data.userdata, "large", t, text,
+				sizeof(block));
+	ck_assert_int_eq(res, 0);
+	var = bgenv_find_uservar(data.userdata, "large");
+	bgenv_map_uservar(var, NULL, &type, NULL, NULL, &size);
+	ck_assert_uint_eq(type, t);
+	ck_assert_uint_eq(size, sizeof(block));
+
+	bgenv_set_compress_uservars(true);
+	memset(&data, 0, sizeof(data));
+	res = bgenv_set_uservar(data.userdata, "small", t, text,
+				USERVAR_COMPRESS_MIN_SIZE - 1);
+	ck_assert_int_eq(res, 0);
+	res = bgenv_set_uservar(data.userdata, "noise", t, noise,
+				sizeof(noise));
+	ck_assert_int_eq(res, 0);
+	/* larger than the whole area, but it compresses well */
+	res = bgenv_set_uservar(data.userdata, "large", t, text, sizeof(text));
+	ck_assert_int_eq(res, 0);
+	ck_assert(bgenv_validate_uservars(data.userdata));
+
+	var = bgenv_find_uservar(data.userdata, "small");
+	bgenv_map_uservar(var, NULL, &type, NULL, NULL, &size);
+	ck_assert_uint_eq(type, t);
+	ck_assert_uint_eq(size, USERVAR_COMPRESS_MIN_SIZE - 1);
+	var = bgenv_find_uservar(data.userdata, "noise");
+	bgenv_map_uservar(var, NULL, &type, NULL, NULL, &size);
+	ck_assert_uint_eq(type, t);
+	ck_assert_uint_eq(size, sizeof(noise));
+
+	var = bgenv_find_uservar(data.userdata, "large");
+	bgenv_map_uservar(var, NULL, &type, &val, NULL, &size);
+	ck_assert_uint_eq(type, t | USERVAR_TYPE_COMPRESSED);
+	ck_assert(size < ENV_MEM_USERVARS / 4);
+	ck_assert_uint_eq(bgenv_uservar_size(var), sizeof(text));
+
+	memset(out, 0, sizeof(out));
+	res = bgenv_get_uservar(data.userdata, "large", &type, out,
+				sizeof(out));
+	ck_assert_int_eq(res, 0);
+	ck_assert_uint_eq(type, t);
+	ck_assert(memcmp(out, text, sizeof(text)) == 0);
+
+	/* short buffers receive the beginning of the value */
+	memset(out, 0, sizeof(out));
+	res = bgenv_get_uservar(data.userdata, "large", NULL, out, 100);
+	ck_assert_int_eq(res, 0);
+	ck_assert(memcmp(out, text, 100) == 0);
+	ck_assert_uint_eq(out[100], 0);
+
+	/* corrupt data is reported instead of returned */
+	memset(val + sizeof(uint32_t), 0xff, 8);
+	res = bgenv_get_uservar(data.userdata, "large", NULL, out,
+				sizeof(out));
+	ck_assert_int_eq(res, -EINVAL);
+
+	/* batches compress as well */
+	ebgenv_batch_op_t ops[] = {
+		{ "large", t, text, sizeof(text) },
+	};
+	res = bgenv_set_uservar_batch(NULL, data.userdata, ops, 1);
+	ck_assert_int_eq(res, 0);
+	memset(out, 0, sizeof(out));
+	res = bgenv_get_uservar(data.userdata, "large", &type, out,
+				sizeof(out));
+	ck_assert_int_eq(res, 0);
+	ck_assert_uint_eq(type, t);
+	ck_assert(memcmp(out, text, sizeof(text)) == 0);
+	bgenv_set_compress_uservars(false);
+}
+END_TEST
+
+struct trace_log {
+	int set;
+	int del;
+	int crc;
+	uint64_t set_bytes;
+	uint64_t crc_bytes;
+	char key[16];
+};
+
+static void record_trace(const ebgenv_trace_event_t *ev, void *priv)
+{
+	struct trace_log *log = priv;
+
+	if (strcmp(ev->event, "set_uservar") == 0) {
+		log->set++;
+		log->set_bytes = ev->bytes;
+		snprintf(log->key, sizeof(log->key), "%s", ev->detail);
+		ck_assert_int_eq(ev->result, 0);
+	} else if (strcmp(ev->event, "del_uservar") == 0) {
+		log->del++;
+	} else if (strcmp(ev->event, "crc32") == 0) {
+		log->crc++;
+		log->crc_bytes = ev->bytes;
+	}
+}
+
+START_TEST(bgenv_uservar_trace_callback)
+{
+	static uint8_t udata[ENV_MEM_USERVARS];
+	struct trace_log log = { 0 };
+	uint32_t value = 42;
+	uint8_t *var;
+
+	ebg_set_trace_callback(record_trace, &log);
+	bgenv_set_uservar(udata, "traced", USERVAR_TYPE_UINT32, &value,
+			  sizeof(value));
+	var = bgenv_find_uservar(udata, "traced");
+	ck_assert(var != NULL);
+	bgenv_del_uservar(udata, var);
+	bgenv_crc32(0, udata, 100);
+	ebg_set_trace_callback(NULL, NULL);
+
+	ck_assert_int_eq(log.set, 1);
+	ck_assert_uint_eq(log.set_bytes, sizeof(value));
+	ck_assert_str_eq(log.key, "traced");
+	ck_assert_int_eq(log.del, 1);
+	ck_assert_int_eq(log.crc, 1);
+	ck_assert_uint_eq(log.crc_bytes, 100);
+
+	/* nothing is reported once the callback is gone */
+	bgenv_set_uservar(udata, "traced", USERVAR_TYPE_UINT32, &value,
+			  sizeof(value));
+	ck_assert_int_eq(log.set, 1);
+}
+END_TEST
+
 Suite *ebg_test_suite(void)
 {
 	Suite *s;
@@ -107,6 +506,13 @@ Suite *ebg_test_suite(void)
 	tc_core = tcase_create("Core");
 
 	tcase_add_test(tc_core, bgenv_get_from_manipulated);
+	tcase_add_test(tc_core, bgenv_uservar_index_consistency);
+	tcase_add_test(tc_core, bgenv_uservar_resize_last);
+	tcase_add_test(tc_core, bgenv_uservar_batch);
+	tcase_add_test(tc_core, bgenv_uservar_unaligned);
+	tcase_add_test(tc_core, bgenv_uservar_front_coding);
+	tcase_add_test(tc_core, bgenv_uservar_compression);
+	tcase_add_test(tc_core, bgenv_uservar_trace_callback);
 
 	suite_add_tcase(s, tc_core);
 
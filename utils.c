@@ -17,6 +17,57 @@
 #include <efilib.h>
 #include <bootguard.h>
 #include <utils.h>
+#include <crc32.h>
+#include "loader_interface.h"
+
+#if defined(BUFFERED_LOG)
+static CHAR16 log_buffer[LOG_BUFFER_SIZE];
+static UINTN log_head;
+static BOOLEAN log_wrapped;
+
+static VOID log_append(const CHAR16 *fmt, va_list args)
+{
+	CHAR16 line[256];
+
+	(VOID) VSPrint(line, sizeof(line), (CHAR16 *)fmt, args);
+	for (CHAR16 *c = line; *c != L'\0'; c++) {
+		log_buffer[log_head++] = *c;
+		if (log_head == LOG_BUFFER_SIZE) {
+			log_head = 0;
+			log_wrapped = TRUE;
+		}
+	}
+}
+
+VOID LogPrint(const CHAR16 *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	log_append(fmt, args);
+	va_end(args);
+}
+
+/* Passes the log, oldest messages first, to the OS via LoaderLog. */
+VOID FlushLog(VOID)
+{
+	UINTN older = log_wrapped ? LOG_BUFFER_SIZE - log_head : 0;
+	UINTN size = (older + log_head) * sizeof(CHAR16);
+	CHAR16 *linear;
+
+	linear = AllocatePool(size);
+	if (!linear) {
+		return;
+	}
+	CopyMem(linear, log_buffer + log_head, older * sizeof(CHAR16));
+	CopyMem(linear + older, log_buffer, log_head * sizeof(CHAR16));
+
+	(VOID) RT->SetVariable(L"LoaderLog", &ebg_vendor_guid,
+			       EFI_VARIABLE_BOOTSERVICE_ACCESS |
+				       EFI_VARIABLE_RUNTIME_ACCESS,
+			       size, linear);
+	FreePool(linear);
+}
+#endif
 
 VOID PrintC(const UINT8 color, const CHAR16 *fmt, ...)
 {
@@ -29,29 +80,90 @@ VOID PrintC(const UINT8 color, const CHAR16 *fmt, ...)
 	va_end(args);
 
 	(VOID) ST->ConOut->SetAttribute(ST->ConOut, attr);
+
+#if defined(BUFFERED_LOG)
+	va_start(args, fmt);
+	log_append(fmt, args);
+	va_end(args);
+#endif
 }
 
-BOOLEAN IsOnBootMedium(EFI_DEVICE_PATH *dp)
+/* device path of the boot medium, i.e. the boot volume without its last
+ * node, see SetBootMedium() */
+static EFI_DEVICE_PATH *boot_medium_dp;
+static UINTN boot_medium_dp_len;
+
+/* Returns the size in bytes of dp without its last node. A single node is
+ * kept as a whole, like GetBootMediumPath() does for its string form. */
+static UINTN DevicePathParentLength(EFI_DEVICE_PATH *dp)
 {
-	extern CHAR16 *boot_medium_path;
-	CHAR16 *device_path, *tmp;
-	BOOLEAN result = FALSE;
+	UINTN len = 0, parent = 0;
 
-	tmp = DevicePathToStr(dp);
-	device_path = GetBootMediumPath(tmp);
-	FreePool(tmp);
+	while (!IsDevicePathEndType(dp)) {
+		UINTN nodelen = DevicePathNodeLength(dp);
+		if (nodelen < sizeof(EFI_DEVICE_PATH)) {
+			/* malformed node */
+			break;
+		}
+		parent = len;
+		len += nodelen;
+		dp = NextDevicePathNode(dp);
+	}
+	return parent ? parent : len;
+}
 
-	if (StrCmp(device_path, boot_medium_path) == 0) {
-		result = TRUE;
+VOID SetBootMedium(EFI_DEVICE_PATH *dp)
+{
+	boot_medium_dp = dp;
+	boot_medium_dp_len = dp ? DevicePathParentLength(dp) : 0;
+}
+
+BOOLEAN IsOnBootMedium(EFI_DEVICE_PATH *dp)
+{
+	if (!dp || !boot_medium_dp) {
+		return FALSE;
 	}
-	FreePool(device_path);
+	/* node-wise comparison of everything but the partition node */
+	return DevicePathParentLength(dp) == boot_medium_dp_len &&
+	       CompareMem(dp, boot_medium_dp, boot_medium_dp_len) == 0;
+}
 
-	return result;
+/* CRC-32 as computed by BS->CalculateCrc32, but continuable over chunks */
+UINT32 crc32_update(UINT32 crc, const VOID *buffer, UINTN len)
+{
+	return ~crc32_raw(~crc, buffer, len);
+}
+
+UINT32 crc32_patch(UINT32 crc, UINTN size, UINTN offset, const VOID *old,
+		   const VOID *new, UINTN len)
+{
+	const UINT8 *o = old;
+	const UINT8 *n = new;
+	UINT8 delta[64];
+	UINT32 d = 0;
+
+	if (len == 0 || offset + len > size) {
+		return crc;
+	}
+	/* the unconditioned CRC of the difference, which the CRC of a
+	 * fixed length message is linear in */
+	for (UINTN done = 0; done < len;) {
+		UINTN chunk = len - done < sizeof(delta) ? len - done
+							 : sizeof(delta);
+
+		for (UINTN i = 0; i < chunk; i++) {
+			delta[i] = o[done + i] ^ n[done + i];
+		}
+		d = crc32_raw(d, delta, chunk);
+		done += chunk;
+	}
+	return crc ^ crc32_multmodp(crc32_x8nmodp(size - offset - len), d);
 }
 
 VOID __attribute__((noreturn)) error_exit(CHAR16 *message, EFI_STATUS status)
 {
 	ERROR(L"%s (%r).\n", message, status);
+	FlushLog();
 	(VOID) BS->Stall(3 * 1000 * 1000);
 	(VOID) BS->Exit(this_image, status, 0, NULL);
 	__builtin_unreachable();
@@ -102,6 +214,69 @@ CHAR16 *get_volume_custom_label(EFI_FILE_HANDLE fh)
 	return buffer;
 }
 
+CHAR16 *volume_label(VOLUME_DESC *v)
+{
+	if (!v->labels_read) {
+		v->fslabel = get_volume_label(v->root);
+		v->fscustomlabel = get_volume_custom_label(v->root);
+		v->labels_read = TRUE;
+	}
+	return v->fslabel;
+}
+
+CHAR16 *volume_custom_label(VOLUME_DESC *v)
+{
+	(VOID) volume_label(v);
+	return v->fscustomlabel;
+}
+
+/* SimpleFileSystem handles off the boot medium, not opened yet */
+static EFI_HANDLE *deferred_handles;
+static UINTN deferred_count;
+
+static BOOLEAN open_volume(EFI_HANDLE handle, UINTN index, VOLUME_DESC *v)
+{
+	EFI_GUID sfspGuid = SIMPLE_FILE_SYSTEM_PROTOCOL;
+	EFI_FILE_IO_INTERFACE *fs = NULL;
+	EFI_FILE_HANDLE tmp;
+	EFI_STATUS status;
+	CHAR16 *devpathstr;
+
+	status = BS->HandleProtocol(handle, &sfspGuid, (VOID **)&fs);
+	if (EFI_ERROR(status)) {
+		/* skip failed handle and continue enumerating */
+		ERROR(L"File IO handle %d does not support SIMPLE_FILE_SYSTEM_PROTOCOL, skipping.\n",
+		      index);
+		return FALSE;
+	}
+	status = fs->OpenVolume(fs, &tmp);
+	if (EFI_ERROR(status)) {
+		/* skip failed handle and continue enumerating */
+		ERROR(L"Could not open file system for IO handle %d, skipping.\n",
+		      index);
+		return FALSE;
+	}
+	EFI_DEVICE_PATH *devpath = DevicePathFromHandle(handle);
+	if (devpath == NULL) {
+		ERROR(L"Could not get device path for config partition, skipping.\n");
+		(VOID) tmp->Close(tmp);
+		return FALSE;
+	}
+
+	v->root = tmp;
+	v->devpath = devpath;
+	/* labels are read on first use, see volume_label() */
+	v->fslabel = NULL;
+	v->fscustomlabel = NULL;
+	v->labels_read = FALSE;
+
+	devpathstr = DevicePathToStr(devpath);
+	INFO(L"Volume %d: %s%s\n", index,
+	     IsOnBootMedium(devpath) ? L"(On boot medium) " : L"", devpathstr);
+	FreePool(devpathstr);
+	return TRUE;
+}
+
 EFI_STATUS get_volumes(VOLUME_DESC **volumes, UINTN *count)
 {
 	EFI_STATUS status;
@@ -110,8 +285,6 @@ EFI_STATUS get_volumes(VOLUME_DESC **volumes, UINTN *count)
 	UINTN handleCount = 0;
 	UINTN index, rootCount = 0;
 
-	EFI_FILE_HANDLE tmp;
-
 	if (!volumes || !count) {
 		ERROR(L"Invalid volume enumeration.\n");
 		return EFI_INVALID_PARAMETER;
@@ -128,57 +301,52 @@ EFI_STATUS get_volumes(VOLUME_DESC **volumes, UINTN *count)
 	*volumes = (VOLUME_DESC *)AllocatePool(sizeof(VOLUME_DESC) * handleCount);
 	if (!*volumes) {
 		ERROR(L"Could not allocate memory for volume descriptors.\n");
+		FreePool(handles);
 		return EFI_OUT_OF_RESOURCES;
 	}
 
+	/* Only volumes on the boot medium are opened right away, the others
+	 * are kept for get_deferred_volumes(). */
+	deferred_count = 0;
 	for (index = 0; index < handleCount; index++) {
-		EFI_FILE_IO_INTERFACE *fs = NULL;
-		CHAR16 *devpathstr;
-
-		status = BS->HandleProtocol(
-		    handles[index], &sfspGuid, (VOID **)&fs);
-		if (EFI_ERROR(status)) {
-			/* skip failed handle and continue enumerating */
-			ERROR(L"File IO handle %d does not support SIMPLE_FILE_SYSTEM_PROTOCOL, skipping.\n",
-			      index);
-			continue;
-		}
-		status = fs->OpenVolume(fs, &tmp);
-		if (EFI_ERROR(status)) {
-			/* skip failed handle and continue enumerating */
-			ERROR(L"Could not open file system for IO handle %d, skipping.\n",
-			      index);
+		if (!IsOnBootMedium(DevicePathFromHandle(handles[index]))) {
+			handles[deferred_count++] = handles[index];
 			continue;
 		}
-		EFI_DEVICE_PATH *devpath = DevicePathFromHandle(handles[index]);
-		if (devpath == NULL) {
-			ERROR(L"Could not get device path for config partition, skipping.\n");
-			continue;
+		if (open_volume(handles[index], rootCount,
+				&(*volumes)[rootCount])) {
+			rootCount++;
 		}
-		devpathstr = DevicePathToStr(devpath);
-
-		(*volumes)[rootCount].root = tmp;
-		(*volumes)[rootCount].devpath = devpath;
-		(*volumes)[rootCount].fslabel =
-		    get_volume_label((*volumes)[rootCount].root);
-		(*volumes)[rootCount].fscustomlabel =
-		    get_volume_custom_label((*volumes)[rootCount].root);
-		INFO(L"Volume %d: ", rootCount);
-		if (IsOnBootMedium(devpath)) {
-			INFO(L"(On boot medium) ");
-		}
-		INFO(L"%s, LABEL=%s, CLABEL=%s\n",
-		      devpathstr, (*volumes)[rootCount].fslabel,
-		      (*volumes)[rootCount].fscustomlabel);
-
-		FreePool(devpathstr);
-
-		rootCount++;
+	}
+	if (deferred_count > 0) {
+		deferred_handles = handles;
+	} else {
+		FreePool(handles);
 	}
 	*count = rootCount;
 	return EFI_SUCCESS;
 }
 
+UINTN get_deferred_volumes(VOLUME_DESC *volumes, UINTN *count)
+{
+	UINTN first = *count;
+
+	if (!deferred_handles) {
+		return 0;
+	}
+	INFO(L"Opening volumes off the boot medium\n");
+	for (UINTN index = 0; index < deferred_count; index++) {
+		if (open_volume(deferred_handles[index], *count,
+				&volumes[*count])) {
+			(*count)++;
+		}
+	}
+	FreePool(deferred_handles);
+	deferred_handles = NULL;
+	deferred_count = 0;
+	return *count - first;
+}
+
 EFI_STATUS close_volumes(VOLUME_DESC *volumes, UINTN count)
 {
 	EFI_STATUS result = EFI_SUCCESS;
@@ -203,6 +371,11 @@ EFI_STATUS close_volumes(VOLUME_DESC *volumes, UINTN count)
 		}
 	}
 	FreePool(volumes);
+	if (deferred_handles) {
+		FreePool(deferred_handles);
+		deferred_handles = NULL;
+		deferred_count = 0;
+	}
 	return result;
 }
 
@@ -231,24 +404,29 @@ EFI_DEVICE_PATH *FileDevicePathFromConfig(EFI_HANDLE device,
 		}
 	}
 
-	if (prefixlen > 0) {
-		for (UINTN v = 0; v < volume_count; v++) {
-			CHAR16 *src;
-			switch (lm) {
-			case DOSFSLABEL:
-				src = volumes[v].fslabel;
-				break;
-			case CUSTOMLABEL:
-				src = volumes[v].fscustomlabel;
-				break;
-			default:
-				src = NULL;
-				break;
-			}
-			if (src && (StrnCmp(src, &payloadpath[2], prefixlen) == 0)) {
-				devpath = volumes[v].devpath;
-				break;
-			}
+	if (prefixlen > 0 && volume_count == 0) {
+		(VOID) get_deferred_volumes(volumes, &volume_count);
+	}
+	for (UINTN v = 0; prefixlen > 0 && v < volume_count; v++) {
+		CHAR16 *src;
+		switch (lm) {
+		case DOSFSLABEL:
+			src = volume_label(&volumes[v]);
+			break;
+		case CUSTOMLABEL:
+			src = volume_custom_label(&volumes[v]);
+			break;
+		default:
+			src = NULL;
+			break;
+		}
+		if (src && (StrnCmp(src, &payloadpath[2], prefixlen) == 0)) {
+			devpath = volumes[v].devpath;
+			break;
+		}
+		/* the label may be on a volume that was not opened yet */
+		if (v + 1 == volume_count) {
+			(VOID) get_deferred_volumes(volumes, &volume_count);
 		}
 	}
 
@@ -271,6 +449,109 @@ EFI_DEVICE_PATH *FileDevicePathFromConfig(EFI_HANDLE device,
 	return appendeddevpath;
 }
 
+/* Reads in chunks of this size, large enough to avoid per-cluster requests
+ * to the firmware's file system driver. */
+#define PRELOAD_CHUNK_SIZE	(4 * 1024 * 1024)
+
+/*
+ * Reads the file referenced by a volume plus file path device path into
+ * freshly allocated pages. On success, the caller releases the buffer with
+ * FreePages(*buffer, EFI_SIZE_TO_PAGES(*size)).
+ */
+EFI_STATUS PreloadFile(EFI_DEVICE_PATH *dp, EFI_PHYSICAL_ADDRESS *buffer,
+		       UINTN *size)
+{
+	EFI_GUID sfspGuid = SIMPLE_FILE_SYSTEM_PROTOCOL;
+	EFI_FILE_IO_INTERFACE *fs;
+	EFI_FILE_HANDLE file, next;
+	EFI_FILE_INFO *info;
+	EFI_HANDLE handle;
+	EFI_STATUS status;
+	UINTN offset;
+
+	status = BS->LocateDevicePath(&sfspGuid, &dp, &handle);
+	if (EFI_ERROR(status)) {
+		return status;
+	}
+	status = BS->HandleProtocol(handle, &sfspGuid, (VOID **)&fs);
+	if (EFI_ERROR(status)) {
+		return status;
+	}
+	status = fs->OpenVolume(fs, &file);
+	if (EFI_ERROR(status)) {
+		return status;
+	}
+
+	/* the remaining nodes form the path, each relative to the previous */
+	for (; !IsDevicePathEnd(dp); dp = NextDevicePathNode(dp)) {
+		UINTN len = DevicePathNodeLength(dp) - sizeof(EFI_DEVICE_PATH);
+		CHAR16 *name;
+
+		if (DevicePathType(dp) != MEDIA_DEVICE_PATH ||
+		    DevicePathSubType(dp) != MEDIA_FILEPATH_DP) {
+			status = EFI_UNSUPPORTED;
+			goto close_file;
+		}
+		/* the node's string is not necessarily aligned */
+		name = AllocateZeroPool(len + sizeof(CHAR16));
+		if (!name) {
+			status = EFI_OUT_OF_RESOURCES;
+			goto close_file;
+		}
+		CopyMem(name, (UINT8 *)dp + sizeof(EFI_DEVICE_PATH), len);
+		status = file->Open(file, &next, name, EFI_FILE_MODE_READ, 0);
+		FreePool(name);
+		if (EFI_ERROR(status)) {
+			goto close_file;
+		}
+		(VOID) file->Close(file);
+		file = next;
+	}
+
+	info = LibFileInfo(file);
+	if (!info) {
+		status = EFI_LOAD_ERROR;
+		goto close_file;
+	}
+	*size = info->FileSize;
+	if ((info->Attribute & EFI_FILE_DIRECTORY) || *size == 0) {
+		status = EFI_LOAD_ERROR;
+	}
+	FreePool(info);
+	if (EFI_ERROR(status)) {
+		goto close_file;
+	}
+
+	status = BS->AllocatePages(AllocateAnyPages, EfiLoaderData,
+				   EFI_SIZE_TO_PAGES(*size), buffer);
+	if (EFI_ERROR(status)) {
+		goto close_file;
+	}
+
+	for (offset = 0; offset < *size; offset += PRELOAD_CHUNK_SIZE) {
+		UINTN chunk = *size - offset;
+		UINTN readlen;
+
+		if (chunk > PRELOAD_CHUNK_SIZE) {
+			chunk = PRELOAD_CHUNK_SIZE;
+		}
+		readlen = chunk;
+		status = file->Read(file, &readlen,
+				    (UINT8 *)(UINTN)*buffer + offset);
+		if (!EFI_ERROR(status) && readlen != chunk) {
+			status = EFI_END_OF_FILE;
+		}
+		if (EFI_ERROR(status)) {
+			(VOID) BS->FreePages(*buffer, EFI_SIZE_TO_PAGES(*size));
+			break;
+		}
+	}
+
+close_file:
+	(VOID) file->Close(file);
+	return status;
+}
+
 CHAR16 *GetBootMediumPath(CHAR16 *input)
 {
 	CHAR16 *dst;